@@ -24,6 +24,20 @@
 
 G_BEGIN_DECLS
 
+/*
+ * An IQueue orders up to 254 small integers, which are the physical slots
+ * of items stored in an array alongside it (see linked-array.h).
+ *
+ * By default the order is kept with prev and next links for each slot, so
+ * items are linked in and out in O(1) but the Nth item is found by
+ * walking the links. Builds which define LINKED_ARRAY_PERMUTATION instead
+ * keep the slots in logical order in an array, so the Nth item is found in
+ * O(1) and inserts and removals move at most 253 bytes with memmove().
+ * Both provide the same macros.
+ */
+
+#ifndef LINKED_ARRAY_PERMUTATION
+
 #define IQUEUE_NODE(Type, N_Items) \
   struct {                         \
     Type length;                   \
@@ -137,6 +151,24 @@ G_BEGIN_DECLS
       }                                                                    \
   } G_STMT_END
 
+#define IQUEUE_INSERT_AFTER(Node, Sibling, Val)                            \
+  G_STMT_START {                                                           \
+    g_assert_cmpint (IQUEUE_LENGTH(Node), <, G_N_ELEMENTS((Node)->items)); \
+    g_assert (IQUEUE_IS_VALID(Node, Sibling));                             \
+                                                                           \
+    (Node)->items[Val].prev = (Sibling);                                   \
+    (Node)->items[Val].next = (Node)->items[Sibling].next;                 \
+    if (IQUEUE_IS_VALID(Node, (Node)->items[Sibling].next))                \
+      (Node)->items[(Node)->items[Sibling].next].prev = (Val);             \
+    else                                                                   \
+      (Node)->tail = (Val);                                                \
+    (Node)->items[Sibling].next = (Val);                                   \
+                                                                           \
+    (Node)->length++;                                                      \
+                                                                           \
+    _IQUEUE_VALIDATE(Node);                                                \
+  } G_STMT_END
+
 #define IQUEUE_POP_HEAD(Node) IQUEUE_POP_NTH((Node), 0)
 #define IQUEUE_POP_TAIL(Node) IQUEUE_POP_NTH((Node), (Node)->length - 1)
 
@@ -210,6 +242,179 @@ G_BEGIN_DECLS
       (Node)->tail = New;                                \
   } G_STMT_END
 
+#define IQUEUE_NEXT(Node, ID) ((Node)->items[ID].next)
+#define IQUEUE_PREV(Node, ID) ((Node)->items[ID].prev)
+
+/* Replaces the queue with the N slots in Slots, in that order */
+#define IQUEUE_BUILD(Node, Slots, N)                               \
+  G_STMT_START {                                                   \
+    const guint8 *_slots = (Slots);                                \
+    typeof((Node)->head) _last = IQUEUE_INVALID(Node);             \
+    guint _n = (N);                                                \
+                                                                   \
+    for (guint _i = 0; _i < _n; _i++)                              \
+      {                                                            \
+        (Node)->items[_slots[_i]].prev = _last;                    \
+        if (_last != IQUEUE_INVALID(Node))                         \
+          (Node)->items[_last].next = _slots[_i];                  \
+        _last = _slots[_i];                                        \
+      }                                                            \
+                                                                   \
+    if (_last != IQUEUE_INVALID(Node))                             \
+      (Node)->items[_last].next = IQUEUE_INVALID(Node);            \
+                                                                   \
+    (Node)->head = _n ? _slots[0] : IQUEUE_INVALID(Node);          \
+    (Node)->tail = _last;                                          \
+    (Node)->length = _n;                                           \
+  } G_STMT_END
+
+/* Replaces the queue with the slots 0 to N-1, in that order */
+#define IQUEUE_INIT_SEQUENCE(Node, N)                              \
+  G_STMT_START {                                                   \
+    guint _n = (N);                                                \
+                                                                   \
+    for (guint _i = 0; _i < _n; _i++)                              \
+      {                                                            \
+        (Node)->items[_i].prev = _i - 1;                           \
+        (Node)->items[_i].next = _i + 1;                           \
+      }                                                            \
+                                                                   \
+    if (_n > 0)                                                    \
+      {                                                            \
+        (Node)->items[0].prev = IQUEUE_INVALID(Node);              \
+        (Node)->items[_n - 1].next = IQUEUE_INVALID(Node);         \
+      }                                                            \
+                                                                   \
+    (Node)->head = _n ? 0 : IQUEUE_INVALID(Node);                  \
+    (Node)->tail = _n ? _n - 1 : IQUEUE_INVALID(Node);             \
+    (Node)->length = _n;                                           \
+  } G_STMT_END
+
+#else /* LINKED_ARRAY_PERMUTATION */
+
+/* Slots must be guint8 so that they can be located with memchr() */
+#define IQUEUE_NODE(Type, N_Items) \
+  struct {                         \
+    Type length;                   \
+    Type order[N_Items];           \
+  }
+
+#define IQUEUE_INVALID(Node) ((typeof((Node)->length))-1)
+#define IQUEUE_LENGTH(Node) ((Node)->length)
+#define IQUEUE_EMPTY(Node) ((Node)->length == 0)
+#define IQUEUE_PEEK_HEAD(Node) ((Node)->length ? (Node)->order[0] : IQUEUE_INVALID(Node))
+#define IQUEUE_PEEK_TAIL(Node) ((Node)->length ? (Node)->order[(Node)->length - 1] : IQUEUE_INVALID(Node))
+#define IQUEUE_IS_VALID(Node, ID) ((ID) != IQUEUE_INVALID(Node))
+
+#define IQUEUE_INIT(Node)                \
+  G_STMT_START {                         \
+    (Node)->length = 0;                  \
+  } G_STMT_END
+
+/* The logical position of ID, or the length if it is not queued */
+#define _IQUEUE_INDEX(Node, ID)                                            \
+  ({                                                                       \
+    const guint8 *_found = memchr ((Node)->order, (ID), (Node)->length);   \
+    _found ? (guint)(_found - (Node)->order) : (guint)(Node)->length;      \
+  })
+
+#define IQUEUE_PUSH_HEAD(Node, ID) IQUEUE_INSERT(Node, 0, ID)
+#define IQUEUE_PUSH_TAIL(Node, ID) IQUEUE_INSERT(Node, (Node)->length, ID)
+
+#define IQUEUE_INSERT(Node, Nth, Val)                                      \
+  G_STMT_START {                                                           \
+    guint _len = IQUEUE_LENGTH(Node);                                      \
+    guint _nth = (Nth);                                                    \
+                                                                           \
+    /* The caller has already stored the item in its slot, so carrying on  \
+     * without queueing it would corrupt the node. This is checked even    \
+     * without assertions, which also bounds the memmove() below.          \
+     */                                                                    \
+    if (G_UNLIKELY (_len >= G_N_ELEMENTS((Node)->order) || _nth > _len))   \
+      g_error ("Cannot insert at %u of %u slots in an IQueue of %u",       \
+               _nth, _len, (guint)G_N_ELEMENTS((Node)->order));            \
+                                                                           \
+    memmove (&(Node)->order[_nth + 1], &(Node)->order[_nth], _len - _nth); \
+    (Node)->order[_nth] = (Val);                                           \
+    (Node)->length = _len + 1;                                             \
+  } G_STMT_END
+
+#define IQUEUE_INSERT_AFTER(Node, Sibling, Val)                            \
+  G_STMT_START {                                                           \
+    guint _sibling = _IQUEUE_INDEX(Node, Sibling);                         \
+                                                                           \
+    g_assert_cmpint (_sibling, <, IQUEUE_LENGTH(Node));                    \
+                                                                           \
+    IQUEUE_INSERT(Node, _sibling + 1, Val);                                \
+  } G_STMT_END
+
+#define IQUEUE_POP_HEAD(Node) IQUEUE_POP_NTH((Node), 0)
+#define IQUEUE_POP_TAIL(Node) IQUEUE_POP_NTH((Node), (Node)->length - 1)
+
+#define IQUEUE_POP_NTH(Node, Nth)                                          \
+  ({                                                                       \
+    typeof((Node)->length) _pos = IQUEUE_INVALID(Node);                    \
+    guint _nth = (Nth);                                                    \
+                                                                           \
+    if (_nth < (Node)->length)                                             \
+      {                                                                    \
+        _pos = (Node)->order[_nth];                                        \
+        (Node)->length--;                                                  \
+        memmove (&(Node)->order[_nth], &(Node)->order[_nth + 1],           \
+                 (Node)->length - _nth);                                   \
+      }                                                                    \
+                                                                           \
+    _pos;                                                                  \
+  })
+
+#define IQUEUE_NTH(Node, Nth) ((Node)->order[Nth])
+
+#define IQUEUE_FOREACH(Node, name, IQBlock)                 \
+  G_STMT_START {                                            \
+    for (guint _iq = 0; _iq < (Node)->length; _iq++)       \
+      {                                                     \
+        typeof((Node)->length) name = (Node)->order[_iq];   \
+        IQBlock                                             \
+      }                                                     \
+  } G_STMT_END
+
+#define _IQUEUE_MOVE(Node, Old, New)                        \
+  G_STMT_START {                                            \
+    (Node)->order[_IQUEUE_INDEX(Node, Old)] = (New);        \
+  } G_STMT_END
+
+#define IQUEUE_NEXT(Node, ID)                                              \
+  ({                                                                       \
+    guint _next = _IQUEUE_INDEX(Node, ID) + 1;                             \
+    _next < (Node)->length ? (Node)->order[_next] : IQUEUE_INVALID(Node);  \
+  })
+
+#define IQUEUE_PREV(Node, ID)                                              \
+  ({                                                                       \
+    guint _prev = _IQUEUE_INDEX(Node, ID);                                 \
+    _prev > 0 && _prev < (Node)->length                                    \
+      ? (Node)->order[_prev - 1] : IQUEUE_INVALID(Node);                   \
+  })
+
+/* Replaces the queue with the N slots in Slots, in that order */
+#define IQUEUE_BUILD(Node, Slots, N)                 \
+  G_STMT_START {                                     \
+    (Node)->length = (N);                            \
+    memcpy ((Node)->order, (Slots), (Node)->length); \
+  } G_STMT_END
+
+/* Replaces the queue with the slots 0 to N-1, in that order */
+#define IQUEUE_INIT_SEQUENCE(Node, N)                             \
+  G_STMT_START {                                                  \
+    guint _n = MIN ((N), G_N_ELEMENTS((Node)->order));            \
+                                                                  \
+    for (guint _i = 0; _i < _n; _i++)                             \
+      (Node)->order[_i] = _i;                                     \
+    (Node)->length = _n;                                          \
+  } G_STMT_END
+
+#endif /* LINKED_ARRAY_PERMUTATION */
+
 G_END_DECLS
 
 #endif /* IQUEUE_H */
@@ -35,6 +35,10 @@ G_BEGIN_DECLS
  * other super-structures.
  *
  * @N_ITEMS must be <= 254 or this macro will fail.
+ *
+ * The logical order of the items is kept by an IQueue, which follows links
+ * between slots unless LINKED_ARRAY_PERMUTATION is defined, in which case
+ * it is an array of slots in logical order. See iqueue.h.
  */
 #define LINKED_ARRAY_FIELD(TYPE,N_ITEMS)        \
   struct {                                      \
@@ -91,6 +95,22 @@ G_BEGIN_DECLS
  */
 #define LINKED_ARRAY_IS_EMPTY(FIELD) (LINKED_ARRAY_LENGTH(FIELD) == 0)
 
+/* The slot for a new element, which is always the one after the last.
+ * Writing past the items would corrupt whatever follows them, so this is
+ * checked even without assertions, which also lets the compiler see that
+ * the slot is within the array.
+ */
+#define _LINKED_ARRAY_NEXT_SLOT(FIELD)                               \
+  ({                                                                 \
+    guint8 _slot = IQUEUE_LENGTH(&(FIELD)->q);                       \
+                                                                     \
+    if (G_UNLIKELY (_slot >= LINKED_ARRAY_CAPACITY(FIELD)))          \
+      g_error ("Cannot add to a LinkedArray of %u items",            \
+               (guint)LINKED_ARRAY_CAPACITY(FIELD));                 \
+                                                                     \
+    _slot;                                                           \
+  })
+
 /**
  * LINKED_ARRAY_INSERT_VAL:
  * @FIELD: A pointer to a LinkedArray field.
@@ -108,11 +128,33 @@ G_BEGIN_DECLS
     g_assert (POSITION >= 0);                               \
     g_assert (POSITION <= LINKED_ARRAY_LENGTH(FIELD));      \
                                                             \
-    _pos = IQUEUE_LENGTH(&(FIELD)->q);                      \
+    _pos = _LINKED_ARRAY_NEXT_SLOT(FIELD);                  \
     (FIELD)->items[_pos] = ELEMENT;                         \
     IQUEUE_INSERT(&(FIELD)->q, POSITION, _pos);             \
   } G_STMT_END
 
+/**
+ * LINKED_ARRAY_INSERT_AFTER:
+ * @FIELD: A pointer to a LinkedArray field.
+ * @SLOT: the physical slot of an existing element
+ * @ELEMENT: The element to insert
+ *
+ * Inserts @ELEMENT directly after the element stored in @SLOT without
+ * walking the list to find a logical position. The LinkedArray must
+ * not be at capacity.
+ *
+ * This macro evaluates to the physical slot of the new element.
+ */
+#define LINKED_ARRAY_INSERT_AFTER(FIELD,SLOT,ELEMENT)       \
+  ({                                                        \
+    guint8 _pos;                                            \
+                                                            \
+    _pos = _LINKED_ARRAY_NEXT_SLOT(FIELD);                  \
+    (FIELD)->items[_pos] = ELEMENT;                         \
+    IQUEUE_INSERT_AFTER(&(FIELD)->q, SLOT, _pos);           \
+    _pos;                                                   \
+  })
+
 #define LINKED_ARRAY_REMOVE_INDEX(FIELD,POSITION)                  \
   ({                                                               \
     typeof((FIELD)->items[0]) _ele;                                \
@@ -120,6 +162,8 @@ G_BEGIN_DECLS
     guint8 _len;                                                   \
                                                                    \
     _pos = IQUEUE_POP_NTH(&(FIELD)->q, POSITION);                  \
+    if (G_UNLIKELY (!IQUEUE_IS_VALID(&(FIELD)->q, _pos)))          \
+      g_error ("Cannot remove past the end of a LinkedArray");     \
     _ele = (FIELD)->items[_pos];                                   \
     _len = IQUEUE_LENGTH(&(FIELD)->q);                             \
                                                                    \
@@ -150,6 +194,7 @@ G_BEGIN_DECLS
  * Calls @Block for every element stored in @FIELD. A pointer to
  * each element will be provided as a variable named @Name.
  */
+#ifndef LINKED_ARRAY_PERMUTATION
 #define LINKED_ARRAY_FOREACH(FIELD, Element, Name, LABlock) \
   G_STMT_START {                                            \
     for (typeof((FIELD)->q.head) _aiter = (FIELD)->q.head;  \
@@ -164,59 +209,125 @@ G_BEGIN_DECLS
 #define LINKED_ARRAY_FOREACH_PEEK(FIELD)                          \
   (((FIELD)->q.items[_aiter].next != IQUEUE_INVALID(&(FIELD)->q)) \
     ? &(FIELD)->items[(FIELD)->q.items[_aiter].next] : NULL)
+#else
+/* _aiter is the logical position rather than the slot */
+#define LINKED_ARRAY_FOREACH(FIELD, Element, Name, LABlock)         \
+  G_STMT_START {                                                    \
+    for (guint _aiter = 0; _aiter < (FIELD)->q.length; _aiter++)    \
+      {                                                             \
+        Element * Name = &(FIELD)->items[(FIELD)->q.order[_aiter]]; \
+        LABlock                                                     \
+      }                                                             \
+  } G_STMT_END
 
-#define LINKED_ARRAY_SPLIT(FIELD, SPLIT)                    \
-  G_STMT_START {                                            \
-    guint8 mid;                                             \
-                                                            \
-    LINKED_ARRAY_INIT(SPLIT);                               \
-                                                            \
-    mid = LINKED_ARRAY_LENGTH(FIELD) / 2;                   \
-                                                            \
-    for (guint8 i = 0; i < mid; i++)                        \
-      {                                                     \
-        typeof((FIELD)->items[0]) ele;                      \
-        ele = LINKED_ARRAY_POP_TAIL(FIELD);                 \
-        LINKED_ARRAY_PUSH_HEAD(SPLIT, ele);                 \
-      }                                                     \
+#define LINKED_ARRAY_FOREACH_PEEK(FIELD)                    \
+  ((_aiter + 1 < (FIELD)->q.length)                         \
+    ? &(FIELD)->items[(FIELD)->q.order[_aiter + 1]] : NULL)
+#endif
+
+/**
+ * LINKED_ARRAY_SPLIT:
+ * @FIELD: A pointer to a LinkedArray
+ * @SPLIT: A pointer to an uninitialized LinkedArray of the same type
+ *
+ * Moves the upper half of @FIELD, by logical position, into @SPLIT.
+ *
+ * The logical order is walked once. Elements of the upper half are copied
+ * into @SPLIT in order, and the elements @FIELD keeps from beyond the
+ * first half of its slots are moved into the slots left behind, after
+ * which both queues are rebuilt in a single pass. Elements may therefore
+ * change slots in @FIELD as well.
+ */
+#define LINKED_ARRAY_SPLIT(FIELD, SPLIT)                               \
+  G_STMT_START {                                                       \
+    guint8 _kept[G_N_ELEMENTS((FIELD)->items)];                        \
+    guint8 _moved[G_N_ELEMENTS((FIELD)->items)];                       \
+    guint _keep = LINKED_ARRAY_LENGTH(FIELD) -                         \
+                  LINKED_ARRAY_LENGTH(FIELD) / 2;                      \
+    guint _n_kept = 0;                                                 \
+    guint _n_split = 0;                                                \
+    guint _hole = 0;                                                   \
+                                                                       \
+    IQUEUE_FOREACH(&(FIELD)->q, _slot, {                               \
+      _moved[_slot] = _n_kept == _keep;                                \
+      if (_moved[_slot])                                               \
+        (SPLIT)->items[_n_split++] = (FIELD)->items[_slot];            \
+      else                                                             \
+        _kept[_n_kept++] = _slot;                                      \
+    });                                                                \
+                                                                       \
+    /* As many kept elements lie beyond _keep as there are holes */    \
+    for (guint _i = 0; _i < _keep; _i++)                               \
+      {                                                                \
+        if (_kept[_i] < _keep)                                         \
+          continue;                                                    \
+        while (!_moved[_hole])                                         \
+          _hole++;                                                     \
+        (FIELD)->items[_hole] = (FIELD)->items[_kept[_i]];             \
+        _kept[_i] = _hole++;                                           \
+      }                                                                \
+                                                                       \
+    IQUEUE_BUILD(&(FIELD)->q, _kept, _keep);                           \
+    IQUEUE_INIT_SEQUENCE(&(SPLIT)->q, _n_split);                       \
   } G_STMT_END
 
-#define LINKED_ARRAY_SPLIT2(FIELD, LEFT, RIGHT)             \
-  G_STMT_START {                                            \
-    guint8 mid;                                             \
-                                                            \
-    LINKED_ARRAY_INIT(LEFT);                                \
-    LINKED_ARRAY_INIT(RIGHT);                               \
-                                                            \
-    mid = LINKED_ARRAY_LENGTH(FIELD) / 2;                   \
-                                                            \
-    for (guint8 i = 0; i < mid; i++)                        \
-      {                                                     \
-        typeof((FIELD)->items[0]) ele;                      \
-        ele = LINKED_ARRAY_POP_TAIL(FIELD);                 \
-        LINKED_ARRAY_PUSH_HEAD(RIGHT, ele);                 \
-      }                                                     \
-                                                            \
-    while (!LINKED_ARRAY_IS_EMPTY(FIELD))                   \
-      {                                                     \
-        typeof((FIELD)->items[0]) ele;                      \
-        ele = LINKED_ARRAY_POP_TAIL(FIELD);                 \
-        LINKED_ARRAY_PUSH_HEAD(LEFT, ele);                  \
-      }                                                     \
+/**
+ * LINKED_ARRAY_SPLIT2:
+ * @FIELD: A pointer to a LinkedArray
+ * @LEFT: A pointer to an uninitialized LinkedArray of the same type
+ * @RIGHT: A pointer to an uninitialized LinkedArray of the same type
+ *
+ * Copies the lower half of @FIELD, by logical position, into @LEFT and
+ * the upper half into @RIGHT in a single walk, leaving @FIELD empty.
+ */
+#define LINKED_ARRAY_SPLIT2(FIELD, LEFT, RIGHT)                        \
+  G_STMT_START {                                                       \
+    guint _len = LINKED_ARRAY_LENGTH(FIELD);                           \
+    guint _keep = _len - _len / 2;                                     \
+    guint _n = 0;                                                      \
+                                                                       \
+    IQUEUE_FOREACH(&(FIELD)->q, _slot, {                               \
+      if (_n < _keep)                                                  \
+        (LEFT)->items[_n] = (FIELD)->items[_slot];                     \
+      else                                                             \
+        (RIGHT)->items[_n - _keep] = (FIELD)->items[_slot];            \
+      _n++;                                                            \
+    });                                                                \
+                                                                       \
+    IQUEUE_INIT_SEQUENCE(&(LEFT)->q, _keep);                           \
+    IQUEUE_INIT_SEQUENCE(&(RIGHT)->q, _len - _keep);                   \
+    LINKED_ARRAY_INIT(FIELD);                                          \
   } G_STMT_END
 
 #define LINKED_ARRAY_PEEK_HEAD(FIELD) ((FIELD)->items[IQUEUE_PEEK_HEAD(&(FIELD)->q)])
+#define LINKED_ARRAY_PEEK_TAIL(FIELD) ((FIELD)->items[IQUEUE_PEEK_TAIL(&(FIELD)->q)])
 #define LINKED_ARRAY_POP_HEAD(FIELD) LINKED_ARRAY_REMOVE_INDEX(FIELD, 0)
 #define LINKED_ARRAY_POP_TAIL(FIELD) LINKED_ARRAY_REMOVE_INDEX(FIELD, LINKED_ARRAY_LENGTH(FIELD)-1)
 
+/**
+ * LINKED_ARRAY_NTH:
+ * @FIELD: A pointer to a LinkedArray field.
+ * @POSITION: the logical position of the element
+ *
+ * Evaluates to a pointer to the element at the logical @POSITION.
+ * @POSITION must be less than LINKED_ARRAY_LENGTH().
+ */
+#define LINKED_ARRAY_NTH(FIELD, POSITION) (&(FIELD)->items[IQUEUE_NTH(&(FIELD)->q, (POSITION))])
+
 #define LINKED_ARRAY_PUSH_HEAD(FIELD, ele)                    \
   G_STMT_START {                                              \
-    guint8 _pos = IQUEUE_LENGTH(&(FIELD)->q);                 \
-    g_assert_cmpint (_pos, <, G_N_ELEMENTS ((FIELD)->items)); \
+    guint8 _pos = _LINKED_ARRAY_NEXT_SLOT(FIELD);             \
     (FIELD)->items[_pos] = ele;                               \
     IQUEUE_PUSH_HEAD(&(FIELD)->q, _pos);                      \
   } G_STMT_END
 
+#define LINKED_ARRAY_PUSH_TAIL(FIELD, ele)                    \
+  G_STMT_START {                                              \
+    guint8 _pos = _LINKED_ARRAY_NEXT_SLOT(FIELD);             \
+    (FIELD)->items[_pos] = ele;                               \
+    IQUEUE_PUSH_TAIL(&(FIELD)->q, _pos);                      \
+  } G_STMT_END
+
 G_END_DECLS
 
 #endif /* LINKED_ARRAY_H */
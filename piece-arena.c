@@ -0,0 +1,218 @@
+/* piece-arena.c
+ *
+ * Copyright (C) 2017 Christian Hergert <chergert@redhat.com>
+ *
+ * This file is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation; either version 2.1 of the License, or (at your option)
+ * any later version.
+ *
+ * This file is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public
+ * License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "piece-arena.h"
+
+/* Elements are rounded up to a whole number of cache lines, and chunks are
+ * aligned to one, so that no two elements share a cache line.
+ */
+#define PIECE_ARENA_CACHELINE  64
+#define PIECE_ARENA_CHUNK_SIZE (64 * 1024)
+
+typedef struct _PieceArenaChunk PieceArenaChunk;
+typedef struct _PieceArenaFree  PieceArenaFree;
+
+/*
+ * Chunks are linked through a header occupying their first cache line, so
+ * that the arena can release them without any other bookkeeping.
+ */
+struct _PieceArenaChunk
+{
+  PieceArenaChunk *next;
+};
+
+/* A released element, linked through its own storage */
+struct _PieceArenaFree
+{
+  PieceArenaFree *next;
+};
+
+/*
+ * The PieceArena hands out fixed-size elements carved from large chunks,
+ * and releases every chunk at once when the last reference is dropped,
+ * without visiting the elements within them.
+ *
+ * Elements are allocated by a single thread, from @free and then from the
+ * unused tail of the newest chunk. They may be released from any thread
+ * onto @released, a lock-free stack. The allocating thread takes the whole
+ * of @released at once when @free runs out, which is safe from ABA since
+ * nothing else ever pops from it.
+ */
+struct _PieceArena
+{
+  gint             ref_count;
+  gsize            element_size;
+  PieceArenaChunk *chunks;
+  guint8          *next;
+  guint8          *end;
+  PieceArenaFree  *free;
+  PieceArenaFree  *released;
+};
+
+/**
+ * piece_arena_new:
+ * @element_size: the size of each element
+ *
+ * Creates a new #PieceArena for elements of @element_size bytes.
+ *
+ * Returns: (transfer full): A new #PieceArena
+ */
+PieceArena *
+piece_arena_new (gsize element_size)
+{
+  PieceArena *self;
+
+  g_return_val_if_fail (element_size > 0, NULL);
+  g_return_val_if_fail (element_size <= PIECE_ARENA_CHUNK_SIZE - PIECE_ARENA_CACHELINE, NULL);
+
+  self = g_slice_new0 (PieceArena);
+  self->ref_count = 1;
+  self->element_size = (element_size + PIECE_ARENA_CACHELINE - 1) & ~(gsize)(PIECE_ARENA_CACHELINE - 1);
+
+  return self;
+}
+
+PieceArena *
+piece_arena_ref (PieceArena *self)
+{
+  g_return_val_if_fail (self != NULL, NULL);
+  g_return_val_if_fail (self->ref_count > 0, NULL);
+
+  g_atomic_int_inc (&self->ref_count);
+
+  return self;
+}
+
+/**
+ * piece_arena_unref:
+ * @self: A #PieceArena
+ *
+ * Releases a reference to @self. Once the last reference is gone, every
+ * chunk is freed along with any elements that are still allocated.
+ */
+void
+piece_arena_unref (PieceArena *self)
+{
+  g_return_if_fail (self != NULL);
+  g_return_if_fail (self->ref_count > 0);
+
+  if (g_atomic_int_dec_and_test (&self->ref_count))
+    {
+      while (self->chunks != NULL)
+        {
+          PieceArenaChunk *chunk = self->chunks;
+
+          self->chunks = chunk->next;
+          g_aligned_free (chunk);
+        }
+
+      g_slice_free (PieceArena, self);
+    }
+}
+
+/**
+ * piece_arena_is_shared:
+ * @self: A #PieceArena
+ *
+ * Checks whether anything other than the caller holds a reference to
+ * @self. If not, the caller may drop its reference without releasing the
+ * elements it allocated one at a time.
+ *
+ * Returns: %TRUE if there is more than one reference
+ */
+gboolean
+piece_arena_is_shared (PieceArena *self)
+{
+  g_return_val_if_fail (self != NULL, FALSE);
+
+  return g_atomic_int_get (&self->ref_count) > 1;
+}
+
+/**
+ * piece_arena_alloc:
+ * @self: A #PieceArena
+ *
+ * Allocates an element, aligned to a cache line, reusing a released one
+ * if possible. The contents are undefined.
+ *
+ * Only one thread may allocate from @self at a time.
+ *
+ * Returns: (not nullable): the new element
+ */
+gpointer
+piece_arena_alloc (PieceArena *self)
+{
+  gpointer element;
+
+  g_assert (self != NULL);
+
+  if G_UNLIKELY (self->free == NULL)
+    self->free = g_atomic_pointer_exchange (&self->released, NULL);
+
+  if (self->free != NULL)
+    {
+      element = self->free;
+      self->free = self->free->next;
+      return element;
+    }
+
+  if G_UNLIKELY (self->next == self->end)
+    {
+      PieceArenaChunk *chunk;
+      gsize n_elements;
+
+      chunk = g_aligned_alloc (1, PIECE_ARENA_CHUNK_SIZE, PIECE_ARENA_CACHELINE);
+      chunk->next = self->chunks;
+      self->chunks = chunk;
+
+      n_elements = (PIECE_ARENA_CHUNK_SIZE - PIECE_ARENA_CACHELINE) / self->element_size;
+      self->next = (guint8 *)chunk + PIECE_ARENA_CACHELINE;
+      self->end = self->next + n_elements * self->element_size;
+    }
+
+  element = self->next;
+  self->next += self->element_size;
+
+  return element;
+}
+
+/**
+ * piece_arena_free:
+ * @self: A #PieceArena
+ * @element: an element allocated from @self
+ *
+ * Releases @element so that it may be reused. This may be called from any
+ * thread, as long as the caller holds a reference to @self.
+ */
+void
+piece_arena_free (PieceArena *self,
+                  gpointer    element)
+{
+  PieceArenaFree *node = element;
+  PieceArenaFree *head;
+
+  g_assert (self != NULL);
+  g_assert (element != NULL);
+
+  do
+    {
+      head = g_atomic_pointer_get (&self->released);
+      node->next = head;
+    }
+  while (!g_atomic_pointer_compare_and_exchange (&self->released, head, node));
+}
@@ -0,0 +1,38 @@
+/* piece-arena.h
+ *
+ * Copyright (C) 2017 Christian Hergert <chergert@redhat.com>
+ *
+ * This file is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation; either version 2.1 of the License, or (at your option)
+ * any later version.
+ *
+ * This file is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public
+ * License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef PIECE_ARENA_H
+#define PIECE_ARENA_H
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+typedef struct _PieceArena PieceArena;
+
+PieceArena *piece_arena_new       (gsize       element_size);
+PieceArena *piece_arena_ref       (PieceArena *self);
+void        piece_arena_unref     (PieceArena *self);
+gboolean    piece_arena_is_shared (PieceArena *self);
+gpointer    piece_arena_alloc     (PieceArena *self);
+void        piece_arena_free      (PieceArena *self,
+                                   gpointer    element);
+
+G_END_DECLS
+
+#endif /* PIECE_ARENA_H */
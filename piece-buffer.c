@@ -0,0 +1,817 @@
+/* piece-buffer.c
+ *
+ * Copyright (C) 2017 Christian Hergert <chergert@redhat.com>
+ *
+ * This file is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation; either version 2.1 of the License, or (at your option)
+ * any later version.
+ *
+ * This file is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public
+ * License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <glib/gstdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#if defined(__AVX2__) || defined(__SSE2__)
+# include <immintrin.h>
+#endif
+
+#include "piece-buffer.h"
+
+/* The size of each chunk within the CHANGE arena. Chunks are never
+ * reallocated so that pointers into them remain valid.
+ */
+#define PIECE_BUFFER_CHUNK_SIZE (1 << 16)
+
+/* The granularity of the counts index. This must divide the chunk size
+ * so that a block never spans two chunks of the CHANGE arena.
+ */
+#define PIECE_BUFFER_INDEX_BLOCK (1 << 12)
+
+G_STATIC_ASSERT (PIECE_BUFFER_CHUNK_SIZE % PIECE_BUFFER_INDEX_BLOCK == 0);
+
+/*
+ * An append-only array which may be read while it is appended to. When
+ * the array grows, the old storage is retired rather than freed, so a
+ * reader that loaded an older pointer can still read every element that
+ * existed at the time. Retired storage is released along with the buffer
+ * and adds up to no more than the final size of the array.
+ */
+typedef struct
+{
+  gpointer  data;
+  guint     len;
+  guint     capacity;
+  GSList   *retired;
+} PieceBufferVector;
+
+/*
+ * The PieceBuffer holds the bytes that a PieceTableEntry refers to.
+ *
+ * The INITIAL buffer is the original file mapped read-only into memory,
+ * so opening a file takes constant time and pages are only read from disk
+ * as they are accessed.
+ *
+ * The CHANGE buffer is an append-only arena made of fixed size chunks. An
+ * offset within the CHANGE buffer is a position within the concatenation
+ * of all chunks, so contiguous appends have contiguous offsets even when
+ * they cross into a new chunk. Readers must therefore use
+ * piece_buffer_peek() to access the data one chunk at a time.
+ *
+ * Each buffer also has a counts index, where element i is the
+ * #PieceTableCounts of everything before block i. Counting the units
+ * within any range then only requires scanning the partial blocks at
+ * either end of it. The index of the CHANGE buffer is extended as it is
+ * appended to, while that of the INITIAL buffer is extended up to a block
+ * the first time the block is queried.
+ */
+struct _PieceBuffer
+{
+  gint               ref_count;
+
+  GMappedFile       *initial;
+
+  /* The chunks of the CHANGE arena. The length is updated atomically so
+   * that it may be checked while another thread is appending.
+   */
+  PieceBufferVector  chunks;
+  guint64            change_length;
+
+  /* The counts index of the INITIAL and CHANGE buffers. Readers on other
+   * threads may extend the INITIAL index, so they do so with the lock held
+   * and the length of the index is updated atomically.
+   */
+  PieceBufferVector  initial_index;
+  PieceBufferVector  change_index;
+  GMutex             initial_lock;
+
+  /* The descriptor the INITIAL buffer was mapped from, so that it may be
+   * copied within the kernel when saving, or -1. Since we keep it open, it
+   * remains valid even after the file has been replaced on disk.
+   */
+  gint               initial_fd;
+};
+
+static void
+piece_buffer_vector_append (PieceBufferVector *vector,
+                            gsize              element_size,
+                            gconstpointer      element)
+{
+  if (vector->len == vector->capacity)
+    {
+      guint capacity = MAX (16, vector->capacity * 2);
+      gpointer data = g_malloc (capacity * element_size);
+
+      if (vector->data != NULL)
+        {
+          memcpy (data, vector->data, vector->len * element_size);
+          vector->retired = g_slist_prepend (vector->retired, vector->data);
+        }
+
+      g_atomic_pointer_set (&vector->data, data);
+      vector->capacity = capacity;
+    }
+
+  memcpy ((guint8 *)vector->data + vector->len * element_size, element, element_size);
+  __atomic_store_n (&vector->len, vector->len + 1, __ATOMIC_RELEASE);
+}
+
+static inline gpointer
+piece_buffer_vector_peek (PieceBufferVector *vector)
+{
+  return g_atomic_pointer_get (&vector->data);
+}
+
+static void
+piece_buffer_vector_clear (PieceBufferVector *vector)
+{
+  g_free (vector->data);
+  g_slist_free_full (vector->retired, g_free);
+}
+
+/* GLib only provides atomics for ints and pointers */
+static inline guint64
+piece_buffer_get_change_length_atomic (PieceBuffer *self)
+{
+  return __atomic_load_n (&self->change_length, __ATOMIC_ACQUIRE);
+}
+
+#if defined(__AVX2__)
+static inline guint64
+piece_buffer_sum_avx2 (__m256i acc)
+{
+  acc = _mm256_sad_epu8 (acc, _mm256_setzero_si256 ());
+
+  return _mm256_extract_epi64 (acc, 0) + _mm256_extract_epi64 (acc, 1) +
+         _mm256_extract_epi64 (acc, 2) + _mm256_extract_epi64 (acc, 3);
+}
+#elif defined(__SSE2__)
+static inline guint64
+piece_buffer_sum_sse2 (__m128i acc)
+{
+  acc = _mm_sad_epu8 (acc, _mm_setzero_si128 ());
+
+  return _mm_cvtsi128_si32 (acc) + _mm_extract_epi16 (acc, 4);
+}
+#endif
+
+/*
+ * piece_buffer_count_raw:
+ * @data: the data to scan
+ * @length: the number of bytes in @data
+ * @counts: (inout): the counts to add to
+ *
+ * Classifies each byte of @data and adds the number of newlines, UTF-8
+ * lead bytes (one per code point) and 4-byte lead bytes (which require a
+ * surrogate pair in UTF-16) to @counts.
+ *
+ * The vectorized loops classify a vector of bytes at a time and accumulate
+ * the matches in per-byte counters, which are summed horizontally before
+ * they can overflow. Continuation bytes (0x80-0xBF) are exactly the bytes
+ * that are not greater than -65 when treated as signed.
+ */
+static void
+piece_buffer_count_raw (const gchar      *data,
+                        gsize             length,
+                        PieceTableCounts *counts)
+{
+  guint64 newlines = 0;
+  guint64 leads = 0;
+  guint64 wide = 0;
+
+#if defined(__AVX2__)
+  const __m256i newline = _mm256_set1_epi8 ('\n');
+  const __m256i continuation = _mm256_set1_epi8 (-65);
+  const __m256i four_byte = _mm256_set1_epi8 ((gchar)0xF0);
+
+  while (length >= sizeof (__m256i))
+    {
+      __m256i newline_acc = _mm256_setzero_si256 ();
+      __m256i lead_acc = _mm256_setzero_si256 ();
+      __m256i wide_acc = _mm256_setzero_si256 ();
+      gsize n = MIN (length / sizeof (__m256i), 255);
+
+      for (gsize i = 0; i < n; i++, data += sizeof (__m256i))
+        {
+          __m256i v = _mm256_loadu_si256 ((const __m256i *)(gconstpointer)data);
+
+          newline_acc = _mm256_sub_epi8 (newline_acc, _mm256_cmpeq_epi8 (v, newline));
+          lead_acc = _mm256_sub_epi8 (lead_acc, _mm256_cmpgt_epi8 (v, continuation));
+          wide_acc = _mm256_sub_epi8 (wide_acc, _mm256_cmpeq_epi8 (_mm256_max_epu8 (v, four_byte), v));
+        }
+
+      newlines += piece_buffer_sum_avx2 (newline_acc);
+      leads += piece_buffer_sum_avx2 (lead_acc);
+      wide += piece_buffer_sum_avx2 (wide_acc);
+      length -= n * sizeof (__m256i);
+    }
+#elif defined(__SSE2__)
+  const __m128i newline = _mm_set1_epi8 ('\n');
+  const __m128i continuation = _mm_set1_epi8 (-65);
+  const __m128i four_byte = _mm_set1_epi8 ((gchar)0xF0);
+
+  while (length >= sizeof (__m128i))
+    {
+      __m128i newline_acc = _mm_setzero_si128 ();
+      __m128i lead_acc = _mm_setzero_si128 ();
+      __m128i wide_acc = _mm_setzero_si128 ();
+      gsize n = MIN (length / sizeof (__m128i), 255);
+
+      for (gsize i = 0; i < n; i++, data += sizeof (__m128i))
+        {
+          __m128i v = _mm_loadu_si128 ((const __m128i *)(gconstpointer)data);
+
+          newline_acc = _mm_sub_epi8 (newline_acc, _mm_cmpeq_epi8 (v, newline));
+          lead_acc = _mm_sub_epi8 (lead_acc, _mm_cmpgt_epi8 (v, continuation));
+          wide_acc = _mm_sub_epi8 (wide_acc, _mm_cmpeq_epi8 (_mm_max_epu8 (v, four_byte), v));
+        }
+
+      newlines += piece_buffer_sum_sse2 (newline_acc);
+      leads += piece_buffer_sum_sse2 (lead_acc);
+      wide += piece_buffer_sum_sse2 (wide_acc);
+      length -= n * sizeof (__m128i);
+    }
+#endif
+
+  for (; length > 0; length--, data++)
+    {
+      guint8 c = *data;
+
+      newlines += (c == '\n');
+      leads += ((c & 0xC0) != 0x80);
+      wide += (c >= 0xF0);
+    }
+
+  counts->newlines += newlines;
+  counts->code_points += leads;
+  counts->utf16 += leads + wide;
+}
+
+static inline PieceBufferVector *
+piece_buffer_get_index (PieceBuffer *self,
+                        PieceKind    kind)
+{
+  return kind == PIECE_INITIAL ? &self->initial_index : &self->change_index;
+}
+
+static inline guint64
+piece_buffer_get_length (PieceBuffer *self,
+                         PieceKind    kind)
+{
+  if (kind == PIECE_INITIAL)
+    return piece_buffer_get_initial_length (self);
+  else
+    return piece_buffer_get_change_length_atomic (self);
+}
+
+static inline guint64
+piece_buffer_counts_get (const PieceTableCounts *counts,
+                         PieceUnit               unit)
+{
+  return unit == PIECE_UNIT_UTF16 ? counts->utf16 : counts->code_points;
+}
+
+/*
+ * piece_buffer_extend_index:
+ * @self: A #PieceBuffer
+ * @kind: the buffer to index
+ * @block: the block whose element is needed
+ *
+ * Adds an element to the counts index of @kind for every block up to and
+ * including @block, scanning only the blocks that were not yet indexed.
+ * Every block before @block must be completely filled.
+ */
+static void
+piece_buffer_extend_index (PieceBuffer *self,
+                           PieceKind    kind,
+                           guint64      block)
+{
+  PieceBufferVector *index = piece_buffer_get_index (self, kind);
+
+  g_assert (block <= piece_buffer_get_length (self, kind) / PIECE_BUFFER_INDEX_BLOCK);
+
+  while (index->len <= block)
+    {
+      PieceTableCounts counts = ((PieceTableCounts *)index->data)[index->len - 1];
+      guint64 block_length = PIECE_BUFFER_INDEX_BLOCK;
+      const gchar *data;
+
+      data = piece_buffer_peek (self, kind, (guint64)(index->len - 1) * PIECE_BUFFER_INDEX_BLOCK, &block_length);
+      g_assert (block_length == PIECE_BUFFER_INDEX_BLOCK);
+
+      piece_buffer_count_raw (data, block_length, &counts);
+      piece_buffer_vector_append (index, sizeof counts, &counts);
+    }
+}
+
+/*
+ * piece_buffer_ensure_index:
+ * @self: A #PieceBuffer
+ * @kind: the buffer to access
+ * @block: the block whose element is needed
+ *
+ * Makes sure the counts index of @kind contains @block, so that it may be
+ * read with piece_buffer_vector_peek(). Only the INITIAL index is built on
+ * demand, and once a block has been indexed this is a single atomic load.
+ */
+static inline void
+piece_buffer_ensure_index (PieceBuffer *self,
+                           PieceKind    kind,
+                           guint64      block)
+{
+  if (kind != PIECE_INITIAL ||
+      G_LIKELY (block < __atomic_load_n (&self->initial_index.len, __ATOMIC_ACQUIRE)))
+    return;
+
+  g_mutex_lock (&self->initial_lock);
+  piece_buffer_extend_index (self, PIECE_INITIAL, block);
+  g_mutex_unlock (&self->initial_lock);
+}
+
+/*
+ * piece_buffer_count_before:
+ * @self: A #PieceBuffer
+ * @kind: the buffer to access
+ * @offset: an offset within the buffer
+ * @counts: (out): the counts of everything in the buffer before @offset
+ */
+static void
+piece_buffer_count_before (PieceBuffer      *self,
+                           PieceKind         kind,
+                           guint64           offset,
+                           PieceTableCounts *counts)
+{
+  const PieceTableCounts *index;
+  guint64 block = offset / PIECE_BUFFER_INDEX_BLOCK;
+  guint64 partial = offset % PIECE_BUFFER_INDEX_BLOCK;
+
+  piece_buffer_ensure_index (self, kind, block);
+  index = piece_buffer_vector_peek (piece_buffer_get_index (self, kind));
+
+  *counts = index[block];
+
+  if (partial > 0)
+    {
+      const gchar *data = piece_buffer_peek (self, kind, offset - partial, &partial);
+      piece_buffer_count_raw (data, partial, counts);
+    }
+}
+
+PieceBuffer *
+piece_buffer_new (void)
+{
+  PieceTableCounts zero = { 0 };
+  PieceBuffer *self;
+
+  self = g_slice_new0 (PieceBuffer);
+  self->ref_count = 1;
+  self->initial_fd = -1;
+  g_mutex_init (&self->initial_lock);
+
+  piece_buffer_vector_append (&self->initial_index, sizeof zero, &zero);
+  piece_buffer_vector_append (&self->change_index, sizeof zero, &zero);
+
+  return self;
+}
+
+/**
+ * piece_buffer_new_for_file:
+ * @filename: the path to the original file
+ * @error: a location for a #GError, or %NULL
+ *
+ * Creates a new #PieceBuffer whose INITIAL buffer is the contents of
+ * @filename, mapped read-only.
+ *
+ * Nothing is read from the file here. Its counts index is built a block
+ * at a time as ranges of it are counted, so this takes constant time.
+ *
+ * Returns: (transfer full) (nullable): A #PieceBuffer or %NULL on failure.
+ */
+PieceBuffer *
+piece_buffer_new_for_file (const gchar  *filename,
+                           GError      **error)
+{
+  GMappedFile *mapped;
+  PieceBuffer *self;
+  gint fd;
+
+  g_return_val_if_fail (filename != NULL, NULL);
+
+  /* Map the descriptor we keep, so that both always refer to the same file
+   * even if @filename is replaced in the meantime.
+   */
+  if (-1 == (fd = g_open (filename, O_RDONLY | O_CLOEXEC, 0)))
+    {
+      int errsv = errno;
+
+      g_set_error (error,
+                   G_FILE_ERROR,
+                   g_file_error_from_errno (errsv),
+                   "Failed to open \"%s\": %s",
+                   filename,
+                   g_strerror (errsv));
+      return NULL;
+    }
+
+  if (!(mapped = g_mapped_file_new_from_fd (fd, FALSE, error)))
+    {
+      g_close (fd, NULL);
+      return NULL;
+    }
+
+  self = piece_buffer_new ();
+  self->initial = mapped;
+  self->initial_fd = fd;
+
+  return self;
+}
+
+PieceBuffer *
+piece_buffer_ref (PieceBuffer *self)
+{
+  g_return_val_if_fail (self != NULL, NULL);
+
+  g_atomic_int_inc (&self->ref_count);
+
+  return self;
+}
+
+void
+piece_buffer_unref (PieceBuffer *self)
+{
+  if (self != NULL && g_atomic_int_dec_and_test (&self->ref_count))
+    {
+      gchar **chunks = self->chunks.data;
+
+      if (self->initial != NULL)
+        g_mapped_file_unref (self->initial);
+      if (self->initial_fd != -1)
+        g_close (self->initial_fd, NULL);
+      for (guint i = 0; i < self->chunks.len; i++)
+        g_free (chunks[i]);
+      piece_buffer_vector_clear (&self->chunks);
+      piece_buffer_vector_clear (&self->initial_index);
+      piece_buffer_vector_clear (&self->change_index);
+      g_mutex_clear (&self->initial_lock);
+      g_slice_free (PieceBuffer, self);
+    }
+}
+
+guint64
+piece_buffer_get_initial_length (PieceBuffer *self)
+{
+  g_return_val_if_fail (self != NULL, 0);
+
+  return self->initial ? g_mapped_file_get_length (self->initial) : 0;
+}
+
+/**
+ * piece_buffer_get_initial_fd:
+ * @self: A #PieceBuffer
+ *
+ * Gets a read-only file descriptor for the INITIAL buffer, which may be
+ * used to copy data within the kernel. The descriptor is owned by @self.
+ *
+ * Returns: a file descriptor or -1
+ */
+gint
+piece_buffer_get_initial_fd (PieceBuffer *self)
+{
+  g_return_val_if_fail (self != NULL, -1);
+
+  return self->initial_fd;
+}
+
+guint64
+piece_buffer_get_change_length (PieceBuffer *self)
+{
+  g_return_val_if_fail (self != NULL, 0);
+
+  return piece_buffer_get_change_length_atomic (self);
+}
+
+/**
+ * piece_buffer_append:
+ * @self: A #PieceBuffer
+ * @data: the data to append
+ * @length: the number of bytes in @data
+ *
+ * Appends @data to the CHANGE arena, allocating new chunks as necessary.
+ * Only the thread which owns the #PieceTable may append, but other threads
+ * may read what was appended before they were handed a snapshot.
+ *
+ * Returns: the offset of @data within the CHANGE buffer
+ */
+guint64
+piece_buffer_append (PieceBuffer *self,
+                     const gchar *data,
+                     gsize        length)
+{
+  guint64 offset;
+
+  g_return_val_if_fail (self != NULL, 0);
+  g_return_val_if_fail (data != NULL || length == 0, 0);
+
+  offset = self->change_length;
+
+  while (length > 0)
+    {
+      guint64 chunk_offset = self->change_length % PIECE_BUFFER_CHUNK_SIZE;
+      gsize to_copy = MIN (length, PIECE_BUFFER_CHUNK_SIZE - chunk_offset);
+      gchar *chunk;
+
+      if (chunk_offset == 0)
+        {
+          chunk = g_malloc (PIECE_BUFFER_CHUNK_SIZE);
+          piece_buffer_vector_append (&self->chunks, sizeof chunk, &chunk);
+        }
+
+      chunk = ((gchar **)self->chunks.data)[self->chunks.len - 1];
+      memcpy (chunk + chunk_offset, data, to_copy);
+
+      __atomic_store_n (&self->change_length, self->change_length + to_copy, __ATOMIC_RELEASE);
+      data += to_copy;
+      length -= to_copy;
+    }
+
+  piece_buffer_extend_index (self, PIECE_CHANGE, self->change_length / PIECE_BUFFER_INDEX_BLOCK);
+
+  return offset;
+}
+
+/**
+ * piece_buffer_peek:
+ * @self: A #PieceBuffer
+ * @kind: the buffer to access
+ * @offset: the offset within the buffer
+ * @length: (inout): the number of bytes requested
+ *
+ * Gets a pointer to the data at @offset within the buffer for @kind.
+ *
+ * The CHANGE buffer is not contiguous in memory, so @length is reduced to
+ * the number of bytes that are available at the resulting pointer. Callers
+ * should continue from @offset + @length to read the remainder.
+ *
+ * Returns: (transfer none): a pointer to the data
+ */
+const gchar *
+piece_buffer_peek (PieceBuffer *self,
+                   PieceKind    kind,
+                   guint64      offset,
+                   guint64     *length)
+{
+  g_return_val_if_fail (self != NULL, NULL);
+  g_return_val_if_fail (length != NULL, NULL);
+
+  if (kind == PIECE_INITIAL)
+    {
+      g_return_val_if_fail (self->initial != NULL, NULL);
+      g_return_val_if_fail (offset + *length <= piece_buffer_get_initial_length (self), NULL);
+
+      return g_mapped_file_get_contents (self->initial) + offset;
+    }
+  else
+    {
+      const gchar *chunk;
+      guint64 chunk_offset;
+
+      g_return_val_if_fail (offset + *length <= piece_buffer_get_change_length_atomic (self), NULL);
+
+      chunk = ((gchar **)piece_buffer_vector_peek (&self->chunks))[offset / PIECE_BUFFER_CHUNK_SIZE];
+      chunk_offset = offset % PIECE_BUFFER_CHUNK_SIZE;
+      *length = MIN (*length, PIECE_BUFFER_CHUNK_SIZE - chunk_offset);
+
+      return chunk + chunk_offset;
+    }
+}
+
+/**
+ * piece_buffer_count:
+ * @self: A #PieceBuffer
+ * @kind: the buffer to access
+ * @offset: the offset within the buffer
+ * @length: the number of bytes
+ * @counts: (out): the counts of the units within the range
+ *
+ * Counts the newlines, code points and UTF-16 code units within @length
+ * bytes starting from @offset. Short ranges are scanned directly, while
+ * longer ranges use the counts index so that at most two partial blocks
+ * are scanned regardless of @length.
+ */
+void
+piece_buffer_count (PieceBuffer      *self,
+                    PieceKind         kind,
+                    guint64           offset,
+                    guint64           length,
+                    PieceTableCounts *counts)
+{
+  g_return_if_fail (self != NULL);
+  g_return_if_fail (counts != NULL);
+
+  memset (counts, 0, sizeof *counts);
+
+  g_return_if_fail (offset + length <= piece_buffer_get_length (self, kind));
+
+  if (length >= PIECE_BUFFER_INDEX_BLOCK)
+    {
+      PieceTableCounts before;
+
+      piece_buffer_count_before (self, kind, offset, &before);
+      piece_buffer_count_before (self, kind, offset + length, counts);
+
+      counts->newlines -= before.newlines;
+      counts->code_points -= before.code_points;
+      counts->utf16 -= before.utf16;
+
+      return;
+    }
+
+  while (length > 0)
+    {
+      guint64 chunk_length = length;
+      const gchar *data;
+
+      data = piece_buffer_peek (self, kind, offset, &chunk_length);
+      piece_buffer_count_raw (data, chunk_length, counts);
+
+      offset += chunk_length;
+      length -= chunk_length;
+    }
+}
+
+/**
+ * piece_buffer_skip_newlines:
+ * @self: A #PieceBuffer
+ * @kind: the buffer to access
+ * @offset: the offset within the buffer to start from
+ * @length: the number of bytes after @offset to search
+ * @n_newlines: the number of newlines to skip, at least 1
+ *
+ * Locates the @n_newlines'th newline within @length bytes of @offset. The
+ * counts index is searched for the block containing it, so only a single
+ * block is scanned. The range must contain at least @n_newlines newlines.
+ *
+ * Returns: the offset immediately after the newline
+ */
+guint64
+piece_buffer_skip_newlines (PieceBuffer *self,
+                            PieceKind    kind,
+                            guint64      offset,
+                            guint64      length,
+                            guint64      n_newlines)
+{
+  const PieceTableCounts *index;
+  PieceTableCounts before;
+  guint64 target;
+  guint64 end;
+  guint lo;
+  guint hi;
+
+  g_return_val_if_fail (self != NULL, 0);
+  g_return_val_if_fail (n_newlines > 0, 0);
+  g_return_val_if_fail (offset + length <= piece_buffer_get_length (self, kind), 0);
+
+  end = offset + length;
+  piece_buffer_ensure_index (self, kind, end / PIECE_BUFFER_INDEX_BLOCK);
+  index = piece_buffer_vector_peek (piece_buffer_get_index (self, kind));
+  piece_buffer_count_before (self, kind, offset, &before);
+  target = before.newlines + n_newlines;
+
+  /* Find the last block which begins before the target newline */
+  lo = offset / PIECE_BUFFER_INDEX_BLOCK;
+  hi = end / PIECE_BUFFER_INDEX_BLOCK;
+
+  while (lo < hi)
+    {
+      guint mid = lo + (hi - lo + 1) / 2;
+
+      if (index[mid].newlines < target)
+        lo = mid;
+      else
+        hi = mid - 1;
+    }
+
+  if ((guint64)lo * PIECE_BUFFER_INDEX_BLOCK > offset)
+    {
+      offset = (guint64)lo * PIECE_BUFFER_INDEX_BLOCK;
+      n_newlines = target - index[lo].newlines;
+    }
+
+  length = MIN (PIECE_BUFFER_INDEX_BLOCK - offset % PIECE_BUFFER_INDEX_BLOCK, end - offset);
+
+  if (length > 0)
+    {
+      const gchar *data = piece_buffer_peek (self, kind, offset, &length);
+      const gchar *last = data + length;
+      const gchar *iter = data;
+
+      while ((iter = memchr (iter, '\n', last - iter)))
+        {
+          iter++;
+
+          if (--n_newlines == 0)
+            return offset + (iter - data);
+        }
+    }
+
+  g_return_val_if_reached (offset + length);
+}
+
+/**
+ * piece_buffer_skip_units:
+ * @self: A #PieceBuffer
+ * @kind: the buffer to access
+ * @offset: the offset within the buffer to start from
+ * @length: the number of bytes after @offset to search
+ * @unit: the kind of unit to skip
+ * @n_units: the number of units to skip
+ *
+ * Locates the furthest character boundary within @length bytes of @offset
+ * such that there are no more than @n_units units between @offset and the
+ * boundary. A position in the middle of a UTF-16 surrogate pair therefore
+ * resolves to the start of the character. Like piece_buffer_skip_newlines(),
+ * only a single block is scanned.
+ *
+ * Returns: the offset of the boundary, or @offset + @length
+ */
+guint64
+piece_buffer_skip_units (PieceBuffer *self,
+                         PieceKind    kind,
+                         guint64      offset,
+                         guint64      length,
+                         PieceUnit    unit,
+                         guint64      n_units)
+{
+  const PieceTableCounts *index;
+  PieceTableCounts before;
+  guint64 target;
+  guint64 end;
+  guint lo;
+  guint hi;
+
+  g_return_val_if_fail (self != NULL, 0);
+  g_return_val_if_fail (unit == PIECE_UNIT_CODE_POINTS || unit == PIECE_UNIT_UTF16, 0);
+  g_return_val_if_fail (offset + length <= piece_buffer_get_length (self, kind), 0);
+
+  end = offset + length;
+  piece_buffer_ensure_index (self, kind, end / PIECE_BUFFER_INDEX_BLOCK);
+  index = piece_buffer_vector_peek (piece_buffer_get_index (self, kind));
+  piece_buffer_count_before (self, kind, offset, &before);
+  target = piece_buffer_counts_get (&before, unit) + n_units;
+
+  /* Find the last block which begins with no more than @target units
+   * before it, as the character which would exceed @target is within it.
+   */
+  lo = offset / PIECE_BUFFER_INDEX_BLOCK;
+  hi = end / PIECE_BUFFER_INDEX_BLOCK;
+
+  while (lo < hi)
+    {
+      guint mid = lo + (hi - lo + 1) / 2;
+
+      if (piece_buffer_counts_get (&index[mid], unit) <= target)
+        lo = mid;
+      else
+        hi = mid - 1;
+    }
+
+  if ((guint64)lo * PIECE_BUFFER_INDEX_BLOCK > offset)
+    {
+      offset = (guint64)lo * PIECE_BUFFER_INDEX_BLOCK;
+      n_units = target - piece_buffer_counts_get (&index[lo], unit);
+    }
+
+  length = MIN (PIECE_BUFFER_INDEX_BLOCK - offset % PIECE_BUFFER_INDEX_BLOCK, end - offset);
+
+  if (length > 0)
+    {
+      const guint8 *data = (const guint8 *)piece_buffer_peek (self, kind, offset, &length);
+
+      for (guint64 i = 0; i < length; i++)
+        {
+          guint width;
+
+          if ((data[i] & 0xC0) == 0x80)
+            continue;
+
+          width = (unit == PIECE_UNIT_UTF16 && data[i] >= 0xF0) ? 2 : 1;
+
+          if (width > n_units)
+            return offset + i;
+
+          n_units -= width;
+        }
+    }
+
+  return offset + length;
+}
@@ -0,0 +1,60 @@
+/* piece-buffer.h
+ *
+ * Copyright (C) 2017 Christian Hergert <chergert@redhat.com>
+ *
+ * This file is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation; either version 2.1 of the License, or (at your option)
+ * any later version.
+ *
+ * This file is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public
+ * License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef PIECE_BUFFER_H
+#define PIECE_BUFFER_H
+
+#include "piece-table.h"
+
+G_BEGIN_DECLS
+
+PieceBuffer *piece_buffer_new                (void);
+PieceBuffer *piece_buffer_new_for_file       (const gchar      *filename,
+                                              GError          **error);
+PieceBuffer *piece_buffer_ref                (PieceBuffer      *self);
+void         piece_buffer_unref              (PieceBuffer      *self);
+guint64      piece_buffer_get_initial_length (PieceBuffer      *self);
+guint64      piece_buffer_get_change_length  (PieceBuffer      *self);
+gint         piece_buffer_get_initial_fd     (PieceBuffer      *self);
+guint64      piece_buffer_append             (PieceBuffer      *self,
+                                              const gchar      *data,
+                                              gsize             length);
+const gchar *piece_buffer_peek               (PieceBuffer      *self,
+                                              PieceKind         kind,
+                                              guint64           offset,
+                                              guint64          *length);
+void         piece_buffer_count              (PieceBuffer      *self,
+                                              PieceKind         kind,
+                                              guint64           offset,
+                                              guint64           length,
+                                              PieceTableCounts *counts);
+guint64      piece_buffer_skip_newlines      (PieceBuffer      *self,
+                                              PieceKind         kind,
+                                              guint64           offset,
+                                              guint64           length,
+                                              guint64           n_newlines);
+guint64      piece_buffer_skip_units         (PieceBuffer      *self,
+                                              PieceKind         kind,
+                                              guint64           offset,
+                                              guint64           length,
+                                              PieceUnit         unit,
+                                              guint64           n_units);
+
+G_END_DECLS
+
+#endif /* PIECE_BUFFER_H */
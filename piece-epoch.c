@@ -0,0 +1,271 @@
+/* piece-epoch.c
+ *
+ * Copyright (C) 2017 Christian Hergert <chergert@redhat.com>
+ *
+ * This file is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation; either version 2.1 of the License, or (at your option)
+ * any later version.
+ *
+ * This file is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public
+ * License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "piece-epoch.h"
+
+/* Readers are written by their own thread on every enter and leave, so
+ * keep each on its own cache line to avoid false sharing between them.
+ */
+#define PIECE_EPOCH_CACHELINE 64
+
+typedef struct _PieceEpochRetired PieceEpochRetired;
+
+/*
+ * A reader registered with a #PieceEpoch. @epoch is the global epoch the
+ * reader observed when it last entered, or zero while it is not reading.
+ */
+struct _PieceEpochReader
+{
+  gsize             epoch;
+  PieceEpoch       *owner;
+  PieceEpochReader *next;
+} __attribute__((aligned (PIECE_EPOCH_CACHELINE)));
+
+/*
+ * Something the writer has unpublished, which readers that entered at or
+ * before @epoch may still be using.
+ */
+struct _PieceEpochRetired
+{
+  gsize          epoch;
+  gpointer       data;
+  GDestroyNotify notify;
+};
+
+/*
+ * The PieceEpoch implements epoch-based reclamation between a single writer
+ * and any number of readers.
+ *
+ * The writer publishes a new version of some structure by swapping a
+ * pointer, and then retires the old version. Retiring records the current
+ * global epoch and advances it. A reader enters by storing the global epoch
+ * in its slot before loading the published pointer, and leaves by clearing
+ * its slot, so entering and leaving are a couple of stores without locks or
+ * shared reference counts.
+ *
+ * A retired version is released once no reader remains in an epoch at or
+ * before the one it was retired in, since any reader entering later must
+ * have loaded the pointer that replaced it.
+ *
+ * @mutex only protects the list of readers, which changes when a reader
+ * registers or unregisters and is scanned by the writer while reclaiming.
+ * The retired list is only touched by the writer.
+ */
+struct _PieceEpoch
+{
+  gsize             epoch;
+  GMutex            mutex;
+  PieceEpochReader *readers;
+  GArray           *retired;
+};
+
+PieceEpoch *
+piece_epoch_new (void)
+{
+  PieceEpoch *self;
+
+  self = g_slice_new0 (PieceEpoch);
+  self->epoch = 1;
+  g_mutex_init (&self->mutex);
+  self->retired = g_array_new (FALSE, FALSE, sizeof (PieceEpochRetired));
+
+  return self;
+}
+
+/*
+ * piece_epoch_free:
+ * @self: A #PieceEpoch
+ *
+ * Releases everything that has been retired. Every reader must have been
+ * unregistered first.
+ */
+void
+piece_epoch_free (PieceEpoch *self)
+{
+  if (self != NULL)
+    {
+      g_assert (self->readers == NULL);
+
+      for (guint i = 0; i < self->retired->len; i++)
+        {
+          PieceEpochRetired *retired = &g_array_index (self->retired, PieceEpochRetired, i);
+
+          retired->notify (retired->data);
+        }
+
+      g_array_unref (self->retired);
+      g_mutex_clear (&self->mutex);
+      g_slice_free (PieceEpoch, self);
+    }
+}
+
+/*
+ * piece_epoch_register:
+ * @self: A #PieceEpoch
+ *
+ * Registers a new reader. A reader must only be used by a single thread
+ * at a time.
+ *
+ * Returns: (transfer full): A #PieceEpochReader
+ */
+PieceEpochReader *
+piece_epoch_register (PieceEpoch *self)
+{
+  PieceEpochReader *reader;
+
+  g_assert (self != NULL);
+
+  reader = g_aligned_alloc0 (1, sizeof *reader, PIECE_EPOCH_CACHELINE);
+  reader->owner = self;
+
+  g_mutex_lock (&self->mutex);
+  reader->next = self->readers;
+  self->readers = reader;
+  g_mutex_unlock (&self->mutex);
+
+  return reader;
+}
+
+void
+piece_epoch_unregister (PieceEpoch       *self,
+                        PieceEpochReader *reader)
+{
+  g_assert (self != NULL);
+  g_assert (reader != NULL);
+  g_assert (reader->epoch == 0);
+
+  g_mutex_lock (&self->mutex);
+  for (PieceEpochReader **iter = &self->readers; *iter != NULL; iter = &(*iter)->next)
+    {
+      if (*iter == reader)
+        {
+          *iter = reader->next;
+          break;
+        }
+    }
+  g_mutex_unlock (&self->mutex);
+
+  g_aligned_free (reader);
+}
+
+/*
+ * piece_epoch_enter:
+ * @reader: A #PieceEpochReader
+ *
+ * Pins the current epoch, after which anything loaded from a published
+ * pointer remains valid until piece_epoch_leave() is called.
+ */
+void
+piece_epoch_enter (PieceEpochReader *reader)
+{
+  gsize epoch;
+
+  g_assert (reader != NULL);
+  g_assert (reader->epoch == 0);
+
+  /* Our store must be visible to the writer before we load the published
+   * pointer, which sequentially consistent atomics guarantee. A stale
+   * epoch only delays reclaiming by one publication.
+   */
+  epoch = __atomic_load_n (&reader->owner->epoch, __ATOMIC_SEQ_CST);
+  __atomic_store_n (&reader->epoch, epoch, __ATOMIC_SEQ_CST);
+}
+
+void
+piece_epoch_leave (PieceEpochReader *reader)
+{
+  g_assert (reader != NULL);
+  g_assert (reader->epoch != 0);
+
+  __atomic_store_n (&reader->epoch, 0, __ATOMIC_RELEASE);
+}
+
+/*
+ * piece_epoch_retire:
+ * @self: A #PieceEpoch
+ * @data: something that is no longer published
+ * @notify: the function to release @data with
+ *
+ * Retires @data, which the writer must have already replaced with a new
+ * version, and advances the epoch. @data is released by a later call to
+ * piece_epoch_reclaim() once no reader can be using it.
+ */
+void
+piece_epoch_retire (PieceEpoch     *self,
+                    gpointer        data,
+                    GDestroyNotify  notify)
+{
+  PieceEpochRetired retired;
+
+  g_assert (self != NULL);
+  g_assert (notify != NULL);
+
+  retired.epoch = self->epoch;
+  retired.data = data;
+  retired.notify = notify;
+  g_array_append_val (self->retired, retired);
+
+  __atomic_store_n (&self->epoch, self->epoch + 1, __ATOMIC_SEQ_CST);
+}
+
+/*
+ * piece_epoch_reclaim:
+ * @self: A #PieceEpoch
+ *
+ * Releases everything retired before the oldest epoch any reader is
+ * still in. Only the writer may call this.
+ *
+ * Returns: the number of retired items that were released
+ */
+guint
+piece_epoch_reclaim (PieceEpoch *self)
+{
+  gsize oldest;
+  guint n = 0;
+
+  g_assert (self != NULL);
+
+  if (self->retired->len == 0)
+    return 0;
+
+  oldest = self->epoch;
+
+  g_mutex_lock (&self->mutex);
+  for (PieceEpochReader *iter = self->readers; iter != NULL; iter = iter->next)
+    {
+      gsize epoch = __atomic_load_n (&iter->epoch, __ATOMIC_SEQ_CST);
+
+      if (epoch != 0 && epoch < oldest)
+        oldest = epoch;
+    }
+  g_mutex_unlock (&self->mutex);
+
+  /* Items are retired in order of their epoch */
+  while (n < self->retired->len &&
+         g_array_index (self->retired, PieceEpochRetired, n).epoch < oldest)
+    {
+      PieceEpochRetired *retired = &g_array_index (self->retired, PieceEpochRetired, n);
+
+      retired->notify (retired->data);
+      n++;
+    }
+
+  g_array_remove_range (self->retired, 0, n);
+
+  return n;
+}
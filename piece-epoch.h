@@ -0,0 +1,43 @@
+/* piece-epoch.h
+ *
+ * Copyright (C) 2017 Christian Hergert <chergert@redhat.com>
+ *
+ * This file is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation; either version 2.1 of the License, or (at your option)
+ * any later version.
+ *
+ * This file is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public
+ * License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef PIECE_EPOCH_H
+#define PIECE_EPOCH_H
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+typedef struct _PieceEpoch       PieceEpoch;
+typedef struct _PieceEpochReader PieceEpochReader;
+
+PieceEpoch       *piece_epoch_new        (void);
+void              piece_epoch_free       (PieceEpoch       *self);
+PieceEpochReader *piece_epoch_register   (PieceEpoch       *self);
+void              piece_epoch_unregister (PieceEpoch       *self,
+                                          PieceEpochReader *reader);
+void              piece_epoch_enter      (PieceEpochReader *reader);
+void              piece_epoch_leave      (PieceEpochReader *reader);
+void              piece_epoch_retire     (PieceEpoch       *self,
+                                          gpointer          data,
+                                          GDestroyNotify    notify);
+guint             piece_epoch_reclaim    (PieceEpoch       *self);
+
+G_END_DECLS
+
+#endif /* PIECE_EPOCH_H */
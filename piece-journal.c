@@ -0,0 +1,499 @@
+/* piece-journal.c
+ *
+ * Copyright (C) 2017 Christian Hergert <chergert@redhat.com>
+ *
+ * This file is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation; either version 2.1 of the License, or (at your option)
+ * any later version.
+ *
+ * This file is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public
+ * License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "piece-journal.h"
+
+typedef struct _PieceJournalRecord PieceJournalRecord;
+
+/*
+ * A single edit, which replaced the removed entries at @position with the
+ * inserted entries. Both are stored back to back in the entries arena of
+ * the journal, starting at @first.
+ *
+ * Records with the same @group are undone and redone together.
+ */
+struct _PieceJournalRecord
+{
+  guint64 position;
+  guint64 first;
+  guint32 n_removed;
+  guint32 n_inserted;
+  guint64 group;
+};
+
+/*
+ * The PieceJournal records the edits made to a #PieceTable so that they
+ * may be undone and redone.
+ *
+ * Since the #PieceBuffer is append-only, the bytes referenced by a piece
+ * remain valid after the piece is removed from the table. An edit is
+ * therefore fully described by its position along with the pieces it
+ * removed and inserted, and replaying it is just another edit of the
+ * table rather than a rebuild.
+ *
+ * Records and their entries are appended to two arrays. The records
+ * before @n_applied are currently applied to the table, and those after
+ * it have been undone and may be redone until the next edit is recorded.
+ *
+ * Typing and deleting at the edge of the previous edit are coalesced into
+ * the previous record, merging adjacent pieces, so a run of typing costs
+ * a single record and entry no matter how many keystrokes it contains.
+ */
+struct _PieceJournal
+{
+  GArray  *records;
+  GArray  *entries;
+  guint    n_applied;
+
+  /* The group of records being recorded when @depth is non-zero */
+  guint64  group;
+  guint64  next_group;
+  guint    depth;
+
+  /* Whether the next edit may be merged into the last record, along with
+   * the number of bytes that record removed and inserted.
+   */
+  guint    can_coalesce : 1;
+  guint64  last_removed;
+  guint64  last_inserted;
+};
+
+PieceJournal *
+piece_journal_new (void)
+{
+  PieceJournal *self;
+
+  self = g_slice_new0 (PieceJournal);
+  self->records = g_array_new (FALSE, FALSE, sizeof (PieceJournalRecord));
+  self->entries = g_array_new (FALSE, FALSE, sizeof (PieceJournalEntry));
+
+  return self;
+}
+
+void
+piece_journal_free (PieceJournal *self)
+{
+  if (self != NULL)
+    {
+      g_array_unref (self->records);
+      g_array_unref (self->entries);
+      g_slice_free (PieceJournal, self);
+    }
+}
+
+/*
+ * piece_journal_begin_group:
+ *
+ * Starts a group of edits which are undone and redone together. Groups
+ * may be nested, in which case the outermost group is used.
+ */
+void
+piece_journal_begin_group (PieceJournal *self)
+{
+  g_return_if_fail (self != NULL);
+
+  if (self->depth++ == 0)
+    {
+      self->group = self->next_group++;
+      self->can_coalesce = FALSE;
+    }
+}
+
+void
+piece_journal_end_group (PieceJournal *self)
+{
+  g_return_if_fail (self != NULL);
+  g_return_if_fail (self->depth > 0);
+
+  if (--self->depth == 0)
+    self->can_coalesce = FALSE;
+}
+
+gboolean
+piece_journal_in_group (PieceJournal *self)
+{
+  g_return_val_if_fail (self != NULL, FALSE);
+
+  return self->depth > 0;
+}
+
+static guint64
+piece_journal_sum (const PieceTableEntry *entries,
+                   gsize                  n_entries)
+{
+  guint64 length = 0;
+
+  for (gsize i = 0; i < n_entries; i++)
+    length += entries[i].length;
+
+  return length;
+}
+
+/*
+ * piece_journal_append:
+ * @merge: if the entry may be merged into the last entry of the arena
+ *
+ * Appends @entry to the arena. Pieces which are contiguous within the
+ * same buffer are merged as they would be within the table.
+ */
+static void
+piece_journal_append (PieceJournal          *self,
+                      const PieceTableEntry *entry,
+                      gboolean               merge)
+{
+  PieceJournalEntry compact;
+
+  if (merge && self->entries->len > 0)
+    {
+      PieceJournalEntry *last = &g_array_index (self->entries, PieceJournalEntry, self->entries->len - 1);
+
+      if (last->kind == entry->kind && last->offset + last->length == entry->offset)
+        {
+          last->length += entry->length;
+          return;
+        }
+    }
+
+  compact.kind = entry->kind;
+  compact.offset = entry->offset;
+  compact.length = entry->length;
+
+  g_array_append_val (self->entries, compact);
+}
+
+/*
+ * piece_journal_coalesce:
+ *
+ * Merges an edit into the last record if it continues it. Inserts are
+ * merged when they begin at the end of an insert, and deletes when they
+ * end at the start of a delete (backspace) or begin at the same position
+ * (the delete key). Deleting the end of an insert trims the insert. The
+ * last record is always at the end of the arena, so merging only touches
+ * its own entries.
+ *
+ * Returns: %TRUE if the edit was merged
+ */
+static gboolean
+piece_journal_coalesce (PieceJournal          *self,
+                        guint64                position,
+                        const PieceTableEntry *removed,
+                        gsize                  n_removed,
+                        const PieceTableEntry *inserted,
+                        gsize                  n_inserted)
+{
+  PieceJournalRecord *last;
+  guint64 removed_length = piece_journal_sum (removed, n_removed);
+  guint64 inserted_length = piece_journal_sum (inserted, n_inserted);
+
+  g_assert (self->n_applied == self->records->len);
+  g_assert (self->n_applied > 0);
+
+  last = &g_array_index (self->records, PieceJournalRecord, self->n_applied - 1);
+
+  if (n_removed == 0 && last->n_removed == 0 &&
+      position == last->position + self->last_inserted)
+    {
+      for (gsize i = 0; i < n_inserted; i++)
+        piece_journal_append (self, &inserted[i], TRUE);
+
+      last->n_inserted = self->entries->len - last->first;
+      self->last_inserted += inserted_length;
+
+      return TRUE;
+    }
+
+  if (n_inserted == 0 && last->n_removed == 0 &&
+      position >= last->position &&
+      position + removed_length == last->position + self->last_inserted)
+    {
+      guint64 remaining = removed_length;
+
+      /* Backspacing over what was just typed forgets it was typed */
+      while (remaining > 0)
+        {
+          PieceJournalEntry *tail = &g_array_index (self->entries, PieceJournalEntry, self->entries->len - 1);
+
+          if (tail->length > remaining)
+            {
+              tail->length -= remaining;
+              break;
+            }
+
+          remaining -= tail->length;
+          g_array_set_size (self->entries, self->entries->len - 1);
+        }
+
+      last->n_inserted = self->entries->len - last->first;
+      self->last_inserted -= removed_length;
+
+      if (last->n_inserted == 0)
+        {
+          g_array_set_size (self->records, --self->n_applied);
+          self->can_coalesce = FALSE;
+        }
+
+      return TRUE;
+    }
+
+  if (n_inserted == 0 && last->n_inserted == 0 && position == last->position)
+    {
+      for (gsize i = 0; i < n_removed; i++)
+        piece_journal_append (self, &removed[i], TRUE);
+
+      last->n_removed = self->entries->len - last->first;
+      self->last_removed += removed_length;
+
+      return TRUE;
+    }
+
+  if (n_inserted == 0 && last->n_inserted == 0 &&
+      position + removed_length == last->position)
+    {
+      guint first = last->first;
+      g_autoptr(GArray) tail = NULL;
+
+      /* Move our entries aside and append them after the new ones */
+      tail = g_array_sized_new (FALSE, FALSE, sizeof (PieceJournalEntry), last->n_removed);
+      g_array_append_vals (tail, &g_array_index (self->entries, PieceJournalEntry, first), last->n_removed);
+      g_array_set_size (self->entries, first);
+
+      for (gsize i = 0; i < n_removed; i++)
+        piece_journal_append (self, &removed[i], i > 0);
+
+      for (guint i = 0; i < tail->len; i++)
+        {
+          const PieceJournalEntry *compact = &g_array_index (tail, PieceJournalEntry, i);
+          PieceTableEntry entry = { compact->kind, compact->offset, compact->length };
+
+          piece_journal_append (self, &entry, TRUE);
+        }
+
+      last->position = position;
+      last->n_removed = self->entries->len - first;
+      self->last_removed += removed_length;
+
+      return TRUE;
+    }
+
+  return FALSE;
+}
+
+/*
+ * piece_journal_record:
+ * @position: the position of the edit
+ * @removed: (array length=n_removed): the entries removed at @position
+ * @n_removed: the number of elements in @removed
+ * @inserted: (array length=n_inserted): the entries inserted at @position
+ * @n_inserted: the number of elements in @inserted
+ *
+ * Records an edit of the table. Any records that were undone are
+ * discarded, since they can no longer be redone.
+ */
+void
+piece_journal_record (PieceJournal          *self,
+                      guint64                position,
+                      const PieceTableEntry *removed,
+                      gsize                  n_removed,
+                      const PieceTableEntry *inserted,
+                      gsize                  n_inserted)
+{
+  PieceJournalRecord record;
+
+  g_return_if_fail (self != NULL);
+  g_return_if_fail (removed != NULL || n_removed == 0);
+  g_return_if_fail (inserted != NULL || n_inserted == 0);
+
+  if (n_removed == 0 && n_inserted == 0)
+    return;
+
+  if (self->n_applied < self->records->len)
+    {
+      const PieceJournalRecord *next = &g_array_index (self->records, PieceJournalRecord, self->n_applied);
+
+      g_array_set_size (self->entries, next->first);
+      g_array_set_size (self->records, self->n_applied);
+      self->can_coalesce = FALSE;
+    }
+
+  if (self->can_coalesce &&
+      piece_journal_coalesce (self, position, removed, n_removed, inserted, n_inserted))
+    return;
+
+  record.position = position;
+  record.first = self->entries->len;
+  record.group = self->depth > 0 ? self->group : self->next_group++;
+
+  for (gsize i = 0; i < n_removed; i++)
+    piece_journal_append (self, &removed[i], i > 0);
+  record.n_removed = self->entries->len - record.first;
+
+  for (gsize i = 0; i < n_inserted; i++)
+    piece_journal_append (self, &inserted[i], i > 0);
+  record.n_inserted = self->entries->len - record.first - record.n_removed;
+
+  g_array_append_val (self->records, record);
+
+  self->n_applied++;
+  self->can_coalesce = TRUE;
+  self->last_removed = piece_journal_sum (removed, n_removed);
+  self->last_inserted = piece_journal_sum (inserted, n_inserted);
+}
+
+gboolean
+piece_journal_can_undo (PieceJournal *self)
+{
+  g_return_val_if_fail (self != NULL, FALSE);
+
+  return self->n_applied > 0;
+}
+
+gboolean
+piece_journal_can_redo (PieceJournal *self)
+{
+  g_return_val_if_fail (self != NULL, FALSE);
+
+  return self->n_applied < self->records->len;
+}
+
+static void
+piece_journal_replay (PieceJournal             *self,
+                      const PieceJournalRecord *record,
+                      gboolean                  undo,
+                      PieceJournalReplace       replace,
+                      gpointer                  user_data)
+{
+  const PieceJournalEntry *removed;
+  const PieceJournalEntry *inserted;
+  const PieceJournalEntry *remove;
+  const PieceJournalEntry *insert;
+  guint n_remove;
+  guint n_insert;
+  guint64 length = 0;
+
+  removed = &g_array_index (self->entries, PieceJournalEntry, record->first);
+  inserted = removed + record->n_removed;
+
+  remove = undo ? inserted : removed;
+  n_remove = undo ? record->n_inserted : record->n_removed;
+  insert = undo ? removed : inserted;
+  n_insert = undo ? record->n_removed : record->n_inserted;
+
+  for (guint i = 0; i < n_remove; i++)
+    length += remove[i].length;
+
+  replace (record->position, length, insert, n_insert, user_data);
+}
+
+/*
+ * piece_journal_undo:
+ * @replace: a function to apply the edits to the table
+ *
+ * Reverts the last group of records which is applied to the table, in
+ * reverse order. Each record is a single call to @replace.
+ *
+ * Returns: %TRUE if anything was undone
+ */
+gboolean
+piece_journal_undo (PieceJournal        *self,
+                    PieceJournalReplace  replace,
+                    gpointer             user_data)
+{
+  guint64 group;
+
+  g_return_val_if_fail (self != NULL, FALSE);
+  g_return_val_if_fail (self->depth == 0, FALSE);
+  g_return_val_if_fail (replace != NULL, FALSE);
+
+  if (self->n_applied == 0)
+    return FALSE;
+
+  group = g_array_index (self->records, PieceJournalRecord, self->n_applied - 1).group;
+
+  while (self->n_applied > 0)
+    {
+      const PieceJournalRecord *record = &g_array_index (self->records, PieceJournalRecord, self->n_applied - 1);
+
+      if (record->group != group)
+        break;
+
+      piece_journal_replay (self, record, TRUE, replace, user_data);
+      self->n_applied--;
+    }
+
+  self->can_coalesce = FALSE;
+
+  return TRUE;
+}
+
+/*
+ * piece_journal_redo:
+ * @replace: a function to apply the edits to the table
+ *
+ * Applies the next group of records which was undone, in order.
+ *
+ * Returns: %TRUE if anything was redone
+ */
+gboolean
+piece_journal_redo (PieceJournal        *self,
+                    PieceJournalReplace  replace,
+                    gpointer             user_data)
+{
+  guint64 group;
+
+  g_return_val_if_fail (self != NULL, FALSE);
+  g_return_val_if_fail (self->depth == 0, FALSE);
+  g_return_val_if_fail (replace != NULL, FALSE);
+
+  if (self->n_applied == self->records->len)
+    return FALSE;
+
+  group = g_array_index (self->records, PieceJournalRecord, self->n_applied).group;
+
+  while (self->n_applied < self->records->len)
+    {
+      const PieceJournalRecord *record = &g_array_index (self->records, PieceJournalRecord, self->n_applied);
+
+      if (record->group != group)
+        break;
+
+      piece_journal_replay (self, record, FALSE, replace, user_data);
+      self->n_applied++;
+    }
+
+  self->can_coalesce = FALSE;
+
+  return TRUE;
+}
+
+/*
+ * piece_journal_get_size:
+ *
+ * Gets the number of bytes used by the records and entries of the journal,
+ * including those which have been undone.
+ *
+ * Returns: the size of the journal in bytes
+ */
+gsize
+piece_journal_get_size (PieceJournal *self)
+{
+  g_return_val_if_fail (self != NULL, 0);
+
+  return sizeof *self +
+         self->records->len * sizeof (PieceJournalRecord) +
+         self->entries->len * sizeof (PieceJournalEntry);
+}
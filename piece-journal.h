@@ -0,0 +1,81 @@
+/* piece-journal.h
+ *
+ * Copyright (C) 2017 Christian Hergert <chergert@redhat.com>
+ *
+ * This file is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation; either version 2.1 of the License, or (at your option)
+ * any later version.
+ *
+ * This file is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public
+ * License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef PIECE_JOURNAL_H
+#define PIECE_JOURNAL_H
+
+#include "piece-table.h"
+
+G_BEGIN_DECLS
+
+typedef struct _PieceJournal      PieceJournal;
+typedef struct _PieceJournalEntry PieceJournalEntry;
+
+/*
+ * PieceJournalEntry:
+ *
+ * A piece as recorded by the journal. The units within the piece are not
+ * kept since the #PieceBuffer can count them again when it is replayed.
+ */
+struct _PieceJournalEntry
+{
+  PieceKind kind : 1;
+  guint64   offset : 63;
+  guint64   length;
+};
+
+/*
+ * PieceJournalReplace:
+ * @position: the position of the first byte to replace
+ * @length: the number of bytes to remove
+ * @entries: (array length=n_entries): the entries to insert at @position
+ * @n_entries: the number of elements in @entries
+ * @user_data: closure data
+ *
+ * Replaces @length bytes at @position with @entries.
+ */
+typedef void (*PieceJournalReplace) (guint64                  position,
+                                     guint64                  length,
+                                     const PieceJournalEntry *entries,
+                                     gsize                    n_entries,
+                                     gpointer                 user_data);
+
+PieceJournal *piece_journal_new         (void);
+void          piece_journal_free        (PieceJournal            *self);
+void          piece_journal_begin_group (PieceJournal            *self);
+void          piece_journal_end_group   (PieceJournal            *self);
+gboolean      piece_journal_in_group    (PieceJournal            *self);
+void          piece_journal_record      (PieceJournal            *self,
+                                         guint64                  position,
+                                         const PieceTableEntry   *removed,
+                                         gsize                    n_removed,
+                                         const PieceTableEntry   *inserted,
+                                         gsize                    n_inserted);
+gboolean      piece_journal_can_undo    (PieceJournal            *self);
+gboolean      piece_journal_can_redo    (PieceJournal            *self);
+gboolean      piece_journal_undo        (PieceJournal            *self,
+                                         PieceJournalReplace      replace,
+                                         gpointer                 user_data);
+gboolean      piece_journal_redo        (PieceJournal            *self,
+                                         PieceJournalReplace      replace,
+                                         gpointer                 user_data);
+gsize         piece_journal_get_size    (PieceJournal            *self);
+
+G_END_DECLS
+
+#endif /* PIECE_JOURNAL_H */
@@ -0,0 +1,182 @@
+/* piece-search.c
+ *
+ * Copyright (C) 2017 Christian Hergert <chergert@redhat.com>
+ *
+ * This file is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation; either version 2.1 of the License, or (at your option)
+ * any later version.
+ *
+ * This file is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public
+ * License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <string.h>
+
+#if defined(__AVX2__) || defined(__SSE2__)
+# include <immintrin.h>
+#endif
+
+#include "piece-search.h"
+
+/*
+ * The searches below use the first and last bytes of the needle as a
+ * filter. A vector of candidate positions is loaded along with the vector
+ * of bytes needle_len - 1 after them, and only positions where both bytes
+ * match are compared in full. Most text rejects nearly every position on
+ * one of the two bytes, so the comparison rarely runs.
+ */
+
+#if defined(__AVX2__)
+typedef __m256i PieceSearchVector;
+# define PIECE_SEARCH_WIDTH 32
+# define piece_search_splat(c)     _mm256_set1_epi8 (c)
+# define piece_search_mask(p,f,l,m) \
+  ((guint)_mm256_movemask_epi8 (_mm256_and_si256 ( \
+     _mm256_cmpeq_epi8 (_mm256_loadu_si256 ((const __m256i *)(gconstpointer)(p)), (f)), \
+     _mm256_cmpeq_epi8 (_mm256_loadu_si256 ((const __m256i *)(gconstpointer)((p) + (m) - 1)), (l)))))
+#elif defined(__SSE2__)
+typedef __m128i PieceSearchVector;
+# define PIECE_SEARCH_WIDTH 16
+# define piece_search_splat(c)     _mm_set1_epi8 (c)
+# define piece_search_mask(p,f,l,m) \
+  ((guint)_mm_movemask_epi8 (_mm_and_si128 ( \
+     _mm_cmpeq_epi8 (_mm_loadu_si128 ((const __m128i *)(gconstpointer)(p)), (f)), \
+     _mm_cmpeq_epi8 (_mm_loadu_si128 ((const __m128i *)(gconstpointer)((p) + (m) - 1)), (l)))))
+#endif
+
+static inline gboolean
+piece_search_matches (const gchar *at,
+                      const gchar *needle,
+                      gsize        needle_len)
+{
+  /* The first and last bytes have already been compared */
+  return needle_len <= 2 || memcmp (at + 1, needle + 1, needle_len - 2) == 0;
+}
+
+/*
+ * piece_search_find:
+ * @haystack: the data to search
+ * @length: the number of bytes in @haystack
+ * @needle: the bytes to find
+ * @needle_len: the number of bytes in @needle, which must not be zero
+ *
+ * Finds the first occurrence of @needle which lies entirely within
+ * @haystack.
+ *
+ * Returns: (nullable): a pointer to the match within @haystack, or %NULL
+ */
+const gchar *
+piece_search_find (const gchar *haystack,
+                   gsize        length,
+                   const gchar *needle,
+                   gsize        needle_len)
+{
+  const gchar first = needle[0];
+  const gchar last = needle[needle_len - 1];
+  gsize i = 0;
+
+  g_assert (needle_len > 0);
+
+  if (length < needle_len)
+    return NULL;
+
+#ifdef PIECE_SEARCH_WIDTH
+  {
+    const PieceSearchVector vfirst = piece_search_splat (first);
+    const PieceSearchVector vlast = piece_search_splat (last);
+
+    for (; i + needle_len - 1 + PIECE_SEARCH_WIDTH <= length; i += PIECE_SEARCH_WIDTH)
+      {
+        guint mask = piece_search_mask (haystack + i, vfirst, vlast, needle_len);
+
+        while (mask != 0)
+          {
+            const gchar *at = haystack + i + __builtin_ctz (mask);
+
+            if (piece_search_matches (at, needle, needle_len))
+              return at;
+
+            mask &= mask - 1;
+          }
+      }
+  }
+#endif
+
+  for (; i + needle_len <= length; i++)
+    {
+      if (haystack[i] == first &&
+          haystack[i + needle_len - 1] == last &&
+          piece_search_matches (haystack + i, needle, needle_len))
+        return haystack + i;
+    }
+
+  return NULL;
+}
+
+/*
+ * piece_search_rfind:
+ *
+ * Like piece_search_find(), but finds the last occurrence of @needle,
+ * scanning backward from the end of @haystack.
+ *
+ * Returns: (nullable): a pointer to the match within @haystack, or %NULL
+ */
+const gchar *
+piece_search_rfind (const gchar *haystack,
+                    gsize        length,
+                    const gchar *needle,
+                    gsize        needle_len)
+{
+  const gchar first = needle[0];
+  const gchar last = needle[needle_len - 1];
+  gsize end;
+
+  g_assert (needle_len > 0);
+
+  if (length < needle_len)
+    return NULL;
+
+  /* One past the last position at which a match could begin */
+  end = length - needle_len + 1;
+
+#ifdef PIECE_SEARCH_WIDTH
+  {
+    const PieceSearchVector vfirst = piece_search_splat (first);
+    const PieceSearchVector vlast = piece_search_splat (last);
+
+    for (; end >= PIECE_SEARCH_WIDTH; end -= PIECE_SEARCH_WIDTH)
+      {
+        guint mask = piece_search_mask (haystack + end - PIECE_SEARCH_WIDTH, vfirst, vlast, needle_len);
+
+        while (mask != 0)
+          {
+            guint bit = 31 - __builtin_clz (mask);
+            const gchar *at = haystack + end - PIECE_SEARCH_WIDTH + bit;
+
+            if (piece_search_matches (at, needle, needle_len))
+              return at;
+
+            mask &= ~(1u << bit);
+          }
+      }
+  }
+#endif
+
+  while (end > 0)
+    {
+      end--;
+
+      if (haystack[end] == first &&
+          haystack[end + needle_len - 1] == last &&
+          piece_search_matches (haystack + end, needle, needle_len))
+        return haystack + end;
+    }
+
+  return NULL;
+}
@@ -0,0 +1,37 @@
+/* piece-search.h
+ *
+ * Copyright (C) 2017 Christian Hergert <chergert@redhat.com>
+ *
+ * This file is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation; either version 2.1 of the License, or (at your option)
+ * any later version.
+ *
+ * This file is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public
+ * License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef PIECE_SEARCH_H
+#define PIECE_SEARCH_H
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+const gchar *piece_search_find  (const gchar *haystack,
+                                 gsize        length,
+                                 const gchar *needle,
+                                 gsize        needle_len);
+const gchar *piece_search_rfind (const gchar *haystack,
+                                 gsize        length,
+                                 const gchar *needle,
+                                 gsize        needle_len);
+
+G_END_DECLS
+
+#endif /* PIECE_SEARCH_H */
@@ -16,15 +16,91 @@
  * with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#ifndef _GNU_SOURCE
+# define _GNU_SOURCE
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <glib/gstdio.h>
+#include <limits.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#if defined(PIECE_TABLE_SOA) && defined(__AVX2__)
+# include <immintrin.h>
+#endif
 
 #include "linked-array.h"
+#include "piece-arena.h"
+#include "piece-buffer.h"
+#include "piece-epoch.h"
+#include "piece-journal.h"
+#include "piece-search.h"
 #include "piece-table.h"
 
-#define PIECE_TREE_BRANCH_FANOUT (26)
-#define PIECE_TREE_LEAF_FANOUT   (26)
-#define PIECE_TREE_MAX_LENGTH    (G_MAXUINT64 >> 1)
+/* Compact entries and children are a little over half the size, so 40 of
+ * them take about as many cache lines as 26 full-size ones.
+ *
+ * timed-fanout does not favour narrow leaves, though. On the single-CPU
+ * machine these were last measured on, leaf fanouts from 26 to 64 were
+ * within about 10% of each other. 64 was slightly ahead for full-size
+ * entries and 40 for compact ones, but the spread between runs was as
+ * large as that, and branch fanouts from 8 to 48 could not be told apart.
+ * Wider nodes are not free either, since every edit after a snapshot
+ * copies each node it touches, so the defaults stay at the smaller size.
+ *
+ * Either may be overridden when building (between 8 and the 254 allowed
+ * by LINKED_ARRAY_FIELD), which tune-fanout.sh uses to find the best
+ * values for a machine.
+ */
+#ifndef PIECE_TREE_BRANCH_FANOUT
+# ifdef PIECE_TABLE_COMPACT
+#  define PIECE_TREE_BRANCH_FANOUT (40)
+# else
+#  define PIECE_TREE_BRANCH_FANOUT (26)
+# endif
+#endif
+#ifndef PIECE_TREE_LEAF_FANOUT
+# ifdef PIECE_TABLE_COMPACT
+#  define PIECE_TREE_LEAF_FANOUT   (40)
+# else
+#  define PIECE_TREE_LEAF_FANOUT   (26)
+# endif
+#endif
+
+G_STATIC_ASSERT (PIECE_TREE_BRANCH_FANOUT >= 8 && PIECE_TREE_BRANCH_FANOUT <= 254);
+G_STATIC_ASSERT (PIECE_TREE_LEAF_FANOUT >= 8 && PIECE_TREE_LEAF_FANOUT <= 254);
+
+/* Builds which define PIECE_TABLE_SOA also keep the lengths of the entries
+ * in each leaf, in logical order, in an array of their own. Locating a
+ * position within a leaf then reads a few contiguous cache lines rather
+ * than following the links between entries. The array is padded to a
+ * whole number of vectors.
+ */
+#ifdef PIECE_TABLE_SOA
+# define PIECE_TREE_LEAF_LANES   (32 / sizeof (PieceTableSize))
+# define PIECE_TREE_LEAF_PADDED  ((PIECE_TREE_LEAF_FANOUT + PIECE_TREE_LEAF_LANES - 1) / PIECE_TREE_LEAF_LANES * PIECE_TREE_LEAF_LANES)
+#endif
+
+#define PIECE_TREE_MAX_LENGTH    PIECE_TABLE_MAX_LENGTH
+#define PIECE_TREE_MAX_HEIGHT    (32)
+
+/* Non-root nodes that drop below these counts are rebalanced with a
+ * sibling during delete so that the tree shrinks along with the number
+ * of live pieces.
+ */
+#define PIECE_TREE_BRANCH_MIN    (PIECE_TREE_BRANCH_FANOUT / 3)
+#define PIECE_TREE_LEAF_MIN      (PIECE_TREE_LEAF_FANOUT / 3)
+
+/* The number of entries placed in each leaf when filling new leaves */
+#define PIECE_TREE_LEAF_FILL     ((PIECE_TREE_LEAF_FANOUT * 3) / 4)
+
+/* The number of detached nodes released at the start of each edit */
+#define PIECE_TREE_RECLAIM_BUDGET (32)
 
 #ifndef G_DISABLE_ASSERT
 # define DEBUG_VALIDATE(a,b) piece_tree_node_validate(a,b)
@@ -53,8 +129,9 @@ typedef enum
 
 struct _PieceTreeChild
 {
-  PieceTreeNode *node;
-  guint64        length;
+  PieceTreeNode    *node;
+  PieceTableSize    length;
+  PieceTableCounts  counts;
 };
 
 struct _PieceTreeNodeAny
@@ -64,6 +141,18 @@ struct _PieceTreeNodeAny
 
   /* The kind of node, either BRANCH or LEAF */
   PieceTreeNodeKind kind : 1;
+
+  /* The physical slot of our PieceTreeChild within the children of
+   * @parent. This lets us walk up the tree without scanning siblings.
+   */
+  guint8 slot;
+
+  /* The number of branches referencing us. This is only greater than one
+   * when we are shared with a snapshot, in which case we must be copied
+   * before being modified. @parent, @slot and the linked-leaves always
+   * describe the live table and are never used by snapshots.
+   */
+  gint ref_count;
 };
 
 struct _PieceTreeNodeBranch
@@ -74,6 +163,12 @@ struct _PieceTreeNodeBranch
   /* Our node kind, always a BRANCH */
   PieceTreeNodeKind kind : 1;
 
+  /* Our slot within the children of @parent */
+  guint8 slot;
+
+  /* The number of branches referencing us */
+  gint ref_count;
+
   LINKED_ARRAY_FIELD(PieceTreeChild, PIECE_TREE_BRANCH_FANOUT) children;
 };
 
@@ -85,12 +180,27 @@ struct _PieceTreeNodeLeaf
   /* For this structure, kind will always be PIECE_TREE_NODE_LEAF. */
   PieceTreeNodeKind  kind : 1;
 
+  /* Our slot within the children of @parent */
+  guint8             slot;
+
+  /* The number of branches referencing us */
+  gint               ref_count;
+
   /* This contains our entries pointing to the data in external bufers.
    * The data is either INITIAL (the original buffer contents) or CHANGE
    * (user edited content).
    */
   LINKED_ARRAY_FIELD(PieceTableEntry, PIECE_TREE_LEAF_FANOUT) entries;
 
+#ifdef PIECE_TABLE_SOA
+  /* The lengths of @entries in logical order and the physical slot of
+   * each, updated by the piece_tree_leaf_index*() functions whenever
+   * @entries changes.
+   */
+  PieceTableSize lengths[PIECE_TREE_LEAF_PADDED];
+  guint8         slots[PIECE_TREE_LEAF_PADDED];
+#endif
+
   /* Pointer to the previous and next leaves along the bottom
    * of the tree. This is essentially the linked-leaves in a
    * B+ tree. It allows us to scan without touching the branches
@@ -117,10 +227,76 @@ union _PieceTreeNode
  * on the table (which is backed by our piece tree), through the public API
  * functions in piece-table.h/
  */
+typedef struct
+{
+  /* The leaf that was last modified, or %NULL if it is no longer valid */
+  PieceTreeNode *leaf;
+
+  /* The absolute position of the first byte in @leaf */
+  guint64 position;
+
+  /* The number of bytes within @leaf */
+  guint64 length;
+} PieceTreeFinger;
+
 struct _PieceTable
 {
-  PieceTreeNode root;
-  guint64       length;
+  PieceTreeNode  root;
+  guint64        length;
+
+  /* Sequential edits (such as typing) tend to land in the same leaf as
+   * the previous edit, so we remember where it is to avoid searching the
+   * tree from the root. Any change in the structure of the tree clears it.
+   */
+  PieceTreeFinger finger;
+
+  /* The storage for the bytes referenced by our entries, or %NULL if the
+   * table is only being used to track offsets.
+   */
+  PieceBuffer *buffer;
+
+  /* The nodes of the tree are allocated from here. Snapshots share the
+   * arena of the table they were taken from, since they share its nodes.
+   */
+  PieceArena *arena;
+
+  /* Subtrees detached by range deletes that have yet to be released.
+   * This is a stack linked through the (now unused) parent pointer of
+   * each node so that detaching requires no allocations.
+   */
+  PieceTreeNode *trash;
+
+  /* The record of edits for undo and redo, or %NULL if it is disabled.
+   * It is cleared while replaying so that replays are not recorded.
+   */
+  PieceJournal *journal;
+
+  /* Set once a snapshot has been taken, after which nodes must be copied
+   * before they are modified if they are still referenced by a snapshot.
+   */
+  guint shared : 1;
+
+  /* Set on the read-only tables returned by piece_table_snapshot() */
+  guint snapshot : 1;
+
+  /* Set by piece_table_new_for_file() so that opening a file does not read
+   * it. Until piece_table_ensure_counts() is called, entries are created
+   * without counting their units and every count in the tree is zero.
+   */
+  guint counts_pending : 1;
+
+  /* The snapshot most recently published for readers on other threads,
+   * and the epochs used to know when older ones may be released. Both are
+   * %NULL until piece_table_publish() or piece_table_reader_new().
+   */
+  PieceTable *published;
+  PieceEpoch *epoch;
+};
+
+struct _PieceTableReader
+{
+  PieceTable       *table;
+  PieceEpochReader *epoch;
 };
 
 struct _PieceTreeInsert
@@ -136,6 +312,9 @@ struct _PieceTreeInsert
 
   /* The run length of the piece from INITIAL or CHANGE */
   guint64 length;
+
+  /* The units within the piece */
+  PieceTableCounts counts;
 };
 
 static guint64
@@ -161,623 +340,4993 @@ piece_tree_node_length (PieceTreeNode *node)
   return length;
 }
 
-static inline gboolean
-piece_tree_node_is_root (PieceTreeNode *node)
+static inline void
+piece_table_counts_add (PieceTableCounts       *counts,
+                        const PieceTableCounts *other)
 {
-  g_assert (node != NULL);
-
-  return node->any.kind == PIECE_TREE_NODE_BRANCH &&
-         node->any.parent == NULL;
+  counts->newlines += other->newlines;
+  counts->code_points += other->code_points;
+  counts->utf16 += other->utf16;
 }
 
-static PieceTreeNode *
-piece_tree_node_new (PieceTreeNodeKind kind)
+static inline void
+piece_table_counts_sub (PieceTableCounts       *counts,
+                        const PieceTableCounts *other)
 {
-  PieceTreeNode *node;
-
-  g_assert (kind == PIECE_TREE_NODE_LEAF || kind == PIECE_TREE_NODE_BRANCH);
+  counts->newlines -= other->newlines;
+  counts->code_points -= other->code_points;
+  counts->utf16 -= other->utf16;
+}
 
-  node = g_slice_new (PieceTreeNode);
-  node->any.kind = kind;
-  node->any.parent = NULL;
+/* The counts are unsigned, so adding the negated counts wraps around to
+ * subtract them.
+ */
+static inline void
+piece_table_counts_negate (PieceTableCounts *counts)
+{
+  counts->newlines = -counts->newlines;
+  counts->code_points = -counts->code_points;
+  counts->utf16 = -counts->utf16;
+}
 
-  if (kind == PIECE_TREE_NODE_BRANCH)
-    LINKED_ARRAY_INIT (&node->branch.children);
-  else
-    {
-      LINKED_ARRAY_INIT (&node->leaf.entries);
-      node->leaf.prev = NULL;
-      node->leaf.next = NULL;
-    }
+static inline void
+piece_table_counts_clamp (PieceTableCounts       *counts,
+                          const PieceTableCounts *max)
+{
+  counts->newlines = MIN (counts->newlines, max->newlines);
+  counts->code_points = MIN (counts->code_points, max->code_points);
+  counts->utf16 = MIN (counts->utf16, max->utf16);
+}
 
-  return node;
+static inline gboolean
+piece_table_counts_equal (const PieceTableCounts *a,
+                          const PieceTableCounts *b)
+{
+  return a->newlines == b->newlines &&
+         a->code_points == b->code_points &&
+         a->utf16 == b->utf16;
 }
 
 static void
-piece_tree_node_free (PieceTreeNode *node)
+piece_tree_node_counts (PieceTreeNode    *node,
+                        PieceTableCounts *counts)
 {
+  g_assert (node != NULL);
+  g_assert (counts != NULL);
+
+  memset (counts, 0, sizeof *counts);
+
   if (node->any.kind == PIECE_TREE_NODE_BRANCH)
     {
       LINKED_ARRAY_FOREACH (&node->branch.children, PieceTreeChild, child, {
-        piece_tree_node_free (child->node);
+        piece_table_counts_add (counts, &child->counts);
+      });
+    }
+  else
+    {
+      LINKED_ARRAY_FOREACH (&node->leaf.entries, PieceTableEntry, entry, {
+        piece_table_counts_add (counts, &entry->counts);
       });
     }
+}
 
-  g_slice_free (PieceTreeNode, node);
+static inline guint
+piece_tree_node_n_items (PieceTreeNode *node)
+{
+  if (node->any.kind == PIECE_TREE_NODE_BRANCH)
+    return LINKED_ARRAY_LENGTH (&node->branch.children);
+  else
+    return LINKED_ARRAY_LENGTH (&node->leaf.entries);
 }
 
-static inline gboolean
-piece_table_entry_chain_head (PieceTableEntry  *entry,
-                              PieceTreeInsert *insert)
+static inline guint
+piece_tree_node_capacity (PieceTreeNode *node)
 {
-  g_assert (entry != NULL);
-  g_assert (insert != NULL);
+  if (node->any.kind == PIECE_TREE_NODE_BRANCH)
+    return LINKED_ARRAY_CAPACITY (&node->branch.children);
+  else
+    return LINKED_ARRAY_CAPACITY (&node->leaf.entries);
+}
 
-  if (entry->kind == insert->kind &&
-      (insert->offset + insert->length) == entry->offset)
-    {
-      entry->offset = insert->offset;
-      entry->length += insert->length;
-      return TRUE;
-    }
+static inline guint
+piece_tree_node_min_items (PieceTreeNode *node)
+{
+  if (node->any.kind == PIECE_TREE_NODE_BRANCH)
+    return PIECE_TREE_BRANCH_MIN;
+  else
+    return PIECE_TREE_LEAF_MIN;
+}
 
-  return FALSE;
+/*
+ * piece_tree_leaf_index:
+ * @leaf: A #PieceTreeNode leaf
+ *
+ * Rebuilds the lengths and slots kept alongside the entries of @leaf,
+ * which must be done whenever they are added, removed or resized. This
+ * does nothing unless built with PIECE_TABLE_SOA.
+ */
+static inline void
+piece_tree_leaf_index (PieceTreeNode *leaf)
+{
+#ifdef PIECE_TABLE_SOA
+  guint i = 0;
+
+  g_assert (leaf->any.kind == PIECE_TREE_NODE_LEAF);
+
+  IQUEUE_FOREACH (&leaf->leaf.entries.q, id, {
+    leaf->leaf.lengths[i] = leaf->leaf.entries.items[id].length;
+    leaf->leaf.slots[i] = id;
+    i++;
+  });
+
+  /* Vector loads read the padding, which must not add to the sums */
+  memset (&leaf->leaf.lengths[i], 0, (PIECE_TREE_LEAF_PADDED - i) * sizeof (PieceTableSize));
+#endif
 }
 
-static inline gboolean
-piece_table_entry_chain_tail (PieceTableEntry *entry,
-                              PieceTreeInsert *insert)
+/*
+ * piece_tree_leaf_index_insert:
+ * @leaf: A #PieceTreeNode leaf
+ * @i: the logical index of an entry which was just inserted
+ * @slot: the physical slot of the inserted entry
+ *
+ * Updates the lengths and slots of @leaf after inserting a single entry,
+ * without walking the entries.
+ */
+static inline void
+piece_tree_leaf_index_insert (PieceTreeNode *leaf,
+                              guint          i,
+                              guint8         slot)
 {
-  g_assert (entry != NULL);
-  g_assert (insert != NULL);
+#ifdef PIECE_TABLE_SOA
+  guint n = LINKED_ARRAY_LENGTH (&leaf->leaf.entries);
 
-  if (entry->kind == insert->kind &&
-      (entry->offset + entry->length) == insert->offset)
-    {
-      entry->length += insert->length;
-      return TRUE;
-    }
+  g_assert (i < n);
 
-  return FALSE;
+  memmove (&leaf->leaf.lengths[i + 1], &leaf->leaf.lengths[i], (n - 1 - i) * sizeof (PieceTableSize));
+  memmove (&leaf->leaf.slots[i + 1], &leaf->leaf.slots[i], n - 1 - i);
+  leaf->leaf.lengths[i] = leaf->leaf.entries.items[slot].length;
+  leaf->leaf.slots[i] = slot;
+#endif
 }
 
-/**
- * piece_table_get_first_leaf:
- * @self: A #PieceTable
+/*
+ * piece_tree_leaf_index_resize:
+ * @leaf: A #PieceTreeNode leaf
+ * @i: the logical index of an entry whose length changed
  *
- * This finds the leftmost leaf in the tree and returns it. This can
- * be used to begin scanning the all leaves (using next pointers) so
- * that you may avoid touching intermediate branches.
+ * Updates the length kept for the entry at @i.
+ */
+static inline void
+piece_tree_leaf_index_resize (PieceTreeNode *leaf,
+                              guint          i)
+{
+#ifdef PIECE_TABLE_SOA
+  leaf->leaf.lengths[i] = leaf->leaf.entries.items[leaf->leaf.slots[i]].length;
+#endif
+}
+
+#ifdef PIECE_TABLE_SOA
+/*
+ * piece_tree_leaf_find:
+ * @leaf: A #PieceTreeNode leaf
+ * @position: (inout): a position relative to @leaf
  *
- * Returns: (not nullable): A #PieceTreeNodeLeaf
+ * Locates the first entry of @leaf which ends after @position, and makes
+ * @position relative to that entry.
+ *
+ * With AVX2 the running sums of a vector of lengths are computed with two
+ * shifts and adds and compared against @position at once, so the entry is
+ * found without a branch per entry.
+ *
+ * Returns: the logical index of the entry, or the number of entries if
+ *   @position is at or beyond the end of @leaf.
  */
-static PieceTreeNodeLeaf *
-piece_table_get_first_leaf (PieceTable *self)
+static inline guint
+piece_tree_leaf_find (PieceTreeNode *leaf,
+                      guint64       *position)
 {
-  PieceTreeNodeLeaf *ret = NULL;
-  PieceTreeNode *iter;
+  const PieceTableSize *lengths = leaf->leaf.lengths;
+  guint n = LINKED_ARRAY_LENGTH (&leaf->leaf.entries);
 
-  g_assert (self != NULL);
+#if defined(__AVX2__) && defined(PIECE_TABLE_COMPACT)
+  /* There is no unsigned compare, so both sides are biased */
+  const __m256i bias = _mm256_set1_epi32 (G_MININT32);
+  const __m256i target = _mm256_xor_si256 (_mm256_set1_epi32 ((gint32)*position), bias);
+  __m256i carry = _mm256_setzero_si256 ();
 
-  iter = &self->root;
+  for (guint i = 0; i < n; i += 8)
+    {
+      __m256i sums = _mm256_loadu_si256 ((const __m256i *)&lengths[i]);
+      guint mask;
 
-  for (;;)
+      /* Sum within each half, then carry the lower half into the upper */
+      sums = _mm256_add_epi32 (sums, _mm256_slli_si256 (sums, 4));
+      sums = _mm256_add_epi32 (sums, _mm256_slli_si256 (sums, 8));
+      sums = _mm256_add_epi32 (sums,
+                               _mm256_blend_epi32 (_mm256_setzero_si256 (),
+                                                   _mm256_permutevar8x32_epi32 (sums, _mm256_set1_epi32 (3)),
+                                                   0xF0));
+      sums = _mm256_add_epi32 (sums, carry);
+
+      mask = _mm256_movemask_ps (_mm256_castsi256_ps (_mm256_cmpgt_epi32 (_mm256_xor_si256 (sums, bias), target)));
+
+      if (mask != 0)
+        {
+          guint32 ends[8];
+          guint j = __builtin_ctz (mask);
+
+          _mm256_storeu_si256 ((__m256i *)ends, sums);
+          *position -= ends[j] - lengths[i + j];
+
+          return i + j;
+        }
+
+      carry = _mm256_permutevar8x32_epi32 (sums, _mm256_set1_epi32 (7));
+    }
+
+  *position -= (guint32)_mm256_cvtsi256_si32 (carry);
+
+  return n;
+#elif defined(__AVX2__)
+  /* Lengths never exceed G_MAXINT64, so a signed compare will do */
+  const __m256i target = _mm256_set1_epi64x (*position);
+  const __m256i zero = _mm256_setzero_si256 ();
+  __m256i carry = zero;
+
+  for (guint i = 0; i < n; i += 4)
     {
-      if (iter->any.kind == PIECE_TREE_NODE_LEAF)
+      __m256i sums = _mm256_loadu_si256 ((const __m256i *)&lengths[i]);
+      guint mask;
+
+      sums = _mm256_add_epi64 (sums, _mm256_blend_epi32 (_mm256_permute4x64_epi64 (sums, _MM_SHUFFLE (2, 1, 0, 0)), zero, 0x03));
+      sums = _mm256_add_epi64 (sums, _mm256_blend_epi32 (_mm256_permute4x64_epi64 (sums, _MM_SHUFFLE (1, 0, 0, 0)), zero, 0x0F));
+      sums = _mm256_add_epi64 (sums, carry);
+
+      mask = _mm256_movemask_pd (_mm256_castsi256_pd (_mm256_cmpgt_epi64 (sums, target)));
+
+      if (mask != 0)
         {
-          ret = &iter->leaf;
-          break;
+          guint64 ends[4];
+          guint j = __builtin_ctz (mask);
+
+          _mm256_storeu_si256 ((__m256i *)ends, sums);
+          *position -= ends[j] - lengths[i + j];
+
+          return i + j;
         }
 
-      g_assert (iter->any.kind == PIECE_TREE_NODE_BRANCH);
-      g_assert (!LINKED_ARRAY_IS_EMPTY (&iter->branch.children));
+      carry = _mm256_permute4x64_epi64 (sums, _MM_SHUFFLE (3, 3, 3, 3));
+    }
 
-      iter = LINKED_ARRAY_PEEK_HEAD (&iter->branch.children).node;
+  *position -= (guint64)_mm256_extract_epi64 (carry, 0);
+
+  return n;
+#else
+  for (guint i = 0; i < n; i++)
+    {
+      if (*position < lengths[i])
+        return i;
+      *position -= lengths[i];
     }
 
-  g_assert (ret->prev == NULL);
+  return n;
+#endif
+}
+#endif
+
+/**
+ * piece_tree_node_get_child:
+ * @node: A non-root #PieceTreeNode
+ * @position: (out) (optional): the logical position of @node within
+ *   the children of its parent.
+ *
+ * Locates the #PieceTreeChild in the parent of @node that points to @node.
+ *
+ * The child is found in constant time using the slot of @node, but
+ * requesting @position requires walking the children of the parent.
+ *
+ * Returns: (not nullable): A #PieceTreeChild
+ */
+static PieceTreeChild *
+piece_tree_node_get_child (PieceTreeNode *node,
+                           guint         *position)
+{
+  PieceTreeNode *parent;
+  PieceTreeChild *ret;
+
+  g_assert (node != NULL);
+  g_assert (node->any.parent != NULL);
+
+  parent = node->any.parent;
+  ret = &parent->branch.children.items[node->any.slot];
+
+  g_assert (node->any.slot < LINKED_ARRAY_LENGTH (&parent->branch.children));
+  g_assert (ret->node == node);
+
+  if (position != NULL)
+    {
+      guint i = 0;
+
+      IQUEUE_FOREACH (&parent->branch.children.q, id, {
+        if (id == node->any.slot)
+          break;
+        i++;
+      });
+
+      *position = i;
+    }
 
   return ret;
 }
 
-static inline gboolean
-piece_tree_node_needs_split (PieceTreeNode *node)
+/*
+ * piece_tree_node_reslot:
+ * @node: A #PieceTreeNode branch
+ *
+ * Updates the slot of every child of @node. This must be called after
+ * moving children in bulk (such as when splitting or merging).
+ */
+static inline void
+piece_tree_node_reslot (PieceTreeNode *node)
 {
-  /*
-   * We want to split the tree node if there is not enough space to
-   * split a single entry into two AND add a new entry. That means we
-   * need two empty slots before we ever perform an insert.
-   */
+  g_assert (node != NULL);
+  g_assert (node->any.kind == PIECE_TREE_NODE_BRANCH);
 
-  if (node->any.kind == PIECE_TREE_NODE_BRANCH)
-    return LINKED_ARRAY_LENGTH (&node->branch.children) >= (LINKED_ARRAY_CAPACITY (&node->branch.children) - 2);
-  else
-    return LINKED_ARRAY_LENGTH (&node->leaf.entries) >= (LINKED_ARRAY_CAPACITY (&node->leaf.entries) - 2);
+  for (guint8 i = 0; i < LINKED_ARRAY_LENGTH (&node->branch.children); i++)
+    node->branch.children.items[i].node->any.slot = i;
 }
 
-/**
- * piece_tree_node_search:
- * @node: A #PieceTreeNode
- * @position: the position, adjusted relative to @node
- * @relative_position: (out): The position adjusted to be relative
- *   to the resulting node.
+/*
+ * piece_tree_node_remove_child:
+ * @node: A #PieceTreeNode branch
+ * @position: the logical position of the child to remove
+ *
+ * Removes the child at @position from @node. The LinkedArray fills the
+ * hole by moving its last item into the vacated slot, so the slot of that
+ * child is updated to match.
  *
+ * Returns: (transfer none): the removed #PieceTreeNode
  */
 static PieceTreeNode *
-piece_tree_node_search (PieceTreeNode *node,
-                        guint64        position,
-                        guint64       *relative_position)
+piece_tree_node_remove_child (PieceTreeNode *node,
+                              guint          position)
 {
-  PieceTreeChild *last_child = NULL;
+  PieceTreeChild removed;
+  guint8 slot;
 
   g_assert (node != NULL);
-  g_assert (relative_position != NULL);
+  g_assert (node->any.kind == PIECE_TREE_NODE_BRANCH);
 
-  if (node->any.kind == PIECE_TREE_NODE_LEAF)
-    {
-      *relative_position = position;
-      return node;
-    }
+  removed = LINKED_ARRAY_REMOVE_INDEX (&node->branch.children, position);
+  slot = removed.node->any.slot;
 
-  g_assert (node->any.kind == PIECE_TREE_NODE_BRANCH);
+  if (slot < LINKED_ARRAY_LENGTH (&node->branch.children))
+    node->branch.children.items[slot].node->any.slot = slot;
+
+  return removed.node;
+}
+
+/**
+ * piece_tree_node_add_length:
+ * @node: A #PieceTreeNode
+ * @delta: the change in length of @node
+ * @counts: the change in the counts of @node
+ *
+ * Walks up the tree from @node and adjusts the length and counts stored
+ * along with the child pointer in each parent so that offsets and lines
+ * may be calculated without dereferencing the child node.
+ *
+ * To remove counts, negate them with piece_table_counts_negate() first.
+ */
+static void
+piece_tree_node_add_length (PieceTreeNode          *node,
+                            gint64                  delta,
+                            const PieceTableCounts *counts)
+{
+  g_assert (node != NULL);
+  g_assert (counts != NULL);
+
+  for (; node->any.parent != NULL; node = node->any.parent)
+    {
+      PieceTreeChild *child = &node->any.parent->branch.children.items[node->any.slot];
+
+      child->length += delta;
+      piece_table_counts_add (&child->counts, counts);
+    }
+}
+
+static inline gboolean
+piece_tree_node_is_root (PieceTreeNode *node)
+{
+  g_assert (node != NULL);
+
+  return node->any.kind == PIECE_TREE_NODE_BRANCH &&
+         node->any.parent == NULL;
+}
+
+static PieceTreeNode *
+piece_tree_node_new (PieceArena        *arena,
+                     PieceTreeNodeKind  kind)
+{
+  PieceTreeNode *node;
+
+  g_assert (kind == PIECE_TREE_NODE_LEAF || kind == PIECE_TREE_NODE_BRANCH);
+
+  node = piece_arena_alloc (arena);
+  node->any.kind = kind;
+  node->any.parent = NULL;
+  node->any.slot = 0;
+  node->any.ref_count = 1;
+
+  if (kind == PIECE_TREE_NODE_BRANCH)
+    LINKED_ARRAY_INIT (&node->branch.children);
+  else
+    {
+      LINKED_ARRAY_INIT (&node->leaf.entries);
+      node->leaf.prev = NULL;
+      node->leaf.next = NULL;
+    }
+
+  return node;
+}
+
+static inline PieceTreeNode *
+piece_tree_node_ref (PieceTreeNode *node)
+{
+  g_atomic_int_inc (&node->any.ref_count);
+
+  return node;
+}
+
+/*
+ * piece_tree_node_unref:
+ * @arena: the #PieceArena @node was allocated from
+ * @node: A #PieceTreeNode
+ *
+ * Releases a reference to @node, freeing it along with any children that
+ * are not shared with another branch once the last reference is gone.
+ * Snapshots may release their nodes from any thread.
+ */
+static void
+piece_tree_node_unref (PieceArena    *arena,
+                       PieceTreeNode *node)
+{
+  if (!g_atomic_int_dec_and_test (&node->any.ref_count))
+    return;
+
+  if (node->any.kind == PIECE_TREE_NODE_BRANCH)
+    {
+      LINKED_ARRAY_FOREACH (&node->branch.children, PieceTreeChild, child, {
+        piece_tree_node_unref (arena, child->node);
+      });
+    }
+
+  piece_arena_free (arena, node);
+}
+
+static inline void
+piece_table_trash (PieceTable    *self,
+                   PieceTreeNode *node)
+{
+  node->any.parent = self->trash;
+  self->trash = node;
+}
+
+/*
+ * piece_table_reclaim:
+ * @self: A #PieceTable
+ * @budget: the maximum number of nodes to release
+ *
+ * Releases up to @budget nodes from subtrees that were detached by a
+ * range delete. Children of a released branch are placed back on the
+ * trash stack so that large subtrees are freed incrementally across a
+ * number of edits rather than all at once. Nodes shared with a snapshot
+ * only have their reference dropped.
+ */
+static void
+piece_table_reclaim (PieceTable *self,
+                     guint       budget)
+{
+  g_assert (self != NULL);
+
+  for (; self->trash != NULL && budget > 0; budget--)
+    {
+      PieceTreeNode *node = self->trash;
+
+      self->trash = node->any.parent;
+
+      /* Still referenced by a snapshot, which will release it */
+      if (!g_atomic_int_dec_and_test (&node->any.ref_count))
+        continue;
+
+      if (node->any.kind == PIECE_TREE_NODE_BRANCH)
+        {
+          LINKED_ARRAY_FOREACH (&node->branch.children, PieceTreeChild, child, {
+            piece_table_trash (self, child->node);
+          });
+        }
+
+      piece_arena_free (self->arena, node);
+    }
+}
+
+static inline void
+piece_table_finger_clear (PieceTable *self)
+{
+  self->finger.leaf = NULL;
+}
+
+static inline void
+piece_table_finger_set (PieceTable    *self,
+                        PieceTreeNode *leaf,
+                        guint64        position,
+                        guint64        length)
+{
+  g_assert (leaf->any.kind == PIECE_TREE_NODE_LEAF);
+
+  self->finger.leaf = leaf;
+  self->finger.position = position;
+  self->finger.length = length;
+}
+
+/*
+ * piece_table_finger_contains:
+ * @self: A #PieceTable
+ * @position: the absolute position of the edit
+ * @length: the number of bytes affected by the edit
+ *
+ * Checks to see if the range starting at @position can be handled by the
+ * leaf that was last modified. The edges of the leaf are included so that
+ * appending to the end of the leaf can use the finger.
+ */
+static inline gboolean
+piece_table_finger_contains (PieceTable *self,
+                             guint64     position,
+                             guint64     length)
+{
+  return self->finger.leaf != NULL &&
+         position >= self->finger.position &&
+         position - self->finger.position + length <= self->finger.length;
+}
+
+/*
+ * piece_tree_node_copy:
+ * @self: A #PieceTable
+ * @node: A #PieceTreeNode shared with a snapshot
+ *
+ * Replaces @node within the live table with a private copy, leaving the
+ * original to the snapshots which reference it. The children of a branch
+ * become shared between the two, and the live metadata of the neighbors
+ * (parent pointers, linked-leaves and the finger) is moved to the copy.
+ *
+ * Returns: (transfer none): the copy of @node
+ */
+static PieceTreeNode *
+piece_tree_node_copy (PieceTable    *self,
+                      PieceTreeNode *node)
+{
+  PieceTreeNode *copy;
+
+  g_assert (node != NULL);
+  g_assert (node->any.parent != NULL);
+
+  copy = piece_arena_alloc (self->arena);
+  *copy = *node;
+  copy->any.ref_count = 1;
+
+  node->any.parent->branch.children.items[node->any.slot].node = copy;
+
+  if (copy->any.kind == PIECE_TREE_NODE_BRANCH)
+    {
+      LINKED_ARRAY_FOREACH (&copy->branch.children, PieceTreeChild, child, {
+        piece_tree_node_ref (child->node);
+        child->node->any.parent = copy;
+      });
+    }
+  else
+    {
+      if (copy->leaf.prev != NULL)
+        copy->leaf.prev->next = &copy->leaf;
+      if (copy->leaf.next != NULL)
+        copy->leaf.next->prev = &copy->leaf;
+      if (self->finger.leaf == node)
+        self->finger.leaf = copy;
+    }
+
+  piece_tree_node_unref (self->arena, node);
+
+  return copy;
+}
+
+/*
+ * piece_table_unshare:
+ * @self: A #PieceTable
+ * @node: A #PieceTreeNode within the live table
+ *
+ * Makes sure that @node and each of its ancestors belong only to the live
+ * table, so that they may be modified without affecting any snapshot.
+ * Shared nodes are copied from the root down, which shares their children
+ * in turn, so an edit only copies the path from the root to the nodes it
+ * modifies.
+ *
+ * This is a no-op until a snapshot has been taken.
+ *
+ * Returns: (transfer none): @node or its private copy
+ */
+static PieceTreeNode *
+piece_table_unshare (PieceTable    *self,
+                     PieceTreeNode *node)
+{
+  PieceTreeNode *path[PIECE_TREE_MAX_HEIGHT];
+  guint depth = 0;
+
+  g_assert (self != NULL);
+  g_assert (node != NULL);
+
+  if (!self->shared)
+    return node;
+
+  for (PieceTreeNode *iter = node; iter->any.parent != NULL; iter = iter->any.parent)
+    {
+      g_assert (depth < G_N_ELEMENTS (path));
+      path[depth++] = iter;
+    }
+
+  while (depth > 0)
+    {
+      PieceTreeNode *iter = path[--depth];
+
+      if (g_atomic_int_get (&iter->any.ref_count) > 1)
+        {
+          iter = piece_tree_node_copy (self, iter);
+
+          if (depth == 0)
+            node = iter;
+        }
+    }
+
+  return node;
+}
+
+/*
+ * piece_table_count:
+ * @buffer: (nullable): A #PieceBuffer
+ * @kind: the kind of piece
+ * @offset: the offset within the buffer for @kind
+ * @length: the number of bytes
+ * @counts: (out): the units referenced by the piece
+ *
+ * Counts the units referenced by a piece. Tables that are only used to
+ * track offsets have no buffer (or reference data beyond it), in which
+ * case the piece is considered to be empty of any units.
+ */
+static inline void
+piece_table_count (PieceBuffer      *buffer,
+                   PieceKind         kind,
+                   guint64           offset,
+                   guint64           length,
+                   PieceTableCounts *counts)
+{
+  guint64 buffer_length;
+
+  memset (counts, 0, sizeof *counts);
+
+  if (buffer == NULL || length == 0)
+    return;
+
+  if (kind == PIECE_INITIAL)
+    buffer_length = piece_buffer_get_initial_length (buffer);
+  else
+    buffer_length = piece_buffer_get_change_length (buffer);
+
+  if (offset > buffer_length || length > buffer_length - offset)
+    return;
+
+  piece_buffer_count (buffer, kind, offset, length, counts);
+}
+
+/*
+ * piece_table_entry_split:
+ * @buffer: (nullable): A #PieceBuffer
+ * @entry: A #PieceTableEntry
+ * @position: the position within @entry to split at
+ * @tail: (out): the entry for the bytes after @position
+ *
+ * Truncates @entry to @position bytes and stores the remainder in @tail.
+ * The counts of @entry are divided between the two, so that the counts of
+ * the leaf containing them are unchanged.
+ */
+static inline void
+piece_table_entry_split (PieceBuffer     *buffer,
+                         PieceTableEntry *entry,
+                         guint64          position,
+                         PieceTableEntry *tail)
+{
+  PieceTableCounts counts;
+
+  g_assert (entry != NULL);
+  g_assert (tail != NULL);
+  g_assert (position <= entry->length);
+
+  piece_table_count (buffer, entry->kind, entry->offset, position, &counts);
+  piece_table_counts_clamp (&counts, &entry->counts);
+
+  tail->kind = entry->kind;
+  tail->offset = entry->offset + position;
+  tail->length = entry->length - position;
+  tail->counts = entry->counts;
+  piece_table_counts_sub (&tail->counts, &counts);
+
+  entry->length = position;
+  entry->counts = counts;
+}
+
+/*
+ * piece_table_entry_slice:
+ * @buffer: (nullable): A #PieceBuffer
+ * @entry: A #PieceTableEntry
+ * @position: the position within @entry of the first byte
+ * @length: the number of bytes
+ * @slice: (out): the entry for the range
+ *
+ * Creates an entry for @length bytes of @entry starting at @position,
+ * counting the units within the range unless it covers all of @entry.
+ */
+static inline void
+piece_table_entry_slice (PieceBuffer           *buffer,
+                         const PieceTableEntry *entry,
+                         guint64                position,
+                         guint64                length,
+                         PieceTableEntry       *slice)
+{
+  g_assert (entry != NULL);
+  g_assert (slice != NULL);
+  g_assert (position + length <= entry->length);
+
+  slice->kind = entry->kind;
+  slice->offset = entry->offset + position;
+  slice->length = length;
+
+  if (position == 0 && length == entry->length)
+    {
+      slice->counts = entry->counts;
+    }
+  else
+    {
+      piece_table_count (buffer, entry->kind, slice->offset, length, &slice->counts);
+      piece_table_counts_clamp (&slice->counts, &entry->counts);
+    }
+}
+
+/*
+ * piece_table_get_count_buffer:
+ * @self: A #PieceTable
+ *
+ * Gets the buffer to count new entries with, which is %NULL while the
+ * counts of @self are pending so that they are left empty.
+ */
+static inline PieceBuffer *
+piece_table_get_count_buffer (PieceTable *self)
+{
+  return self->counts_pending ? NULL : self->buffer;
+}
+
+static void
+piece_tree_node_recount (PieceTreeNode *node,
+                         PieceBuffer   *buffer)
+{
+  if (node->any.kind == PIECE_TREE_NODE_BRANCH)
+    {
+      LINKED_ARRAY_FOREACH (&node->branch.children, PieceTreeChild, child, {
+        piece_tree_node_recount (child->node, buffer);
+        piece_tree_node_counts (child->node, &child->counts);
+      });
+    }
+  else
+    {
+      LINKED_ARRAY_FOREACH (&node->leaf.entries, PieceTableEntry, entry, {
+        piece_table_count (buffer, entry->kind, entry->offset, entry->length, &entry->counts);
+      });
+    }
+}
+
+/*
+ * piece_table_ensure_counts:
+ * @self: A #PieceTable
+ *
+ * Counts the units of every entry if that was deferred when the file was
+ * opened. This is the first pass over the file, and it only happens once
+ * lines or units are needed. It must happen before the nodes are shared
+ * with a snapshot, since it updates them in place.
+ */
+static inline void
+piece_table_ensure_counts (PieceTable *self)
+{
+  if (G_LIKELY (!self->counts_pending))
+    return;
+
+  g_assert (!self->shared);
+
+  self->counts_pending = FALSE;
+  piece_tree_node_recount (&self->root, self->buffer);
+}
+
+static inline gboolean
+piece_table_entry_chain_head (PieceTableEntry  *entry,
+                              PieceTreeInsert *insert)
+{
+  g_assert (entry != NULL);
+  g_assert (insert != NULL);
+
+  if (entry->kind == insert->kind &&
+      (insert->offset + insert->length) == entry->offset)
+    {
+      entry->offset = insert->offset;
+      entry->length += insert->length;
+      piece_table_counts_add (&entry->counts, &insert->counts);
+      return TRUE;
+    }
+
+  return FALSE;
+}
+
+static inline gboolean
+piece_table_entry_chain_tail (PieceTableEntry *entry,
+                              PieceTreeInsert *insert)
+{
+  g_assert (entry != NULL);
+  g_assert (insert != NULL);
+
+  if (entry->kind == insert->kind &&
+      (entry->offset + entry->length) == insert->offset)
+    {
+      entry->length += insert->length;
+      piece_table_counts_add (&entry->counts, &insert->counts);
+      return TRUE;
+    }
+
+  return FALSE;
+}
+
+/**
+ * piece_table_get_first_leaf:
+ * @self: A #PieceTable
+ *
+ * This finds the leftmost leaf in the tree and returns it. This can
+ * be used to begin scanning the all leaves (using next pointers) so
+ * that you may avoid touching intermediate branches.
+ *
+ * Returns: (not nullable): A #PieceTreeNodeLeaf
+ */
+static PieceTreeNodeLeaf *
+piece_table_get_first_leaf (PieceTable *self)
+{
+  PieceTreeNodeLeaf *ret = NULL;
+  PieceTreeNode *iter;
+
+  g_assert (self != NULL);
+
+  iter = &self->root;
+
+  for (;;)
+    {
+      if (iter->any.kind == PIECE_TREE_NODE_LEAF)
+        {
+          ret = &iter->leaf;
+          break;
+        }
+
+      g_assert (iter->any.kind == PIECE_TREE_NODE_BRANCH);
+      g_assert (!LINKED_ARRAY_IS_EMPTY (&iter->branch.children));
+
+      iter = LINKED_ARRAY_PEEK_HEAD (&iter->branch.children).node;
+    }
+
+  g_assert (self->snapshot || ret->prev == NULL);
+
+  return ret;
+}
+
+static inline gboolean
+piece_tree_node_needs_split (PieceTreeNode *node)
+{
+  /*
+   * We want to split the tree node if there is not enough space to
+   * split a single entry into two AND add a new entry. That means we
+   * need two empty slots before we ever perform an insert.
+   */
+
+  if (node->any.kind == PIECE_TREE_NODE_BRANCH)
+    return LINKED_ARRAY_LENGTH (&node->branch.children) >= (LINKED_ARRAY_CAPACITY (&node->branch.children) - 2);
+  else
+    return LINKED_ARRAY_LENGTH (&node->leaf.entries) >= (LINKED_ARRAY_CAPACITY (&node->leaf.entries) - 2);
+}
+
+/**
+ * piece_tree_node_search:
+ * @node: A #PieceTreeNode
+ * @position: the position, adjusted relative to @node
+ * @relative_position: (out): The position adjusted to be relative
+ *   to the resulting node.
+ *
+ */
+static PieceTreeNode *
+piece_tree_node_search (PieceTreeNode *node,
+                        guint64        position,
+                        guint64       *relative_position)
+{
+  PieceTreeChild *last_child = NULL;
+
+  g_assert (node != NULL);
+  g_assert (relative_position != NULL);
+
+  if (node->any.kind == PIECE_TREE_NODE_LEAF)
+    {
+      *relative_position = position;
+      return node;
+    }
+
+  g_assert (node->any.kind == PIECE_TREE_NODE_BRANCH);
+  g_assert (!LINKED_ARRAY_IS_EMPTY (&node->branch.children));
+
+  LINKED_ARRAY_FOREACH (&node->branch.children, PieceTreeChild, child, {
+    /* We always want to prefer the left if the item can land between two
+     * nodes. That allows us to only have to look right when trying to sink
+     * a new PieceTableEntry.
+     *
+     * The practical effect here is that instead of < we use <=.
+     */
+    if (position <= child->length)
+      return piece_tree_node_search (child->node, position, relative_position);
+
+    position -= child->length;
+    last_child = child;
+  });
+
+  /* It belongs in the last node (and we've already subtracted the
+   * relative length.
+   */
+  return piece_tree_node_search (last_child->node, position, relative_position);
+}
+
+/**
+ * piece_table_get_leaf_at:
+ * @self: A #PieceTable
+ * @position: the position within the table
+ * @relative_position: (out) (optional): The position adjusted to be
+ *   relative to the resulting leaf.
+ *
+ * Locates the leaf containing the byte at @position, which must be less
+ * than the length of the table. Unlike piece_tree_node_search(), this does
+ * not prefer the left leaf when @position lands between two leaves.
+ *
+ * Only the lengths stored in the branches are used, so this is safe to use
+ * with snapshots.
+ *
+ * Returns: (not nullable): A #PieceTreeNode leaf
+ */
+static PieceTreeNode *
+piece_table_get_leaf_at (PieceTable *self,
+                         guint64     position,
+                         guint64    *relative_position)
+{
+  PieceTreeNode *node = &self->root;
+
+  g_assert (self != NULL);
+  g_assert (position < self->length);
+
+  while (node->any.kind == PIECE_TREE_NODE_BRANCH)
+    {
+      PieceTreeNode *next = NULL;
+
+      LINKED_ARRAY_FOREACH (&node->branch.children, PieceTreeChild, child, {
+        if (position < child->length)
+          {
+            next = child->node;
+            break;
+          }
+        position -= child->length;
+      });
+
+      g_assert (next != NULL);
+
+      node = next;
+    }
+
+  if (relative_position != NULL)
+    *relative_position = position;
+
+  return node;
+}
+
+/*
+ * piece_table_get_next_leaf:
+ * @self: A #PieceTable
+ * @leaf: A #PieceTreeNode leaf
+ * @position: the position at which @leaf ends
+ *
+ * Gets the leaf following @leaf. The linked-leaves only describe the live
+ * table, so snapshots locate the leaf beginning at @position instead.
+ *
+ * Returns: (nullable): A #PieceTreeNode leaf, or %NULL
+ */
+static inline PieceTreeNode *
+piece_table_get_next_leaf (PieceTable    *self,
+                           PieceTreeNode *leaf,
+                           guint64        position)
+{
+  if G_LIKELY (!self->snapshot)
+    return (PieceTreeNode *)leaf->leaf.next;
+
+  if (position >= self->length)
+    return NULL;
+
+  return piece_table_get_leaf_at (self, position, NULL);
+}
+
+/*
+ * piece_table_get_prev_leaf:
+ * @self: A #PieceTable
+ * @leaf: A #PieceTreeNode leaf
+ * @position: the position at which @leaf begins
+ *
+ * Like piece_table_get_next_leaf(), but gets the leaf preceding @leaf.
+ *
+ * Returns: (nullable): A #PieceTreeNode leaf, or %NULL
+ */
+static inline PieceTreeNode *
+piece_table_get_prev_leaf (PieceTable    *self,
+                           PieceTreeNode *leaf,
+                           guint64        position)
+{
+  if G_LIKELY (!self->snapshot)
+    return (PieceTreeNode *)leaf->leaf.prev;
+
+  if (position == 0)
+    return NULL;
+
+  return piece_table_get_leaf_at (self, position - 1, NULL);
+}
+
+static void
+piece_tree_node_split_root (PieceArena    *arena,
+                            PieceTreeNode *node)
+{
+  PieceTreeNode *left;
+  PieceTreeNode *right;
+  PieceTreeChild child;
+
+  g_assert (node->any.kind == PIECE_TREE_NODE_BRANCH);
+  g_assert (node->any.parent == NULL);
   g_assert (!LINKED_ARRAY_IS_EMPTY (&node->branch.children));
 
-  LINKED_ARRAY_FOREACH (&node->branch.children, PieceTreeChild, child, {
-    /* We always want to prefer the left if the item can land between two
-     * nodes. That allows us to only have to look right when trying to sink
-     * a new PieceTableEntry.
-     *
-     * The practical effect here is that instead of < we use <=.
-     */
-    if (position <= child->length)
-      return piece_tree_node_search (child->node, position, relative_position);
+  left = piece_tree_node_new (arena, PIECE_TREE_NODE_BRANCH);
+  right = piece_tree_node_new (arena, PIECE_TREE_NODE_BRANCH);
+
+  LINKED_ARRAY_SPLIT2 (&node->branch.children, &left->branch.children, &right->branch.children);
+  LINKED_ARRAY_FOREACH (&left->branch.children, PieceTreeChild, child, {
+    child->node->any.parent = left;
+  });
+  LINKED_ARRAY_FOREACH (&right->branch.children, PieceTreeChild, child, {
+    child->node->any.parent = right;
+  });
+  piece_tree_node_reslot (left);
+  piece_tree_node_reslot (right);
+
+  g_assert (LINKED_ARRAY_IS_EMPTY (&node->branch.children));
+
+  child.node = right;
+  child.length = piece_tree_node_length (right);
+  piece_tree_node_counts (right, &child.counts);
+  LINKED_ARRAY_PUSH_HEAD (&node->branch.children, child);
+  right->any.parent = node;
+
+  child.node = left;
+  child.length = piece_tree_node_length (left);
+  piece_tree_node_counts (left, &child.counts);
+  LINKED_ARRAY_PUSH_HEAD (&node->branch.children, child);
+  left->any.parent = node;
+
+  g_assert_cmpint (LINKED_ARRAY_LENGTH (&node->branch.children), ==, 2);
+
+  piece_tree_node_reslot (node);
+
+  DEBUG_VALIDATE (node, NULL);
+  DEBUG_VALIDATE (left, node);
+  DEBUG_VALIDATE (right, node);
+}
+
+static void
+piece_tree_node_split_internal_node (PieceArena    *arena,
+                                     PieceTreeNode *left)
+{
+  PieceTreeNode *parent;
+  PieceTreeNode *right;
+  PieceTreeChild *left_child;
+  PieceTreeChild right_child;
+
+  g_assert (left != NULL);
+  g_assert (left->any.kind == PIECE_TREE_NODE_BRANCH);
+  g_assert (left->any.parent != NULL);
+  g_assert (left->any.parent->any.kind == PIECE_TREE_NODE_BRANCH);
+
+  /*
+   * This operation should not change the height of the tree. Only
+   * splitting the root node can change the height of the tree. So
+   * here we add a new right node, and update the parent to point to
+   * it right after our node.
+   *
+   * Since no new items are added, lengths do not change and we do
+   * not need to update lengths up the hierarchy except for our two
+   * effected nodes (and their direct parent).
+   */
+
+  parent = left->any.parent;
+
+  /* Create a new node to split half the items into */
+  right = piece_tree_node_new (arena, PIECE_TREE_NODE_BRANCH);
+  right->any.parent = parent;
+
+  LINKED_ARRAY_SPLIT (&left->branch.children, &right->branch.children);
+  LINKED_ARRAY_FOREACH (&right->branch.children, PieceTreeChild, child, {
+    child->node->any.parent = right;
+  });
+
+  /* Popping from @left may have moved its remaining children */
+  piece_tree_node_reslot (left);
+  piece_tree_node_reslot (right);
+
+  left_child = piece_tree_node_get_child (left, NULL);
+  left_child->length = piece_tree_node_length (left);
+  piece_tree_node_counts (left, &left_child->counts);
+
+  right_child.node = right;
+  right_child.length = piece_tree_node_length (right);
+  piece_tree_node_counts (right, &right_child.counts);
+  right->any.slot = LINKED_ARRAY_INSERT_AFTER (&parent->branch.children, left->any.slot, right_child);
+
+  DEBUG_VALIDATE (left, parent);
+  DEBUG_VALIDATE (right, parent);
+}
+
+static void
+piece_tree_node_split_leaf (PieceArena    *arena,
+                            PieceTreeNode *left)
+{
+  PieceTreeNode *parent;
+  PieceTreeNode *right;
+  PieceTreeChild *left_child;
+  PieceTreeChild right_child;
+
+  g_assert (left != NULL);
+  g_assert (left->any.kind == PIECE_TREE_NODE_LEAF);
+  g_assert (left->any.parent != NULL);
+
+  parent = left->any.parent;
+
+  g_assert (parent != left);
+  g_assert (parent->any.kind == PIECE_TREE_NODE_BRANCH);
+  g_assert (!LINKED_ARRAY_IS_EMPTY (&parent->branch.children));
+  g_assert (!LINKED_ARRAY_IS_FULL (&parent->branch.children));
+
+  DEBUG_VALIDATE (parent, parent->any.parent);
+  DEBUG_VALIDATE (left, parent);
+
+  right = piece_tree_node_new (arena, PIECE_TREE_NODE_LEAF);
+  right->any.parent = parent;
+
+  right->leaf.prev = &left->leaf;
+  right->leaf.next = left->leaf.next;
+
+  if (right->leaf.next != NULL)
+    right->leaf.next->prev = &right->leaf;
+
+  left->leaf.next = &right->leaf;
+
+  LINKED_ARRAY_SPLIT (&left->leaf.entries, &right->leaf.entries);
+  piece_tree_leaf_index (left);
+  piece_tree_leaf_index (right);
+
+  right_child.node = right;
+  right_child.length = piece_tree_node_length (right);
+  piece_tree_node_counts (right, &right_child.counts);
+
+  left_child = piece_tree_node_get_child (left, NULL);
+  left_child->length -= right_child.length;
+  piece_table_counts_sub (&left_child->counts, &right_child.counts);
+
+  right->any.slot = LINKED_ARRAY_INSERT_AFTER (&parent->branch.children, left->any.slot, right_child);
+}
+
+static void
+piece_tree_node_split (PieceArena    *arena,
+                       PieceTreeNode *node)
+{
+  g_assert (node != NULL);
+
+  /* First, work our way up to the root and ensure that the parent
+   * has also been split if necessary.
+   */
+  if (node->any.parent != NULL &&
+      piece_tree_node_needs_split (node->any.parent))
+    piece_tree_node_split (arena, node->any.parent);
+
+  if (node->any.kind == PIECE_TREE_NODE_BRANCH)
+    {
+      if (piece_tree_node_is_root (node))
+        piece_tree_node_split_root (arena, node);
+      else
+        piece_tree_node_split_internal_node (arena, node);
+    }
+  else if (node->any.kind == PIECE_TREE_NODE_LEAF)
+    piece_tree_node_split_leaf (arena, node);
+  else
+    g_assert_not_reached ();
+}
+
+/*
+ * piece_tree_node_split_at:
+ * @arena: the #PieceArena to allocate new nodes from
+ * @leaf: A #PieceTreeNode leaf
+ * @position: (inout): a position relative to the start of @leaf
+ *
+ * Splits @leaf (and any ancestors that need it) and determines which of
+ * the two halves now contains @position, so that the caller does not need
+ * to search the tree again.
+ *
+ * Splitting ancestors only moves @leaf to a new parent, so @leaf itself
+ * always remains the left half. A @position on the boundary stays in the
+ * left half so that an insert there may chain to the last entry.
+ *
+ * Returns: (not nullable): the leaf containing @position, with @position
+ *   rebased to be relative to that leaf.
+ */
+static PieceTreeNode *
+piece_tree_node_split_at (PieceArena    *arena,
+                          PieceTreeNode *leaf,
+                          guint64       *position)
+{
+  guint64 left_length;
+
+  g_assert (leaf != NULL);
+  g_assert (leaf->any.kind == PIECE_TREE_NODE_LEAF);
+  g_assert (position != NULL);
+
+  piece_tree_node_split (arena, leaf);
+
+  left_length = piece_tree_node_get_child (leaf, NULL)->length;
+
+  if (*position <= left_length)
+    return leaf;
+
+  *position -= left_length;
+
+  g_assert (leaf->leaf.next != NULL);
+  g_assert_cmpint (*position, <=, piece_tree_node_length ((PieceTreeNode *)leaf->leaf.next));
+
+  return (PieceTreeNode *)leaf->leaf.next;
+}
+
+/*
+ * piece_tree_leaf_insert_entry:
+ * @leaf: A #PieceTreeNode leaf
+ * @i: the logical index of @entry
+ * @entry: the entry at which @insert lands
+ * @next: (nullable): the entry following @entry
+ * @insert: our insert request, with a position relative to @entry
+ * @to_insert: the entry to insert if it cannot be chained
+ * @buffer: (nullable): the #PieceBuffer used to count units
+ *
+ * Inserts @to_insert before, after or in the middle of @entry, chaining it
+ * to @entry or @next when possible. New entries are placed after @entry by
+ * its slot, so the entries before it are not walked again.
+ */
+static inline void
+piece_tree_leaf_insert_entry (PieceTreeNode         *leaf,
+                              guint                  i,
+                              PieceTableEntry       *entry,
+                              PieceTableEntry       *next,
+                              PieceTreeInsert       *insert,
+                              const PieceTableEntry *to_insert,
+                              PieceBuffer           *buffer)
+{
+  guint8 slot = entry - leaf->leaf.entries.items;
+
+  /*
+   * If this insert request would happen immediately after this entry,
+   * we want to see if we can chain it to this entry or the beginning
+   * of the next entry.
+   *
+   * Note: We coudld also follow the the B+tree style linked-leaf to
+   *       the next leaf and compare against it's first item. But that is
+   *       out of scope for this prototype.
+   */
+
+  if (insert->position == 0)
+    {
+      g_assert (i == 0);
+
+      if (piece_table_entry_chain_head (entry, insert))
+        piece_tree_leaf_index_resize (leaf, i);
+      else
+        {
+          LINKED_ARRAY_PUSH_HEAD (&leaf->leaf.entries, *to_insert);
+          /* New entries always take the first free slot */
+          piece_tree_leaf_index_insert (leaf, i, LINKED_ARRAY_LENGTH (&leaf->leaf.entries) - 1);
+        }
+    }
+  else if (insert->position == entry->length)
+    {
+      /* Try to chain to the end of this entry or the beginning of the next */
+      if (piece_table_entry_chain_tail (entry, insert))
+        piece_tree_leaf_index_resize (leaf, i);
+      else if (next != NULL && piece_table_entry_chain_head (next, insert))
+        piece_tree_leaf_index_resize (leaf, i + 1);
+      else
+        piece_tree_leaf_index_insert (leaf, i + 1,
+                                      LINKED_ARRAY_INSERT_AFTER (&leaf->leaf.entries, slot, *to_insert));
+    }
+  else
+    {
+      PieceTableEntry split;
+      guint8 inserted;
+
+      g_assert (insert->position < entry->length);
+
+      piece_table_entry_split (buffer, entry, insert->position, &split);
+      piece_tree_leaf_index_resize (leaf, i);
+
+      inserted = LINKED_ARRAY_INSERT_AFTER (&leaf->leaf.entries, slot, *to_insert);
+      piece_tree_leaf_index_insert (leaf, i + 1, inserted);
+      piece_tree_leaf_index_insert (leaf, i + 2,
+                                    LINKED_ARRAY_INSERT_AFTER (&leaf->leaf.entries, inserted, split));
+    }
+}
+
+/*
+ * piece_tree_node_insert_leaf:
+ * @leaf: A #PieceTreeNode leaf which does not need to be split
+ * @insert: our insert request, with a position relative to @leaf
+ * @buffer: (nullable): the #PieceBuffer used to count units
+ *
+ * Inserts the piece described by @insert into @leaf, chaining it to a
+ * neighboring entry when possible. The lengths stored in the parents of
+ * @leaf are not updated. @insert->position is consumed.
+ */
+static void
+piece_tree_node_insert_leaf (PieceTreeNode   *leaf,
+                             PieceTreeInsert *insert,
+                             PieceBuffer     *buffer)
+{
+  PieceTableEntry to_insert;
+  guint i;
+
+  g_assert (leaf != NULL);
+  g_assert (leaf->any.kind == PIECE_TREE_NODE_LEAF);
+  g_assert (!piece_tree_node_needs_split (leaf));
+  g_assert (insert != NULL);
+  g_assert (insert->length > 0);
+  g_assert (insert->position <= piece_tree_node_length (leaf));
+
+  to_insert.kind = insert->kind;
+  to_insert.offset = insert->offset;
+  to_insert.length = insert->length;
+  to_insert.counts = insert->counts;
+
+  /* We should only hit this if we have an empty tree. */
+  if G_UNLIKELY (LINKED_ARRAY_IS_EMPTY (&leaf->leaf.entries))
+    {
+      g_assert (insert->position == 0);
+      LINKED_ARRAY_PUSH_HEAD (&leaf->leaf.entries, to_insert);
+      piece_tree_leaf_index (leaf);
+      return;
+    }
+
+#ifdef PIECE_TABLE_SOA
+  {
+    PieceTableEntry *items = leaf->leaf.entries.items;
+    guint8 *slots = leaf->leaf.slots;
+
+    /* Land at the end of the entry before the position rather than the
+     * start of the one after it, as the loop below does, so that typing
+     * is chained to the entry it follows.
+     */
+    if (insert->position == 0)
+      i = 0;
+    else
+      {
+        insert->position--;
+        i = piece_tree_leaf_find (leaf, &insert->position);
+        insert->position++;
+      }
+
+    g_assert (i < LINKED_ARRAY_LENGTH (&leaf->leaf.entries));
+
+    piece_tree_leaf_insert_entry (leaf, i, &items[slots[i]],
+                                  i + 1 < LINKED_ARRAY_LENGTH (&leaf->leaf.entries) ? &items[slots[i + 1]] : NULL,
+                                  insert, &to_insert, buffer);
+  }
+#else
+  i = 0;
+  LINKED_ARRAY_FOREACH (&leaf->leaf.entries, PieceTableEntry, entry, {
+    if (insert->position <= entry->length)
+      {
+        piece_tree_leaf_insert_entry (leaf, i, entry,
+                                      LINKED_ARRAY_FOREACH_PEEK (&leaf->leaf.entries),
+                                      insert, &to_insert, buffer);
+        return;
+      }
+
+    insert->position -= entry->length;
+
+    i++;
+  });
+
+  g_assert_not_reached ();
+#endif
+}
+
+/*
+ * piece_table_insert_full:
+ * @self: A PieceTable
+ * @insert: our insert request
+ *
+ * Locates the target leaf to insert into, either using the finger or by
+ * walking the tree from the root, and inserts into it.
+ *
+ * So that we don't have to update any node other than the parent branches,
+ * we pass the calculated offset as we walk down (and then update them as
+ * we walk back up the tree).
+ */
+static void
+piece_table_insert_full (PieceTable      *self,
+                         PieceTreeInsert *insert)
+{
+  PieceTreeNode *target;
+  guint64 real_position;
+  guint64 target_position;
+
+  g_assert (self != NULL);
+  g_assert (insert != NULL);
+  g_assert (insert->length > 0);
+
+  real_position = insert->position;
+
+  if (piece_table_finger_contains (self, insert->position, 0))
+    {
+      target = self->finger.leaf;
+      insert->position -= self->finger.position;
+    }
+  else
+    {
+      target = piece_tree_node_search (&self->root, insert->position, &insert->position);
+    }
+
+  target = piece_table_unshare (self, target);
+  target_position = real_position - insert->position;
+
+  g_assert (target->any.kind == PIECE_TREE_NODE_LEAF);
+  g_assert (target->any.parent != NULL);
+  g_assert (insert->position <= piece_tree_node_length (target));
+
+  if (piece_tree_node_needs_split (target))
+    {
+      /* Split the target into two and continue with whichever half
+       * now contains our position.
+       */
+      piece_table_finger_clear (self);
+      target = piece_tree_node_split_at (self->arena, target, &insert->position);
+      target_position = real_position - insert->position;
+
+      g_assert (target->any.kind == PIECE_TREE_NODE_LEAF);
+      g_assert (target->any.parent != NULL);
+      g_assert_cmpint (insert->position, <=, piece_tree_node_length (target));
+    }
+
+  piece_tree_node_insert_leaf (target, insert, piece_table_get_count_buffer (self));
+
+  /*
+   * Now update each of the parent nodes in the tree so that they have
+   * an apprporiate length along with the child pointer. This allows them
+   * to calculate offsets while walking the tree (without dereferncing the
+   * child node) at the cost of us walking back up the tree.
+   */
+  piece_tree_node_add_length (target, insert->length, &insert->counts);
+
+  self->length += insert->length;
+
+  if (self->finger.leaf == target)
+    self->finger.length += insert->length;
+  else
+    piece_table_finger_set (self, target, target_position, piece_tree_node_length (target));
+}
+
+/*
+ * piece_tree_node_delete_leaf:
+ * @leaf: A #PieceTreeNode leaf
+ * @position: the position relative to @leaf
+ * @length: the number of bytes to remove
+ * @buffer: (nullable): the #PieceBuffer used to count units
+ * @counts: (out): the units removed from @leaf
+ *
+ * Removes up to @length bytes from @leaf starting at @position. Entries at
+ * the edges of the range are trimmed (or split if the range is contained
+ * within a single entry) and entries in between are removed.
+ *
+ * If the range begins and ends within a single entry, the entry is split
+ * in two and the caller must ensure that @leaf has room for the new entry.
+ *
+ * Returns: the number of bytes that were removed from @leaf.
+ */
+static guint64
+piece_tree_node_delete_leaf (PieceTreeNode    *leaf,
+                             guint64           position,
+                             guint64           length,
+                             PieceBuffer      *buffer,
+                             PieceTableCounts *counts)
+{
+  guint64 removed = 0;
+  guint i = 0;
+
+  g_assert (leaf != NULL);
+  g_assert (leaf->any.kind == PIECE_TREE_NODE_LEAF);
+  g_assert (counts != NULL);
+
+  memset (counts, 0, sizeof *counts);
+
+#ifdef PIECE_TABLE_SOA
+  i = piece_tree_leaf_find (leaf, &position);
+#else
+  LINKED_ARRAY_FOREACH (&leaf->leaf.entries, PieceTableEntry, entry, {
+    if (position < entry->length)
+      break;
+    position -= entry->length;
+    i++;
+  });
+#endif
+
+  if (position > 0)
+    {
+      PieceTableEntry *entry = LINKED_ARRAY_NTH (&leaf->leaf.entries, i);
+
+      if (position + length < entry->length)
+        {
+          PieceTableEntry middle;
+          PieceTableEntry split;
+
+          piece_table_entry_split (buffer, entry, position, &middle);
+          piece_table_entry_split (buffer, &middle, length, &split);
+          *counts = middle.counts;
+
+          g_assert (!LINKED_ARRAY_IS_FULL (&leaf->leaf.entries));
+          LINKED_ARRAY_INSERT_VAL (&leaf->leaf.entries, i + 1, split);
+          piece_tree_leaf_index (leaf);
+
+          return length;
+        }
+      else
+        {
+          PieceTableEntry rest;
+
+          piece_table_entry_split (buffer, entry, position, &rest);
+          removed = rest.length;
+          *counts = rest.counts;
+          i++;
+        }
+    }
+
+  while (removed < length && i < LINKED_ARRAY_LENGTH (&leaf->leaf.entries))
+    {
+      PieceTableEntry *entry = LINKED_ARRAY_NTH (&leaf->leaf.entries, i);
+
+      if (entry->length <= length - removed)
+        {
+          removed += entry->length;
+          piece_table_counts_add (counts, &entry->counts);
+          (void)LINKED_ARRAY_REMOVE_INDEX (&leaf->leaf.entries, i);
+        }
+      else
+        {
+          PieceTableEntry rest;
+
+          piece_table_entry_split (buffer, entry, length - removed, &rest);
+          piece_table_counts_add (counts, &entry->counts);
+          *entry = rest;
+          removed = length;
+        }
+    }
+
+  piece_tree_leaf_index (leaf);
+
+  return removed;
+}
+
+/*
+ * piece_tree_node_delete_range:
+ * @self: A #PieceTable
+ * @node: A #PieceTreeNode
+ * @position: the position relative to @node
+ * @length: the number of bytes to remove
+ * @counts: (out): the units removed from @node
+ *
+ * Removes up to @length bytes from @node starting at @position.
+ *
+ * Children that are fully covered by the range are detached as a whole
+ * (using the length stored with the child pointer) and placed on the trash
+ * stack without visiting their descendants. Only the children at the edges
+ * of the range are descended into, so this is O(height * fanout) no matter
+ * how many pieces are removed.
+ *
+ * The linked-leaves are not updated, the caller is responsible for joining
+ * the leaves at either edge of the range.
+ *
+ * Returns: the number of bytes that were removed from @node.
+ */
+static guint64
+piece_tree_node_delete_range (PieceTable       *self,
+                              PieceTreeNode    *node,
+                              guint64           position,
+                              guint64           length,
+                              PieceTableCounts *counts)
+{
+  guint64 removed = 0;
+  guint i = 0;
+
+  g_assert (self != NULL);
+  g_assert (node != NULL);
+  g_assert (counts != NULL);
+
+  if (node->any.kind == PIECE_TREE_NODE_LEAF)
+    return piece_tree_node_delete_leaf (node, position, length, piece_table_get_count_buffer (self), counts);
+
+  memset (counts, 0, sizeof *counts);
+
+  while (removed < length && i < LINKED_ARRAY_LENGTH (&node->branch.children))
+    {
+      PieceTreeChild *child = LINKED_ARRAY_NTH (&node->branch.children, i);
+
+      if (position >= child->length)
+        {
+          position -= child->length;
+          i++;
+        }
+      else if (position == 0 && child->length <= length - removed)
+        {
+          removed += child->length;
+          piece_table_counts_add (counts, &child->counts);
+          piece_table_trash (self, piece_tree_node_remove_child (node, i));
+        }
+      else
+        {
+          PieceTableCounts n_counts;
+          guint64 n_removed;
+
+          /* The caller unshares the leaves at either edge of the range */
+          g_assert (g_atomic_int_get (&child->node->any.ref_count) == 1);
+
+          n_removed = piece_tree_node_delete_range (self, child->node, position, length - removed, &n_counts);
+          child->length -= n_removed;
+          piece_table_counts_sub (&child->counts, &n_counts);
+          removed += n_removed;
+          piece_table_counts_add (counts, &n_counts);
+          position = 0;
+          i++;
+        }
+    }
+
+  return removed;
+}
+
+/*
+ * piece_tree_node_merge:
+ * @arena: the #PieceArena to release the emptied node to
+ * @parent: A #PieceTreeNode branch
+ * @position: the logical position of the left child
+ *
+ * Moves all of the items from the child at @position + 1 into the child
+ * at @position and releases the emptied node. For leaves, the emptied node
+ * is unlinked from the linked-leaves.
+ *
+ * The length of @parent does not change, so nothing above @parent needs
+ * to be updated.
+ */
+static void
+piece_tree_node_merge (PieceArena    *arena,
+                       PieceTreeNode *parent,
+                       guint          position)
+{
+  PieceTreeChild *left_child;
+  PieceTreeChild *right_child;
+  PieceTreeNode *left;
+  PieceTreeNode *right;
+
+  g_assert (parent != NULL);
+  g_assert (parent->any.kind == PIECE_TREE_NODE_BRANCH);
+  g_assert_cmpint (position + 1, <, LINKED_ARRAY_LENGTH (&parent->branch.children));
+
+  left_child = LINKED_ARRAY_NTH (&parent->branch.children, position);
+  right_child = LINKED_ARRAY_NTH (&parent->branch.children, position + 1);
+
+  left = left_child->node;
+  right = right_child->node;
+
+  g_assert (left->any.kind == right->any.kind);
+
+  if (left->any.kind == PIECE_TREE_NODE_BRANCH)
+    {
+      while (!LINKED_ARRAY_IS_EMPTY (&right->branch.children))
+        {
+          PieceTreeChild child = LINKED_ARRAY_POP_HEAD (&right->branch.children);
+
+          child.node->any.parent = left;
+          LINKED_ARRAY_PUSH_TAIL (&left->branch.children, child);
+        }
+
+      piece_tree_node_reslot (left);
+    }
+  else
+    {
+      while (!LINKED_ARRAY_IS_EMPTY (&right->leaf.entries))
+        {
+          PieceTableEntry entry = LINKED_ARRAY_POP_HEAD (&right->leaf.entries);
+
+          LINKED_ARRAY_PUSH_TAIL (&left->leaf.entries, entry);
+        }
+
+      piece_tree_leaf_index (left);
+
+      left->leaf.next = right->leaf.next;
+      if (right->leaf.next != NULL)
+        right->leaf.next->prev = &left->leaf;
+    }
+
+  /* Update the left length before removing, as the removal may move
+   * the left child into a new slot.
+   */
+  left_child->length += right_child->length;
+  piece_table_counts_add (&left_child->counts, &right_child->counts);
+  piece_tree_node_remove_child (parent, position + 1);
+
+  piece_tree_node_unref (arena, right);
+
+  DEBUG_VALIDATE (left, parent);
+}
+
+/*
+ * piece_tree_node_borrow:
+ * @parent: A #PieceTreeNode branch
+ * @position: the logical position of the left child
+ *
+ * Moves items between the children at @position and @position + 1 so that
+ * they contain roughly the same number of items.
+ */
+static void
+piece_tree_node_borrow (PieceTreeNode *parent,
+                        guint          position)
+{
+  PieceTreeChild *left_child;
+  PieceTreeChild *right_child;
+  PieceTreeNode *left;
+  PieceTreeNode *right;
+  guint n_left;
+  guint n_right;
+  guint64 moved = 0;
+  PieceTableCounts moved_counts = { 0 };
+
+  g_assert (parent != NULL);
+  g_assert (parent->any.kind == PIECE_TREE_NODE_BRANCH);
+  g_assert_cmpint (position + 1, <, LINKED_ARRAY_LENGTH (&parent->branch.children));
+
+  left_child = LINKED_ARRAY_NTH (&parent->branch.children, position);
+  right_child = LINKED_ARRAY_NTH (&parent->branch.children, position + 1);
+
+  left = left_child->node;
+  right = right_child->node;
+
+  n_left = piece_tree_node_n_items (left);
+  n_right = piece_tree_node_n_items (right);
+
+  if (left->any.kind == PIECE_TREE_NODE_BRANCH)
+    {
+      for (; n_left + 1 < n_right; n_left++, n_right--)
+        {
+          PieceTreeChild child = LINKED_ARRAY_POP_HEAD (&right->branch.children);
+
+          child.node->any.parent = left;
+          LINKED_ARRAY_PUSH_TAIL (&left->branch.children, child);
+          moved += child.length;
+          piece_table_counts_add (&moved_counts, &child.counts);
+        }
+
+      for (; n_right + 1 < n_left; n_left--, n_right++)
+        {
+          PieceTreeChild child = LINKED_ARRAY_POP_TAIL (&left->branch.children);
+
+          child.node->any.parent = right;
+          LINKED_ARRAY_PUSH_HEAD (&right->branch.children, child);
+          moved -= child.length;
+          piece_table_counts_sub (&moved_counts, &child.counts);
+        }
+
+      piece_tree_node_reslot (left);
+      piece_tree_node_reslot (right);
+    }
+  else
+    {
+      for (; n_left + 1 < n_right; n_left++, n_right--)
+        {
+          PieceTableEntry entry = LINKED_ARRAY_POP_HEAD (&right->leaf.entries);
+
+          LINKED_ARRAY_PUSH_TAIL (&left->leaf.entries, entry);
+          moved += entry.length;
+          piece_table_counts_add (&moved_counts, &entry.counts);
+        }
+
+      for (; n_right + 1 < n_left; n_left--, n_right++)
+        {
+          PieceTableEntry entry = LINKED_ARRAY_POP_TAIL (&left->leaf.entries);
+
+          LINKED_ARRAY_PUSH_HEAD (&right->leaf.entries, entry);
+          moved -= entry.length;
+          piece_table_counts_sub (&moved_counts, &entry.counts);
+        }
+
+      piece_tree_leaf_index (left);
+      piece_tree_leaf_index (right);
+    }
+
+  /* The totals may have wrapped, but unsigned arithmetic gets us back */
+  left_child->length += moved;
+  piece_table_counts_add (&left_child->counts, &moved_counts);
+  right_child->length -= moved;
+  piece_table_counts_sub (&right_child->counts, &moved_counts);
+
+  DEBUG_VALIDATE (left, parent);
+  DEBUG_VALIDATE (right, parent);
+}
+
+/*
+ * piece_table_collapse_root:
+ * @self: A #PieceTable
+ *
+ * While the root only has a single branch child, pull the children of
+ * that branch up into the root, reducing the height of the tree. The root
+ * always remains a branch so that an empty table still has a leaf.
+ */
+static void
+piece_table_collapse_root (PieceTable *self)
+{
+  g_assert (self != NULL);
+
+  while (LINKED_ARRAY_LENGTH (&self->root.branch.children) == 1)
+    {
+      PieceTreeNode *child = LINKED_ARRAY_PEEK_HEAD (&self->root.branch.children).node;
+
+      if (child->any.kind != PIECE_TREE_NODE_BRANCH)
+        break;
+
+      child = piece_table_unshare (self, child);
+
+      self->root.branch.children = child->branch.children;
+      LINKED_ARRAY_INIT (&child->branch.children);
+
+      LINKED_ARRAY_FOREACH (&self->root.branch.children, PieceTreeChild, grandchild, {
+        grandchild->node->any.parent = &self->root;
+      });
+
+      /* Slots are physical, so they remain valid after the copy */
+
+      piece_tree_node_unref (self->arena, child);
+    }
+}
+
+/*
+ * piece_table_rebalance:
+ * @self: A #PieceTable
+ * @node: the node that had items removed
+ *
+ * Walks from @node up to the root. Any node that has fallen below the
+ * minimum number of items either borrows items from a sibling or is merged
+ * with it. A merged node may still be underfull (range deletes can leave
+ * nodes with a single item), so it is checked again before moving on to
+ * the parent, which has lost a child.
+ *
+ * Nodes which are the only child of their parent are skipped, as they have
+ * no sibling to rebalance with until their parent has been merged.
+ *
+ * Returns: %TRUE if any nodes were merged or borrowed from.
+ */
+static gboolean
+piece_table_rebalance (PieceTable    *self,
+                       PieceTreeNode *node)
+{
+  gboolean changed = FALSE;
+
+  g_assert (self != NULL);
+  g_assert (node != NULL);
+
+  while (node != &self->root)
+    {
+      PieceTreeNode *parent = node->any.parent;
+
+      if (piece_tree_node_n_items (node) < piece_tree_node_min_items (node) &&
+          LINKED_ARRAY_LENGTH (&parent->branch.children) > 1)
+        {
+          PieceTreeNode *left;
+          PieceTreeNode *right;
+          guint position;
+
+          piece_tree_node_get_child (node, &position);
+
+          /* Prefer our left sibling, so that @position is the left of the pair */
+          if (position > 0)
+            position--;
+
+          left = LINKED_ARRAY_NTH (&parent->branch.children, position)->node;
+          right = LINKED_ARRAY_NTH (&parent->branch.children, position + 1)->node;
+
+          /* Both siblings (and @parent) are about to be modified */
+          left = piece_table_unshare (self, left);
+          right = piece_table_unshare (self, right);
+          parent = left->any.parent;
+
+          /* Only merge if the result would not immediately need a split */
+          if (piece_tree_node_n_items (left) + piece_tree_node_n_items (right) <
+              piece_tree_node_capacity (node) - 2)
+            {
+              piece_tree_node_merge (self->arena, parent, position);
+              node = left;
+              changed = TRUE;
+              continue;
+            }
+
+          piece_tree_node_borrow (parent, position);
+          changed = TRUE;
+        }
+
+      node = parent;
+    }
+
+  piece_table_collapse_root (self);
+
+  return changed;
+}
+
+/*
+ * piece_tree_update_lengths:
+ * @nodes: an array of nodes whose length within their parent may be stale
+ *
+ * Recalculates the length and counts stored with each node in @nodes and then does the
+ * same for their parents, one level at a time, until reaching the root.
+ *
+ * @nodes must contain nodes at the same depth of the tree in order, so that
+ * siblings sharing a parent are adjacent. Each parent is then only visited
+ * once per level, making this a single pass up the tree no matter how many
+ * nodes were modified. @nodes is empty upon return.
+ */
+static void
+piece_tree_update_lengths (GPtrArray *nodes)
+{
+  g_assert (nodes != NULL);
+
+  while (nodes->len > 0)
+    {
+      guint n_parents = 0;
+
+      for (guint i = 0; i < nodes->len; i++)
+        {
+          PieceTreeNode *node = g_ptr_array_index (nodes, i);
+          PieceTreeNode *parent = node->any.parent;
+          PieceTreeChild *child;
+
+          if (parent == NULL)
+            continue;
+
+          child = piece_tree_node_get_child (node, NULL);
+          child->length = piece_tree_node_length (node);
+          piece_tree_node_counts (node, &child->counts);
+
+          if (n_parents == 0 || g_ptr_array_index (nodes, n_parents - 1) != parent)
+            g_ptr_array_index (nodes, n_parents++) = parent;
+        }
+
+      g_ptr_array_set_size (nodes, n_parents);
+    }
+}
+
+/*
+ * piece_tree_node_insert_after:
+ * @arena: the #PieceArena to allocate new nodes from
+ * @sibling: A #PieceTreeNode
+ * @node: A #PieceTreeNode of the same kind as @sibling
+ * @length: the length of @node
+ * @counts: the units within @node
+ * @dirty: nodes whose length within their parent is pending an update
+ *
+ * Inserts @node into the parent of @sibling, immediately after @sibling,
+ * splitting the parent first if necessary.
+ *
+ * Splitting a branch above the parent would validate lengths that are
+ * still pending, so @dirty is flushed first in that (rare) case.
+ */
+static void
+piece_tree_node_insert_after (PieceArena             *arena,
+                              PieceTreeNode          *sibling,
+                              PieceTreeNode          *node,
+                              guint64                 length,
+                              const PieceTableCounts *counts,
+                              GPtrArray              *dirty)
+{
+  PieceTreeNode *parent;
+  PieceTreeChild child;
+
+  g_assert (sibling != NULL);
+  g_assert (sibling->any.parent != NULL);
+  g_assert (node != NULL);
+  g_assert (node->any.kind == sibling->any.kind);
+
+  parent = sibling->any.parent;
+
+  if (piece_tree_node_needs_split (parent))
+    {
+      if (parent->any.parent != NULL &&
+          piece_tree_node_needs_split (parent->any.parent))
+        piece_tree_update_lengths (dirty);
+
+      piece_tree_node_split (arena, parent);
+      parent = sibling->any.parent;
+    }
+
+  child.node = node;
+  child.length = length;
+  child.counts = *counts;
+
+  node->any.slot = LINKED_ARRAY_INSERT_AFTER (&parent->branch.children, sibling->any.slot, child);
+  node->any.parent = parent;
+}
+
+static inline void
+piece_table_entries_append (GArray                *entries,
+                            const PieceTableEntry *entry)
+{
+  /* Chain to the previous entry if they are contiguous */
+  if (entries->len > 0)
+    {
+      PieceTableEntry *last = &g_array_index (entries, PieceTableEntry, entries->len - 1);
+
+      if (last->kind == entry->kind &&
+          last->offset + last->length == entry->offset)
+        {
+          last->length += entry->length;
+          piece_table_counts_add (&last->counts, &entry->counts);
+          return;
+        }
+    }
+
+  g_array_append_vals (entries, entry, 1);
+}
+
+/*
+ * piece_table_collect:
+ * @self: A #PieceTable
+ * @position: the position of the first byte
+ * @length: the number of bytes
+ * @entries: an array of #PieceTableEntry
+ *
+ * Appends the entries covering @length bytes starting from @position to
+ * @entries, trimming the entries at either edge. This walks the linked
+ * leaves so only a single search is performed.
+ */
+static void
+piece_table_collect (PieceTable *self,
+                     guint64     position,
+                     guint64     length,
+                     GArray     *entries)
+{
+  PieceTreeNodeLeaf *leaf;
+
+  g_assert (self != NULL);
+  g_assert (entries != NULL);
+
+  if (length == 0)
+    return;
+
+  leaf = &piece_table_get_leaf_at (self, position, &position)->leaf;
+
+  for (; length > 0; leaf = leaf->next)
+    {
+      g_assert (leaf != NULL);
+
+      LINKED_ARRAY_FOREACH (&leaf->entries, PieceTableEntry, entry, {
+        PieceTableEntry copy;
+
+        if (position >= entry->length)
+          {
+            position -= entry->length;
+            continue;
+          }
+
+        piece_table_entry_slice (piece_table_get_count_buffer (self), entry, position,
+                                 MIN (entry->length - position, length),
+                                 &copy);
+
+        position = 0;
+        length -= copy.length;
+
+        piece_table_entries_append (entries, &copy);
+
+        if (length == 0)
+          break;
+      });
+    }
+}
+
+/*
+ * piece_table_splice:
+ * @self: A #PieceTable
+ * @position: the position at which to insert
+ * @entries: the entries to insert
+ * @n_entries: the number of elements in @entries
+ *
+ * Inserts @entries at @position in a single operation. The entries of the
+ * target leaf are combined with @entries and then distributed across the
+ * target leaf and as many new leaves as necessary, so no additional
+ * searches are performed. Lengths are updated in a single pass up the
+ * tree once all of the leaves have been placed.
+ *
+ * Returns: the number of bytes inserted
+ */
+static guint64
+piece_table_splice (PieceTable            *self,
+                    guint64                position,
+                    const PieceTableEntry *entries,
+                    guint                  n_entries)
+{
+  PieceTableEntry tail[PIECE_TREE_LEAF_FANOUT];
+  g_autoptr(GPtrArray) dirty = NULL;
+  g_autoptr(GArray) run = NULL;
+  PieceTreeNode *target;
+  PieceTreeNode *leaf;
+  guint64 inserted = 0;
+  guint n_tail = 0;
+  guint n_leaves;
+  guint pos = 0;
+
+  g_assert (self != NULL);
+  g_assert (position <= self->length);
+  g_assert (entries != NULL || n_entries == 0);
+
+  target = piece_tree_node_search (&self->root, position, &position);
+  target = piece_table_unshare (self, target);
+
+  g_assert (target->any.kind == PIECE_TREE_NODE_LEAF);
+
+  run = g_array_sized_new (FALSE, FALSE, sizeof (PieceTableEntry),
+                           n_entries + LINKED_ARRAY_LENGTH (&target->leaf.entries) + 1);
+
+  /* Take the entries out of the target, splitting the entry at @position.
+   * Those before @position go into the run, and the others after it.
+   */
+  while (!LINKED_ARRAY_IS_EMPTY (&target->leaf.entries))
+    {
+      PieceTableEntry entry = LINKED_ARRAY_POP_HEAD (&target->leaf.entries);
+
+      if (position >= entry.length)
+        {
+          position -= entry.length;
+          piece_table_entries_append (run, &entry);
+        }
+      else if (position > 0)
+        {
+          PieceTableEntry split;
+
+          piece_table_entry_split (piece_table_get_count_buffer (self), &entry, position, &split);
+          position = 0;
+
+          piece_table_entries_append (run, &entry);
+          tail[n_tail++] = split;
+        }
+      else
+        {
+          tail[n_tail++] = entry;
+        }
+    }
+
+  for (guint i = 0; i < n_entries; i++)
+    {
+      piece_table_entries_append (run, &entries[i]);
+      inserted += entries[i].length;
+    }
+
+  for (guint i = 0; i < n_tail; i++)
+    piece_table_entries_append (run, &tail[i]);
+
+  /* Distribute the run evenly so that each leaf has room to grow */
+  if (run->len < LINKED_ARRAY_CAPACITY (&target->leaf.entries) - 2)
+    n_leaves = 1;
+  else
+    n_leaves = (run->len + PIECE_TREE_LEAF_FILL - 1) / PIECE_TREE_LEAF_FILL;
+
+  dirty = g_ptr_array_sized_new (n_leaves);
+  leaf = target;
+
+  for (guint i = 0; i < n_leaves; i++)
+    {
+      guint n_items = (run->len - pos) / (n_leaves - i);
+      PieceTableCounts counts = { 0 };
+      guint64 length = 0;
+
+      if (i > 0)
+        {
+          PieceTreeNode *prev = leaf;
+
+          leaf = piece_tree_node_new (self->arena, PIECE_TREE_NODE_LEAF);
+          leaf->leaf.prev = &prev->leaf;
+          leaf->leaf.next = prev->leaf.next;
+          if (leaf->leaf.next != NULL)
+            leaf->leaf.next->prev = &leaf->leaf;
+          prev->leaf.next = &leaf->leaf;
+        }
+
+      for (guint j = 0; j < n_items; j++)
+        {
+          PieceTableEntry *entry = &g_array_index (run, PieceTableEntry, pos++);
+
+          LINKED_ARRAY_PUSH_TAIL (&leaf->leaf.entries, *entry);
+          length += entry->length;
+          piece_table_counts_add (&counts, &entry->counts);
+        }
+
+      piece_tree_leaf_index (leaf);
+
+      /* Leaf lengths must always be exact as they are used when splitting
+       * the branches above them.
+       */
+      if (i == 0)
+        {
+          PieceTreeChild *child = piece_tree_node_get_child (target, NULL);
+
+          child->length = length;
+          child->counts = counts;
+        }
+      else
+        piece_tree_node_insert_after (self->arena, (PieceTreeNode *)leaf->leaf.prev, leaf, length, &counts, dirty);
+
+      g_ptr_array_add (dirty, leaf);
+    }
+
+  g_assert_cmpint (pos, ==, run->len);
+
+  piece_tree_update_lengths (dirty);
+
+  /* The run chains entries that have become contiguous, such as when a
+   * piece is copied back between the two it was cut from. A target that
+   * stays a single leaf can then hold fewer entries than it started with,
+   * and fall below the minimum.
+   */
+  if (n_leaves == 1 &&
+      piece_tree_node_n_items (target) < piece_tree_node_min_items (target))
+    piece_table_rebalance (self, target);
+
+  return inserted;
+}
+
+/**
+ * piece_table_new:
+ *
+ * Creates a new #PieceTable.
+ *
+ * The PieceTable is backed by an N-ary B+ tree.
+ */
+PieceTable *
+piece_table_new (void)
+{
+  PieceTable *self;
+  PieceTreeNode *leaf;
+  PieceTreeChild child;
+
+  self = g_slice_new0 (PieceTable);
+  self->length = 0;
+  self->arena = piece_arena_new (sizeof (PieceTreeNode));
+
+  /* The B+Tree has a root node (a branch) and a single leaf
+   * as a child to simplify how we do splits/rotations/etc.
+   */
+  leaf = piece_tree_node_new (self->arena, PIECE_TREE_NODE_LEAF);
+  leaf->any.parent = &self->root;
+
+  child.node = leaf;
+  child.length = 0;
+  memset (&child.counts, 0, sizeof child.counts);
+
+  self->root.any.kind = PIECE_TREE_NODE_BRANCH;
+  LINKED_ARRAY_INIT (&self->root.branch.children);
+  LINKED_ARRAY_PUSH_HEAD (&self->root.branch.children, child);
+
+  return self;
+}
+
+/*
+ * piece_tree_fill_count:
+ * @fill: the requested fill factor between 0.0 and 1.0
+ * @capacity: the capacity of the node
+ * @min_items: the minimum number of items for the node
+ *
+ * Determines how many items to place within each node when bulk loading.
+ *
+ * The result is kept below the split threshold so the next insert does not
+ * split the node, and at least twice @min_items so that evenly distributing
+ * items never produces an underfull node.
+ */
+static guint
+piece_tree_fill_count (gdouble fill,
+                       guint   capacity,
+                       guint   min_items)
+{
+  guint count = fill * capacity;
+
+  return CLAMP (count, min_items * 2, capacity - 3);
+}
+
+/*
+ * piece_tree_build_level:
+ * @arena: the #PieceArena to allocate the branches from
+ * @children: the #PieceTreeChild for each node of the level below
+ * @per_node: the number of children to place within each branch
+ *
+ * Creates a level of branches above @children, distributing @children
+ * evenly so that each branch contains about @per_node children.
+ *
+ * Returns: (transfer full): the #PieceTreeChild for each new branch
+ */
+static GArray *
+piece_tree_build_level (PieceArena *arena,
+                        GArray     *children,
+                        guint       per_node)
+{
+  GArray *level;
+  guint n_nodes;
+
+  g_assert (children != NULL);
+  g_assert (children->len > 0);
+  g_assert (per_node > 0);
+
+  n_nodes = (children->len + per_node - 1) / per_node;
+  level = g_array_sized_new (FALSE, FALSE, sizeof (PieceTreeChild), n_nodes);
+
+  for (guint i = 0; i < n_nodes; i++)
+    {
+      guint begin = (guint64)children->len * i / n_nodes;
+      guint end = (guint64)children->len * (i + 1) / n_nodes;
+      PieceTreeChild branch_child;
+      PieceTreeNode *branch;
+
+      branch = piece_tree_node_new (arena, PIECE_TREE_NODE_BRANCH);
+
+      branch_child.node = branch;
+      branch_child.length = 0;
+      memset (&branch_child.counts, 0, sizeof branch_child.counts);
+
+      for (guint j = begin; j < end; j++)
+        {
+          PieceTreeChild *child = &g_array_index (children, PieceTreeChild, j);
+
+          child->node->any.parent = branch;
+          child->node->any.slot = j - begin;
+          LINKED_ARRAY_PUSH_TAIL (&branch->branch.children, *child);
+          branch_child.length += child->length;
+          piece_table_counts_add (&branch_child.counts, &child->counts);
+        }
+
+      g_array_append_val (level, branch_child);
+    }
+
+  return level;
+}
+
+/**
+ * piece_table_new_from_entries:
+ * @entries: (array length=n_entries) (nullable): the entries in order
+ * @n_entries: the number of elements in @entries
+ * @fill: the fraction of each node to fill, or 0.0 for the default
+ *
+ * Creates a new #PieceTable containing @entries, in order.
+ *
+ * Rather than inserting each entry individually, the tree is built from
+ * the bottom up. Leaves are packed with entries according to @fill and
+ * linked together, and then each level of branches is created from the
+ * level below it. This runs in linear time and produces a denser tree
+ * than inserting the entries one at a time.
+ *
+ * Contiguous entries are chained together and empty entries are skipped.
+ * The counts of @entries are ignored, as the new table has no
+ * #PieceBuffer to count them from.
+ *
+ * @fill is clamped so that nodes are neither underfull nor so full that
+ * the next edit immediately splits them. The lengths of @entries may not
+ * add up to more than %PIECE_TABLE_MAX_LENGTH.
+ *
+ * Returns: (transfer full): A newly allocated #PieceTable
+ */
+PieceTable *
+piece_table_new_from_entries (const PieceTableEntry *entries,
+                              gsize                  n_entries,
+                              gdouble                fill)
+{
+  g_autoptr(GArray) chained = NULL;
+  g_autoptr(GArray) level = NULL;
+  PieceTreeNode *prev = NULL;
+  PieceTable *self;
+  guint64 length = 0;
+  guint per_leaf;
+  guint per_branch;
+  guint n_leaves;
+
+  g_return_val_if_fail (entries != NULL || n_entries == 0, NULL);
+  g_return_val_if_fail (fill >= 0.0 && fill <= 1.0, NULL);
+
+  for (gsize i = 0; i < n_entries; i++)
+    {
+      g_return_val_if_fail (entries[i].length <= PIECE_TREE_MAX_LENGTH - length, NULL);
+      length += entries[i].length;
+    }
+
+  if (fill == 0.0)
+    fill = (gdouble)PIECE_TREE_LEAF_FILL / PIECE_TREE_LEAF_FANOUT;
+
+  self = piece_table_new ();
+
+  chained = g_array_sized_new (FALSE, FALSE, sizeof (PieceTableEntry), n_entries);
+
+  for (gsize i = 0; i < n_entries; i++)
+    {
+      PieceTableEntry entry = entries[i];
+
+      if (entry.length == 0)
+        continue;
+
+      /* There is no buffer attached to count units from */
+      memset (&entry.counts, 0, sizeof entry.counts);
+
+      piece_table_entries_append (chained, &entry);
+      self->length += entry.length;
+    }
+
+  if (chained->len == 0)
+    return self;
+
+  /* Replace the empty leaf created by piece_table_new() */
+  piece_tree_node_unref (self->arena, LINKED_ARRAY_PEEK_HEAD (&self->root.branch.children).node);
+  LINKED_ARRAY_INIT (&self->root.branch.children);
+
+  per_leaf = piece_tree_fill_count (fill, PIECE_TREE_LEAF_FANOUT, PIECE_TREE_LEAF_MIN);
+  per_branch = piece_tree_fill_count (fill, PIECE_TREE_BRANCH_FANOUT, PIECE_TREE_BRANCH_MIN);
+
+  n_leaves = (chained->len + per_leaf - 1) / per_leaf;
+  level = g_array_sized_new (FALSE, FALSE, sizeof (PieceTreeChild), n_leaves);
+
+  for (guint i = 0; i < n_leaves; i++)
+    {
+      guint begin = (guint64)chained->len * i / n_leaves;
+      guint end = (guint64)chained->len * (i + 1) / n_leaves;
+      PieceTreeChild child;
+      PieceTreeNode *leaf;
+
+      leaf = piece_tree_node_new (self->arena, PIECE_TREE_NODE_LEAF);
+
+      child.node = leaf;
+      child.length = 0;
+      memset (&child.counts, 0, sizeof child.counts);
+
+      for (guint j = begin; j < end; j++)
+        {
+          const PieceTableEntry *entry = &g_array_index (chained, PieceTableEntry, j);
+
+          LINKED_ARRAY_PUSH_TAIL (&leaf->leaf.entries, *entry);
+          child.length += entry->length;
+          piece_table_counts_add (&child.counts, &entry->counts);
+        }
+
+      piece_tree_leaf_index (leaf);
+
+      if (prev != NULL)
+        {
+          prev->leaf.next = &leaf->leaf;
+          leaf->leaf.prev = &prev->leaf;
+        }
+
+      g_array_append_val (level, child);
+      prev = leaf;
+    }
+
+  while (level->len > per_branch)
+    {
+      GArray *parents = piece_tree_build_level (self->arena, level, per_branch);
+
+      g_array_unref (level);
+      level = parents;
+    }
+
+  for (guint i = 0; i < level->len; i++)
+    {
+      PieceTreeChild *child = &g_array_index (level, PieceTreeChild, i);
+
+      child->node->any.parent = &self->root;
+      child->node->any.slot = i;
+      LINKED_ARRAY_PUSH_TAIL (&self->root.branch.children, *child);
+    }
+
+  return self;
+}
+
+void
+piece_table_free (PieceTable *self)
+{
+  if (self != NULL)
+    {
+      g_assert (self->root.any.kind == PIECE_TREE_NODE_BRANCH);
+      g_assert (!LINKED_ARRAY_IS_EMPTY (&self->root.branch.children));
+
+      /* Every reader must have been freed by now */
+      piece_table_free (self->published);
+      piece_epoch_free (self->epoch);
+
+      /* If no snapshot remains, every node belongs to us alone and is
+       * released along with the chunks of the arena. Otherwise we only
+       * release the nodes which are not shared.
+       */
+      if (piece_arena_is_shared (self->arena))
+        {
+          LINKED_ARRAY_FOREACH (&self->root.branch.children, PieceTreeChild, child, {
+            piece_tree_node_unref (self->arena, child->node);
+          });
+
+          piece_table_reclaim (self, G_MAXUINT);
+        }
+
+      piece_arena_unref (self->arena);
+      piece_buffer_unref (self->buffer);
+      piece_journal_free (self->journal);
+
+      g_slice_free (PieceTable, self);
+    }
+}
+
+/**
+ * piece_table_snapshot:
+ * @self: A #PieceTable
+ *
+ * Creates a read-only copy of @self in O(1) which is unaffected by later
+ * edits to @self. The tree is shared between the two, and @self copies the
+ * nodes along the path to each node it modifies (once) while they are
+ * still referenced by a snapshot. Snapshots share the #PieceBuffer as well,
+ * which is append-only.
+ *
+ * Snapshots may be read from, and freed with piece_table_free(), from
+ * another thread while @self continues to be edited, as long as they are
+ * handed off after being created. Any function that modifies the table is
+ * a programming error on a snapshot.
+ *
+ * Returns: (transfer full): A new #PieceTable
+ */
+PieceTable *
+piece_table_snapshot (PieceTable *self)
+{
+  PieceTable *snapshot;
+
+  g_return_val_if_fail (self != NULL, NULL);
+
+  piece_table_ensure_counts (self);
+
+  snapshot = g_slice_new0 (PieceTable);
+  snapshot->root = self->root;
+  snapshot->length = self->length;
+  snapshot->arena = piece_arena_ref (self->arena);
+  snapshot->buffer = self->buffer ? piece_buffer_ref (self->buffer) : NULL;
+  snapshot->snapshot = TRUE;
+
+  LINKED_ARRAY_FOREACH (&snapshot->root.branch.children, PieceTreeChild, child, {
+    piece_tree_node_ref (child->node);
+  });
+
+  if (!self->snapshot)
+    {
+      self->shared = TRUE;
+
+      /* The finger leaf is now shared, and is rarely worth copying */
+      piece_table_finger_clear (self);
+    }
+
+  return snapshot;
+}
+
+/**
+ * piece_table_publish:
+ * @self: A #PieceTable
+ *
+ * Publishes the current contents of @self to readers created with
+ * piece_table_reader_new(), which may be running on other threads.
+ *
+ * The new version is a snapshot which replaces the previous one with a
+ * single atomic store. The previous version is retired and released once
+ * every reader that could still be using it has unpinned it, so readers
+ * never take locks or reference counts.
+ */
+void
+piece_table_publish (PieceTable *self)
+{
+  PieceTable *old;
+
+  g_return_if_fail (self != NULL);
+  g_return_if_fail (!self->snapshot);
+
+  if (self->epoch == NULL)
+    self->epoch = piece_epoch_new ();
+
+  old = g_atomic_pointer_exchange (&self->published, piece_table_snapshot (self));
+
+  if (old != NULL)
+    piece_epoch_retire (self->epoch, old, (GDestroyNotify)piece_table_free);
+
+  piece_epoch_reclaim (self->epoch);
+}
+
+/**
+ * piece_table_reader_new:
+ * @self: A #PieceTable
+ *
+ * Creates a reader of the versions of @self published with
+ * piece_table_publish(), publishing the current contents if nothing has
+ * been published yet.
+ *
+ * This must be called from the thread editing @self, after which the
+ * reader may be handed to (and freed by) another thread. Each reader must
+ * only be used by one thread at a time, and all of them must be freed
+ * before @self.
+ *
+ * Returns: (transfer full): A #PieceTableReader
+ */
+PieceTableReader *
+piece_table_reader_new (PieceTable *self)
+{
+  PieceTableReader *reader;
+
+  g_return_val_if_fail (self != NULL, NULL);
+  g_return_val_if_fail (!self->snapshot, NULL);
+
+  if (self->published == NULL)
+    piece_table_publish (self);
+
+  reader = g_slice_new0 (PieceTableReader);
+  reader->table = self;
+  reader->epoch = piece_epoch_register (self->epoch);
+
+  return reader;
+}
+
+void
+piece_table_reader_free (PieceTableReader *reader)
+{
+  if (reader != NULL)
+    {
+      piece_epoch_unregister (reader->table->epoch, reader->epoch);
+      g_slice_free (PieceTableReader, reader);
+    }
+}
+
+/**
+ * piece_table_reader_pin:
+ * @reader: A #PieceTableReader
+ *
+ * Gets the most recently published version of the table, which remains
+ * valid and unchanged until piece_table_reader_unpin() is called. Pinning
+ * only stores the current epoch, so any number of readers may pin versions
+ * concurrently without contending with each other or the writer.
+ *
+ * Returns: (transfer none): A read-only #PieceTable
+ */
+PieceTable *
+piece_table_reader_pin (PieceTableReader *reader)
+{
+  g_return_val_if_fail (reader != NULL, NULL);
+
+  piece_epoch_enter (reader->epoch);
+
+  return g_atomic_pointer_get (&reader->table->published);
+}
+
+void
+piece_table_reader_unpin (PieceTableReader *reader)
+{
+  g_return_if_fail (reader != NULL);
+
+  piece_epoch_leave (reader->epoch);
+}
+
+void
+piece_table_insert (PieceTable *self,
+                    guint64     position,
+                    PieceKind   kind,
+                    guint64     offset,
+                    guint64     length)
+{
+  PieceTreeInsert insert;
+
+  g_return_if_fail (self != NULL);
+  g_return_if_fail (!self->snapshot);
+  g_return_if_fail (position >= 0);
+  g_return_if_fail (kind == PIECE_INITIAL || kind == PIECE_CHANGE);
+  g_return_if_fail (offset >= 0);
+  g_return_if_fail (length >= 0);
+  g_return_if_fail (length <= (PIECE_TREE_MAX_LENGTH - self->length));
+  g_return_if_fail (offset <= (PIECE_TREE_MAX_LENGTH - length));
+
+  if (length == 0)
+    return;
+
+  piece_table_reclaim (self, PIECE_TREE_RECLAIM_BUDGET);
+
+  insert.kind = kind;
+  insert.offset = offset;
+  insert.length = length;
+  insert.position = position;
+  piece_table_count (piece_table_get_count_buffer (self), kind, offset, length, &insert.counts);
+
+  if (self->journal != NULL)
+    {
+      PieceTableEntry entry = { kind, offset, length };
+
+      piece_journal_record (self->journal, position, NULL, 0, &entry, 1);
+    }
+
+  piece_table_insert_full (self, &insert);
+}
+
+/**
+ * piece_table_new_for_file:
+ * @filename: the path to the file to edit
+ * @error: a location for a #GError, or %NULL
+ *
+ * Creates a new #PieceTable containing the contents of @filename.
+ *
+ * The file is mapped read-only rather than read into memory, so this takes
+ * constant time regardless of the size of the file and pages are only read
+ * from disk when they are accessed. The newlines and other units are first
+ * counted when they are needed, such as by piece_table_get_n_lines().
+ *
+ * Returns: (transfer full) (nullable): A #PieceTable or %NULL on failure.
+ */
+PieceTable *
+piece_table_new_for_file (const gchar  *filename,
+                          GError      **error)
+{
+  PieceBuffer *buffer;
+  PieceTable *self;
+
+  g_return_val_if_fail (filename != NULL, NULL);
+
+  if (!(buffer = piece_buffer_new_for_file (filename, error)))
+    return NULL;
+
+  if (piece_buffer_get_initial_length (buffer) > PIECE_TREE_MAX_LENGTH)
+    {
+      g_set_error (error,
+                   G_FILE_ERROR,
+                   g_file_error_from_errno (EFBIG),
+                   "Failed to open \"%s\": %s",
+                   filename,
+                   g_strerror (EFBIG));
+      piece_buffer_unref (buffer);
+      return NULL;
+    }
+
+  self = piece_table_new ();
+  self->buffer = buffer;
+  self->counts_pending = TRUE;
+
+  piece_table_insert (self, 0, PIECE_INITIAL, 0, piece_buffer_get_initial_length (buffer));
+
+  return self;
+}
+
+/**
+ * piece_table_get_buffer:
+ * @self: A #PieceTable
+ *
+ * Gets the storage for the bytes referenced by the entries of @self.
+ *
+ * Returns: (transfer none) (nullable): A #PieceBuffer or %NULL if no text
+ *   has been attached to @self.
+ */
+PieceBuffer *
+piece_table_get_buffer (PieceTable *self)
+{
+  g_return_val_if_fail (self != NULL, NULL);
+
+  return self->buffer;
+}
+
+/**
+ * piece_table_insert_text:
+ * @self: A #PieceTable
+ * @position: the position to insert at
+ * @text: the text to insert
+ * @length: the length of @text in bytes, or -1 if it is nul-terminated
+ *
+ * Appends @text to the CHANGE buffer and inserts a piece referencing it at
+ * @position. Consecutive inserts (such as typing) reference contiguous
+ * offsets within the CHANGE buffer and are chained into a single piece.
+ */
+void
+piece_table_insert_text (PieceTable  *self,
+                         guint64      position,
+                         const gchar *text,
+                         gssize       length)
+{
+  guint64 offset;
+
+  g_return_if_fail (self != NULL);
+  g_return_if_fail (!self->snapshot);
+  g_return_if_fail (text != NULL || length == 0);
+  g_return_if_fail (position <= self->length);
+
+  if (length < 0)
+    length = strlen (text);
+
+  if (length == 0)
+    return;
+
+  g_return_if_fail ((guint64)length <= PIECE_TREE_MAX_LENGTH - self->length);
+
+  if (self->buffer == NULL)
+    self->buffer = piece_buffer_new ();
+
+  /* Compact tables must be able to address every byte of the buffer */
+  g_return_if_fail ((guint64)length <= PIECE_TREE_MAX_LENGTH - piece_buffer_get_change_length (self->buffer));
+
+  offset = piece_buffer_append (self->buffer, text, length);
+  piece_table_insert (self, position, PIECE_CHANGE, offset, length);
+}
+
+/*
+ * piece_table_read_entries:
+ *
+ * Like piece_table_get_entries(), but without counting the units of a newly
+ * opened file first. Entries created while its counts are pending have
+ * none, which is all that reading the text requires.
+ */
+static gsize
+piece_table_read_entries (PieceTable      *self,
+                          guint64         *position,
+                          guint64          end,
+                          PieceTableEntry *entries,
+                          gsize            n_entries)
+{
+  PieceTreeNode *leaf;
+  guint64 relative;
+  guint64 begin;
+  gsize n = 0;
+
+  g_return_val_if_fail (self != NULL, 0);
+  g_return_val_if_fail (position != NULL, 0);
+  g_return_val_if_fail (end <= self->length, 0);
+  g_return_val_if_fail (entries != NULL || n_entries == 0, 0);
+
+  if (*position >= end || n_entries == 0)
+    return 0;
+
+  begin = *position;
+  leaf = piece_table_get_leaf_at (self, begin, &relative);
+
+  for (; leaf != NULL && n < n_entries; leaf = piece_table_get_next_leaf (self, leaf, begin))
+    {
+      IQUEUE_FOREACH (&leaf->leaf.entries.q, id, {
+        const PieceTableEntry *entry = &leaf->leaf.entries.items[id];
+        PieceTableEntry *out;
+
+        if (relative >= entry->length)
+          {
+            relative -= entry->length;
+            continue;
+          }
+
+        out = &entries[n++];
+        piece_table_entry_slice (piece_table_get_count_buffer (self), entry, relative,
+                                 MIN (entry->length - relative, end - begin),
+                                 out);
+
+        begin += out->length;
+        relative = 0;
+
+        if (begin == end || n == n_entries)
+          goto done;
+      });
+    }
+
+done:
+  *position = begin;
+
+  return n;
+}
+
+/**
+ * piece_table_get_text:
+ * @self: A #PieceTable
+ * @position: the position of the first byte
+ * @length: the number of bytes
+ *
+ * Copies @length bytes starting from @position into a newly allocated,
+ * nul-terminated string.
+ *
+ * Returns: (transfer full): A newly allocated string
+ */
+gchar *
+piece_table_get_text (PieceTable *self,
+                      guint64     position,
+                      guint64     length)
+{
+  PieceTableEntry entries[64];
+  guint64 end;
+  gchar *ret;
+  gchar *out;
+  gsize n;
+
+  g_return_val_if_fail (self != NULL, NULL);
+  g_return_val_if_fail (position <= self->length, NULL);
+  g_return_val_if_fail (length <= self->length - position, NULL);
+  g_return_val_if_fail (self->buffer != NULL || length == 0, NULL);
+
+  end = position + length;
+  out = ret = g_malloc (length + 1);
+
+  while ((n = piece_table_read_entries (self, &position, end, entries, G_N_ELEMENTS (entries))))
+    {
+      for (gsize i = 0; i < n; i++)
+        {
+          guint64 offset = entries[i].offset;
+          guint64 remaining = entries[i].length;
+
+          while (remaining > 0)
+            {
+              guint64 chunk_length = remaining;
+              const gchar *data;
+
+              data = piece_buffer_peek (self->buffer, entries[i].kind, offset, &chunk_length);
+              memcpy (out, data, chunk_length);
+
+              out += chunk_length;
+              offset += chunk_length;
+              remaining -= chunk_length;
+            }
+        }
+    }
+
+  *out = 0;
+
+  return ret;
+}
+
+/**
+ * piece_table_get_iovecs:
+ * @self: A #PieceTable with a #PieceBuffer attached
+ * @position: (inout): the position to start from
+ * @end: the position to stop at
+ * @iov: (out caller-allocates) (array length=n_iov): the vectors to fill
+ * @n_iov: the number of elements in @iov
+ *
+ * Like piece_table_get_entries(), but fills @iov with pointers to the data
+ * referenced by each entry. Entries that cross a chunk of the CHANGE buffer
+ * require more than one vector.
+ *
+ * @position is advanced past the bytes referenced by @iov, so the range can
+ * be streamed by calling this function until it returns zero.
+ *
+ * Returns: the number of vectors filled
+ */
+gsize
+piece_table_get_iovecs (PieceTable   *self,
+                        guint64      *position,
+                        guint64       end,
+                        struct iovec *iov,
+                        gsize         n_iov)
+{
+  PieceTableEntry entries[64];
+  guint64 next;
+  gsize n = 0;
+  gsize n_entries;
+
+  g_return_val_if_fail (self != NULL, 0);
+  g_return_val_if_fail (position != NULL, 0);
+  g_return_val_if_fail (self->buffer != NULL || *position >= end, 0);
+  g_return_val_if_fail (iov != NULL || n_iov == 0, 0);
+
+  /* Each entry needs at least one vector, so never fetch more entries
+   * than we have vectors. @position only advances past the bytes that
+   * made it into @iov, in case an entry crossing chunks does not fit.
+   */
+  next = *position;
+
+  while (n < n_iov &&
+         (n_entries = piece_table_read_entries (self, &next, end, entries,
+                                                MIN (n_iov - n, G_N_ELEMENTS (entries)))))
+    {
+      for (gsize i = 0; i < n_entries; i++)
+        {
+          guint64 offset = entries[i].offset;
+          guint64 remaining = entries[i].length;
+
+          while (remaining > 0)
+            {
+              guint64 length = remaining;
+
+              if (n == n_iov)
+                return n;
+
+              iov[n].iov_base = (gpointer)piece_buffer_peek (self->buffer, entries[i].kind, offset, &length);
+              iov[n].iov_len = length;
+              n++;
+
+              *position += length;
+              offset += length;
+              remaining -= length;
+            }
+        }
+    }
+
+  return n;
+}
+
+/* Searches start by reading a few vectors, or a small block when going
+ * backward, and double that each time up to the maximum, so that finding
+ * a nearby match costs little while long scans still stream in bulk.
+ */
+#define PIECE_TABLE_SEARCH_MIN_IOV   4
+#define PIECE_TABLE_SEARCH_MIN_BLOCK 256
+#define PIECE_TABLE_SEARCH_MAX_BLOCK (64 * 1024)
+
+/*
+ * piece_table_search:
+ * @self: A #PieceTable
+ * @needle: the bytes to find
+ * @needle_len: the number of bytes in @needle
+ * @begin: the start of the range to search
+ * @end: the end of the range to search
+ * @last: whether to find the last match rather than the first
+ * @match: (out): the position of the match
+ *
+ * Streams the range with piece_table_get_iovecs() and searches each vector
+ * in place. Matches which straddle vectors are found by copying the last
+ * @needle_len - 1 bytes seen into a small window, followed by up to as many
+ * bytes from the next vector. Any match found in that window must begin in
+ * the carried bytes, since one beginning later would not fit.
+ *
+ * Returns: %TRUE if a match lying entirely within the range was found
+ */
+static gboolean
+piece_table_search (PieceTable  *self,
+                    const gchar *needle,
+                    gsize        needle_len,
+                    guint64      begin,
+                    guint64      end,
+                    gboolean     last,
+                    guint64     *match)
+{
+  g_autofree gchar *heap_window = NULL;
+  gchar stack_window[256];
+  gchar *window = stack_window;
+  struct iovec iov[64];
+  gsize carry = needle_len - 1;
+  gsize tail_len = 0;
+  guint64 tail_pos = begin;
+  guint64 chunk_pos = begin;
+  guint64 position = begin;
+  gboolean found = FALSE;
+  gsize n_iov = PIECE_TABLE_SEARCH_MIN_IOV;
+  gsize n;
+
+  if (carry * 2 > sizeof stack_window)
+    window = heap_window = g_malloc (carry * 2);
+
+  while ((n = piece_table_get_iovecs (self, &position, end, iov, n_iov)))
+    {
+      n_iov = MIN (n_iov * 2, G_N_ELEMENTS (iov));
+
+      for (gsize i = 0; i < n; i++)
+        {
+          const gchar *data = iov[i].iov_base;
+          gsize len = iov[i].iov_len;
+          const gchar *hit;
+
+          if (tail_len > 0)
+            {
+              gsize k = MIN (len, carry);
+
+              memcpy (window + tail_len, data, k);
+
+              if (last)
+                hit = piece_search_rfind (window, tail_len + k, needle, needle_len);
+              else
+                hit = piece_search_find (window, tail_len + k, needle, needle_len);
+
+              if (hit != NULL)
+                {
+                  *match = tail_pos + (hit - window);
+                  found = TRUE;
+
+                  if (!last)
+                    return TRUE;
+                }
+            }
+
+          if (last)
+            hit = piece_search_rfind (data, len, needle, needle_len);
+          else
+            hit = piece_search_find (data, len, needle, needle_len);
+
+          if (hit != NULL)
+            {
+              *match = chunk_pos + (hit - data);
+              found = TRUE;
+
+              if (!last)
+                return TRUE;
+            }
+
+          /* Keep the last @carry bytes for the next vector */
+          if (len >= carry)
+            {
+              memcpy (window, data + len - carry, carry);
+              tail_len = carry;
+              tail_pos = chunk_pos + len - carry;
+            }
+          else
+            {
+              memcpy (window + tail_len, data, len);
+              tail_len += len;
+
+              if (tail_len > carry)
+                {
+                  gsize drop = tail_len - carry;
+
+                  memmove (window, window + drop, carry);
+                  tail_pos += drop;
+                  tail_len = carry;
+                }
+            }
+
+          chunk_pos += len;
+        }
+    }
+
+  return found;
+}
+
+/**
+ * piece_table_find:
+ * @self: A #PieceTable
+ * @needle: the bytes to find
+ * @needle_len: the length of @needle, or -1 if it is nul-terminated
+ * @position: the position to search from
+ * @match: (out) (optional): the position of the match
+ *
+ * Finds the first occurrence of @needle beginning at or after @position.
+ *
+ * The pieces are searched where they are in the buffer, without copying
+ * the text, using a vectorized filter on the first and last bytes of
+ * @needle. Matches which cross from one piece into another are found too.
+ *
+ * To find every occurrence, call this again from one past each match.
+ *
+ * Returns: %TRUE if @needle was found
+ */
+gboolean
+piece_table_find (PieceTable  *self,
+                  const gchar *needle,
+                  gssize       needle_len,
+                  guint64      position,
+                  guint64     *match)
+{
+  guint64 ignored;
+
+  g_return_val_if_fail (self != NULL, FALSE);
+  g_return_val_if_fail (needle != NULL, FALSE);
+  g_return_val_if_fail (position <= self->length, FALSE);
+
+  if (needle_len < 0)
+    needle_len = strlen (needle);
+
+  g_return_val_if_fail (needle_len > 0, FALSE);
+
+  if (match == NULL)
+    match = &ignored;
+
+  if (self->length - position < (guint64)needle_len)
+    return FALSE;
+
+  return piece_table_search (self, needle, needle_len, position, self->length, FALSE, match);
+}
+
+/**
+ * piece_table_find_backward:
+ * @self: A #PieceTable
+ * @needle: the bytes to find
+ * @needle_len: the length of @needle, or -1 if it is nul-terminated
+ * @position: the position to search back from
+ * @match: (out) (optional): the position of the match
+ *
+ * Finds the last occurrence of @needle ending at or before @position.
+ *
+ * The range before @position is searched in blocks, starting with the one
+ * closest to @position, so that nearby matches are found without reading
+ * the rest of the table. Consecutive blocks overlap by @needle_len - 1
+ * bytes so matches crossing them are not missed, and grow as the search
+ * moves further away.
+ *
+ * Returns: %TRUE if @needle was found
+ */
+gboolean
+piece_table_find_backward (PieceTable  *self,
+                           const gchar *needle,
+                           gssize       needle_len,
+                           guint64      position,
+                           guint64     *match)
+{
+  guint64 ignored;
+  guint64 block;
+
+  g_return_val_if_fail (self != NULL, FALSE);
+  g_return_val_if_fail (needle != NULL, FALSE);
+  g_return_val_if_fail (position <= self->length, FALSE);
+
+  if (needle_len < 0)
+    needle_len = strlen (needle);
+
+  g_return_val_if_fail (needle_len > 0, FALSE);
+
+  if (match == NULL)
+    match = &ignored;
+
+  block = MAX (PIECE_TABLE_SEARCH_MIN_BLOCK, (guint64)needle_len * 2);
+
+  while (position >= (guint64)needle_len)
+    {
+      guint64 begin = position > block ? position - block : 0;
+
+      if (piece_table_search (self, needle, needle_len, begin, position, TRUE, match))
+        return TRUE;
+
+      if (begin == 0)
+        break;
+
+      position = begin + needle_len - 1;
+      block = MAX (block, MIN (block * 2, PIECE_TABLE_SEARCH_MAX_BLOCK));
+    }
+
+  return FALSE;
+}
+
+/*
+ * piece_table_write_all:
+ * @fd: the file descriptor to write to
+ * @iov: the vectors to write
+ * @n_iov: the number of elements in @iov
+ *
+ * Writes all of @iov to @fd, retrying after partial writes.
+ *
+ * Returns: %TRUE if successful, otherwise %FALSE and errno is set
+ */
+static gboolean
+piece_table_write_all (gint          fd,
+                       struct iovec *iov,
+                       gsize         n_iov)
+{
+  while (n_iov > 0)
+    {
+      gssize r = writev (fd, iov, MIN (n_iov, IOV_MAX));
+
+      if (r < 0)
+        {
+          if (errno == EINTR)
+            continue;
+          return FALSE;
+        }
+
+      while (n_iov > 0 && (gsize)r >= iov->iov_len)
+        {
+          r -= iov->iov_len;
+          iov++;
+          n_iov--;
+        }
+
+      if (n_iov > 0)
+        {
+          iov->iov_base = (gchar *)iov->iov_base + r;
+          iov->iov_len -= r;
+        }
+    }
+
+  return TRUE;
+}
+
+/*
+ * piece_table_copy_range:
+ * @out_fd: the file descriptor to write to
+ * @in_fd: the file descriptor of the INITIAL buffer
+ * @offset: the offset within @in_fd
+ * @length: the number of bytes to copy
+ *
+ * Copies bytes from the original file within the kernel. Some filesystems
+ * can share the underlying extents rather than copying at all.
+ *
+ * Returns: the number of bytes copied, which is less than @length if
+ *   copy_file_range() is not supported for these files.
+ */
+static guint64
+piece_table_copy_range (gint    out_fd,
+                        gint    in_fd,
+                        guint64 offset,
+                        guint64 length)
+{
+  guint64 copied = 0;
+
+  while (copied < length)
+    {
+      loff_t in_offset = offset + copied;
+      gssize r;
+
+      r = copy_file_range (in_fd, &in_offset, out_fd, NULL, length - copied, 0);
+
+      if (r < 0 && errno == EINTR)
+        continue;
+
+      if (r <= 0)
+        break;
+
+      copied += r;
+    }
+
+  return copied;
+}
+
+/*
+ * piece_table_sync_directory:
+ * @filename: the path of a file
+ *
+ * Flushes the directory containing @filename, so that a file renamed into
+ * it remains there after a crash.
+ *
+ * Returns: %TRUE if successful, otherwise %FALSE and errno is set
+ */
+static gboolean
+piece_table_sync_directory (const gchar *filename)
+{
+  g_autofree gchar *dirname = g_path_get_dirname (filename);
+  gint fd;
+  gint r;
+
+  if (-1 == (fd = open (dirname, O_RDONLY | O_DIRECTORY | O_CLOEXEC)))
+    return FALSE;
+
+  r = fsync (fd);
+
+  if (r != 0)
+    {
+      int errsv = errno;
+      close (fd);
+      errno = errsv;
+      return FALSE;
+    }
+
+  close (fd);
+
+  return TRUE;
+}
+
+/* Pieces of the original file at least this long are copied within the
+ * kernel rather than written from the mapping.
+ */
+#define PIECE_TABLE_COPY_RANGE_MIN (64 * 1024)
+
+#define PIECE_TABLE_SAVE_N_IOV 256
+
+/**
+ * piece_table_save:
+ * @self: A #PieceTable
+ * @filename: the path to save to
+ * @error: a location for a #GError, or %NULL
+ *
+ * Saves the contents of @self to @filename without building the contents in
+ * memory.
+ *
+ * Pieces are gathered into vectors and written with writev(). Long pieces
+ * of the original file are instead copied within the kernel using
+ * copy_file_range() when the filesystem supports it, so saving a large file
+ * with a few edits moves very little data through user space.
+ *
+ * The contents are written to a temporary file next to @filename which is
+ * then renamed over @filename, so readers never see a partial file. The
+ * file and its directory are flushed to disk before this returns. A new
+ * file is created with mode 0666 less the umask, and an existing file
+ * keeps its mode.
+ *
+ * Returns: %TRUE if successful; otherwise %FALSE and @error is set.
+ */
+gboolean
+piece_table_save (PieceTable   *self,
+                  const gchar  *filename,
+                  GError      **error)
+{
+  struct iovec iov[PIECE_TABLE_SAVE_N_IOV];
+  PieceTableEntry entries[64];
+  g_autofree gchar *tmpname = NULL;
+  gboolean can_copy_range;
+  guint64 position = 0;
+  struct stat st;
+  gsize n_iov = 0;
+  gsize n;
+  gint in_fd;
+  gint fd;
+
+  g_return_val_if_fail (self != NULL, FALSE);
+  g_return_val_if_fail (filename != NULL, FALSE);
+  g_return_val_if_fail (self->buffer != NULL || self->length == 0, FALSE);
+
+  tmpname = g_strdup_printf ("%s.XXXXXX", filename);
+
+  /* New files get the usual permissions, less the umask */
+  if (-1 == (fd = g_mkstemp_full (tmpname, O_RDWR | O_CLOEXEC, 0666)))
+    goto failure;
+
+  /* Keep the permissions of the file we are replacing */
+  if (stat (filename, &st) == 0)
+    fchmod (fd, st.st_mode & 07777);
+
+  in_fd = self->buffer ? piece_buffer_get_initial_fd (self->buffer) : -1;
+  can_copy_range = in_fd != -1;
+
+  while ((n = piece_table_read_entries (self, &position, self->length, entries, G_N_ELEMENTS (entries))))
+    {
+      for (gsize i = 0; i < n; i++)
+        {
+          PieceTableEntry *entry = &entries[i];
+
+          if (can_copy_range &&
+              entry->kind == PIECE_INITIAL &&
+              entry->length >= PIECE_TABLE_COPY_RANGE_MIN)
+            {
+              guint64 copied;
+
+              /* Everything gathered so far must be written first */
+              if (!piece_table_write_all (fd, iov, n_iov))
+                goto failure;
+              n_iov = 0;
+
+              copied = piece_table_copy_range (fd, in_fd, entry->offset, entry->length);
+
+              /* Fall back to writing from the mapping for the rest */
+              if (copied < entry->length)
+                can_copy_range = FALSE;
+
+              entry->offset += copied;
+              entry->length -= copied;
+            }
+
+          while (entry->length > 0)
+            {
+              guint64 length = entry->length;
+
+              if (n_iov == G_N_ELEMENTS (iov))
+                {
+                  if (!piece_table_write_all (fd, iov, n_iov))
+                    goto failure;
+                  n_iov = 0;
+                }
+
+              iov[n_iov].iov_base = (gpointer)piece_buffer_peek (self->buffer, entry->kind, entry->offset, &length);
+              iov[n_iov].iov_len = length;
+              n_iov++;
+
+              entry->offset += length;
+              entry->length -= length;
+            }
+        }
+    }
+
+  if (!piece_table_write_all (fd, iov, n_iov) || fsync (fd) != 0)
+    goto failure;
+
+  if (!g_close (fd, error))
+    {
+      fd = -1;
+      goto cleanup;
+    }
+
+  fd = -1;
+
+  if (g_rename (tmpname, filename) != 0)
+    goto failure;
+
+  if (!piece_table_sync_directory (filename))
+    goto failure;
+
+  return TRUE;
+
+failure:
+  {
+    int errsv = errno;
+
+    g_set_error (error,
+                 G_FILE_ERROR,
+                 g_file_error_from_errno (errsv),
+                 "Failed to save \"%s\": %s",
+                 filename,
+                 g_strerror (errsv));
+  }
+
+cleanup:
+  if (fd != -1)
+    g_close (fd, NULL);
+
+  g_unlink (tmpname);
+
+  return FALSE;
+}
+
+/*
+ * piece_table_record_delete:
+ * @self: A #PieceTable
+ * @position: the position of the first byte
+ * @length: the number of bytes
+ *
+ * Records the removal of @length bytes from @position in the journal. This
+ * must be called before the bytes are removed.
+ */
+static void
+piece_table_record_delete (PieceTable *self,
+                           guint64     position,
+                           guint64     length)
+{
+  g_autoptr(GArray) removed = NULL;
+
+  g_assert (self->journal != NULL);
+
+  removed = g_array_new (FALSE, FALSE, sizeof (PieceTableEntry));
+  piece_table_collect (self, position, length, removed);
+
+  piece_journal_record (self->journal, position,
+                        (const PieceTableEntry *)(gpointer)removed->data, removed->len,
+                        NULL, 0);
+}
+
+/**
+ * piece_table_delete:
+ * @self: A #PieceTable
+ * @position: the position of the first byte to remove
+ * @length: the number of bytes to remove
+ *
+ * Removes @length bytes starting from @position. Entries that straddle
+ * the edges of the range are trimmed (or split) and everything in between
+ * is removed. Subtrees that are fully covered by the range are detached
+ * from the tree without visiting them and released incrementally by later
+ * edits, so the cost of a delete does not depend on how many pieces it
+ * covers.
+ *
+ * Nodes that become underfull are rebalanced with their siblings so that
+ * the tree shrinks as pieces are removed.
+ */
+void
+piece_table_delete (PieceTable *self,
+                    guint64     position,
+                    guint64     length)
+{
+  PieceTreeNode *first;
+  PieceTreeNode *last;
+  PieceTreeNodeLeaf *prev;
+  PieceTreeNodeLeaf *next;
+  guint64 first_position;
+  guint64 last_position;
+  PieceTableCounts counts;
+  guint64 removed;
+
+  g_return_if_fail (self != NULL);
+  g_return_if_fail (!self->snapshot);
+  g_return_if_fail (position <= self->length);
+  g_return_if_fail (length <= self->length - position);
+
+  if (length == 0)
+    return;
+
+  if (self->journal != NULL)
+    piece_table_record_delete (self, position, length);
+
+  piece_table_reclaim (self, PIECE_TREE_RECLAIM_BUDGET);
+
+  /* If the range is contained within the leaf we last modified, such as
+   * when pressing backspace while typing, we can avoid the search.
+   */
+  if (piece_table_finger_contains (self, position, length) &&
+      !LINKED_ARRAY_IS_FULL (&self->finger.leaf->leaf.entries))
+    {
+      PieceTreeNode *leaf = piece_table_unshare (self, self->finger.leaf);
+
+      removed = piece_tree_node_delete_leaf (leaf, position - self->finger.position, length,
+                                             piece_table_get_count_buffer (self), &counts);
+      g_assert_cmpint (removed, ==, length);
+
+      piece_table_counts_negate (&counts);
+      piece_tree_node_add_length (leaf, -(gint64)removed, &counts);
+      self->length -= removed;
+      self->finger.length -= removed;
+
+      if (piece_tree_node_n_items (leaf) < piece_tree_node_min_items (leaf))
+        {
+          piece_table_finger_clear (self);
+          piece_table_rebalance (self, leaf);
+        }
+
+      return;
+    }
+
+  piece_table_finger_clear (self);
+
+  /* We might need to split an entry in two, so make room first */
+  first = piece_table_get_leaf_at (self, position, &first_position);
+  first = piece_table_unshare (self, first);
+  if G_UNLIKELY (LINKED_ARRAY_IS_FULL (&first->leaf.entries))
+    {
+      first = piece_tree_node_split_at (self->arena, first, &first_position);
+
+      /* The byte at @position begins the right half */
+      if (first_position == piece_tree_node_get_child (first, NULL)->length)
+        {
+          first = (PieceTreeNode *)first->leaf.next;
+          first_position = 0;
+        }
+    }
+
+  /* Find the leaves that will survive on either edge of the range so
+   * that we can join them once everything in between has been detached.
+   */
+  last = piece_table_get_leaf_at (self, position + length - 1, &last_position);
+  last = piece_table_unshare (self, last);
+  prev = first_position > 0 ? &first->leaf : first->leaf.prev;
+  next = last_position + 1 < piece_tree_node_length (last) ? &last->leaf : last->leaf.next;
+
+  removed = piece_tree_node_delete_range (self, &self->root, position, length, &counts);
+  g_assert_cmpint (removed, ==, length);
+
+  self->length -= removed;
+
+  if (prev != next)
+    {
+      if (prev != NULL)
+        prev->next = next;
+      if (next != NULL)
+        next->prev = prev;
+    }
+
+  if G_UNLIKELY (LINKED_ARRAY_IS_EMPTY (&self->root.branch.children))
+    {
+      PieceTreeNode *leaf;
+      PieceTreeChild child;
+
+      /* Everything was removed, so we need a new leaf to insert into */
+      leaf = piece_tree_node_new (self->arena, PIECE_TREE_NODE_LEAF);
+      leaf->any.parent = &self->root;
+
+      child.node = leaf;
+      child.length = 0;
+      memset (&child.counts, 0, sizeof child.counts);
+
+      LINKED_ARRAY_PUSH_HEAD (&self->root.branch.children, child);
+
+      return;
+    }
+
+  /* Only nodes along the edges of the range can be underfull, and they
+   * contain either the byte before or the byte at @position. Merging a
+   * parent can give a previously skipped only-child a sibling, so keep
+   * going until the edges have settled.
+   */
+  for (;;)
+    {
+      gboolean changed = FALSE;
+
+      if (position > 0)
+        changed |= piece_table_rebalance (self, piece_table_get_leaf_at (self, position - 1, NULL));
+
+      if (position < self->length)
+        changed |= piece_table_rebalance (self, piece_table_get_leaf_at (self, position, NULL));
+
+      if (!changed)
+        break;
+    }
+}
+
+/**
+ * piece_table_copy:
+ * @self: A #PieceTable
+ * @from: the position of the first byte to copy
+ * @to: the position at which to insert the copy
+ * @length: the number of bytes to copy
+ *
+ * Inserts a copy of @length bytes starting at @from at the position @to.
+ * @to is relative to the table before the copy has been inserted.
+ *
+ * Rather than inserting each entry individually, the entries are gathered
+ * from the linked leaves and placed into new leaves directly, so copying
+ * k entries costs O(k + log n).
+ */
+void
+piece_table_copy (PieceTable *self,
+                  guint64     from,
+                  guint64     to,
+                  guint64     length)
+{
+  g_autoptr(GArray) entries = NULL;
+  guint64 inserted;
+
+  g_return_if_fail (self != NULL);
+  g_return_if_fail (!self->snapshot);
+  g_return_if_fail (from <= self->length);
+  g_return_if_fail (length <= self->length - from);
+  g_return_if_fail (to <= self->length);
+  g_return_if_fail (length <= (PIECE_TREE_MAX_LENGTH - self->length));
+
+  if (length == 0)
+    return;
+
+  piece_table_reclaim (self, PIECE_TREE_RECLAIM_BUDGET);
+  piece_table_finger_clear (self);
+
+  entries = g_array_new (FALSE, FALSE, sizeof (PieceTableEntry));
+  piece_table_collect (self, from, length, entries);
+
+  if (self->journal != NULL)
+    piece_journal_record (self->journal, to, NULL, 0,
+                          (const PieceTableEntry *)(gpointer)entries->data, entries->len);
+
+  inserted = piece_table_splice (self, to, (PieceTableEntry *)(gpointer)entries->data, entries->len);
+  g_assert_cmpint (inserted, ==, length);
+
+  self->length += inserted;
+}
+
+/*
+ * piece_table_apply_touch:
+ * @dirty: the leaves modified since the lengths were last updated
+ * @leaf: the leaf that was just modified
+ *
+ * Records that the length of @leaf within its parent is stale. Leaves are
+ * touched from left to right, so only the last leaf needs to be checked.
+ */
+static inline void
+piece_table_apply_touch (GPtrArray     *dirty,
+                         PieceTreeNode *leaf)
+{
+  if (dirty->len == 0 || g_ptr_array_index (dirty, dirty->len - 1) != leaf)
+    g_ptr_array_add (dirty, leaf);
+}
+
+/**
+ * piece_table_apply_edits:
+ * @self: A #PieceTable
+ * @edits: (array length=n_edits): the edits to apply
+ * @n_edits: the number of elements in @edits
+ *
+ * Applies a batch of inserts and deletes, such as those produced by a
+ * formatter or multiple cursors, in a single pass over the linked leaves.
+ *
+ * The position of each edit refers to the contents of @self before any of
+ * @edits were applied. @edits must be sorted by position and no edit may
+ * start before the end of a preceding delete. Inserts at the same position
+ * are applied in the order they are provided.
+ *
+ * Rather than searching from the root and updating the lengths of every
+ * ancestor for each edit, the pass moves along the linked leaves and only
+ * updates the lengths of the branches above the touched leaves once. Edits
+ * that are far apart, span multiple leaves, or require rebalancing the tree
+ * fall back to the regular machinery for that edit.
+ */
+void
+piece_table_apply_edits (PieceTable           *self,
+                         const PieceTableEdit *edits,
+                         guint                 n_edits)
+{
+  g_autoptr(GPtrArray) dirty = NULL;
+  PieceJournal *journal;
+  PieceTreeNode *leaf = NULL;
+  guint64 leaf_position = 0;
+  guint64 leaf_length = 0;
+  guint64 prev_position = 0;
+  guint64 deleted_end = 0;
+  guint64 inserted = 0;
+  gint64 shift = 0;
+
+  g_return_if_fail (self != NULL);
+  g_return_if_fail (!self->snapshot);
+  g_return_if_fail (edits != NULL || n_edits == 0);
+
+  /* Validate the edits up front so that we never apply half a batch */
+  for (guint i = 0; i < n_edits; i++)
+    {
+      const PieceTableEdit *edit = &edits[i];
+
+      g_return_if_fail (edit->edit == PIECE_EDIT_INSERT || edit->edit == PIECE_EDIT_DELETE);
+      g_return_if_fail (edit->position >= prev_position);
+      g_return_if_fail (edit->position >= deleted_end);
+      g_return_if_fail (edit->position <= self->length);
+
+      prev_position = edit->position;
+
+      if (edit->edit == PIECE_EDIT_DELETE)
+        {
+          g_return_if_fail (edit->length <= self->length - edit->position);
+          deleted_end = edit->position + edit->length;
+        }
+      else
+        {
+          g_return_if_fail (edit->kind == PIECE_INITIAL || edit->kind == PIECE_CHANGE);
+          g_return_if_fail (edit->length <= PIECE_TREE_MAX_LENGTH - self->length - inserted);
+          g_return_if_fail (edit->offset <= PIECE_TREE_MAX_LENGTH - edit->length);
+          inserted += edit->length;
+        }
+    }
+
+  /* Record the batch as a single group, and stop recording while we apply
+   * it since deletes spanning leaves fall back to piece_table_delete().
+   */
+  if ((journal = self->journal) != NULL)
+    {
+      g_autoptr(GArray) removed = g_array_new (FALSE, FALSE, sizeof (PieceTableEntry));
+      gint64 recorded_shift = 0;
+
+      piece_journal_begin_group (journal);
+
+      for (guint i = 0; i < n_edits; i++)
+        {
+          const PieceTableEdit *edit = &edits[i];
+
+          if (edit->length == 0)
+            continue;
+
+          if (edit->edit == PIECE_EDIT_INSERT)
+            {
+              PieceTableEntry entry = { edit->kind, edit->offset, edit->length };
+
+              piece_journal_record (journal, edit->position + recorded_shift, NULL, 0, &entry, 1);
+              recorded_shift += edit->length;
+            }
+          else
+            {
+              g_array_set_size (removed, 0);
+              piece_table_collect (self, edit->position, edit->length, removed);
+              piece_journal_record (journal, edit->position + recorded_shift,
+                                    (const PieceTableEntry *)(gpointer)removed->data, removed->len,
+                                    NULL, 0);
+              recorded_shift -= edit->length;
+            }
+        }
+
+      piece_journal_end_group (journal);
+
+      self->journal = NULL;
+    }
+
+  piece_table_reclaim (self, PIECE_TREE_RECLAIM_BUDGET);
+  piece_table_finger_clear (self);
+
+  dirty = g_ptr_array_new ();
+
+  for (guint i = 0; i < n_edits; i++)
+    {
+      const PieceTableEdit *edit = &edits[i];
+      guint64 position = edit->position + shift;
+      guint64 end = position + (edit->edit == PIECE_EDIT_DELETE ? edit->length : 0);
+      guint steps = 0;
+
+      if (edit->length == 0)
+        continue;
+
+      /* Move along the linked leaves to the leaf containing @position. If
+       * it is too far away, flush pending lengths and search instead.
+       */
+      while (leaf != NULL &&
+             position > leaf_position + leaf_length &&
+             leaf->leaf.next != NULL &&
+             steps++ < 4)
+        {
+          leaf_position += leaf_length;
+          leaf = (PieceTreeNode *)leaf->leaf.next;
+          leaf_length = piece_tree_node_get_child (leaf, NULL)->length;
+        }
+
+      /* A delete starting at the end of the leaf belongs to the next one */
+      if (leaf != NULL &&
+          edit->edit == PIECE_EDIT_DELETE &&
+          position == leaf_position + leaf_length &&
+          leaf->leaf.next != NULL)
+        {
+          leaf_position += leaf_length;
+          leaf = (PieceTreeNode *)leaf->leaf.next;
+          leaf_length = piece_tree_node_get_child (leaf, NULL)->length;
+        }
+
+      if (leaf == NULL ||
+          position < leaf_position ||
+          position > leaf_position + leaf_length)
+        {
+          guint64 relative;
+
+          piece_tree_update_lengths (dirty);
+          leaf = piece_tree_node_search (&self->root, position, &relative);
+          leaf_position = position - relative;
+          leaf_length = piece_tree_node_get_child (leaf, NULL)->length;
+        }
+
+      leaf = piece_table_unshare (self, leaf);
+
+      if (edit->edit == PIECE_EDIT_INSERT)
+        {
+          PieceTreeInsert insert;
+
+          insert.position = position - leaf_position;
+          insert.kind = edit->kind;
+          insert.offset = edit->offset;
+          insert.length = edit->length;
+          piece_table_count (piece_table_get_count_buffer (self), edit->kind, edit->offset, edit->length, &insert.counts);
+
+          if (piece_tree_node_needs_split (leaf))
+            {
+              /* Splitting relies on the lengths of the parents */
+              piece_tree_update_lengths (dirty);
+              leaf = piece_tree_node_split_at (self->arena, leaf, &insert.position);
+              leaf_position = position - insert.position;
+              leaf_length = piece_tree_node_get_child (leaf, NULL)->length;
+            }
+
+          piece_tree_node_insert_leaf (leaf, &insert, piece_table_get_count_buffer (self));
+          piece_table_apply_touch (dirty, leaf);
+
+          leaf_length += edit->length;
+          self->length += edit->length;
+          shift += edit->length;
+        }
+      else if (end <= leaf_position + leaf_length &&
+               !LINKED_ARRAY_IS_FULL (&leaf->leaf.entries))
+        {
+          PieceTableCounts counts;
+          guint64 removed;
+
+          removed = piece_tree_node_delete_leaf (leaf, position - leaf_position, edit->length,
+                                                 piece_table_get_count_buffer (self), &counts);
+          g_assert_cmpint (removed, ==, edit->length);
+
+          piece_table_apply_touch (dirty, leaf);
+
+          leaf_length -= removed;
+          self->length -= removed;
+          shift -= removed;
+
+          if (piece_tree_node_n_items (leaf) < piece_tree_node_min_items (leaf))
+            {
+              piece_tree_update_lengths (dirty);
+              piece_table_rebalance (self, leaf);
+              leaf = NULL;
+            }
+        }
+      else
+        {
+          /* The range spans multiple leaves */
+          piece_tree_update_lengths (dirty);
+          piece_table_delete (self, position, edit->length);
+          shift -= edit->length;
+          leaf = NULL;
+        }
+    }
+
+  piece_tree_update_lengths (dirty);
+
+  self->journal = journal;
+}
+
+/**
+ * piece_table_set_undo_enabled:
+ * @self: A #PieceTable
+ * @enabled: whether edits should be recorded
+ *
+ * Enables or disables recording edits so that they may be undone with
+ * piece_table_undo(). Disabling it discards everything recorded so far.
+ *
+ * Each edit is recorded as its position along with the pieces it removed
+ * and inserted, which remain valid since the #PieceBuffer is append-only.
+ * Consecutive typing or deleting is coalesced into a single record.
+ */
+void
+piece_table_set_undo_enabled (PieceTable *self,
+                              gboolean    enabled)
+{
+  g_return_if_fail (self != NULL);
+  g_return_if_fail (!self->snapshot);
+
+  if (enabled && self->journal == NULL)
+    self->journal = piece_journal_new ();
+  else if (!enabled)
+    g_clear_pointer (&self->journal, piece_journal_free);
+}
+
+/**
+ * piece_table_begin_group:
+ * @self: A #PieceTable
+ *
+ * Starts a group of edits which are undone and redone as one, such as a
+ * search and replace. Groups may be nested, and must be ended with
+ * piece_table_end_group(). This also stops the next edit from being
+ * coalesced with the previous one.
+ */
+void
+piece_table_begin_group (PieceTable *self)
+{
+  g_return_if_fail (self != NULL);
+
+  if (self->journal != NULL)
+    piece_journal_begin_group (self->journal);
+}
+
+/**
+ * piece_table_end_group:
+ * @self: A #PieceTable
+ *
+ * Ends a group started with piece_table_begin_group().
+ */
+void
+piece_table_end_group (PieceTable *self)
+{
+  g_return_if_fail (self != NULL);
+
+  if (self->journal != NULL)
+    piece_journal_end_group (self->journal);
+}
+
+gboolean
+piece_table_can_undo (PieceTable *self)
+{
+  g_return_val_if_fail (self != NULL, FALSE);
+
+  return self->journal != NULL && piece_journal_can_undo (self->journal);
+}
+
+gboolean
+piece_table_can_redo (PieceTable *self)
+{
+  g_return_val_if_fail (self != NULL, FALSE);
+
+  return self->journal != NULL && piece_journal_can_redo (self->journal);
+}
+
+/*
+ * piece_table_replace:
+ *
+ * Applies a record of the journal by replacing @length bytes at @position
+ * with @entries. A single entry goes through piece_table_insert() so that
+ * it may be chained with its neighbors, and others are spliced in at once.
+ */
+static void
+piece_table_replace (guint64                  position,
+                     guint64                  length,
+                     const PieceJournalEntry *entries,
+                     gsize                    n_entries,
+                     gpointer                 user_data)
+{
+  g_autoptr(GArray) spliced = NULL;
+  PieceTable *self = user_data;
+  guint64 inserted;
+
+  g_assert (self != NULL);
+  g_assert (self->journal == NULL);
+
+  piece_table_delete (self, position, length);
+
+  if (n_entries == 1)
+    {
+      piece_table_insert (self, position, entries[0].kind, entries[0].offset, entries[0].length);
+      return;
+    }
+
+  if (n_entries == 0)
+    return;
+
+  spliced = g_array_sized_new (FALSE, FALSE, sizeof (PieceTableEntry), n_entries);
+
+  for (gsize i = 0; i < n_entries; i++)
+    {
+      PieceTableEntry entry;
+
+      entry.kind = entries[i].kind;
+      entry.offset = entries[i].offset;
+      entry.length = entries[i].length;
+      piece_table_count (piece_table_get_count_buffer (self), entry.kind, entry.offset, entry.length, &entry.counts);
+
+      g_array_append_val (spliced, entry);
+    }
+
+  piece_table_reclaim (self, PIECE_TREE_RECLAIM_BUDGET);
+  piece_table_finger_clear (self);
+
+  inserted = piece_table_splice (self, position, (PieceTableEntry *)(gpointer)spliced->data, spliced->len);
+  self->length += inserted;
+}
+
+/**
+ * piece_table_undo:
+ * @self: A #PieceTable
+ *
+ * Reverts the last edit, or group of edits, recorded since undo was
+ * enabled with piece_table_set_undo_enabled().
+ *
+ * Each record is replayed as a delete of the bytes it inserted followed
+ * by an insert of the pieces it removed, so undoing an edit costs about
+ * as much as making it rather than rebuilding the table.
+ *
+ * Returns: %TRUE if an edit was undone
+ */
+gboolean
+piece_table_undo (PieceTable *self)
+{
+  PieceJournal *journal;
+  gboolean ret;
+
+  g_return_val_if_fail (self != NULL, FALSE);
+
+  if ((journal = self->journal) == NULL)
+    return FALSE;
+
+  self->journal = NULL;
+  ret = piece_journal_undo (journal, piece_table_replace, self);
+  self->journal = journal;
+
+  return ret;
+}
+
+/**
+ * piece_table_redo:
+ * @self: A #PieceTable
+ *
+ * Applies the last edit, or group of edits, reverted by piece_table_undo().
+ * Making any other edit discards the edits that may be redone.
+ *
+ * Returns: %TRUE if an edit was redone
+ */
+gboolean
+piece_table_redo (PieceTable *self)
+{
+  PieceJournal *journal;
+  gboolean ret;
+
+  g_return_val_if_fail (self != NULL, FALSE);
 
-    position -= child->length;
-    last_child = child;
-  });
+  if ((journal = self->journal) == NULL)
+    return FALSE;
 
-  /* It belongs in the last node (and we've already subtracted the
-   * relative length.
-   */
-  return piece_tree_node_search (last_child->node, position, relative_position);
+  self->journal = NULL;
+  ret = piece_journal_redo (journal, piece_table_replace, self);
+  self->journal = journal;
+
+  return ret;
 }
 
-static void
-piece_tree_node_split_root (PieceTreeNode *node)
+/**
+ * piece_table_get_journal_size:
+ * @self: A #PieceTable
+ *
+ * Gets the number of bytes used to record edits for undo and redo.
+ *
+ * Returns: the size of the journal in bytes
+ */
+gsize
+piece_table_get_journal_size (PieceTable *self)
 {
-  PieceTreeNode *left;
-  PieceTreeNode *right;
-  PieceTreeChild child;
+  g_return_val_if_fail (self != NULL, 0);
 
-  g_assert (node->any.kind == PIECE_TREE_NODE_BRANCH);
-  g_assert (node->any.parent == NULL);
-  g_assert (!LINKED_ARRAY_IS_EMPTY (&node->branch.children));
+  return self->journal ? piece_journal_get_size (self->journal) : 0;
+}
 
-  left = piece_tree_node_new (PIECE_TREE_NODE_BRANCH);
-  right = piece_tree_node_new (PIECE_TREE_NODE_BRANCH);
+/**
+ * piece_table_get_n_lines:
+ * @self: A #PieceTable
+ *
+ * Gets the number of lines within @self, which is one more than the number
+ * of newlines. Tables without a #PieceBuffer have no newlines.
+ *
+ * Returns: the number of lines
+ */
+guint64
+piece_table_get_n_lines (PieceTable *self)
+{
+  PieceTableCounts counts;
 
-  LINKED_ARRAY_SPLIT2 (&node->branch.children, &left->branch.children, &right->branch.children);
-  LINKED_ARRAY_FOREACH (&left->branch.children, PieceTreeChild, child, {
-    child->node->any.parent = left;
-  });
-  LINKED_ARRAY_FOREACH (&right->branch.children, PieceTreeChild, child, {
-    child->node->any.parent = right;
+  g_return_val_if_fail (self != NULL, 0);
+
+  piece_table_ensure_counts (self);
+  piece_tree_node_counts (&self->root, &counts);
+
+  return counts.newlines + 1;
+}
+
+/**
+ * piece_table_get_counts:
+ * @self: A #PieceTable
+ * @offset: a position within @self
+ * @counts: (out): the units before @offset
+ *
+ * Counts the newlines, code points and UTF-16 code units before @offset.
+ * Subtracting the counts at the start of a line gives the column of
+ * @offset in any of those units, such as for an LSP position.
+ *
+ * The search descends the tree using the counts stored with each child, so
+ * only the entry containing @offset is scanned. This is O(log n) regardless
+ * of the position of @offset.
+ */
+void
+piece_table_get_counts (PieceTable       *self,
+                        guint64           offset,
+                        PieceTableCounts *counts)
+{
+  PieceTreeNode *node;
+
+  g_return_if_fail (self != NULL);
+  g_return_if_fail (counts != NULL);
+
+  memset (counts, 0, sizeof *counts);
+
+  g_return_if_fail (offset <= self->length);
+
+  piece_table_ensure_counts (self);
+
+  node = &self->root;
+
+  while (node->any.kind == PIECE_TREE_NODE_BRANCH)
+    {
+      PieceTreeNode *next = NULL;
+
+      LINKED_ARRAY_FOREACH (&node->branch.children, PieceTreeChild, child, {
+        if (offset < child->length)
+          {
+            next = child->node;
+            break;
+          }
+
+        offset -= child->length;
+        piece_table_counts_add (counts, &child->counts);
+      });
+
+      /* @offset is the end of the table */
+      if (next == NULL)
+        return;
+
+      node = next;
+    }
+
+#ifdef PIECE_TABLE_SOA
+  {
+    guint i = piece_tree_leaf_find (node, &offset);
+    const PieceTableEntry *entry;
+    PieceTableCounts partial;
+
+    g_assert (i < LINKED_ARRAY_LENGTH (&node->leaf.entries));
+
+    /* The counts of the entries before it are still summed one by one */
+    for (guint j = 0; j < i; j++)
+      piece_table_counts_add (counts, &node->leaf.entries.items[node->leaf.slots[j]].counts);
+
+    entry = &node->leaf.entries.items[node->leaf.slots[i]];
+    piece_table_count (self->buffer, entry->kind, entry->offset, offset, &partial);
+    piece_table_counts_clamp (&partial, &entry->counts);
+    piece_table_counts_add (counts, &partial);
+  }
+#else
+  LINKED_ARRAY_FOREACH (&node->leaf.entries, PieceTableEntry, entry, {
+    if (offset < entry->length)
+      {
+        PieceTableCounts partial;
+
+        piece_table_count (self->buffer, entry->kind, entry->offset, offset, &partial);
+        piece_table_counts_clamp (&partial, &entry->counts);
+        piece_table_counts_add (counts, &partial);
+
+        return;
+      }
+
+    offset -= entry->length;
+    piece_table_counts_add (counts, &entry->counts);
   });
 
-  g_assert (LINKED_ARRAY_IS_EMPTY (&node->branch.children));
+  g_assert_not_reached ();
+#endif
+}
 
-  child.node = right;
-  child.length = piece_tree_node_length (right);
-  LINKED_ARRAY_PUSH_HEAD (&node->branch.children, child);
-  right->any.parent = node;
+/**
+ * piece_table_offset_to_line:
+ * @self: A #PieceTable
+ * @offset: a position within @self
+ *
+ * Gets the line containing @offset, counting from zero. See
+ * piece_table_get_counts().
+ *
+ * Returns: the number of newlines before @offset
+ */
+guint64
+piece_table_offset_to_line (PieceTable *self,
+                            guint64     offset)
+{
+  PieceTableCounts counts;
 
-  child.node = left;
-  child.length = piece_tree_node_length (left);
-  LINKED_ARRAY_PUSH_HEAD (&node->branch.children, child);
-  left->any.parent = node;
+  g_return_val_if_fail (self != NULL, 0);
+  g_return_val_if_fail (offset <= self->length, 0);
 
-  g_assert_cmpint (LINKED_ARRAY_LENGTH (&node->branch.children), ==, 2);
+  piece_table_get_counts (self, offset, &counts);
 
-  DEBUG_VALIDATE (node, NULL);
-  DEBUG_VALIDATE (left, node);
-  DEBUG_VALIDATE (right, node);
+  return counts.newlines;
 }
 
-static void
-piece_tree_node_split_internal_node (PieceTreeNode *left)
+/**
+ * piece_table_line_to_offset:
+ * @self: A #PieceTable
+ * @line: a line within @self, counting from zero
+ *
+ * Gets the position of the first byte of @line.
+ *
+ * The search descends the tree to the entry containing the newline which
+ * ends the previous line, and the #PieceBuffer locates the newline within
+ * that entry using its counts index. This is O(log n) regardless of the
+ * length of the entry.
+ *
+ * Returns: the position of the start of @line
+ */
+guint64
+piece_table_line_to_offset (PieceTable *self,
+                            guint64     line)
 {
-  PieceTreeNode *parent;
-  PieceTreeNode *right;
-  guint64 right_length = 0;
-  guint64 left_length = 0;
-  guint i = 0;
+  PieceTreeNode *node;
+  guint64 offset = 0;
 
-  g_assert (left != NULL);
-  g_assert (left->any.kind == PIECE_TREE_NODE_BRANCH);
-  g_assert (left->any.parent != NULL);
-  g_assert (left->any.parent->any.kind == PIECE_TREE_NODE_BRANCH);
+  g_return_val_if_fail (self != NULL, 0);
+  g_return_val_if_fail (line < piece_table_get_n_lines (self), 0);
 
-  /*
-   * This operation should not change the height of the tree. Only
-   * splitting the root node can change the height of the tree. So
-   * here we add a new right node, and update the parent to point to
-   * it right after our node.
-   *
-   * Since no new items are added, lengths do not change and we do
-   * not need to update lengths up the hierarchy except for our two
-   * effected nodes (and their direct parent).
-   */
+  if (line == 0)
+    return 0;
 
-  parent = left->any.parent;
+  piece_table_ensure_counts (self);
 
-  /* Create a new node to split half the items into */
-  right = piece_tree_node_new (PIECE_TREE_NODE_BRANCH);
-  right->any.parent = parent;
+  node = &self->root;
 
-  LINKED_ARRAY_SPLIT (&left->branch.children, &right->branch.children);
-  LINKED_ARRAY_FOREACH (&right->branch.children, PieceTreeChild, child, {
-    child->node->any.parent = right;
+  /* Find the entry containing the @line'th newline */
+  while (node->any.kind == PIECE_TREE_NODE_BRANCH)
+    {
+      PieceTreeNode *next = NULL;
+
+      LINKED_ARRAY_FOREACH (&node->branch.children, PieceTreeChild, child, {
+        if (line <= child->counts.newlines)
+          {
+            next = child->node;
+            break;
+          }
+
+        line -= child->counts.newlines;
+        offset += child->length;
+      });
+
+      g_assert (next != NULL);
+
+      node = next;
+    }
+
+  LINKED_ARRAY_FOREACH (&node->leaf.entries, PieceTableEntry, entry, {
+    if (line <= entry->counts.newlines)
+      return offset +
+             piece_buffer_skip_newlines (self->buffer, entry->kind, entry->offset, entry->length, line) -
+             entry->offset;
+
+    line -= entry->counts.newlines;
+    offset += entry->length;
   });
 
-  right_length = piece_tree_node_length (right);
-  left_length = piece_tree_node_length (left);
+  g_assert_not_reached ();
 
-  LINKED_ARRAY_FOREACH (&parent->branch.children, PieceTreeChild, child, {
-    i++;
+  return offset;
+}
 
-    if (child->node == left)
-      {
-        PieceTreeChild right_child;
+static inline guint64
+piece_table_counts_get (const PieceTableCounts *counts,
+                        PieceUnit               unit)
+{
+  return unit == PIECE_UNIT_UTF16 ? counts->utf16 : counts->code_points;
+}
+
+/**
+ * piece_table_units_to_offset:
+ * @self: A #PieceTable
+ * @unit: the kind of unit
+ * @n_units: the number of units from the start of @self
+ *
+ * Gets the position of the character boundary after @n_units code points
+ * or UTF-16 code units. A position within a UTF-16 surrogate pair resolves
+ * to the start of the character, and positions beyond the end of @self
+ * resolve to the end.
+ *
+ * Along with piece_table_get_counts(), this converts between byte offsets
+ * and code points or UTF-16 positions in O(log n), by descending the tree
+ * and then scanning a single block of the entry containing the position.
+ *
+ * Returns: the position of the boundary
+ */
+guint64
+piece_table_units_to_offset (PieceTable *self,
+                             PieceUnit   unit,
+                             guint64     n_units)
+{
+  PieceTreeNode *node;
+  guint64 offset = 0;
 
-        child->length = left_length;
+  g_return_val_if_fail (self != NULL, 0);
+  g_return_val_if_fail (unit == PIECE_UNIT_CODE_POINTS || unit == PIECE_UNIT_UTF16, 0);
 
-        right_child.node = right;
-        right_child.length = right_length;
-        LINKED_ARRAY_INSERT_VAL (&parent->branch.children, i, right_child);
+  piece_table_ensure_counts (self);
 
-        DEBUG_VALIDATE (left, parent);
-        DEBUG_VALIDATE (right, parent);
+  node = &self->root;
 
-        return;
-      }
+  /* Find the entry containing the character which would exceed @n_units */
+  while (node->any.kind == PIECE_TREE_NODE_BRANCH)
+    {
+      PieceTreeNode *next = NULL;
+
+      LINKED_ARRAY_FOREACH (&node->branch.children, PieceTreeChild, child, {
+        if (n_units < piece_table_counts_get (&child->counts, unit))
+          {
+            next = child->node;
+            break;
+          }
+
+        n_units -= piece_table_counts_get (&child->counts, unit);
+        offset += child->length;
+      });
+
+      if (next == NULL)
+        return self->length;
+
+      node = next;
+    }
+
+  LINKED_ARRAY_FOREACH (&node->leaf.entries, PieceTableEntry, entry, {
+    if (n_units < piece_table_counts_get (&entry->counts, unit))
+      return offset +
+             piece_buffer_skip_units (self->buffer, entry->kind, entry->offset, entry->length, unit, n_units) -
+             entry->offset;
+
+    n_units -= piece_table_counts_get (&entry->counts, unit);
+    offset += entry->length;
   });
 
   g_assert_not_reached ();
+
+  return offset;
 }
 
-static void
-piece_tree_node_split_leaf (PieceTreeNode *left)
+/**
+ * piece_table_foreach:
+ * @self: A #PieceTable
+ * @func: (scope call) (closure user_data): A callback for each entry
+ * @user_data: closure data for @func
+ *
+ * This function will invoke @func for each entry in the piece table.
+ * The first parameter @func will be a #PieceTableEntry and must not
+ * be modified.
+ *
+ * It is a programming error to modify the table from @func.
+ */
+void
+piece_table_foreach (PieceTable *self,
+                     GFunc       func,
+                     gpointer    user_data)
 {
-  PieceTreeNode *parent;
-  PieceTreeNode *right;
-  guint64 right_length;
-  guint i;
+  PieceTreeNode *leaf;
+  guint64 position = 0;
 
-  g_assert (left != NULL);
-  g_assert (left->any.kind == PIECE_TREE_NODE_LEAF);
-  g_assert (left->any.parent != NULL);
+  g_return_if_fail (self != NULL);
+  g_return_if_fail (func != NULL);
 
-  parent = left->any.parent;
+  piece_table_ensure_counts (self);
 
-  g_assert (parent != left);
-  g_assert (parent->any.kind == PIECE_TREE_NODE_BRANCH);
-  g_assert (!LINKED_ARRAY_IS_EMPTY (&parent->branch.children));
-  g_assert (!LINKED_ARRAY_IS_FULL (&parent->branch.children));
+  for (leaf = (PieceTreeNode *)piece_table_get_first_leaf (self);
+       leaf != NULL;
+       leaf = piece_table_get_next_leaf (self, leaf, position))
+    {
+      g_assert (self->snapshot || leaf->leaf.next == NULL || leaf->leaf.next->prev == &leaf->leaf);
 
-  DEBUG_VALIDATE (parent, parent->any.parent);
-  DEBUG_VALIDATE (left, parent);
+      LINKED_ARRAY_FOREACH (&leaf->leaf.entries, PieceTableEntry, entry, {
+        position += entry->length;
+        func (entry, user_data);
+      });
+    }
+}
 
-  right = piece_tree_node_new (PIECE_TREE_NODE_LEAF);
-  right->any.parent = parent;
+/* Whole-table passes are split into about this many tasks per thread so
+ * that threads finishing early can pick up the remainder, but tasks are
+ * never smaller than the minimum length unless the range is.
+ */
+#define PIECE_TABLE_MAP_TASKS_PER_THREAD 8
+#define PIECE_TABLE_MAP_MIN_LENGTH       (64 * 1024)
 
-  right->leaf.prev = &left->leaf;
-  right->leaf.next = left->leaf.next;
+typedef struct
+{
+  guint64 position;
+  guint64 length;
+} PieceTableMapTask;
 
-  left->leaf.next = &right->leaf;
+typedef struct
+{
+  PieceTable        *table;
+  PieceTableMapFunc  map;
+  gpointer           user_data;
+  GArray            *tasks;
+  gpointer          *results;
+
+  /* The next task to be claimed, and the number of helpers which have
+   * yet to finish (protected by @mutex).
+   */
+  gint               next_task;
+  guint              n_running;
+  GMutex             mutex;
+  GCond              cond;
+} PieceTableMapJob;
+
+/*
+ * piece_table_map_add_task:
+ *
+ * Appends the range to @tasks, extending the previous task if they are
+ * adjacent and small, or splitting the range if it is longer than @target
+ * (such as a single piece covering a large file).
+ */
+static void
+piece_table_map_add_task (GArray  *tasks,
+                          guint64  position,
+                          guint64  length,
+                          guint64  target)
+{
+  PieceTableMapTask task;
+  guint64 n;
+
+  if (tasks->len > 0)
+    {
+      PieceTableMapTask *last = &g_array_index (tasks, PieceTableMapTask, tasks->len - 1);
+
+      if (last->position + last->length == position &&
+          last->length + length <= target)
+        {
+          last->length += length;
+          return;
+        }
+    }
+
+  n = (length + target - 1) / target;
+
+  for (guint64 i = 0; i < n; i++)
+    {
+      task.position = position + length * i / n;
+      task.length = position + length * (i + 1) / n - task.position;
+      g_array_append_val (tasks, task);
+    }
+}
 
-  LINKED_ARRAY_SPLIT (&left->leaf.entries, &right->leaf.entries);
+/*
+ * piece_table_map_split:
+ * @node: A #PieceTreeNode branch
+ * @base: the absolute position of @node
+ * @begin: the start of the range to split
+ * @end: the end of the range to split
+ * @target: the preferred length of each task
+ * @tasks: an array of #PieceTableMapTask
+ *
+ * Splits the range into tasks along the children of @node, using the
+ * lengths stored in the branches. Children longer than @target are split
+ * along their own children, so tasks cover whole subtrees where possible.
+ */
+static void
+piece_table_map_split (PieceTreeNode *node,
+                       guint64        base,
+                       guint64        begin,
+                       guint64        end,
+                       guint64        target,
+                       GArray        *tasks)
+{
+  g_assert (node->any.kind == PIECE_TREE_NODE_BRANCH);
 
-  right_length = piece_tree_node_length (right);
+  LINKED_ARRAY_FOREACH (&node->branch.children, PieceTreeChild, child, {
+    guint64 child_end = base + child->length;
 
-  i = 0;
-  LINKED_ARRAY_FOREACH (&parent->branch.children, PieceTreeChild, child, {
-    ++i;
+    if (base >= end)
+      break;
 
-    if (child->node == left)
+    if (child_end > begin)
       {
-        PieceTreeChild right_child;
+        if (child->length <= target || child->node->any.kind == PIECE_TREE_NODE_LEAF)
+          piece_table_map_add_task (tasks, MAX (base, begin), MIN (child_end, end) - MAX (base, begin), target);
+        else
+          piece_table_map_split (child->node, base, begin, end, target, tasks);
+      }
 
-        right_child.node = right;
-        right_child.length = right_length;
-        child->length -= right_length;
+    base = child_end;
+  });
+}
 
-        LINKED_ARRAY_INSERT_VAL (&parent->branch.children, i, right_child);
+static void
+piece_table_map_run (PieceTableMapJob *job)
+{
+  guint i;
 
-        return;
-      }
-  });
+  while ((i = g_atomic_int_add (&job->next_task, 1)) < job->tasks->len)
+    {
+      const PieceTableMapTask *task = &g_array_index (job->tasks, PieceTableMapTask, i);
 
-  g_assert_not_reached ();
+      job->results[i] = job->map (job->table, task->position, task->length, job->user_data);
+    }
 }
 
 static void
-piece_tree_node_split (PieceTreeNode *node)
+piece_table_map_worker (gpointer data,
+                        gpointer user_data)
 {
-  g_assert (node != NULL);
+  PieceTableMapJob *job = data;
 
-  /* First, work our way up to the root and ensure that the parent
-   * has also been split if necessary.
-   */
-  if (node->any.parent != NULL &&
-      piece_tree_node_needs_split (node->any.parent))
-    piece_tree_node_split (node->any.parent);
+  piece_table_map_run (job);
 
-  if (node->any.kind == PIECE_TREE_NODE_BRANCH)
+  g_mutex_lock (&job->mutex);
+  if (--job->n_running == 0)
+    g_cond_signal (&job->cond);
+  g_mutex_unlock (&job->mutex);
+}
+
+static GThreadPool *
+piece_table_map_get_pool (void)
+{
+  static GThreadPool *pool;
+  static gsize initialized;
+
+  if (g_once_init_enter (&initialized))
     {
-      if (piece_tree_node_is_root (node))
-        piece_tree_node_split_root (node);
-      else
-        piece_tree_node_split_internal_node (node);
+      if (g_get_num_processors () > 1)
+        pool = g_thread_pool_new (piece_table_map_worker, NULL,
+                                  g_get_num_processors () - 1, FALSE, NULL);
+      g_once_init_leave (&initialized, TRUE);
     }
-  else if (node->any.kind == PIECE_TREE_NODE_LEAF)
-    piece_tree_node_split_leaf (node);
-  else
-    g_assert_not_reached ();
+
+  return pool;
 }
 
-/*
- * piece_table_insert_full:
- * @self: A PieceTable
- * @node: The current node being inspected
- * @insert: our insert request
+/**
+ * piece_table_map_reduce:
+ * @self: A #PieceTable
+ * @position: the position of the first byte
+ * @length: the number of bytes
+ * @map: (scope call): called for each task
+ * @reduce: (scope call): combines the results of adjacent tasks
+ * @user_data: closure data for @map and @reduce
  *
- * This is a recursive function used to walk the tree and locate the target
- * leaf to insert into.
+ * Runs a pass over a range of @self in parallel, such as counting words,
+ * computing a checksum or searching.
  *
- * So that we don't have to update any node other than the parent branches,
- * we pass the calculated offset as we walk down (and then update them as
- * we walk back up the tree).
+ * The range is split into tasks of similar length along the subtrees of
+ * @self, and @map is called for each task with its absolute position and
+ * length. It may read that range with piece_table_get_entries() or
+ * piece_table_get_iovecs(). Tasks are claimed by the calling thread and a
+ * shared pool of threads as each finishes the last, so uneven tasks still
+ * keep every thread busy.
+ *
+ * The results are then combined in order with @reduce, which receives the
+ * result for the text before that of @right, and may free both. @map is
+ * called once with an empty range if @length is zero.
  *
- * Since the size of the PieceTreeNodeBranch and PieceTreeNodeLeaf are the
- * same, we can change their type if we have to split the nodes because it
- * is out of space.
+ * @map runs on multiple threads at once, and must not call this function.
+ * @self must not be modified until this returns, though snapshots and
+ * published versions may be used while it continues to be edited.
+ *
+ * Returns: the combined result
  */
-static void
-piece_table_insert_full (PieceTable      *self,
-                         PieceTreeInsert *insert)
+gpointer
+piece_table_map_reduce (PieceTable           *self,
+                        guint64               position,
+                        guint64               length,
+                        PieceTableMapFunc     map,
+                        PieceTableReduceFunc  reduce,
+                        gpointer              user_data)
 {
-  PieceTableEntry to_insert;
-  PieceTreeNode *target;
-  PieceTreeNode *node;
-  PieceTreeNode *parent;
-  guint64 real_position;
-  guint i;
+  g_autoptr(GArray) tasks = NULL;
+  PieceTableMapJob job;
+  GThreadPool *pool;
+  guint64 target;
+  guint n_threads;
+  guint n_helpers;
+  gpointer ret;
+
+  g_return_val_if_fail (self != NULL, NULL);
+  g_return_val_if_fail (position <= self->length, NULL);
+  g_return_val_if_fail (length <= self->length - position, NULL);
+  g_return_val_if_fail (map != NULL, NULL);
+  g_return_val_if_fail (reduce != NULL, NULL);
+
+  /* @map may read entries on other threads, which must not race to count
+   * the units of a newly opened file.
+   */
+  piece_table_ensure_counts (self);
 
-  g_assert (self != NULL);
-  g_assert (insert != NULL);
-  g_assert (insert->length > 0);
+  if (length == 0)
+    return map (self, position, 0, user_data);
 
-  to_insert.kind = insert->kind;
-  to_insert.offset = insert->offset;
-  to_insert.length = insert->length;
+  pool = piece_table_map_get_pool ();
+  n_threads = g_get_num_processors ();
+  target = MAX (length / (n_threads * PIECE_TABLE_MAP_TASKS_PER_THREAD), PIECE_TABLE_MAP_MIN_LENGTH);
 
-  real_position = insert->position;
-  target = piece_tree_node_search (&self->root, insert->position, &insert->position);
+  tasks = g_array_new (FALSE, FALSE, sizeof (PieceTableMapTask));
+  piece_table_map_split (&self->root, 0, position, position + length, target, tasks);
 
-  g_assert (target->any.kind == PIECE_TREE_NODE_LEAF);
-  g_assert (target->any.parent != NULL);
-  g_assert (insert->position <= piece_tree_node_length (target));
+  g_assert (tasks->len > 0);
 
-  /* We should only hit this if we have an empty tree. */
-  if G_UNLIKELY (LINKED_ARRAY_IS_EMPTY (&target->leaf.entries))
+  job.table = self;
+  job.map = map;
+  job.user_data = user_data;
+  job.tasks = tasks;
+  job.results = g_new (gpointer, tasks->len);
+  job.next_task = 0;
+  job.n_running = 0;
+
+  n_helpers = pool != NULL ? MIN (n_threads - 1, tasks->len - 1) : 0;
+
+  if (n_helpers > 0)
     {
-      g_assert (insert->position == 0);
-      LINKED_ARRAY_PUSH_HEAD (&target->leaf.entries, to_insert);
-      goto inserted;
+      g_mutex_init (&job.mutex);
+      g_cond_init (&job.cond);
+
+      job.n_running = n_helpers;
+      for (guint i = 0; i < n_helpers; i++)
+        g_thread_pool_push (pool, &job, NULL);
     }
 
-  if (piece_tree_node_needs_split (target))
+  piece_table_map_run (&job);
+
+  if (n_helpers > 0)
     {
-      /* Split the target into two and then re-locate our position as
-       * we might need to be in another node.
-       *
-       * TODO: Potentially optimization here to look at prev/next to
-       *       locate which we need. Complicated though since we don't
-       *       have real offsets.
-       */
-      piece_tree_node_split (target);
+      /* Helpers reference @job until they finish, even without a task */
+      g_mutex_lock (&job.mutex);
+      while (job.n_running > 0)
+        g_cond_wait (&job.cond, &job.mutex);
+      g_mutex_unlock (&job.mutex);
+
+      g_cond_clear (&job.cond);
+      g_mutex_clear (&job.mutex);
+    }
 
-      insert->position = real_position;
-      target = piece_tree_node_search (&self->root, insert->position, &insert->position);
+  ret = job.results[0];
+  for (guint i = 1; i < tasks->len; i++)
+    ret = reduce (ret, job.results[i], user_data);
 
-      g_assert (target->any.kind == PIECE_TREE_NODE_LEAF);
-      g_assert (target->any.parent != NULL);
-      g_assert_cmpint (insert->position, <=, piece_tree_node_length (target));
-    }
+  g_free (job.results);
 
-  i = 0;
-  LINKED_ARRAY_FOREACH (&target->leaf.entries, PieceTableEntry, entry, {
-    /*
-     * If this insert request would happen immediately after this entry,
-     * we want to see if we can chain it to this entry or the beginning
-     * of the next entry.
-     *
-     * Note: We coudld also follow the the B+tree style linked-leaf to
-     *       the next leaf and compare against it's first item. But that is
-     *       out of scope for this prototype.
-     */
+  return ret;
+}
 
-      if (insert->position == 0)
-        {
-          if (!piece_table_entry_chain_head (entry, insert))
-            LINKED_ARRAY_INSERT_VAL (&target->leaf.entries, i, to_insert);
-          goto inserted;
-        }
-      else if (insert->position == entry->length)
-        {
-          PieceTableEntry *next = LINKED_ARRAY_FOREACH_PEEK (&target->leaf.entries);
+/**
+ * piece_table_get_entries:
+ * @self: A #PieceTable
+ * @position: (inout): the position to start from
+ * @end: the position to stop at
+ * @entries: (out caller-allocates) (array length=n_entries): the entries
+ * @n_entries: the number of elements in @entries
+ *
+ * Copies the entries covering the range from @position to @end into
+ * @entries, trimming entries that straddle either edge of the range.
+ *
+ * At most @n_entries are copied and @position is advanced past the bytes
+ * that were copied, so a large range can be streamed through a small fixed
+ * size buffer by calling this function until it returns zero.
+ *
+ * Each call performs a single search of the tree and then copies entries
+ * by walking the linked leaves.
+ *
+ * Returns: the number of entries copied into @entries
+ */
+gsize
+piece_table_get_entries (PieceTable      *self,
+                         guint64         *position,
+                         guint64          end,
+                         PieceTableEntry *entries,
+                         gsize            n_entries)
+{
+  g_return_val_if_fail (self != NULL, 0);
 
-          /* Try to chain to the end of this entry or the beginning of the next */
-          if (!piece_table_entry_chain_tail (entry, insert) &&
-              (next == NULL || !piece_table_entry_chain_head (next, insert)))
-            LINKED_ARRAY_INSERT_VAL (&target->leaf.entries, i + 1, to_insert);
-          goto inserted;
-        }
-      else if (insert->position < entry->length)
-        {
-          PieceTableEntry split;
+  piece_table_ensure_counts (self);
 
-          split.kind = entry->kind;
-          split.offset = entry->offset + insert->position;
-          split.length = entry->length - insert->position;
+  return piece_table_read_entries (self, position, end, entries, n_entries);
+}
 
-          entry->length = insert->position;
+typedef struct
+{
+  PieceTable    *table;
+  PieceTreeNode *leaf;
+  guint64        position;
+  guint          slot;
+} PieceTableRealIter;
 
-          LINKED_ARRAY_INSERT_VAL (&target->leaf.entries, i + 1, to_insert);
-          LINKED_ARRAY_INSERT_VAL (&target->leaf.entries, i + 2, split);
+G_STATIC_ASSERT (sizeof (PieceTableRealIter) <= sizeof (PieceTableIter));
 
-          goto inserted;
-        }
+/**
+ * piece_table_iter_init_at_offset:
+ * @iter: (out caller-allocates): A #PieceTableIter
+ * @table: A #PieceTable
+ * @offset: the position within @table
+ *
+ * Initializes @iter to point at the entry containing the byte at @offset.
+ * Locating the entry requires a single search of the tree, after which
+ * piece_table_iter_next() and piece_table_iter_prev() follow the linked
+ * leaves. Visiting k entries from @offset therefore costs O(log n + k).
+ *
+ * Returns: %TRUE if @offset is within @table and @iter points at an entry
+ */
+gboolean
+piece_table_iter_init_at_offset (PieceTableIter *iter,
+                                 PieceTable     *table,
+                                 guint64         offset)
+{
+  PieceTableRealIter *real = (PieceTableRealIter *)iter;
+  PieceTreeNode *leaf;
+  guint64 relative;
 
-      insert->position -= entry->length;
+  g_return_val_if_fail (iter != NULL, FALSE);
+  g_return_val_if_fail (table != NULL, FALSE);
 
-      i++;
-    });
+  piece_table_ensure_counts (table);
 
-  g_assert_not_reached ();
+  real->table = table;
+  real->leaf = NULL;
+  real->position = 0;
+  real->slot = 0;
 
-inserted:
+  if (offset >= table->length)
+    return FALSE;
 
-  /*
-   * Now update each of the parent nodes in the tree so that they have
-   * an apprporiate length along with the child pointer. This allows them
-   * to calculate offsets while walking the tree (without dereferncing the
-   * child node) at the cost of us walking back up the tree.
-   */
-  for (parent = target->any.parent, node = target;
-       parent != NULL;
-       node = parent, parent = node->any.parent)
-    {
-      LINKED_ARRAY_FOREACH (&parent->branch.children, PieceTreeChild, child, {
-        if (child->node == node)
-          {
-            child->length += insert->length;
-            break;
-          }
-      });
-    }
+  leaf = piece_table_get_leaf_at (table, offset, &relative);
 
-  self->length += insert->length;
+#ifdef PIECE_TABLE_SOA
+  {
+    guint i = piece_tree_leaf_find (leaf, &relative);
+
+    g_assert (i < LINKED_ARRAY_LENGTH (&leaf->leaf.entries));
+
+    real->leaf = leaf;
+    real->position = offset - relative;
+    real->slot = leaf->leaf.slots[i];
+
+    return TRUE;
+  }
+#else
+  IQUEUE_FOREACH (&leaf->leaf.entries.q, id, {
+    const PieceTableEntry *entry = &leaf->leaf.entries.items[id];
+
+    if (relative < entry->length)
+      {
+        real->leaf = leaf;
+        real->position = offset - relative;
+        real->slot = id;
+        return TRUE;
+      }
+
+    relative -= entry->length;
+  });
+
+  g_assert_not_reached ();
+
+  return FALSE;
+#endif
 }
 
 /**
- * piece_table_new:
+ * piece_table_iter_next:
+ * @iter: A #PieceTableIter
  *
- * Creates a new #PieceTable.
+ * Moves @iter to the next entry in the table.
  *
- * The PieceTable is backed by an N-ary B+ tree.
+ * Returns: %TRUE if @iter was moved, %FALSE if it was at the last entry.
  */
-PieceTable *
-piece_table_new (void)
+gboolean
+piece_table_iter_next (PieceTableIter *iter)
 {
-  PieceTable *self;
+  PieceTableRealIter *real = (PieceTableRealIter *)iter;
   PieceTreeNode *leaf;
-  PieceTreeChild child;
+  guint next;
 
-  self = g_slice_new0 (PieceTable);
-  self->length = 0;
+  g_return_val_if_fail (iter != NULL, FALSE);
+  g_return_val_if_fail (real->leaf != NULL, FALSE);
 
-  /* The B+Tree has a root node (a branch) and a single leaf
-   * as a child to simplify how we do splits/rotations/etc.
-   */
-  leaf = piece_tree_node_new (PIECE_TREE_NODE_LEAF);
-  leaf->any.parent = &self->root;
+  leaf = real->leaf;
+  next = IQUEUE_NEXT (&leaf->leaf.entries.q, real->slot);
 
-  child.node = leaf;
-  child.length = 0;
+  while (!IQUEUE_IS_VALID (&leaf->leaf.entries.q, next))
+    {
+      leaf = piece_table_get_next_leaf (real->table, leaf,
+                                        real->position + real->leaf->leaf.entries.items[real->slot].length);
+      if (leaf == NULL)
+        return FALSE;
 
-  self->root.any.kind = PIECE_TREE_NODE_BRANCH;
-  LINKED_ARRAY_INIT (&self->root.branch.children);
-  LINKED_ARRAY_PUSH_HEAD (&self->root.branch.children, child);
+      next = IQUEUE_PEEK_HEAD (&leaf->leaf.entries.q);
+    }
 
-  return self;
+  real->position += real->leaf->leaf.entries.items[real->slot].length;
+  real->leaf = leaf;
+  real->slot = next;
+
+  return TRUE;
 }
 
-void
-piece_table_free (PieceTable *self)
+/**
+ * piece_table_iter_prev:
+ * @iter: A #PieceTableIter
+ *
+ * Moves @iter to the previous entry in the table.
+ *
+ * Returns: %TRUE if @iter was moved, %FALSE if it was at the first entry.
+ */
+gboolean
+piece_table_iter_prev (PieceTableIter *iter)
 {
-  if (self != NULL)
-    {
-      g_assert (self->root.any.kind == PIECE_TREE_NODE_BRANCH);
-      g_assert (!LINKED_ARRAY_IS_EMPTY (&self->root.branch.children));
-
-      LINKED_ARRAY_FOREACH (&self->root.branch.children, PieceTreeChild, child, {
-        piece_tree_node_free (child->node);
-      });
+  PieceTableRealIter *real = (PieceTableRealIter *)iter;
+  PieceTreeNode *leaf;
+  guint prev;
 
-      g_slice_free (PieceTable, self);
-    }
-}
+  g_return_val_if_fail (iter != NULL, FALSE);
+  g_return_val_if_fail (real->leaf != NULL, FALSE);
 
-void
-piece_table_insert (PieceTable *self,
-                    guint64     position,
-                    PieceKind   kind,
-                    guint64     offset,
-                    guint64     length)
-{
-  PieceTreeInsert insert;
+  leaf = real->leaf;
+  prev = IQUEUE_PREV (&leaf->leaf.entries.q, real->slot);
 
-  g_return_if_fail (self != NULL);
-  g_return_if_fail (position >= 0);
-  g_return_if_fail (kind == PIECE_INITIAL || kind == PIECE_CHANGE);
-  g_return_if_fail (offset >= 0);
-  g_return_if_fail (length >= 0);
-  g_return_if_fail (length <= (PIECE_TREE_MAX_LENGTH - self->length));
+  while (!IQUEUE_IS_VALID (&leaf->leaf.entries.q, prev))
+    {
+      leaf = piece_table_get_prev_leaf (real->table, leaf, real->position);
+      if (leaf == NULL)
+        return FALSE;
 
-  if (length == 0)
-    return;
+      prev = IQUEUE_PEEK_TAIL (&leaf->leaf.entries.q);
+    }
 
-  insert.kind = kind;
-  insert.offset = offset;
-  insert.length = length;
-  insert.position = position;
+  real->leaf = leaf;
+  real->slot = prev;
+  real->position -= leaf->leaf.entries.items[prev].length;
 
-  piece_table_insert_full (self, &insert);
+  return TRUE;
 }
 
 /**
- * piece_table_foreach:
- * @self: A #PieceTable
- * @func: (scope call) (closure user_data): A callback for each entry
- * @user_data: closure data for @func
+ * piece_table_iter_get_entry:
+ * @iter: A #PieceTableIter
+ * @position: (out) (optional): the absolute position of the entry
  *
- * This function will invoke @func for each entry in the piece table.
- * The first parameter @func will be a #PieceTableEntry and must not
- * be modified.
+ * Gets the entry @iter points at, along with the position of its first
+ * byte within the table.
  *
- * It is a programming error to modify the table from @func.
+ * Returns: (transfer none): A #PieceTableEntry which must not be modified
  */
-void
-piece_table_foreach (PieceTable *self,
-                     GFunc       func,
-                     gpointer    user_data)
+const PieceTableEntry *
+piece_table_iter_get_entry (PieceTableIter *iter,
+                            guint64        *position)
 {
-  PieceTreeNodeLeaf *leaf;
+  PieceTableRealIter *real = (PieceTableRealIter *)iter;
 
-  g_return_if_fail (self != NULL);
-  g_return_if_fail (func != NULL);
+  g_return_val_if_fail (iter != NULL, NULL);
+  g_return_val_if_fail (real->leaf != NULL, NULL);
 
-  for (leaf = piece_table_get_first_leaf (self);
-       leaf != NULL;
-       leaf = leaf->next)
-    {
-      g_assert (leaf->next == NULL || leaf->next->prev == leaf);
+  if (position != NULL)
+    *position = real->position;
 
-      LINKED_ARRAY_FOREACH (&leaf->entries, PieceTableEntry, entry, {
-        func (entry, user_data);
-      });
-    }
+  return &real->leaf->leaf.entries.items[real->slot];
 }
 
 guint64
@@ -793,6 +5342,8 @@ static void
 piece_tree_node_validate (PieceTreeNode *node,
                           PieceTreeNode *parent)
 {
+  PieceTableCounts counts;
+
   g_assert (node != NULL);
   g_assert (node->any.parent == parent);
   g_assert (!parent || parent->any.kind == PIECE_TREE_NODE_BRANCH);
@@ -806,8 +5357,11 @@ piece_tree_node_validate (PieceTreeNode *node,
           goto found;
       });
       g_assert_not_reached ();
+    found:
+      /* Make sure our slot points back at us */
+      g_assert_cmpint (node->any.slot, <, LINKED_ARRAY_LENGTH (&parent->branch.children));
+      g_assert (parent->branch.children.items[node->any.slot].node == node);
     }
-found:
 
   for (PieceTreeNode *iter = node->any.parent;
        iter != NULL;
@@ -819,6 +5373,8 @@ found:
       LINKED_ARRAY_FOREACH (&node->branch.children, PieceTreeChild, child, {
         g_assert (child->node != NULL);
         g_assert_cmpint (child->length, ==, piece_tree_node_length (child->node));
+        piece_tree_node_counts (child->node, &counts);
+        g_assert (piece_table_counts_equal (&child->counts, &counts));
         g_assert (child->node->any.parent == node);
 
         //piece_tree_node_validate (child->node, node);
@@ -830,7 +5386,18 @@ found:
         g_assert (entry->length > 0);
       });
 
-#if 0
+#ifdef PIECE_TABLE_SOA
+      {
+        guint i = 0;
+
+        IQUEUE_FOREACH (&node->leaf.entries.q, id, {
+          g_assert_cmpint (node->leaf.slots[i], ==, id);
+          g_assert_cmpint (node->leaf.lengths[i], ==, node->leaf.entries.items[id].length);
+          i++;
+        });
+      }
+#endif
+
       if (node->leaf.next != NULL)
         {
           g_assert (node->leaf.next->kind == PIECE_TREE_NODE_LEAF);
@@ -842,31 +5409,76 @@ found:
           g_assert (node->leaf.prev->kind == PIECE_TREE_NODE_LEAF);
           g_assert (node->leaf.prev->next == &node->leaf);
         }
-#endif
     }
   else
     g_assert_not_reached ();
 }
+
+static void
+piece_tree_node_validate_recursive (PieceTreeNode *node,
+                                    PieceTreeNode *parent,
+                                    gboolean       live)
+{
+  if (live)
+    piece_tree_node_validate (node, parent);
+  else if (node->any.kind == PIECE_TREE_NODE_BRANCH)
+    {
+      /* Parents and linked-leaves of shared nodes belong to the live table */
+      LINKED_ARRAY_FOREACH (&node->branch.children, PieceTreeChild, child, {
+        PieceTableCounts counts;
+
+        g_assert_cmpint (child->length, ==, piece_tree_node_length (child->node));
+        piece_tree_node_counts (child->node, &counts);
+        g_assert (piece_table_counts_equal (&child->counts, &counts));
+      });
+    }
+
+  /* Only the root, or an only child of the root, may be underfull */
+  if (parent != NULL && LINKED_ARRAY_LENGTH (&parent->branch.children) > 1)
+    g_assert_cmpint (piece_tree_node_n_items (node), >=, piece_tree_node_min_items (node));
+
+  if (node->any.kind == PIECE_TREE_NODE_BRANCH)
+    {
+      LINKED_ARRAY_FOREACH (&node->branch.children, PieceTreeChild, child, {
+        piece_tree_node_validate_recursive (child->node, node, live);
+      });
+    }
+}
 #endif
 
 void
 piece_table_validate (PieceTable *self)
 {
 #ifndef G_DISABLE_ASSERT
-  PieceTreeNodeLeaf *left;
+  PieceTreeNode *left;
+  guint64 position = 0;
   guint64 length = 0;
 
   g_assert (self != NULL);
   g_assert (self->root.any.kind == PIECE_TREE_NODE_BRANCH);
 
-  piece_tree_node_validate (&self->root, NULL);
+  piece_tree_node_validate_recursive (&self->root, NULL, !self->snapshot);
 
   g_assert (!LINKED_ARRAY_IS_EMPTY (&self->root.branch.children));
 
-  left = piece_table_get_first_leaf (self);
-  g_assert (left->prev == NULL);
+  left = (PieceTreeNode *)piece_table_get_first_leaf (self);
 
   length = piece_tree_node_length (&self->root);
   g_assert_cmpint (self->length, ==, length);
+
+  /* Make sure each entry has counted the units it references */
+  if (self->buffer != NULL && !self->counts_pending)
+    {
+      for (; left != NULL; left = piece_table_get_next_leaf (self, left, position))
+        {
+          LINKED_ARRAY_FOREACH (&left->leaf.entries, PieceTableEntry, entry, {
+            PieceTableCounts counts;
+
+            position += entry->length;
+            piece_table_count (self->buffer, entry->kind, entry->offset, entry->length, &counts);
+            g_assert (piece_table_counts_equal (&entry->counts, &counts));
+          });
+        }
+    }
 #endif
 }
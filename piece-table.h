@@ -20,11 +20,32 @@
 #define PIECE_TABLE_H
 
 #include <glib.h>
+#include <sys/uio.h>
 
 G_BEGIN_DECLS
 
-typedef struct _PieceTable      PieceTable;
-typedef struct _PieceTableEntry PieceTableEntry;
+typedef struct _PieceBuffer      PieceBuffer;
+typedef struct _PieceTable       PieceTable;
+typedef struct _PieceTableCounts PieceTableCounts;
+typedef struct _PieceTableEntry  PieceTableEntry;
+typedef struct _PieceTableEdit   PieceTableEdit;
+typedef struct _PieceTableIter   PieceTableIter;
+typedef struct _PieceTableReader PieceTableReader;
+
+/*
+ * Builds which define PIECE_TABLE_COMPACT store the offsets, lengths and
+ * counts of pieces in 32 bits rather than 64. Entries and the children of
+ * branches take about half the space, so twice as many fit in each node,
+ * but a table and each of its buffers are limited to 4 GiB. Code sharing
+ * these structures with the table must be built the same way.
+ */
+#ifdef PIECE_TABLE_COMPACT
+typedef guint32 PieceTableSize;
+# define PIECE_TABLE_MAX_LENGTH G_MAXUINT32
+#else
+typedef guint64 PieceTableSize;
+# define PIECE_TABLE_MAX_LENGTH (G_MAXUINT64 >> 1)
+#endif
 
 typedef enum
 {
@@ -32,32 +53,200 @@ typedef enum
   PIECE_CHANGE  = 1,
 } PieceKind;
 
+/**
+ * PieceTableCounts:
+ * @newlines: the number of '\n' bytes
+ * @code_points: the number of UTF-8 code points, counted by lead bytes
+ * @utf16: the number of UTF-16 code units those code points require
+ *
+ * Counts of the units within a range of bytes, used to convert between
+ * byte offsets, lines, code points and UTF-16 positions.
+ */
+struct _PieceTableCounts
+{
+  PieceTableSize newlines;
+  PieceTableSize code_points;
+  PieceTableSize utf16;
+};
+
 struct _PieceTableEntry
 {
-  PieceKind kind : 1;
-  guint64   offset : 63;
-  guint64   length;
+  PieceKind        kind : 1;
+#ifdef PIECE_TABLE_COMPACT
+  guint32          offset;
+#else
+  guint64          offset : 63;
+#endif
+  PieceTableSize   length;
+  PieceTableCounts counts;
+};
+
+typedef enum
+{
+  PIECE_UNIT_CODE_POINTS = 0,
+  PIECE_UNIT_UTF16       = 1,
+} PieceUnit;
+
+typedef enum
+{
+  PIECE_EDIT_INSERT = 0,
+  PIECE_EDIT_DELETE = 1,
+} PieceEditKind;
+
+struct _PieceTableEdit
+{
+  PieceEditKind edit;
+  PieceKind     kind;
+  guint64       position;
+  guint64       offset;
+  guint64       length;
 };
 
-PieceTable *piece_table_new        (void);
-void        piece_table_free       (PieceTable    *self);
-guint64     piece_table_get_length (PieceTable    *self);
-void        piece_table_insert     (PieceTable    *self,
-                                    guint64        position,
-                                    PieceKind      kind,
-                                    guint64        offset,
-                                    guint64        length);
-void        piece_table_delete     (PieceTable    *self,
-                                    guint64        position,
-                                    guint64        length);
-void        piece_table_copy       (PieceTable    *self,
-                                    guint64        from,
-                                    guint64        to,
-                                    guint64        length);
-void        piece_table_foreach    (PieceTable    *self,
-                                    GFunc          func,
-                                    gpointer       user_data);
-void        piece_table_validate   (PieceTable    *self);
+/**
+ * PieceTableMapFunc:
+ * @table: the #PieceTable being mapped
+ * @position: the absolute position of the range to process
+ * @length: the number of bytes in the range
+ * @user_data: closure data
+ *
+ * Processes a range of @table as part of piece_table_map_reduce(),
+ * possibly on another thread.
+ *
+ * Returns: the result for the range
+ */
+typedef gpointer (*PieceTableMapFunc)    (PieceTable *table,
+                                          guint64     position,
+                                          guint64     length,
+                                          gpointer    user_data);
+
+/**
+ * PieceTableReduceFunc:
+ * @left: the result for a range
+ * @right: the result for the range following @left
+ * @user_data: closure data
+ *
+ * Combines the results of two adjacent ranges.
+ *
+ * Returns: the result for both ranges
+ */
+typedef gpointer (*PieceTableReduceFunc) (gpointer    left,
+                                          gpointer    right,
+                                          gpointer    user_data);
+
+/**
+ * PieceTableIter:
+ *
+ * A stack-allocated iterator over the entries of a #PieceTable. It is
+ * invalidated by any modification to the table.
+ */
+struct _PieceTableIter
+{
+  /*< private >*/
+  gpointer dummy1;
+  gpointer dummy2;
+  guint64  dummy3;
+  guint    dummy4;
+};
+
+PieceTable *piece_table_new              (void);
+PieceTable *piece_table_new_from_entries (const PieceTableEntry *entries,
+                                          gsize                  n_entries,
+                                          gdouble                fill);
+PieceTable *piece_table_new_for_file     (const gchar           *filename,
+                                          GError               **error);
+void        piece_table_free             (PieceTable            *self);
+PieceTable *piece_table_snapshot         (PieceTable            *self);
+void        piece_table_publish          (PieceTable            *self);
+PieceBuffer *piece_table_get_buffer      (PieceTable            *self);
+guint64     piece_table_get_length       (PieceTable            *self);
+void        piece_table_insert           (PieceTable            *self,
+                                          guint64                position,
+                                          PieceKind              kind,
+                                          guint64                offset,
+                                          guint64                length);
+void        piece_table_insert_text      (PieceTable            *self,
+                                          guint64                position,
+                                          const gchar           *text,
+                                          gssize                 length);
+gchar      *piece_table_get_text         (PieceTable            *self,
+                                          guint64                position,
+                                          guint64                length);
+gsize       piece_table_get_iovecs       (PieceTable            *self,
+                                          guint64               *position,
+                                          guint64                end,
+                                          struct iovec          *iov,
+                                          gsize                  n_iov);
+gboolean    piece_table_save             (PieceTable            *self,
+                                          const gchar           *filename,
+                                          GError               **error);
+void        piece_table_delete           (PieceTable            *self,
+                                          guint64                position,
+                                          guint64                length);
+void        piece_table_copy             (PieceTable            *self,
+                                          guint64                from,
+                                          guint64                to,
+                                          guint64                length);
+void        piece_table_apply_edits      (PieceTable            *self,
+                                          const PieceTableEdit  *edits,
+                                          guint                  n_edits);
+gsize       piece_table_get_entries      (PieceTable            *self,
+                                          guint64               *position,
+                                          guint64                end,
+                                          PieceTableEntry       *entries,
+                                          gsize                  n_entries);
+guint64     piece_table_get_n_lines      (PieceTable            *self);
+guint64     piece_table_offset_to_line   (PieceTable            *self,
+                                          guint64                offset);
+guint64     piece_table_line_to_offset   (PieceTable            *self,
+                                          guint64                line);
+void        piece_table_get_counts       (PieceTable            *self,
+                                          guint64                offset,
+                                          PieceTableCounts      *counts);
+guint64     piece_table_units_to_offset  (PieceTable            *self,
+                                          PieceUnit              unit,
+                                          guint64                n_units);
+void        piece_table_set_undo_enabled (PieceTable            *self,
+                                          gboolean               enabled);
+void        piece_table_begin_group      (PieceTable            *self);
+void        piece_table_end_group        (PieceTable            *self);
+gboolean    piece_table_can_undo         (PieceTable            *self);
+gboolean    piece_table_can_redo         (PieceTable            *self);
+gboolean    piece_table_undo             (PieceTable            *self);
+gboolean    piece_table_redo             (PieceTable            *self);
+gsize       piece_table_get_journal_size (PieceTable            *self);
+void        piece_table_foreach          (PieceTable            *self,
+                                          GFunc                  func,
+                                          gpointer               user_data);
+gpointer    piece_table_map_reduce       (PieceTable            *self,
+                                          guint64                position,
+                                          guint64                length,
+                                          PieceTableMapFunc      map,
+                                          PieceTableReduceFunc   reduce,
+                                          gpointer               user_data);
+gboolean    piece_table_find             (PieceTable            *self,
+                                          const gchar           *needle,
+                                          gssize                 needle_len,
+                                          guint64                position,
+                                          guint64               *match);
+gboolean    piece_table_find_backward    (PieceTable            *self,
+                                          const gchar           *needle,
+                                          gssize                 needle_len,
+                                          guint64                position,
+                                          guint64               *match);
+void        piece_table_validate         (PieceTable            *self);
+
+PieceTableReader      *piece_table_reader_new          (PieceTable       *self);
+void                   piece_table_reader_free         (PieceTableReader *reader);
+PieceTable            *piece_table_reader_pin          (PieceTableReader *reader);
+void                   piece_table_reader_unpin        (PieceTableReader *reader);
+
+gboolean               piece_table_iter_init_at_offset (PieceTableIter *iter,
+                                                        PieceTable     *table,
+                                                        guint64         offset);
+gboolean               piece_table_iter_next           (PieceTableIter *iter);
+gboolean               piece_table_iter_prev           (PieceTableIter *iter);
+const PieceTableEntry *piece_table_iter_get_entry      (PieceTableIter *iter,
+                                                        guint64        *position);
 
 G_END_DECLS
 
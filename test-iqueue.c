@@ -84,74 +84,74 @@ test_iqueue_head_tail (void)
 
   IQUEUE_PUSH_HEAD (&node, 10);
   g_assert_cmpint (1, ==, IQUEUE_LENGTH (&node));
-  g_assert_cmpint (node.head, ==, 10);
-  g_assert_cmpint (node.tail, ==, 10);
-  g_assert_cmpint (node.items[10].prev, ==, 0xFF);
-  g_assert_cmpint (node.items[10].next, ==, 0xFF);
+  g_assert_cmpint (IQUEUE_PEEK_HEAD (&node), ==, 10);
+  g_assert_cmpint (IQUEUE_PEEK_TAIL (&node), ==, 10);
+  g_assert_cmpint (IQUEUE_PREV (&node, 10), ==, 0xFF);
+  g_assert_cmpint (IQUEUE_NEXT (&node, 10), ==, 0xFF);
 
   id = IQUEUE_POP_TAIL (&node);
   g_assert_cmpint (0, ==, IQUEUE_LENGTH (&node));
   g_assert_cmpint (id, ==, 10);
-  g_assert_cmpint (node.head, ==, 0xFF);
-  g_assert_cmpint (node.tail, ==, 0xFF);
-  g_assert_cmpint (node.items[10].prev, ==, 0xFF);
-  g_assert_cmpint (node.items[10].next, ==, 0xFF);
+  g_assert_cmpint (IQUEUE_PEEK_HEAD (&node), ==, 0xFF);
+  g_assert_cmpint (IQUEUE_PEEK_TAIL (&node), ==, 0xFF);
+  g_assert_cmpint (IQUEUE_PREV (&node, 10), ==, 0xFF);
+  g_assert_cmpint (IQUEUE_NEXT (&node, 10), ==, 0xFF);
 
 
   IQUEUE_PUSH_HEAD (&node, 10);
   g_assert_cmpint (1, ==, IQUEUE_LENGTH (&node));
-  g_assert_cmpint (node.head, ==, 10);
-  g_assert_cmpint (node.tail, ==, 10);
-  g_assert_cmpint (node.items[10].prev, ==, 0xFF);
-  g_assert_cmpint (node.items[10].next, ==, 0xFF);
+  g_assert_cmpint (IQUEUE_PEEK_HEAD (&node), ==, 10);
+  g_assert_cmpint (IQUEUE_PEEK_TAIL (&node), ==, 10);
+  g_assert_cmpint (IQUEUE_PREV (&node, 10), ==, 0xFF);
+  g_assert_cmpint (IQUEUE_NEXT (&node, 10), ==, 0xFF);
 
   IQUEUE_PUSH_HEAD (&node, 12);
   g_assert_cmpint (2, ==, IQUEUE_LENGTH (&node));
-  g_assert_cmpint (node.head, ==, 12);
-  g_assert_cmpint (node.tail, ==, 10);
-  g_assert_cmpint (node.items[12].prev, ==, 0xFF);
-  g_assert_cmpint (node.items[12].next, ==, 10);
-  g_assert_cmpint (node.items[10].prev, ==, 12);
-  g_assert_cmpint (node.items[10].next, ==, 0xFF);
+  g_assert_cmpint (IQUEUE_PEEK_HEAD (&node), ==, 12);
+  g_assert_cmpint (IQUEUE_PEEK_TAIL (&node), ==, 10);
+  g_assert_cmpint (IQUEUE_PREV (&node, 12), ==, 0xFF);
+  g_assert_cmpint (IQUEUE_NEXT (&node, 12), ==, 10);
+  g_assert_cmpint (IQUEUE_PREV (&node, 10), ==, 12);
+  g_assert_cmpint (IQUEUE_NEXT (&node, 10), ==, 0xFF);
 
   id = IQUEUE_POP_TAIL (&node);
   g_assert_cmpint (1, ==, IQUEUE_LENGTH (&node));
   g_assert_cmpint (id, ==, 10);
-  g_assert_cmpint (node.head, ==, 12);
-  g_assert_cmpint (node.tail, ==, 12);
-  g_assert_cmpint (node.items[12].prev, ==, 0xFF);
-  g_assert_cmpint (node.items[12].next, ==, 0xFF);
-  g_assert_cmpint (node.items[10].prev, ==, 0xFF);
-  g_assert_cmpint (node.items[10].next, ==, 0xFF);
+  g_assert_cmpint (IQUEUE_PEEK_HEAD (&node), ==, 12);
+  g_assert_cmpint (IQUEUE_PEEK_TAIL (&node), ==, 12);
+  g_assert_cmpint (IQUEUE_PREV (&node, 12), ==, 0xFF);
+  g_assert_cmpint (IQUEUE_NEXT (&node, 12), ==, 0xFF);
+  g_assert_cmpint (IQUEUE_PREV (&node, 10), ==, 0xFF);
+  g_assert_cmpint (IQUEUE_NEXT (&node, 10), ==, 0xFF);
 
   IQUEUE_PUSH_TAIL (&node, 10);
   g_assert_cmpint (2, ==, IQUEUE_LENGTH (&node));
-  g_assert_cmpint (node.head, ==, 12);
-  g_assert_cmpint (node.tail, ==, 10);
-  g_assert_cmpint (node.items[12].prev, ==, 0xFF);
-  g_assert_cmpint (node.items[12].next, ==, 10);
-  g_assert_cmpint (node.items[10].prev, ==, 12);
-  g_assert_cmpint (node.items[10].next, ==, 0xFF);
+  g_assert_cmpint (IQUEUE_PEEK_HEAD (&node), ==, 12);
+  g_assert_cmpint (IQUEUE_PEEK_TAIL (&node), ==, 10);
+  g_assert_cmpint (IQUEUE_PREV (&node, 12), ==, 0xFF);
+  g_assert_cmpint (IQUEUE_NEXT (&node, 12), ==, 10);
+  g_assert_cmpint (IQUEUE_PREV (&node, 10), ==, 12);
+  g_assert_cmpint (IQUEUE_NEXT (&node, 10), ==, 0xFF);
 
   id = IQUEUE_POP_HEAD (&node);
   g_assert_cmpint (1, ==, IQUEUE_LENGTH (&node));
   g_assert_cmpint (id, ==, 12);
-  g_assert_cmpint (node.head, ==, 10);
-  g_assert_cmpint (node.tail, ==, 10);
-  g_assert_cmpint (node.items[12].prev, ==, 0xFF);
-  g_assert_cmpint (node.items[12].next, ==, 0xFF);
-  g_assert_cmpint (node.items[10].prev, ==, 0xFF);
-  g_assert_cmpint (node.items[10].next, ==, 0xFF);
+  g_assert_cmpint (IQUEUE_PEEK_HEAD (&node), ==, 10);
+  g_assert_cmpint (IQUEUE_PEEK_TAIL (&node), ==, 10);
+  g_assert_cmpint (IQUEUE_PREV (&node, 12), ==, 0xFF);
+  g_assert_cmpint (IQUEUE_NEXT (&node, 12), ==, 0xFF);
+  g_assert_cmpint (IQUEUE_PREV (&node, 10), ==, 0xFF);
+  g_assert_cmpint (IQUEUE_NEXT (&node, 10), ==, 0xFF);
 
   id = IQUEUE_POP_HEAD (&node);
   g_assert_cmpint (0, ==, IQUEUE_LENGTH (&node));
   g_assert_cmpint (id, ==, 10);
-  g_assert_cmpint (node.head, ==, 0xFF);
-  g_assert_cmpint (node.tail, ==, 0xFF);
-  g_assert_cmpint (node.items[12].prev, ==, 0xFF);
-  g_assert_cmpint (node.items[12].next, ==, 0xFF);
-  g_assert_cmpint (node.items[10].prev, ==, 0xFF);
-  g_assert_cmpint (node.items[10].next, ==, 0xFF);
+  g_assert_cmpint (IQUEUE_PEEK_HEAD (&node), ==, 0xFF);
+  g_assert_cmpint (IQUEUE_PEEK_TAIL (&node), ==, 0xFF);
+  g_assert_cmpint (IQUEUE_PREV (&node, 12), ==, 0xFF);
+  g_assert_cmpint (IQUEUE_NEXT (&node, 12), ==, 0xFF);
+  g_assert_cmpint (IQUEUE_PREV (&node, 10), ==, 0xFF);
+  g_assert_cmpint (IQUEUE_NEXT (&node, 10), ==, 0xFF);
 
   id = IQUEUE_POP_HEAD (&node);
   g_assert_cmpint (0, ==, IQUEUE_LENGTH (&node));
@@ -256,6 +256,42 @@ test_iqueue_insert (void)
   g_assert_cmpint (7, ==, IQUEUE_LENGTH (&node));
 }
 
+static void
+test_iqueue_insert_after (void)
+{
+  IQUEUE_NODE (guint8, 32) node;
+
+  IQUEUE_INIT (&node);
+
+  IQUEUE_PUSH_HEAD (&node, 3);
+  IQUEUE_INSERT_AFTER (&node, 3, 5);
+
+  g_assert_cmpint (3, ==, IQUEUE_NTH (&node, 0));
+  g_assert_cmpint (5, ==, IQUEUE_NTH (&node, 1));
+  g_assert_cmpint (5, ==, IQUEUE_PEEK_TAIL (&node));
+  g_assert_cmpint (2, ==, IQUEUE_LENGTH (&node));
+
+  IQUEUE_INSERT_AFTER (&node, 3, 4);
+
+  g_assert_cmpint (3, ==, IQUEUE_NTH (&node, 0));
+  g_assert_cmpint (4, ==, IQUEUE_NTH (&node, 1));
+  g_assert_cmpint (5, ==, IQUEUE_NTH (&node, 2));
+  g_assert_cmpint (3, ==, IQUEUE_PEEK_HEAD (&node));
+  g_assert_cmpint (5, ==, IQUEUE_PEEK_TAIL (&node));
+  g_assert_cmpint (3, ==, IQUEUE_LENGTH (&node));
+
+  IQUEUE_INSERT_AFTER (&node, 5, 1);
+
+  g_assert_cmpint (3, ==, IQUEUE_NTH (&node, 0));
+  g_assert_cmpint (4, ==, IQUEUE_NTH (&node, 1));
+  g_assert_cmpint (5, ==, IQUEUE_NTH (&node, 2));
+  g_assert_cmpint (1, ==, IQUEUE_NTH (&node, 3));
+  g_assert_cmpint (1, ==, IQUEUE_PEEK_TAIL (&node));
+  g_assert_cmpint (4, ==, IQUEUE_LENGTH (&node));
+  g_assert_cmpint (IQUEUE_PREV (&node, 1), ==, 5);
+  g_assert_cmpint (IQUEUE_NEXT (&node, 1), ==, 0xFF);
+}
+
 static void
 test_iqueue_move (void)
 {
@@ -275,13 +311,13 @@ test_iqueue_move (void)
   g_assert_cmpint (4, ==, IQUEUE_NTH (&node, 3));
   g_assert_cmpint (5, ==, IQUEUE_NTH (&node, 4));
 
-  g_assert_cmpint (node.head, ==, 1);
-  g_assert_cmpint (node.items[1].prev, ==, 0xFF);
-  g_assert_cmpint (node.items[1].next, ==, 2);
-  g_assert_cmpint (node.items[2].prev, ==, 1);
-  g_assert_cmpint (node.items[2].next, ==, 3);
-  g_assert_cmpint (node.items[3].next, ==, 4);
-  g_assert_cmpint (node.items[4].next, ==, 5);
+  g_assert_cmpint (IQUEUE_PEEK_HEAD (&node), ==, 1);
+  g_assert_cmpint (IQUEUE_PREV (&node, 1), ==, 0xFF);
+  g_assert_cmpint (IQUEUE_NEXT (&node, 1), ==, 2);
+  g_assert_cmpint (IQUEUE_PREV (&node, 2), ==, 1);
+  g_assert_cmpint (IQUEUE_NEXT (&node, 2), ==, 3);
+  g_assert_cmpint (IQUEUE_NEXT (&node, 3), ==, 4);
+  g_assert_cmpint (IQUEUE_NEXT (&node, 4), ==, 5);
 
   /* this is testing internal move helpers, this does
    * not use public virtual positions, but raw bucket
@@ -290,12 +326,12 @@ test_iqueue_move (void)
 
   _IQUEUE_MOVE (&node, 1, 31);
 
-  g_assert_cmpint (node.head, ==, 31);
-  g_assert_cmpint (node.items[2].prev, ==, 31);
-  g_assert_cmpint (node.items[2].next, ==, 3);
-  g_assert_cmpint (node.items[3].prev, ==, 2);
-  g_assert_cmpint (node.items[3].next, ==, 4);
-  g_assert_cmpint (node.items[4].next, ==, 5);
+  g_assert_cmpint (IQUEUE_PEEK_HEAD (&node), ==, 31);
+  g_assert_cmpint (IQUEUE_PREV (&node, 2), ==, 31);
+  g_assert_cmpint (IQUEUE_NEXT (&node, 2), ==, 3);
+  g_assert_cmpint (IQUEUE_PREV (&node, 3), ==, 2);
+  g_assert_cmpint (IQUEUE_NEXT (&node, 3), ==, 4);
+  g_assert_cmpint (IQUEUE_NEXT (&node, 4), ==, 5);
 }
 
 static void
@@ -374,6 +410,7 @@ main (gint argc,
   g_test_add_func ("/IQueue/head_tail", test_iqueue_head_tail);
   g_test_add_func ("/IQueue/foreach", test_iqueue_foreach);
   g_test_add_func ("/IQueue/insert", test_iqueue_insert);
+  g_test_add_func ("/IQueue/insert_after", test_iqueue_insert_after);
   g_test_add_func ("/IQueue/move", test_iqueue_move);
   g_test_add_func ("/IQueue/pop_nth", test_iqueue_pop_nth);
   g_test_add_func ("/IQueue/full_foreach", test_iqueue_full_foreach);
@@ -41,11 +41,83 @@ test_basic (void)
   });
 }
 
+typedef LINKED_ARRAY_FIELD(Count, 32) CountArray;
+
+/* Fills @array with 0 to @length - 1 in logical order, with the slots
+ * shuffled by removing and reinserting random elements.
+ */
+static void
+fill_shuffled (CountArray *array,
+               gint        length)
+{
+  LINKED_ARRAY_INIT (array);
+
+  for (gint i = 0; i < length; i++)
+    {
+      Count count = { -i, i };
+      LINKED_ARRAY_PUSH_TAIL (array, count);
+    }
+
+  for (gint i = 0; i < length; i++)
+    {
+      guint n = g_random_int_range (0, length);
+      Count count = LINKED_ARRAY_REMOVE_INDEX (array, n);
+      LINKED_ARRAY_INSERT_VAL (array, n, count);
+    }
+}
+
+static void
+test_split (void)
+{
+  for (gint length = 1; length <= 32; length++)
+    {
+      CountArray linked_array;
+      CountArray left;
+      CountArray right;
+      gint expected = 0;
+
+      fill_shuffled (&linked_array, length);
+      LINKED_ARRAY_SPLIT (&linked_array, &right);
+
+      g_assert_cmpint (LINKED_ARRAY_LENGTH (&linked_array), ==, length - length / 2);
+      g_assert_cmpint (LINKED_ARRAY_LENGTH (&right), ==, length / 2);
+      LINKED_ARRAY_FOREACH (&linked_array, Count, count, {
+        g_assert_cmpint (count->positive, ==, expected++);
+      });
+      LINKED_ARRAY_FOREACH (&right, Count, count, {
+        g_assert_cmpint (count->positive, ==, expected++);
+      });
+      g_assert_cmpint (expected, ==, length);
+
+      /* Both must remain usable afterwards */
+      for (gint i = 0; i < length / 2; i++)
+        g_assert_cmpint (LINKED_ARRAY_POP_TAIL (&linked_array).positive, ==, length - length / 2 - 1 - i);
+      if (length > 1)
+        g_assert_cmpint (LINKED_ARRAY_POP_HEAD (&right).positive, ==, length - length / 2);
+
+      fill_shuffled (&linked_array, length);
+      LINKED_ARRAY_SPLIT2 (&linked_array, &left, &right);
+
+      expected = 0;
+      g_assert (LINKED_ARRAY_IS_EMPTY (&linked_array));
+      g_assert_cmpint (LINKED_ARRAY_LENGTH (&left), ==, length - length / 2);
+      g_assert_cmpint (LINKED_ARRAY_LENGTH (&right), ==, length / 2);
+      LINKED_ARRAY_FOREACH (&left, Count, count, {
+        g_assert_cmpint (count->positive, ==, expected++);
+      });
+      LINKED_ARRAY_FOREACH (&right, Count, count, {
+        g_assert_cmpint (count->positive, ==, expected++);
+      });
+      g_assert_cmpint (expected, ==, length);
+    }
+}
+
 gint
 main (gint argc,
       gchar *argv[])
 {
   g_test_init (&argc, &argv, NULL);
   g_test_add_func ("/LinkedArray/basic", test_basic);
+  g_test_add_func ("/LinkedArray/split", test_split);
   return g_test_run ();
 }
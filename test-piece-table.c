@@ -1,4 +1,6 @@
+#include <glib/gstdio.h>
 #include <string.h>
+#include <sys/stat.h>
 
 #include "piece-table.h"
 
@@ -235,6 +237,1984 @@ test_root_split (void)
   piece_table_free (table);
 }
 
+static void
+expand_entry (gpointer data,
+              gpointer user_data)
+{
+  const PieceTableEntry *entry = data;
+  GArray *ar = user_data;
+
+  for (guint64 i = 0; i < entry->length; i++)
+    {
+      guint64 id = ((guint64)entry->kind << 63) | (entry->offset + i);
+      g_array_append_val (ar, id);
+    }
+}
+
+static void
+compare_expanded (PieceTable *table,
+                  GArray     *model)
+{
+  g_autoptr(GArray) ar = g_array_new (FALSE, FALSE, sizeof (guint64));
+
+  piece_table_foreach (table, expand_entry, ar);
+
+  g_assert_cmpint (piece_table_get_length (table), ==, model->len);
+  g_assert_cmpint (ar->len, ==, model->len);
+  g_assert_cmpmem (ar->data, ar->len * sizeof (guint64), model->data, model->len * sizeof (guint64));
+}
+
+static void
+model_insert (GArray    *model,
+              guint64    position,
+              PieceKind  kind,
+              guint64    offset,
+              guint64    length)
+{
+  for (guint64 i = 0; i < length; i++)
+    {
+      guint64 id = ((guint64)kind << 63) | (offset + i);
+      g_array_insert_vals (model, position + i, &id, 1);
+    }
+}
+
+static void
+test_delete (void)
+{
+  PieceTable *table;
+
+  table = piece_table_new ();
+
+  piece_table_insert (table, 0, PIECE_INITIAL, 0, 1024);
+  piece_table_insert (table, 512, PIECE_CHANGE, 0, 100);
+  piece_table_insert (table, 0, PIECE_CHANGE, 200, 10);
+
+  /* Remove from within a single entry */
+  piece_table_delete (table, 20, 10);
+  g_assert_cmpint (1124, ==, piece_table_get_length (table));
+
+  {
+    static const PieceTableEntry entries[] = {
+      { PIECE_CHANGE, 200, 10 },
+      { PIECE_INITIAL, 0, 10 },
+      { PIECE_INITIAL, 20, 492 },
+      { PIECE_CHANGE, 0, 100 },
+      { PIECE_INITIAL, 512, 512 },
+    };
+    compare_entries (table, entries, G_N_ELEMENTS (entries));
+  }
+
+  /* Remove across entries, trimming both edges */
+  piece_table_delete (table, 500, 200);
+  g_assert_cmpint (924, ==, piece_table_get_length (table));
+
+  {
+    static const PieceTableEntry entries[] = {
+      { PIECE_CHANGE, 200, 10 },
+      { PIECE_INITIAL, 0, 10 },
+      { PIECE_INITIAL, 20, 480 },
+      { PIECE_INITIAL, 600, 424 },
+    };
+    compare_entries (table, entries, G_N_ELEMENTS (entries));
+  }
+
+  /* Remove whole entries at the head and tail */
+  piece_table_delete (table, 0, 20);
+  piece_table_delete (table, 480, 424);
+  g_assert_cmpint (480, ==, piece_table_get_length (table));
+
+  {
+    static const PieceTableEntry entries[] = {
+      { PIECE_INITIAL, 20, 480 },
+    };
+    compare_entries (table, entries, G_N_ELEMENTS (entries));
+  }
+
+  piece_table_delete (table, 0, 480);
+  g_assert_cmpint (0, ==, piece_table_get_length (table));
+  compare_entries (table, NULL, 0);
+
+  piece_table_insert (table, 0, PIECE_CHANGE, 1, 1);
+  g_assert_cmpint (1, ==, piece_table_get_length (table));
+
+  piece_table_validate (table);
+  piece_table_free (table);
+}
+
+static void
+test_delete_all (void)
+{
+  PieceTable *table = piece_table_new ();
+
+  /* Use discontiguous pieces so that nothing is chained */
+  for (guint i = 0; i < 10000; i++)
+    piece_table_insert (table, i * 2, PIECE_CHANGE, i * 3, 2);
+
+  /* Remove in chunks that don't align with the pieces */
+  while (piece_table_get_length (table) > 0)
+    {
+      piece_table_delete (table, 0, MIN (777, piece_table_get_length (table)));
+      piece_table_validate (table);
+    }
+
+  compare_entries (table, NULL, 0);
+
+  for (guint i = 0; i < 10000; i++)
+    piece_table_insert (table, 0, PIECE_CHANGE, i * 3, 1);
+
+  piece_table_delete (table, 1, piece_table_get_length (table) - 2);
+  piece_table_validate (table);
+
+  {
+    static const PieceTableEntry entries[] = {
+      { PIECE_CHANGE, 29997, 1 },
+      { PIECE_CHANGE, 0, 1 },
+    };
+    compare_entries (table, entries, G_N_ELEMENTS (entries));
+  }
+
+  piece_table_free (table);
+}
+
+static void
+test_delete_random (void)
+{
+  PieceTable *table = piece_table_new ();
+  g_autoptr(GArray) model = g_array_new (FALSE, FALSE, sizeof (guint64));
+  GRand *rand = g_rand_new_with_seed (1234);
+
+  for (guint i = 0; i < 20000; i++)
+    {
+      guint64 length = piece_table_get_length (table);
+
+      if (length > 0 && g_rand_int_range (rand, 0, 100) < 45)
+        {
+          guint64 position = g_rand_int_range (rand, 0, length);
+          guint64 to_delete = g_rand_int_range (rand, 1, MIN (length - position, 200) + 1);
+
+          piece_table_delete (table, position, to_delete);
+          g_array_remove_range (model, position, to_delete);
+        }
+      else
+        {
+          guint64 position = g_rand_int_range (rand, 0, length + 1);
+          PieceKind kind = g_rand_int_range (rand, 0, 2);
+          guint64 offset = g_rand_int_range (rand, 0, 1000) * 32;
+          guint64 to_insert = g_rand_int_range (rand, 1, 32);
+
+          piece_table_insert (table, position, kind, offset, to_insert);
+          model_insert (model, position, kind, offset, to_insert);
+        }
+
+      if (i % 500 == 0)
+        {
+          piece_table_validate (table);
+          compare_expanded (table, model);
+        }
+    }
+
+  piece_table_validate (table);
+  compare_expanded (table, model);
+
+  g_rand_free (rand);
+  piece_table_free (table);
+}
+
+static void
+test_delete_large (void)
+{
+  PieceTable *table = piece_table_new ();
+  g_autoptr(GArray) model = g_array_new (FALSE, FALSE, sizeof (guint64));
+  GRand *rand = g_rand_new_with_seed (4321);
+
+  for (guint round = 0; round < 50; round++)
+    {
+      /* Grow the table with discontiguous pieces so that large ranges
+       * cover whole subtrees.
+       */
+      for (guint i = 0; i < 2000; i++)
+        {
+          guint64 position = g_rand_int_range (rand, 0, piece_table_get_length (table) + 1);
+          guint64 offset = (round * 2000 + i) * 8;
+          guint64 to_insert = g_rand_int_range (rand, 1, 5);
+
+          piece_table_insert (table, position, PIECE_INITIAL, offset, to_insert);
+          model_insert (model, position, PIECE_INITIAL, offset, to_insert);
+        }
+
+      for (guint i = 0; i < 3; i++)
+        {
+          guint64 length = piece_table_get_length (table);
+          guint64 position = g_rand_int_range (rand, 0, length);
+          guint64 to_delete = g_rand_int_range (rand, 1, (length - position) / 2 + 2);
+
+          piece_table_delete (table, position, to_delete);
+          g_array_remove_range (model, position, to_delete);
+
+          piece_table_validate (table);
+          compare_expanded (table, model);
+        }
+    }
+
+  /* Remove everything but the edges */
+  piece_table_delete (table, 1, piece_table_get_length (table) - 2);
+  g_array_remove_range (model, 1, model->len - 2);
+  piece_table_validate (table);
+  compare_expanded (table, model);
+
+  piece_table_delete (table, 0, piece_table_get_length (table));
+  g_array_set_size (model, 0);
+  piece_table_validate (table);
+  compare_expanded (table, model);
+
+  g_rand_free (rand);
+  piece_table_free (table);
+}
+
+static void
+test_copy (void)
+{
+  PieceTable *table = piece_table_new ();
+
+  piece_table_insert (table, 0, PIECE_INITIAL, 0, 100);
+  piece_table_insert (table, 50, PIECE_CHANGE, 0, 10);
+
+  /* Copy across entries into the middle of another entry */
+  piece_table_copy (table, 45, 20, 10);
+  g_assert_cmpint (120, ==, piece_table_get_length (table));
+
+  {
+    static const PieceTableEntry entries[] = {
+      { PIECE_INITIAL, 0, 20 },
+      { PIECE_INITIAL, 45, 5 },
+      { PIECE_CHANGE, 0, 5 },
+      { PIECE_INITIAL, 20, 30 },
+      { PIECE_CHANGE, 0, 10 },
+      { PIECE_INITIAL, 50, 50 },
+    };
+    compare_entries (table, entries, G_N_ELEMENTS (entries));
+  }
+
+  /* Copy to the end of the table */
+  piece_table_copy (table, 0, 120, 20);
+  g_assert_cmpint (140, ==, piece_table_get_length (table));
+
+  {
+    static const PieceTableEntry entries[] = {
+      { PIECE_INITIAL, 0, 20 },
+      { PIECE_INITIAL, 45, 5 },
+      { PIECE_CHANGE, 0, 5 },
+      { PIECE_INITIAL, 20, 30 },
+      { PIECE_CHANGE, 0, 10 },
+      { PIECE_INITIAL, 50, 50 },
+      { PIECE_INITIAL, 0, 20 },
+    };
+    compare_entries (table, entries, G_N_ELEMENTS (entries));
+  }
+
+  piece_table_validate (table);
+  piece_table_free (table);
+}
+
+static void
+test_copy_random (void)
+{
+  PieceTable *table = piece_table_new ();
+  g_autoptr(GArray) model = g_array_new (FALSE, FALSE, sizeof (guint64));
+  GRand *rand = g_rand_new_with_seed (5678);
+
+  for (guint i = 0; i < 1000; i++)
+    {
+      guint64 offset = i * 8;
+
+      piece_table_insert (table, i * 2, PIECE_CHANGE, offset, 2);
+      model_insert (model, i * 2, PIECE_CHANGE, offset, 2);
+    }
+
+  for (guint i = 0; i < 200; i++)
+    {
+      guint64 length = piece_table_get_length (table);
+      guint64 from = g_rand_int_range (rand, 0, length);
+      guint64 to = g_rand_int_range (rand, 0, length + 1);
+      guint64 to_copy = g_rand_int_range (rand, 1, MIN (length - from, 5000) + 1);
+      g_autoptr(GArray) copy = g_array_new (FALSE, FALSE, sizeof (guint64));
+
+      piece_table_copy (table, from, to, to_copy);
+
+      g_array_append_vals (copy, &g_array_index (model, guint64, from), to_copy);
+      g_array_insert_vals (model, to, copy->data, copy->len);
+
+      /* Keep the table from growing too large */
+      if (piece_table_get_length (table) > 50000)
+        {
+          piece_table_delete (table, 0, 25000);
+          g_array_remove_range (model, 0, 25000);
+        }
+
+      if (i % 10 == 0)
+        {
+          piece_table_validate (table);
+          compare_expanded (table, model);
+        }
+    }
+
+  piece_table_validate (table);
+  compare_expanded (table, model);
+
+  g_rand_free (rand);
+  piece_table_free (table);
+}
+
+/*
+ * Copies pieces into the gap between the two entries they were cut from,
+ * so that splicing them chains three entries into one and leaves the leaf
+ * with one entry fewer than it had. Deleting entries between copies keeps
+ * some leaves at their minimum, which must not then be left below it.
+ */
+static void
+test_copy_chain (void)
+{
+  PieceTable *table = piece_table_new ();
+  PieceTableEntry entries[1024];
+  GRand *rand = g_rand_new_with_seed (2468);
+  guint n_front = 500;
+
+  /* The front entries are followed by the gaps between them */
+  for (guint i = 0; i < n_front; i++)
+    piece_table_insert (table, i * 10, PIECE_INITIAL, i * 20, 10);
+  for (guint i = 0; i < n_front; i++)
+    piece_table_insert (table, (n_front + i) * 10, PIECE_INITIAL, i * 20 + 10, 10);
+
+  /* Each edit leaves at most one entry fewer in the front */
+  for (guint i = 0; i < n_front - 10; i++)
+    {
+      guint64 position = 0;
+      guint64 before = 0;
+      gsize n;
+      gsize j;
+
+      n = piece_table_get_entries (table, &position, piece_table_get_length (table),
+                                   entries, G_N_ELEMENTS (entries));
+      g_assert_cmpint (n, <, G_N_ELEMENTS (entries));
+      g_assert_cmpint (n, >, n_front + 1);
+
+      /* Only the front is edited, so that every gap can still be copied */
+      j = g_rand_int_range (rand, 0, n - n_front - 1);
+      for (gsize k = 0; k < j; k++)
+        before += entries[k].length;
+
+      if (g_rand_boolean (rand))
+        {
+          piece_table_delete (table, before, entries[j].length);
+        }
+      else if (entries[j].offset + entries[j].length + 10 == entries[j + 1].offset)
+        {
+          guint64 gap = entries[j].offset + entries[j].length;
+          guint64 from = piece_table_get_length (table) - n_front * 10 + (gap - 10) / 2;
+
+          piece_table_copy (table, from, before + entries[j].length, 10);
+        }
+
+      piece_table_validate (table);
+    }
+
+  g_rand_free (rand);
+  piece_table_free (table);
+}
+
+static void
+test_typing (void)
+{
+  PieceTable *table = piece_table_new ();
+  g_autoptr(GArray) model = g_array_new (FALSE, FALSE, sizeof (guint64));
+  GRand *rand = g_rand_new_with_seed (2468);
+  guint64 cursor = 0;
+  guint64 offset = 0;
+
+  /* Simulate a user typing with occasional backspaces and cursor jumps,
+   * which exercises the finger used to skip searching the tree.
+   */
+  for (guint i = 0; i < 50000; i++)
+    {
+      guint64 length = piece_table_get_length (table);
+      guint action = g_rand_int_range (rand, 0, 100);
+
+      if (action < 2)
+        {
+          cursor = g_rand_int_range (rand, 0, length + 1);
+        }
+      else if (action < 15 && cursor > 0)
+        {
+          guint64 to_delete = MIN (cursor, (guint64)g_rand_int_range (rand, 1, 4));
+
+          cursor -= to_delete;
+          piece_table_delete (table, cursor, to_delete);
+          g_array_remove_range (model, cursor, to_delete);
+        }
+      else
+        {
+          piece_table_insert (table, cursor, PIECE_CHANGE, offset, 1);
+          model_insert (model, cursor, PIECE_CHANGE, offset, 1);
+          cursor++;
+          offset++;
+        }
+
+      if (i % 1000 == 0)
+        {
+          piece_table_validate (table);
+          compare_expanded (table, model);
+        }
+    }
+
+  piece_table_validate (table);
+  compare_expanded (table, model);
+
+  g_rand_free (rand);
+  piece_table_free (table);
+}
+
+static void
+test_new_from_entries (void)
+{
+  static const gdouble fills[] = { 0.0, 0.1, 0.5, 0.75, 1.0 };
+  static const guint sizes[] = { 0, 1, 7, 23, 24, 500, 20000 };
+  GRand *rand = g_rand_new_with_seed (1357);
+
+  for (guint f = 0; f < G_N_ELEMENTS (fills); f++)
+    {
+      for (guint n = 0; n < G_N_ELEMENTS (sizes); n++)
+        {
+          g_autoptr(GArray) entries = g_array_new (FALSE, FALSE, sizeof (PieceTableEntry));
+          g_autoptr(GArray) model = g_array_new (FALSE, FALSE, sizeof (guint64));
+          PieceTable *table;
+
+          for (guint i = 0; i < sizes[n]; i++)
+            {
+              PieceTableEntry entry;
+
+              entry.kind = g_rand_int_range (rand, 0, 2);
+              entry.offset = i * 64;
+              entry.length = g_rand_int_range (rand, 0, 8);
+
+              g_array_append_val (entries, entry);
+              model_insert (model, model->len, entry.kind, entry.offset, entry.length);
+            }
+
+          table = piece_table_new_from_entries ((const PieceTableEntry *)(gpointer)entries->data,
+                                                entries->len,
+                                                fills[f]);
+          piece_table_validate (table);
+          compare_expanded (table, model);
+
+          /* Make sure the tree remains usable after loading */
+          for (guint i = 0; i < 1000; i++)
+            {
+              guint64 length = piece_table_get_length (table);
+
+              if (length > 0 && g_rand_boolean (rand))
+                {
+                  guint64 position = g_rand_int_range (rand, 0, length);
+                  guint64 to_delete = g_rand_int_range (rand, 1, MIN (length - position, 50) + 1);
+
+                  piece_table_delete (table, position, to_delete);
+                  g_array_remove_range (model, position, to_delete);
+                }
+              else
+                {
+                  guint64 position = g_rand_int_range (rand, 0, length + 1);
+                  guint64 offset = g_rand_int_range (rand, 0, 1000) * 32;
+                  guint64 to_insert = g_rand_int_range (rand, 1, 32);
+
+                  piece_table_insert (table, position, PIECE_CHANGE, offset, to_insert);
+                  model_insert (model, position, PIECE_CHANGE, offset, to_insert);
+                }
+            }
+
+          piece_table_validate (table);
+          compare_expanded (table, model);
+
+          piece_table_free (table);
+        }
+    }
+
+  g_rand_free (rand);
+}
+
+static void
+test_apply_edits (void)
+{
+  PieceTable *table = piece_table_new ();
+  g_autoptr(GArray) model = g_array_new (FALSE, FALSE, sizeof (guint64));
+  GRand *rand = g_rand_new_with_seed (9753);
+
+  for (guint i = 0; i < 5000; i++)
+    {
+      guint64 position = g_rand_int_range (rand, 0, piece_table_get_length (table) + 1);
+      guint64 offset = i * 64;
+      guint64 to_insert = g_rand_int_range (rand, 1, 32);
+
+      piece_table_insert (table, position, PIECE_INITIAL, offset, to_insert);
+      model_insert (model, position, PIECE_INITIAL, offset, to_insert);
+    }
+
+  for (guint round = 0; round < 100; round++)
+    {
+      g_autoptr(GArray) edits = g_array_new (FALSE, FALSE, sizeof (PieceTableEdit));
+      guint64 length = piece_table_get_length (table);
+      guint64 position = 0;
+      gint64 shift = 0;
+
+      /* Sparse batches jump around the tree, dense ones stay in a few leaves */
+      guint gap = round % 2 ? 2000 : 20;
+
+      for (;;)
+        {
+          PieceTableEdit edit;
+
+          position += g_rand_int_range (rand, 0, gap);
+
+          if (position > length)
+            break;
+
+          edit.position = position;
+
+          if (position < length && g_rand_boolean (rand))
+            {
+              edit.edit = PIECE_EDIT_DELETE;
+              edit.kind = PIECE_INITIAL;
+              edit.offset = 0;
+
+              /* Sometimes delete across several leaves */
+              if (g_rand_int_range (rand, 0, 20) == 0)
+                edit.length = g_rand_int_range (rand, 1, MIN (length - position, 2000) + 1);
+              else
+                edit.length = g_rand_int_range (rand, 1, MIN (length - position, 10) + 1);
+
+              position += edit.length;
+            }
+          else
+            {
+              edit.edit = PIECE_EDIT_INSERT;
+              edit.kind = PIECE_CHANGE;
+              edit.offset = g_rand_int_range (rand, 0, 1000) * 32;
+              edit.length = g_rand_int_range (rand, 1, 8);
+            }
+
+          g_array_append_val (edits, edit);
+        }
+
+      piece_table_apply_edits (table, (const PieceTableEdit *)(gpointer)edits->data, edits->len);
+
+      for (guint i = 0; i < edits->len; i++)
+        {
+          const PieceTableEdit *edit = &g_array_index (edits, PieceTableEdit, i);
+
+          if (edit->edit == PIECE_EDIT_DELETE)
+            {
+              g_array_remove_range (model, edit->position + shift, edit->length);
+              shift -= edit->length;
+            }
+          else
+            {
+              model_insert (model, edit->position + shift, edit->kind, edit->offset, edit->length);
+              shift += edit->length;
+            }
+        }
+
+      piece_table_validate (table);
+      compare_expanded (table, model);
+    }
+
+  /* Batches out of order are refused without applying any of them */
+  {
+    static const PieceTableEdit unsorted[] = {
+      { PIECE_EDIT_INSERT, PIECE_CHANGE, 10, 100, 3 },
+      { PIECE_EDIT_INSERT, PIECE_CHANGE, 5, 200, 1 },
+      { PIECE_EDIT_DELETE, PIECE_INITIAL, 2, 0, 2 },
+    };
+
+    g_test_expect_message (NULL, G_LOG_LEVEL_CRITICAL, "*prev_position*");
+    piece_table_apply_edits (table, unsorted, G_N_ELEMENTS (unsorted));
+    g_test_assert_expected_messages ();
+
+    piece_table_validate (table);
+    compare_expanded (table, model);
+  }
+
+  g_rand_free (rand);
+  piece_table_free (table);
+}
+
+static void
+test_iter (void)
+{
+  PieceTable *table = piece_table_new ();
+  g_autoptr(GArray) entries = g_array_new (FALSE, FALSE, sizeof (PieceTableEntry));
+  g_autoptr(GArray) positions = g_array_new (FALSE, FALSE, sizeof (guint64));
+  GRand *rand = g_rand_new_with_seed (8642);
+  PieceTableIter iter;
+  guint64 position = 0;
+  gboolean r;
+
+  r = piece_table_iter_init_at_offset (&iter, table, 0);
+  g_assert_false (r);
+
+  for (guint i = 0; i < 5000; i++)
+    piece_table_insert (table,
+                        g_rand_int_range (rand, 0, piece_table_get_length (table) + 1),
+                        g_rand_int_range (rand, 0, 2),
+                        i * 64,
+                        g_rand_int_range (rand, 1, 32));
+
+  piece_table_foreach (table, collect_entries, entries);
+
+  for (guint i = 0; i < entries->len; i++)
+    {
+      g_array_append_val (positions, position);
+      position += g_array_index (entries, PieceTableEntry, i).length;
+    }
+
+  r = piece_table_iter_init_at_offset (&iter, table, position);
+  g_assert_false (r);
+
+  for (guint round = 0; round < 200; round++)
+    {
+      guint64 offset = g_rand_int_range (rand, 0, position);
+      guint64 entry_position;
+      const PieceTableEntry *entry;
+      guint first;
+      guint i;
+
+      r = piece_table_iter_init_at_offset (&iter, table, offset);
+      g_assert_true (r);
+
+      /* Find the entry we expect the iter to be positioned at */
+      for (first = 0; first + 1 < positions->len; first++)
+        if (g_array_index (positions, guint64, first + 1) > offset)
+          break;
+
+      /* Walk forward a window of entries */
+      i = first;
+      do
+        {
+          entry = piece_table_iter_get_entry (&iter, &entry_position);
+          g_assert_cmpint (entry_position, ==, g_array_index (positions, guint64, i));
+          g_assert_cmpint (entry->kind, ==, g_array_index (entries, PieceTableEntry, i).kind);
+          g_assert_cmpint (entry->offset, ==, g_array_index (entries, PieceTableEntry, i).offset);
+          g_assert_cmpint (entry->length, ==, g_array_index (entries, PieceTableEntry, i).length);
+          i++;
+        }
+      while (i < first + 100 && piece_table_iter_next (&iter));
+
+      if (i < first + 100)
+        g_assert_cmpint (i, ==, entries->len);
+
+      /* And back again, past where we started */
+      i--;
+      while (piece_table_iter_prev (&iter))
+        {
+          i--;
+          entry = piece_table_iter_get_entry (&iter, &entry_position);
+          g_assert_cmpint (entry_position, ==, g_array_index (positions, guint64, i));
+          g_assert_cmpint (entry->offset, ==, g_array_index (entries, PieceTableEntry, i).offset);
+
+          if (i + 100 < first)
+            break;
+        }
+
+      if (i + 100 >= first)
+        g_assert_cmpint (i, ==, 0);
+    }
+
+  g_rand_free (rand);
+  piece_table_free (table);
+}
+
+static void
+test_get_entries (void)
+{
+  PieceTable *table = piece_table_new ();
+  g_autoptr(GArray) model = g_array_new (FALSE, FALSE, sizeof (guint64));
+  GRand *rand = g_rand_new_with_seed (3141);
+  PieceTableEntry scratch[7];
+  guint64 position = 0;
+  guint64 length;
+
+  g_assert_cmpint (0, ==, piece_table_get_entries (table, &position, 0, scratch, G_N_ELEMENTS (scratch)));
+
+  for (guint i = 0; i < 3000; i++)
+    {
+      guint64 where = g_rand_int_range (rand, 0, piece_table_get_length (table) + 1);
+      PieceKind kind = g_rand_int_range (rand, 0, 2);
+      guint64 to_insert = g_rand_int_range (rand, 1, 32);
+
+      piece_table_insert (table, where, kind, i * 64, to_insert);
+      model_insert (model, where, kind, i * 64, to_insert);
+    }
+
+  length = piece_table_get_length (table);
+
+  for (guint round = 0; round < 200; round++)
+    {
+      g_autoptr(GArray) ar = g_array_new (FALSE, FALSE, sizeof (guint64));
+      guint64 begin = g_rand_int_range (rand, 0, length);
+      guint64 end = g_rand_int_range (rand, begin, MIN (length, begin + 5000) + 1);
+      gsize n;
+
+      /* Stream the range through a small buffer */
+      position = begin;
+      while ((n = piece_table_get_entries (table, &position, end, scratch, G_N_ELEMENTS (scratch))))
+        {
+          for (gsize i = 0; i < n; i++)
+            {
+              g_assert_cmpint (scratch[i].length, >, 0);
+              expand_entry (&scratch[i], ar);
+            }
+        }
+
+      g_assert_cmpint (position, ==, end);
+      g_assert_cmpint (ar->len, ==, end - begin);
+      g_assert_cmpmem (ar->data, ar->len * sizeof (guint64),
+                       &g_array_index (model, guint64, begin), (end - begin) * sizeof (guint64));
+    }
+
+  g_rand_free (rand);
+  piece_table_free (table);
+}
+
+static void
+test_text (void)
+{
+  g_autoptr(GError) error = NULL;
+  g_autofree gchar *filename = NULL;
+  g_autofree gchar *big = NULL;
+  GString *model;
+  PieceTable *table;
+  GRand *rand = g_rand_new_with_seed (2718);
+  gchar *text;
+  gint fd;
+
+  table = piece_table_new_for_file ("/this/file/does/not/exist", &error);
+  g_assert_null (table);
+  g_assert_nonnull (error);
+  g_clear_error (&error);
+
+  fd = g_file_open_tmp ("piece-table-XXXXXX", &filename, &error);
+  g_assert_no_error (error);
+  g_close (fd, NULL);
+
+  model = g_string_new (NULL);
+  for (guint i = 0; i < 1000; i++)
+    g_string_append (model, "The quick brown fox jumps over the lazy dog.\n");
+
+  g_file_set_contents (filename, model->str, model->len, &error);
+  g_assert_no_error (error);
+
+  table = piece_table_new_for_file (filename, &error);
+  g_assert_no_error (error);
+  g_assert_nonnull (table);
+  g_assert_nonnull (piece_table_get_buffer (table));
+  g_assert_cmpint (piece_table_get_length (table), ==, model->len);
+
+  text = piece_table_get_text (table, 0, model->len);
+  g_assert_cmpstr (text, ==, model->str);
+  g_free (text);
+
+  /* Insert enough text to cross into several CHANGE chunks */
+  big = g_malloc (200000 + 1);
+  for (guint i = 0; i < 200000; i++)
+    big[i] = 'a' + (i % 26);
+  big[200000] = 0;
+
+  for (guint i = 0; i < 2000; i++)
+    {
+      guint64 length = piece_table_get_length (table);
+      guint action = g_rand_int_range (rand, 0, 100);
+
+      if (action < 30 && length > 0)
+        {
+          guint64 position = g_rand_int_range (rand, 0, length);
+          guint64 to_delete = g_rand_int_range (rand, 1, MIN (length - position, 100) + 1);
+
+          piece_table_delete (table, position, to_delete);
+          g_string_erase (model, position, to_delete);
+        }
+      else if (action < 32)
+        {
+          guint64 position = g_rand_int_range (rand, 0, length + 1);
+          gsize to_insert = g_rand_int_range (rand, 1, 200000);
+
+          piece_table_insert_text (table, position, big, to_insert);
+          g_string_insert_len (model, position, big, to_insert);
+        }
+      else
+        {
+          guint64 position = g_rand_int_range (rand, 0, length + 1);
+          const gchar *word = (i % 2) ? "hello" : "world";
+
+          piece_table_insert_text (table, position, word, -1);
+          g_string_insert_len (model, position, word, -1);
+        }
+    }
+
+  piece_table_validate (table);
+  g_assert_cmpint (piece_table_get_length (table), ==, model->len);
+
+  text = piece_table_get_text (table, 0, model->len);
+  g_assert_cmpmem (text, model->len, model->str, model->len);
+  g_free (text);
+
+  for (guint i = 0; i < 100; i++)
+    {
+      guint64 position = g_rand_int_range (rand, 0, model->len);
+      guint64 length = g_rand_int_range (rand, 0, MIN (model->len - position, 100000) + 1);
+
+      text = piece_table_get_text (table, position, length);
+      g_assert_cmpint (strlen (text), ==, length);
+      g_assert_cmpmem (text, length, model->str + position, length);
+      g_free (text);
+    }
+
+  piece_table_free (table);
+  g_string_free (model, TRUE);
+  g_unlink (filename);
+  g_rand_free (rand);
+}
+
+static void
+test_save (void)
+{
+  g_autoptr(GError) error = NULL;
+  g_autofree gchar *filename = NULL;
+  g_autofree gchar *saved = NULL;
+  g_autofree gchar *contents = NULL;
+  g_autofree gchar *expected = NULL;
+  PieceTable *table;
+  GString *model;
+  GRand *rand = g_rand_new_with_seed (1618);
+  struct iovec iov[3];
+  struct stat st;
+  guint64 position;
+  gsize contents_length;
+  mode_t mask;
+  gsize n;
+  gint fd;
+
+  fd = g_file_open_tmp ("piece-table-XXXXXX", &filename, &error);
+  g_assert_no_error (error);
+  g_close (fd, NULL);
+
+  /* Large enough that runs of the original are copied in the kernel */
+  model = g_string_new (NULL);
+  for (guint i = 0; model->len < 1024 * 1024; i++)
+    g_string_append_printf (model, "line %u\n", i);
+
+  g_file_set_contents (filename, model->str, model->len, &error);
+  g_assert_no_error (error);
+
+  table = piece_table_new_for_file (filename, &error);
+  g_assert_no_error (error);
+
+  for (guint i = 0; i < 200; i++)
+    {
+      guint64 where = g_rand_int_range (rand, 0, model->len + 1);
+
+      if (i % 3 == 0 && where < model->len)
+        {
+          guint64 to_delete = MIN (model->len - where, 10);
+
+          piece_table_delete (table, where, to_delete);
+          g_string_erase (model, where, to_delete);
+        }
+      else
+        {
+          piece_table_insert_text (table, where, "edit", -1);
+          g_string_insert (model, where, "edit");
+        }
+    }
+
+  /* Stream the vectors through a tiny array */
+  position = 0;
+  contents_length = 0;
+  while ((n = piece_table_get_iovecs (table, &position, model->len, iov, G_N_ELEMENTS (iov))))
+    {
+      for (gsize i = 0; i < n; i++)
+        {
+          g_assert_cmpmem (iov[i].iov_base, iov[i].iov_len, model->str + contents_length, iov[i].iov_len);
+          contents_length += iov[i].iov_len;
+        }
+    }
+  g_assert_cmpint (contents_length, ==, model->len);
+
+  saved = g_strdup_printf ("%s.saved", filename);
+  mask = umask (022);
+  piece_table_save (table, saved, &error);
+  umask (mask);
+  g_assert_no_error (error);
+
+  /* New files are created as they would be by open() */
+  g_assert_cmpint (stat (saved, &st), ==, 0);
+  g_assert_cmpint (st.st_mode & 0777, ==, 0644);
+
+  g_file_get_contents (saved, &contents, &contents_length, &error);
+  g_assert_no_error (error);
+  g_assert_cmpint (contents_length, ==, model->len);
+  g_assert_cmpmem (contents, contents_length, model->str, model->len);
+  g_clear_pointer (&contents, g_free);
+
+  /* Saving over the original must not disturb the pieces still referencing it */
+  piece_table_save (table, filename, &error);
+  g_assert_no_error (error);
+
+  expected = piece_table_get_text (table, 0, piece_table_get_length (table));
+  g_assert_cmpmem (expected, piece_table_get_length (table), model->str, model->len);
+
+  g_file_get_contents (filename, &contents, &contents_length, &error);
+  g_assert_no_error (error);
+  g_assert_cmpint (contents_length, ==, model->len);
+  g_assert_cmpmem (contents, contents_length, model->str, model->len);
+
+  piece_table_save (table, "/this/directory/does/not/exist", &error);
+  g_assert_nonnull (error);
+  g_clear_error (&error);
+
+  piece_table_free (table);
+  g_string_free (model, TRUE);
+  g_unlink (filename);
+  g_unlink (saved);
+  g_rand_free (rand);
+}
+
+static void
+check_lines (PieceTable    *table,
+             const GString *model,
+             GRand         *rand)
+{
+  g_autoptr(GArray) starts = g_array_new (FALSE, FALSE, sizeof (guint64));
+  guint64 zero = 0;
+
+  g_array_append_val (starts, zero);
+  for (gsize i = 0; i < model->len; i++)
+    {
+      if (model->str[i] == '\n')
+        {
+          guint64 start = i + 1;
+          g_array_append_val (starts, start);
+        }
+    }
+
+  g_assert_cmpint (piece_table_get_n_lines (table), ==, starts->len);
+
+  for (guint i = 0; i < starts->len; i++)
+    g_assert_cmpint (piece_table_line_to_offset (table, i), ==, g_array_index (starts, guint64, i));
+
+  for (guint i = 0; i < 1000; i++)
+    {
+      guint64 offset = g_rand_int_range (rand, 0, model->len + 1);
+      guint64 line = piece_table_offset_to_line (table, offset);
+
+      g_assert_cmpint (g_array_index (starts, guint64, line), <=, offset);
+      g_assert_true (line + 1 == starts->len || g_array_index (starts, guint64, line + 1) > offset);
+    }
+
+  g_assert_cmpint (piece_table_offset_to_line (table, model->len), ==, starts->len - 1);
+}
+
+static void
+test_lines (void)
+{
+  g_autoptr(GError) error = NULL;
+  g_autofree gchar *filename = NULL;
+  g_autofree gchar *big = NULL;
+  g_autofree gchar *text = NULL;
+  PieceTable *snapshot;
+  PieceTable *table;
+  GString *model;
+  GString *copy;
+  GRand *rand = g_rand_new_with_seed (4242);
+  gint fd;
+
+  /* Tables that only track offsets have a single line */
+  table = piece_table_new ();
+  piece_table_insert (table, 0, PIECE_INITIAL, 0, 100);
+  g_assert_cmpint (piece_table_get_n_lines (table), ==, 1);
+  g_assert_cmpint (piece_table_offset_to_line (table, 50), ==, 0);
+  g_assert_cmpint (piece_table_line_to_offset (table, 0), ==, 0);
+  piece_table_free (table);
+
+  fd = g_file_open_tmp ("piece-table-XXXXXX", &filename, &error);
+  g_assert_no_error (error);
+  g_close (fd, NULL);
+
+  /* Lines of varying length, some longer than a block of the index */
+  model = g_string_new (NULL);
+  for (guint i = 0; model->len < 256 * 1024; i++)
+    {
+      guint n = g_rand_int_range (rand, 0, (i % 50) ? 80 : 10000);
+
+      for (guint j = 0; j < n; j++)
+        g_string_append_c (model, 'a' + (j % 26));
+      g_string_append_c (model, '\n');
+    }
+
+  g_file_set_contents (filename, model->str, model->len, &error);
+  g_assert_no_error (error);
+
+  table = piece_table_new_for_file (filename, &error);
+  g_assert_no_error (error);
+
+  check_lines (table, model, rand);
+  piece_table_free (table);
+
+  /* The units of a newly opened file are only counted once they are needed,
+   * so edit it first to count them after it has been split into pieces.
+   */
+  table = piece_table_new_for_file (filename, &error);
+  g_assert_no_error (error);
+  copy = g_string_new_len (model->str, model->len);
+
+  for (guint i = 0; i < 200; i++)
+    {
+      guint64 position = g_rand_int_range (rand, 0, copy->len);
+
+      if (i % 2)
+        {
+          piece_table_delete (table, position, MIN (copy->len - position, 500));
+          g_string_erase (copy, position, MIN (copy->len - position, 500));
+        }
+      else
+        {
+          piece_table_insert_text (table, position, "a\nb", -1);
+          g_string_insert (copy, position, "a\nb");
+        }
+    }
+
+  piece_table_validate (table);
+  text = piece_table_get_text (table, 0, copy->len);
+  g_assert_cmpmem (text, copy->len, copy->str, copy->len);
+
+  snapshot = piece_table_snapshot (table);
+  check_lines (snapshot, copy, rand);
+  piece_table_free (snapshot);
+  piece_table_validate (table);
+  check_lines (table, copy, rand);
+  piece_table_free (table);
+  g_string_free (copy, TRUE);
+
+  table = piece_table_new_for_file (filename, &error);
+  g_assert_no_error (error);
+
+  big = g_malloc (100000);
+  for (guint i = 0; i < 100000; i++)
+    big[i] = (i % 37) ? 'x' : '\n';
+
+  for (guint i = 0; i < 1000; i++)
+    {
+      guint64 length = piece_table_get_length (table);
+      guint action = g_rand_int_range (rand, 0, 100);
+      guint64 position = g_rand_int_range (rand, 0, length + 1);
+
+      if (action < 40 && position < length)
+        {
+          guint64 to_delete = g_rand_int_range (rand, 1, MIN (length - position, 20000) + 1);
+
+          piece_table_delete (table, position, to_delete);
+          g_string_erase (model, position, to_delete);
+        }
+      else if (action < 45)
+        {
+          gsize to_insert = g_rand_int_range (rand, 1, 100000);
+
+          piece_table_insert_text (table, position, big, to_insert);
+          g_string_insert_len (model, position, big, to_insert);
+        }
+      else
+        {
+          const gchar *text = (i % 3) ? "a\nb" : "word";
+
+          piece_table_insert_text (table, position, text, -1);
+          g_string_insert (model, position, text);
+        }
+    }
+
+  piece_table_validate (table);
+  check_lines (table, model, rand);
+
+  piece_table_delete (table, 0, piece_table_get_length (table));
+  g_string_truncate (model, 0);
+  check_lines (table, model, rand);
+
+  piece_table_free (table);
+  g_string_free (model, TRUE);
+  g_unlink (filename);
+  g_rand_free (rand);
+}
+
+static void
+count_units (const gchar      *str,
+             gsize             len,
+             PieceTableCounts *counts)
+{
+  memset (counts, 0, sizeof *counts);
+
+  for (gsize i = 0; i < len; i++)
+    {
+      guchar c = str[i];
+
+      counts->newlines += c == '\n';
+      counts->code_points += (c & 0xC0) != 0x80;
+      counts->utf16 += ((c & 0xC0) != 0x80) + (c >= 0xF0);
+    }
+}
+
+static guint64
+units_to_offset (const GString *model,
+                 PieceUnit      unit,
+                 guint64        n_units)
+{
+  const gchar *iter = model->str;
+  const gchar *end = model->str + model->len;
+
+  while (iter < end)
+    {
+      guint width = (guchar)*iter >= 0xF0 && unit == PIECE_UNIT_UTF16 ? 2 : 1;
+
+      if (n_units < width)
+        break;
+
+      n_units -= width;
+      iter = g_utf8_next_char (iter);
+    }
+
+  return iter - model->str;
+}
+
+static void
+check_code_units (PieceTable    *table,
+                  const GString *model,
+                  GRand         *rand)
+{
+  PieceTableCounts expected;
+  PieceTableCounts counts;
+
+  count_units (model->str, model->len, &expected);
+  piece_table_get_counts (table, model->len, &counts);
+  g_assert_cmpint (counts.newlines, ==, expected.newlines);
+  g_assert_cmpint (counts.code_points, ==, expected.code_points);
+  g_assert_cmpint (counts.utf16, ==, expected.utf16);
+
+  for (guint i = 0; i < 1000; i++)
+    {
+      guint64 offset = g_rand_int_range (rand, 0, model->len + 1);
+      guint64 n_units;
+
+      count_units (model->str, offset, &expected);
+      piece_table_get_counts (table, offset, &counts);
+      g_assert_cmpint (counts.newlines, ==, expected.newlines);
+      g_assert_cmpint (counts.code_points, ==, expected.code_points);
+      g_assert_cmpint (counts.utf16, ==, expected.utf16);
+
+      /* Includes positions within surrogate pairs and past the end */
+      n_units = g_rand_int_range (rand, 0, expected.utf16 + 10);
+      g_assert_cmpint (piece_table_units_to_offset (table, PIECE_UNIT_UTF16, n_units), ==,
+                       units_to_offset (model, PIECE_UNIT_UTF16, n_units));
+      g_assert_cmpint (piece_table_units_to_offset (table, PIECE_UNIT_CODE_POINTS, n_units), ==,
+                       units_to_offset (model, PIECE_UNIT_CODE_POINTS, n_units));
+    }
+}
+
+static void
+test_code_units (void)
+{
+  static const gchar *words[] = { "a", "\n", "\xC3\xA9", "\xE2\x82\xAC", "\xF0\x9F\x98\x80" };
+  g_autoptr(GError) error = NULL;
+  g_autofree gchar *filename = NULL;
+  PieceTable *table;
+  GString *model;
+  GRand *rand = g_rand_new_with_seed (4343);
+  gint fd;
+
+  fd = g_file_open_tmp ("piece-table-XXXXXX", &filename, &error);
+  g_assert_no_error (error);
+  g_close (fd, NULL);
+
+  /* Runs of each width, some longer than a block of the index */
+  model = g_string_new (NULL);
+  while (model->len < 256 * 1024)
+    {
+      const gchar *word = words[g_rand_int_range (rand, 0, G_N_ELEMENTS (words))];
+      guint n = g_rand_int_range (rand, 1, g_rand_boolean (rand) ? 10 : 3000);
+
+      for (guint j = 0; j < n; j++)
+        g_string_append (model, word);
+    }
+
+  g_file_set_contents (filename, model->str, model->len, &error);
+  g_assert_no_error (error);
+
+  table = piece_table_new_for_file (filename, &error);
+  g_assert_no_error (error);
+
+  check_code_units (table, model, rand);
+
+  /* Edit on character boundaries so the model remains valid UTF-8 */
+  for (guint i = 0; i < 1000; i++)
+    {
+      guint64 n_chars = g_utf8_strlen (model->str, model->len);
+      guint64 position = units_to_offset (model, PIECE_UNIT_CODE_POINTS,
+                                          g_rand_int_range (rand, 0, n_chars + 1));
+
+      g_assert_cmpint (piece_table_units_to_offset (table, PIECE_UNIT_CODE_POINTS,
+                                                    g_utf8_pointer_to_offset (model->str, model->str + position)),
+                       ==, position);
+
+      if (g_rand_int_range (rand, 0, 100) < 40 && position < model->len)
+        {
+          const gchar *end = model->str + position;
+
+          for (guint j = g_rand_int_range (rand, 1, 500); j > 0 && end < model->str + model->len; j--)
+            end = g_utf8_next_char (end);
+
+          piece_table_delete (table, position, end - model->str - position);
+          g_string_erase (model, position, end - model->str - position);
+        }
+      else
+        {
+          const gchar *word = words[g_rand_int_range (rand, 0, G_N_ELEMENTS (words))];
+
+          piece_table_insert_text (table, position, word, -1);
+          g_string_insert (model, position, word);
+        }
+    }
+
+  piece_table_validate (table);
+  check_code_units (table, model, rand);
+
+  piece_table_free (table);
+  g_string_free (model, TRUE);
+  g_unlink (filename);
+  g_rand_free (rand);
+}
+
+static void
+test_undo (void)
+{
+  PieceTable *table = piece_table_new ();
+  GPtrArray *history = g_ptr_array_new_with_free_func ((GDestroyNotify)g_array_unref);
+  GArray *model = g_array_new (FALSE, FALSE, sizeof (guint64));
+  GRand *rand = g_rand_new_with_seed (1357);
+  guint current = 0;
+  gsize size;
+  gboolean r;
+
+  piece_table_set_undo_enabled (table, TRUE);
+  g_assert_false (piece_table_can_undo (table));
+  r = piece_table_undo (table);
+  g_assert_false (r);
+
+  /* Typing coalesces into a single record */
+  for (guint i = 0; i < 1000; i++)
+    piece_table_insert (table, i, PIECE_CHANGE, i, 1);
+  size = piece_table_get_journal_size (table);
+
+  /* Backspacing over it trims the record */
+  for (guint i = 1000; i > 500; i--)
+    piece_table_delete (table, i - 1, 1);
+  g_assert_cmpint (piece_table_get_journal_size (table), ==, size);
+
+  /* The delete key and backspace elsewhere coalesce too */
+  for (guint i = 0; i < 100; i++)
+    piece_table_delete (table, 0, 1);
+  for (guint i = 400; i > 300; i--)
+    piece_table_delete (table, i - 1, 1);
+  g_assert_cmpint (piece_table_get_length (table), ==, 300);
+  g_assert_cmpint (piece_table_get_journal_size (table), <, size + 128);
+
+  r = piece_table_undo (table);
+  g_assert_true (r);
+  g_assert_cmpint (piece_table_get_length (table), ==, 400);
+  r = piece_table_undo (table);
+  g_assert_true (r);
+  g_assert_cmpint (piece_table_get_length (table), ==, 500);
+  r = piece_table_undo (table);
+  g_assert_true (r);
+  g_assert_cmpint (piece_table_get_length (table), ==, 0);
+  g_assert_false (piece_table_can_undo (table));
+
+  r = piece_table_redo (table);
+  g_assert_true (r);
+  model_insert (model, 0, PIECE_CHANGE, 0, 500);
+  compare_expanded (table, model);
+  r = piece_table_redo (table);
+  g_assert_true (r);
+  g_array_remove_range (model, 0, 100);
+  compare_expanded (table, model);
+  r = piece_table_redo (table);
+  g_assert_true (r);
+  g_array_remove_range (model, 300, 100);
+  compare_expanded (table, model);
+  g_assert_false (piece_table_can_redo (table));
+
+  /* Nested groups are undone as one */
+  piece_table_begin_group (table);
+  piece_table_insert (table, 0, PIECE_INITIAL, 0, 10);
+  piece_table_begin_group (table);
+  piece_table_delete (table, 5, 100);
+  piece_table_end_group (table);
+  piece_table_copy (table, 0, 50, 200);
+  piece_table_end_group (table);
+  r = piece_table_undo (table);
+  g_assert_true (r);
+  compare_expanded (table, model);
+
+  /* Random edits, each of which is its own group */
+  g_ptr_array_add (history, g_array_copy (model));
+
+  for (guint i = 0; i < 2000; i++)
+    {
+      guint64 length = piece_table_get_length (table);
+      guint64 position = g_rand_int_range (rand, 0, length + 1);
+      guint action = g_rand_int_range (rand, 0, 100);
+
+      if (action < 10 && current > 0)
+        {
+          guint n = g_rand_int_range (rand, 1, MIN (current, 10) + 1);
+
+          for (guint j = 0; j < n; j++)
+            {
+              r = piece_table_undo (table);
+              g_assert_true (r);
+            }
+          current -= n;
+
+          compare_expanded (table, g_ptr_array_index (history, current));
+          continue;
+        }
+      else if (action < 20 && current + 1 < history->len)
+        {
+          guint n = g_rand_int_range (rand, 1, MIN (history->len - current - 1, 10) + 1);
+
+          for (guint j = 0; j < n; j++)
+            {
+              r = piece_table_redo (table);
+              g_assert_true (r);
+            }
+          current += n;
+
+          compare_expanded (table, g_ptr_array_index (history, current));
+          continue;
+        }
+
+      g_array_unref (model);
+      model = g_array_copy (g_ptr_array_index (history, current));
+
+      piece_table_begin_group (table);
+
+      if (action < 50 && position < length)
+        {
+          guint64 to_delete = g_rand_int_range (rand, 1, MIN (length - position, 2000) + 1);
+
+          piece_table_delete (table, position, to_delete);
+          g_array_remove_range (model, position, to_delete);
+        }
+      else if (action < 60 && position < length)
+        {
+          guint64 to = g_rand_int_range (rand, 0, length + 1);
+          guint64 to_copy = g_rand_int_range (rand, 1, MIN (length - position, 1000) + 1);
+
+          g_autofree guint64 *copied = g_memdup2 (&g_array_index (model, guint64, position),
+                                                  to_copy * sizeof (guint64));
+
+          piece_table_copy (table, position, to, to_copy);
+          g_array_insert_vals (model, to, copied, to_copy);
+        }
+      else if (action < 70)
+        {
+          PieceTableEdit edits[2];
+
+          edits[0].edit = PIECE_EDIT_INSERT;
+          edits[0].kind = PIECE_INITIAL;
+          edits[0].position = position;
+          edits[0].offset = i * 64;
+          edits[0].length = 10;
+          edits[1].edit = PIECE_EDIT_DELETE;
+          edits[1].kind = PIECE_INITIAL;
+          edits[1].position = position;
+          edits[1].offset = 0;
+          edits[1].length = MIN (length - position, 20);
+
+          piece_table_apply_edits (table, edits, 2);
+          model_insert (model, position, PIECE_INITIAL, i * 64, 10);
+          g_array_remove_range (model, position + 10, MIN (length - position, 20));
+        }
+      else
+        {
+          PieceKind kind = g_rand_int_range (rand, 0, 2);
+          guint64 to_insert = g_rand_int_range (rand, 1, 100);
+
+          piece_table_insert (table, position, kind, i * 128, to_insert);
+          model_insert (model, position, kind, i * 128, to_insert);
+        }
+
+      piece_table_end_group (table);
+
+      /* Editing discards anything that could have been redone */
+      g_assert_false (piece_table_can_redo (table));
+      g_ptr_array_set_size (history, ++current);
+      g_ptr_array_add (history, g_array_copy (model));
+
+      piece_table_validate (table);
+      compare_expanded (table, model);
+    }
+
+  /* Undo everything since the random edits began */
+  for (; current > 0; current--)
+    {
+      r = piece_table_undo (table);
+      g_assert_true (r);
+    }
+  compare_expanded (table, g_ptr_array_index (history, 0));
+
+  g_array_unref (model);
+  g_ptr_array_unref (history);
+  g_rand_free (rand);
+  piece_table_free (table);
+}
+
+typedef struct
+{
+  PieceTable *snapshot;
+  gchar      *text;
+} SnapshotReader;
+
+static gpointer
+read_snapshot (gpointer data)
+{
+  SnapshotReader *reader = data;
+
+  /* Read while the table is being edited by the main thread */
+  for (guint i = 0; i < 50; i++)
+    {
+      g_autofree gchar *text = piece_table_get_text (reader->snapshot, 0,
+                                                     piece_table_get_length (reader->snapshot));
+
+      g_assert_cmpstr (text, ==, reader->text);
+    }
+
+  piece_table_free (reader->snapshot);
+
+  return NULL;
+}
+
+static void
+check_snapshot (PieceTable *snapshot,
+                GArray     *model)
+{
+  g_autoptr(GArray) entries = g_array_new (FALSE, FALSE, sizeof (PieceTableEntry));
+  PieceTableIter iter;
+  guint64 position = 0;
+  guint n = 0;
+
+  piece_table_validate (snapshot);
+  compare_expanded (snapshot, model);
+
+  /* Iterators search for each leaf of a snapshot instead of following links */
+  piece_table_foreach (snapshot, collect_entries, entries);
+
+  if (piece_table_iter_init_at_offset (&iter, snapshot, 0))
+    {
+      do
+        {
+          const PieceTableEntry *entry = piece_table_iter_get_entry (&iter, &position);
+
+          g_assert_cmpint (n, <, entries->len);
+          g_assert_cmpint (entry->offset, ==, g_array_index (entries, PieceTableEntry, n).offset);
+          n++;
+        }
+      while (piece_table_iter_next (&iter));
+
+      while (piece_table_iter_prev (&iter))
+        n--;
+    }
+
+  g_assert_cmpint (n, ==, MIN (entries->len, 1));
+}
+
+static void
+test_snapshot (void)
+{
+  PieceTable *table = piece_table_new ();
+  GPtrArray *snapshots = g_ptr_array_new ();
+  GPtrArray *models = g_ptr_array_new_with_free_func ((GDestroyNotify)g_array_unref);
+  GArray *model = g_array_new (FALSE, FALSE, sizeof (guint64));
+  GRand *rand = g_rand_new_with_seed (2468);
+  SnapshotReader reader;
+  PieceTable *snapshot;
+  GThread *thread;
+  gchar *text;
+
+  /* An empty table can be snapshotted too */
+  snapshot = piece_table_snapshot (table);
+  piece_table_insert (table, 0, PIECE_INITIAL, 0, 10);
+  check_snapshot (snapshot, model);
+  piece_table_free (snapshot);
+  model_insert (model, 0, PIECE_INITIAL, 0, 10);
+
+  for (guint i = 0; i < 3000; i++)
+    {
+      guint64 length = piece_table_get_length (table);
+      guint64 position = g_rand_int_range (rand, 0, length + 1);
+      guint action = g_rand_int_range (rand, 0, 100);
+
+      if (i % 100 == 0)
+        {
+          g_ptr_array_add (snapshots, piece_table_snapshot (table));
+          g_ptr_array_add (models, g_array_copy (model));
+        }
+
+      /* Release snapshots out of order, leaving some until the end */
+      if (i % 250 == 0 && snapshots->len > 2)
+        {
+          guint nth = g_rand_int_range (rand, 0, snapshots->len - 1);
+
+          check_snapshot (g_ptr_array_index (snapshots, nth), g_ptr_array_index (models, nth));
+          piece_table_free (g_ptr_array_index (snapshots, nth));
+          g_ptr_array_remove_index (snapshots, nth);
+          g_ptr_array_remove_index (models, nth);
+        }
+
+      if (action < 40 && position < length)
+        {
+          guint64 to_delete = g_rand_int_range (rand, 1, MIN (length - position, 500) + 1);
+
+          piece_table_delete (table, position, to_delete);
+          g_array_remove_range (model, position, to_delete);
+        }
+      else if (action < 45 && position < length)
+        {
+          guint64 to = g_rand_int_range (rand, 0, length + 1);
+          guint64 to_copy = g_rand_int_range (rand, 1, MIN (length - position, 1000) + 1);
+          g_autofree guint64 *copied = g_memdup2 (&g_array_index (model, guint64, position),
+                                                  to_copy * sizeof (guint64));
+
+          piece_table_copy (table, position, to, to_copy);
+          g_array_insert_vals (model, to, copied, to_copy);
+        }
+      else if (action < 55)
+        {
+          PieceTableEdit edits[2];
+
+          edits[0].edit = PIECE_EDIT_INSERT;
+          edits[0].kind = PIECE_CHANGE;
+          edits[0].position = position;
+          edits[0].offset = i * 64;
+          edits[0].length = 10;
+          edits[1].edit = PIECE_EDIT_DELETE;
+          edits[1].kind = PIECE_INITIAL;
+          edits[1].position = position;
+          edits[1].offset = 0;
+          edits[1].length = MIN (length - position, 20);
+
+          piece_table_apply_edits (table, edits, 2);
+          model_insert (model, position, PIECE_CHANGE, i * 64, 10);
+          g_array_remove_range (model, position + 10, MIN (length - position, 20));
+        }
+      else
+        {
+          PieceKind kind = g_rand_int_range (rand, 0, 2);
+          guint64 to_insert = g_rand_int_range (rand, 1, 100);
+
+          piece_table_insert (table, position, kind, i * 128, to_insert);
+          model_insert (model, position, kind, i * 128, to_insert);
+        }
+
+      if (i % 50 == 0)
+        {
+          piece_table_validate (table);
+          compare_expanded (table, model);
+        }
+    }
+
+  piece_table_validate (table);
+  compare_expanded (table, model);
+
+  /* Snapshots outlive the table they were taken from */
+  piece_table_free (table);
+
+  for (guint i = 0; i < snapshots->len; i++)
+    {
+      check_snapshot (g_ptr_array_index (snapshots, i), g_ptr_array_index (models, i));
+      piece_table_free (g_ptr_array_index (snapshots, i));
+    }
+
+  /* Read a snapshot from another thread while editing the table */
+  table = piece_table_new ();
+  for (guint i = 0; i < 2000; i++)
+    piece_table_insert_text (table, g_rand_int_range (rand, 0, piece_table_get_length (table) + 1),
+                             "snapshot\n", -1);
+
+  text = piece_table_get_text (table, 0, piece_table_get_length (table));
+  reader.snapshot = piece_table_snapshot (table);
+  reader.text = text;
+  thread = g_thread_new ("reader", read_snapshot, &reader);
+
+  for (guint i = 0; i < 5000; i++)
+    {
+      guint64 length = piece_table_get_length (table);
+      guint64 position = g_rand_int_range (rand, 0, length + 1);
+
+      if (i % 3 == 0 && position < length)
+        piece_table_delete (table, position, MIN (length - position, 7));
+      else
+        piece_table_insert_text (table, position, "typing", -1);
+    }
+
+  g_thread_join (thread);
+  piece_table_validate (table);
+
+  g_free (text);
+  piece_table_free (table);
+  g_array_unref (model);
+  g_ptr_array_unref (models);
+  g_ptr_array_unref (snapshots);
+  g_rand_free (rand);
+}
+
+typedef struct
+{
+  PieceTableReader *reader;
+  gint             *done;
+  guint             n_reads;
+} PublishReader;
+
+static gpointer
+read_published (gpointer data)
+{
+  PublishReader *reader = data;
+
+  do
+    {
+      PieceTable *version = piece_table_reader_pin (reader->reader);
+      guint64 length = piece_table_get_length (version);
+      g_autofree gchar *text = piece_table_get_text (version, 0, length);
+
+      /* Each version is a whole number of lines, and never half an edit */
+      g_assert_cmpint (length % 5, ==, 0);
+      g_assert_cmpint (piece_table_get_n_lines (version), ==, length / 5 + 1);
+      for (guint64 i = 0; i < length; i += 5)
+        g_assert_cmpmem (text + i, 5, "line\n", 5);
+
+      piece_table_reader_unpin (reader->reader);
+      reader->n_reads++;
+    }
+  while (!g_atomic_int_get (reader->done));
+
+  return NULL;
+}
+
+static void
+test_publish (void)
+{
+  PieceTable *table = piece_table_new ();
+  GRand *rand = g_rand_new_with_seed (9753);
+  PublishReader readers[3];
+  GThread *threads[3];
+  gint done = FALSE;
+
+  for (guint i = 0; i < 100; i++)
+    piece_table_insert_text (table, 0, "line\n", -1);
+
+  for (guint i = 0; i < G_N_ELEMENTS (readers); i++)
+    {
+      readers[i].reader = piece_table_reader_new (table);
+      readers[i].done = &done;
+      readers[i].n_reads = 0;
+      threads[i] = g_thread_new ("reader", read_published, &readers[i]);
+    }
+
+  /* Only publish between whole lines, as the readers expect */
+  for (guint i = 0; i < 5000; i++)
+    {
+      guint64 n_lines = piece_table_get_length (table) / 5;
+      guint64 line = g_rand_int_range (rand, 0, n_lines + 1);
+
+      if (i % 3 == 0 && line < n_lines)
+        {
+          piece_table_delete (table, line * 5, 5);
+        }
+      else
+        {
+          piece_table_insert_text (table, line * 5, "li", -1);
+          piece_table_insert_text (table, line * 5 + 2, "ne\n", -1);
+        }
+
+      piece_table_publish (table);
+    }
+
+  g_atomic_int_set (&done, TRUE);
+
+  for (guint i = 0; i < G_N_ELEMENTS (readers); i++)
+    {
+      g_thread_join (threads[i]);
+      g_assert_cmpint (readers[i].n_reads, >, 0);
+      piece_table_reader_free (readers[i].reader);
+    }
+
+  piece_table_validate (table);
+
+  g_rand_free (rand);
+  piece_table_free (table);
+}
+
+static gpointer
+map_text (PieceTable *table,
+          guint64     position,
+          guint64     length,
+          gpointer    user_data)
+{
+  g_autofree gchar *text = piece_table_get_text (table, position, length);
+  guint *n_tasks = user_data;
+
+  g_atomic_int_inc (n_tasks);
+
+  return g_string_new_len (text, length);
+}
+
+static gpointer
+reduce_text (gpointer left,
+             gpointer right,
+             gpointer user_data)
+{
+  g_string_append_len (left, ((GString *)right)->str, ((GString *)right)->len);
+  g_string_free (right, TRUE);
+
+  return left;
+}
+
+static void
+check_map_reduce (PieceTable *table,
+                  guint64     position,
+                  guint64     length)
+{
+  g_autofree gchar *expected = piece_table_get_text (table, position, length);
+  guint n_tasks = 0;
+  GString *text;
+
+  text = piece_table_map_reduce (table, position, length, map_text, reduce_text, &n_tasks);
+
+  g_assert_cmpint (text->len, ==, length);
+  g_assert_cmpstr (text->str, ==, expected);
+  g_assert_cmpint (n_tasks, >=, MIN (length / (64 * 1024), 8));
+
+  g_string_free (text, TRUE);
+}
+
+static void
+test_map_reduce (void)
+{
+  PieceTable *table = piece_table_new ();
+  g_autoptr(GArray) entries = g_array_new (FALSE, FALSE, sizeof (PieceTableEntry));
+  GRand *rand = g_rand_new_with_seed (1122);
+  PieceTable *snapshot;
+  gchar line[64];
+
+  check_map_reduce (table, 0, 0);
+
+  for (guint i = 0; i < 100000; i++)
+    {
+      g_snprintf (line, sizeof line, "%u,", i);
+      piece_table_insert_text (table,
+                               g_rand_int_range (rand, 0, piece_table_get_length (table) + 1),
+                               line, -1);
+    }
+
+  check_map_reduce (table, 0, piece_table_get_length (table));
+  check_map_reduce (table, 12345, piece_table_get_length (table) / 2);
+  check_map_reduce (table, 100, 1);
+
+  /* Snapshots can be mapped while the table is being edited */
+  snapshot = piece_table_snapshot (table);
+  piece_table_delete (table, 0, piece_table_get_length (table) / 2);
+  check_map_reduce (snapshot, 0, piece_table_get_length (snapshot));
+  piece_table_free (snapshot);
+
+  /* A single large piece is split too */
+  piece_table_free (table);
+  table = piece_table_new ();
+  for (guint i = 0; i < 1000; i++)
+    {
+      memset (line, 'a' + i % 26, sizeof line - 1);
+      line[sizeof line - 1] = 0;
+      piece_table_insert_text (table, piece_table_get_length (table), line, -1);
+    }
+  piece_table_foreach (table, collect_entries, entries);
+  g_assert_cmpint (entries->len, ==, 1);
+  check_map_reduce (table, 0, piece_table_get_length (table));
+
+  g_rand_free (rand);
+  piece_table_free (table);
+}
+
+static gboolean
+naive_match (const gchar *text,
+             gsize        length,
+             gsize        position,
+             const gchar *needle,
+             gsize        needle_len)
+{
+  return position + needle_len <= length && memcmp (text + position, needle, needle_len) == 0;
+}
+
+static void
+check_find (PieceTable  *table,
+            const gchar *needle,
+            gsize        needle_len)
+{
+  guint64 length = piece_table_get_length (table);
+  g_autofree gchar *text = piece_table_get_text (table, 0, length);
+  g_autoptr(GArray) expected = g_array_new (FALSE, FALSE, sizeof (guint64));
+  guint64 match;
+  guint n = 0;
+
+  for (guint64 i = 0; i + needle_len <= length; i++)
+    {
+      if (naive_match (text, length, i, needle, needle_len))
+        g_array_append_val (expected, i);
+    }
+
+  /* Every match, in order, searching from one past the previous */
+  for (guint64 from = 0; piece_table_find (table, needle, needle_len, from, &match); from = match + 1)
+    {
+      g_assert_cmpint (n, <, expected->len);
+      g_assert_cmpint (match, ==, g_array_index (expected, guint64, n));
+      n++;
+    }
+  g_assert_cmpint (n, ==, expected->len);
+
+  /* And backward, from the end of each match to the one before it */
+  for (guint64 from = length; piece_table_find_backward (table, needle, needle_len, from, &match); from = match + needle_len - 1)
+    {
+      g_assert_cmpint (n, >, 0);
+      n--;
+      g_assert_cmpint (match, ==, g_array_index (expected, guint64, n));
+    }
+  g_assert_cmpint (n, ==, 0);
+}
+
+static void
+test_find (void)
+{
+  PieceTable *table = piece_table_new ();
+  GRand *rand = g_rand_new_with_seed (1234);
+  PieceTable *snapshot;
+  g_autofree gchar *text = NULL;
+  guint64 match;
+
+  g_assert_false (piece_table_find (table, "a", 1, 0, NULL));
+  g_assert_false (piece_table_find_backward (table, "a", 1, 0, NULL));
+
+  /* Short pieces of a small alphabet, so most matches cross pieces */
+  for (guint i = 0; i < 20000; i++)
+    piece_table_insert_text (table,
+                             g_rand_int_range (rand, 0, piece_table_get_length (table) + 1),
+                             &"abcab"[g_rand_int_range (rand, 0, 3)],
+                             g_rand_int_range (rand, 1, 3));
+
+  check_find (table, "a", 1);
+  check_find (table, "ba", 2);
+  check_find (table, "abca", 4);
+  check_find (table, "bbbbbbbbbbb", 11);
+  check_find (table, "x", 1);
+
+  /* A needle longer than the carried window kept on the stack */
+  text = piece_table_get_text (table, 12345, 1000);
+  g_assert_true (piece_table_find (table, text, 1000, 0, &match));
+  g_assert_cmpint (match, <=, 12345);
+  check_find (table, text, 1000);
+
+  /* Searching from the middle only finds matches on the correct side */
+  g_assert_true (piece_table_find (table, text, 1000, 12345, &match));
+  g_assert_cmpint (match, ==, 12345);
+  g_assert_true (piece_table_find_backward (table, text, 1000, 12345 + 1000, &match));
+  g_assert_cmpint (match, ==, 12345);
+  g_assert_false (piece_table_find (table, text, 1000, piece_table_get_length (table) - 999, NULL));
+  g_assert_false (piece_table_find_backward (table, text, 1000, 999, NULL));
+
+  /* Snapshots stream their leaves without links */
+  snapshot = piece_table_snapshot (table);
+  piece_table_delete (table, 0, piece_table_get_length (table) / 2);
+  check_find (snapshot, "abca", 4);
+  piece_table_free (snapshot);
+
+  g_rand_free (rand);
+  piece_table_free (table);
+}
+
+static void
+test_max_length (void)
+{
+  PieceTable *table = piece_table_new ();
+  guint64 half = PIECE_TABLE_MAX_LENGTH / 2;
+
+  /* Pieces as long as the layout allows can be chained, split and removed */
+  piece_table_insert (table, 0, PIECE_INITIAL, 0, half);
+  piece_table_insert (table, half, PIECE_INITIAL, half, PIECE_TABLE_MAX_LENGTH - half);
+  g_assert_cmpint (piece_table_get_length (table), ==, PIECE_TABLE_MAX_LENGTH);
+
+  {
+    static const PieceTableEntry entries[] = {
+      { PIECE_INITIAL, 0, PIECE_TABLE_MAX_LENGTH },
+    };
+    compare_entries (table, entries, G_N_ELEMENTS (entries));
+  }
+
+  piece_table_delete (table, 1, PIECE_TABLE_MAX_LENGTH - 2);
+  piece_table_insert (table, 1, PIECE_CHANGE, PIECE_TABLE_MAX_LENGTH - 5, 5);
+
+  {
+    static const PieceTableEntry entries[] = {
+      { PIECE_INITIAL, 0, 1 },
+      { PIECE_CHANGE, PIECE_TABLE_MAX_LENGTH - 5, 5 },
+      { PIECE_INITIAL, PIECE_TABLE_MAX_LENGTH - 1, 1 },
+    };
+    compare_entries (table, entries, G_N_ELEMENTS (entries));
+  }
+
+  /* Anything which could not be stored is refused */
+  g_test_expect_message (NULL, G_LOG_LEVEL_CRITICAL, "*PIECE_TREE_MAX_LENGTH*");
+  piece_table_insert (table, 0, PIECE_CHANGE, 0, PIECE_TABLE_MAX_LENGTH);
+  g_test_assert_expected_messages ();
+
+  g_test_expect_message (NULL, G_LOG_LEVEL_CRITICAL, "*PIECE_TREE_MAX_LENGTH*");
+  piece_table_insert (table, 0, PIECE_CHANGE, PIECE_TABLE_MAX_LENGTH, 1);
+  g_test_assert_expected_messages ();
+
+  {
+    PieceTableEdit edit = { PIECE_EDIT_INSERT, PIECE_CHANGE, 0, PIECE_TABLE_MAX_LENGTH, 1 };
+
+    g_test_expect_message (NULL, G_LOG_LEVEL_CRITICAL, "*PIECE_TREE_MAX_LENGTH*");
+    piece_table_apply_edits (table, &edit, 1);
+    g_test_assert_expected_messages ();
+  }
+
+  g_assert_cmpint (piece_table_get_length (table), ==, 7);
+
+  {
+    static const PieceTableEntry entries[] = {
+      { PIECE_INITIAL, 0, PIECE_TABLE_MAX_LENGTH / 2 + 1 },
+      { PIECE_CHANGE, 0, PIECE_TABLE_MAX_LENGTH / 2 + 1 },
+    };
+    PieceTable *built;
+
+    g_test_expect_message (NULL, G_LOG_LEVEL_CRITICAL, "*PIECE_TREE_MAX_LENGTH*");
+    built = piece_table_new_from_entries (entries, G_N_ELEMENTS (entries), 0.0);
+    g_test_assert_expected_messages ();
+    g_assert_null (built);
+  }
+
+  piece_table_free (table);
+}
+
 gint
 main (gint argc,
       gchar *argv[])
@@ -244,5 +2224,27 @@ main (gint argc,
   g_test_add_func ("/PieceTable/inserts_at_head", test_inserts_at_head);
   g_test_add_func ("/PieceTable/inserts_at_tail", test_inserts_at_tail);
   g_test_add_func ("/PieceTable/test_root_split", test_root_split);
+  g_test_add_func ("/PieceTable/delete", test_delete);
+  g_test_add_func ("/PieceTable/delete_all", test_delete_all);
+  g_test_add_func ("/PieceTable/delete_random", test_delete_random);
+  g_test_add_func ("/PieceTable/delete_large", test_delete_large);
+  g_test_add_func ("/PieceTable/copy", test_copy);
+  g_test_add_func ("/PieceTable/copy_random", test_copy_random);
+  g_test_add_func ("/PieceTable/copy_chain", test_copy_chain);
+  g_test_add_func ("/PieceTable/typing", test_typing);
+  g_test_add_func ("/PieceTable/new_from_entries", test_new_from_entries);
+  g_test_add_func ("/PieceTable/apply_edits", test_apply_edits);
+  g_test_add_func ("/PieceTable/iter", test_iter);
+  g_test_add_func ("/PieceTable/get_entries", test_get_entries);
+  g_test_add_func ("/PieceTable/text", test_text);
+  g_test_add_func ("/PieceTable/save", test_save);
+  g_test_add_func ("/PieceTable/lines", test_lines);
+  g_test_add_func ("/PieceTable/code_units", test_code_units);
+  g_test_add_func ("/PieceTable/undo", test_undo);
+  g_test_add_func ("/PieceTable/snapshot", test_snapshot);
+  g_test_add_func ("/PieceTable/publish", test_publish);
+  g_test_add_func ("/PieceTable/map_reduce", test_map_reduce);
+  g_test_add_func ("/PieceTable/find", test_find);
+  g_test_add_func ("/PieceTable/max_length", test_max_length);
   return g_test_run ();
 }
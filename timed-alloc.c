@@ -0,0 +1,83 @@
+#include "piece-table.h"
+
+#define N_INSERTS 1000000
+#define N_ROUNDS  10
+
+/*
+ * Measures the node allocator: building large tables from random inserts
+ * (which allocate a node for every split), repeatedly deleting and
+ * re-inserting ranges (which releases nodes and allocates them again) and
+ * closing large documents, with and without a snapshot still open.
+ */
+
+static PieceTable *
+build (guint n_inserts)
+{
+  PieceTable *table = piece_table_new ();
+
+  for (guint i = 0; i < n_inserts; i++)
+    piece_table_insert (table,
+                        g_random_int_range (0, piece_table_get_length (table) + 1),
+                        PIECE_CHANGE,
+                        i,
+                        g_random_int_range (1, 32));
+
+  return table;
+}
+
+gint
+main (gint argc,
+      gchar *argv[])
+{
+  PieceTable *table;
+  PieceTable *snapshot;
+  GTimer *t;
+  gdouble elapsed;
+
+  t = g_timer_new ();
+
+  table = build (N_INSERTS);
+  g_print ("%u random inserts: %lf seconds\n", N_INSERTS, g_timer_elapsed (t, NULL));
+
+  g_timer_start (t);
+
+  for (guint i = 0; i < N_ROUNDS; i++)
+    {
+      guint64 length = piece_table_get_length (table);
+      guint64 position = g_random_int_range (0, length / 2);
+
+      piece_table_delete (table, position, length / 4);
+
+      for (guint j = 0; j < N_INSERTS / N_ROUNDS / 4; j++)
+        piece_table_insert (table,
+                            g_random_int_range (0, piece_table_get_length (table) + 1),
+                            PIECE_CHANGE,
+                            j,
+                            g_random_int_range (1, 32));
+    }
+
+  g_print ("%u rounds of deleting a quarter and re-inserting: %lf seconds\n",
+           N_ROUNDS, g_timer_elapsed (t, NULL));
+
+  g_timer_start (t);
+  piece_table_free (table);
+  g_print ("Closing the document: %lf seconds\n", g_timer_elapsed (t, NULL));
+
+  /* Nodes shared with a snapshot must be released one at a time */
+  table = build (N_INSERTS);
+  snapshot = piece_table_snapshot (table);
+  piece_table_insert (table, 0, PIECE_CHANGE, 0, 1);
+
+  g_timer_start (t);
+  piece_table_free (table);
+  elapsed = g_timer_elapsed (t, NULL);
+  g_timer_start (t);
+  piece_table_free (snapshot);
+
+  g_print ("Closing the document with a snapshot open: %lf seconds, then the snapshot: %lf seconds\n",
+           elapsed, g_timer_elapsed (t, NULL));
+
+  g_timer_destroy (t);
+
+  return 0;
+}
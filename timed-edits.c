@@ -0,0 +1,116 @@
+#include "piece-table.h"
+
+#define N_INITIAL 1000000
+#define N_BATCHES 200
+#define N_EDITS   500
+
+/*
+ * Compares applying batches of sorted edits (such as those produced by a
+ * formatter) with piece_table_apply_edits() against issuing each edit
+ * individually with piece_table_insert() and piece_table_delete().
+ */
+
+static PieceTable *
+build_table (void)
+{
+  PieceTableEntry *entries = g_new (PieceTableEntry, N_INITIAL);
+  PieceTable *table;
+
+  for (guint i = 0; i < N_INITIAL; i++)
+    {
+      entries[i].kind = PIECE_INITIAL;
+      entries[i].offset = (guint64)i * 64;
+      entries[i].length = 1 + (i % 31);
+    }
+
+  table = piece_table_new_from_entries (entries, N_INITIAL, 0.0);
+  g_free (entries);
+
+  return table;
+}
+
+gint
+main (gint argc,
+      gchar *argv[])
+{
+  PieceTableEdit *edits = g_new (PieceTableEdit, N_BATCHES * N_EDITS);
+  PieceTable *table;
+  guint64 length;
+  GTimer *t;
+
+  g_print ("Generating %u batches of %u edits before starting timer.\n", N_BATCHES, N_EDITS);
+
+  table = build_table ();
+  length = piece_table_get_length (table);
+
+  for (guint b = 0; b < N_BATCHES; b++)
+    {
+      PieceTableEdit *batch = &edits[b * N_EDITS];
+      guint64 position = g_random_int_range (0, length / 2);
+
+      /* Each batch touches a region of the document like a formatter would */
+      for (guint i = 0; i < N_EDITS; i++)
+        {
+          position += g_random_int_range (1, 64);
+          batch[i].position = position;
+
+          if (i % 2)
+            {
+              batch[i].edit = PIECE_EDIT_DELETE;
+              batch[i].kind = PIECE_INITIAL;
+              batch[i].offset = 0;
+              batch[i].length = g_random_int_range (1, 4);
+              position += batch[i].length;
+            }
+          else
+            {
+              batch[i].edit = PIECE_EDIT_INSERT;
+              batch[i].kind = PIECE_CHANGE;
+              batch[i].offset = (guint64)(b * N_EDITS + i) * 8;
+              batch[i].length = g_random_int_range (1, 4);
+            }
+        }
+    }
+
+  g_print ("Starting timer\n");
+  t = g_timer_new ();
+
+  for (guint b = 0; b < N_BATCHES; b++)
+    {
+      const PieceTableEdit *batch = &edits[b * N_EDITS];
+      gint64 shift = 0;
+
+      for (guint i = 0; i < N_EDITS; i++)
+        {
+          if (batch[i].edit == PIECE_EDIT_DELETE)
+            {
+              piece_table_delete (table, batch[i].position + shift, batch[i].length);
+              shift -= batch[i].length;
+            }
+          else
+            {
+              piece_table_insert (table, batch[i].position + shift,
+                                  batch[i].kind, batch[i].offset, batch[i].length);
+              shift += batch[i].length;
+            }
+        }
+    }
+
+  g_print ("One at a time: %lf seconds\n", g_timer_elapsed (t, NULL));
+  piece_table_free (table);
+
+  table = build_table ();
+
+  g_timer_start (t);
+
+  for (guint b = 0; b < N_BATCHES; b++)
+    piece_table_apply_edits (table, &edits[b * N_EDITS], N_EDITS);
+
+  g_print ("piece_table_apply_edits: %lf seconds\n", g_timer_elapsed (t, NULL));
+  piece_table_free (table);
+
+  g_timer_destroy (t);
+  g_free (edits);
+
+  return 0;
+}
@@ -0,0 +1,102 @@
+#include "piece-table.h"
+
+#define N_INITIAL    200000
+#define N_KEYSTROKES 500000
+#define N_DELETES    50000
+#define N_LOOKUPS    500000
+#define N_SCANS      20
+
+/*
+ * Runs a mix of workloads representative of an editor and prints the time
+ * taken by each on a single line. tune-fanout.sh builds this at a range
+ * of fanouts to find the best for a machine.
+ */
+
+gint
+main (gint argc,
+      gchar *argv[])
+{
+  PieceTable *table = piece_table_new ();
+  PieceTableEntry entries[64];
+  PieceTableCounts counts;
+  gdouble elapsed[5];
+  gdouble total = 0;
+  /* Printed so that builds at different fanouts can be seen to agree */
+  guint64 checksum = 0;
+  guint64 cursor;
+  GRand *rand;
+  GTimer *t;
+
+  /* The same edits for every build, so that the trees compared match */
+  rand = g_rand_new_with_seed (0x5eed);
+  t = g_timer_new ();
+
+  for (guint i = 0; i < N_INITIAL; i++)
+    piece_table_insert_text (table,
+                             g_rand_int_range (rand, 0, piece_table_get_length (table) + 1),
+                             "abcdefghijklmnopqrstuvwxyz\n",
+                             g_rand_int_range (rand, 1, 28));
+
+  elapsed[0] = g_timer_elapsed (t, NULL);
+  g_timer_start (t);
+
+  cursor = piece_table_get_length (table) / 2;
+
+  for (guint i = 0; i < N_KEYSTROKES; i++)
+    {
+      if (i % 1000 == 0)
+        cursor = g_rand_int_range (rand, 0, piece_table_get_length (table) + 1);
+
+      piece_table_insert_text (table, cursor++, "x", 1);
+    }
+
+  elapsed[1] = g_timer_elapsed (t, NULL);
+  g_timer_start (t);
+
+  for (guint i = 0; i < N_DELETES; i++)
+    piece_table_delete (table,
+                        g_rand_int_range (rand, 0, piece_table_get_length (table) - 16),
+                        g_rand_int_range (rand, 1, 16));
+
+  elapsed[2] = g_timer_elapsed (t, NULL);
+  g_timer_start (t);
+
+  for (guint i = 0; i < N_LOOKUPS; i++)
+    {
+      guint64 offset = g_rand_int_range (rand, 0, piece_table_get_length (table));
+
+      if (i & 1)
+        checksum += piece_table_offset_to_line (table, offset);
+      else
+        {
+          piece_table_get_counts (table, offset, &counts);
+          checksum += counts.code_points;
+        }
+    }
+
+  elapsed[3] = g_timer_elapsed (t, NULL);
+  g_timer_start (t);
+
+  for (guint i = 0; i < N_SCANS; i++)
+    {
+      guint64 position = 0;
+
+      while (piece_table_get_entries (table, &position, piece_table_get_length (table),
+                                      entries, G_N_ELEMENTS (entries)))
+        ;
+    }
+
+  elapsed[4] = g_timer_elapsed (t, NULL);
+
+  for (guint i = 0; i < G_N_ELEMENTS (elapsed); i++)
+    total += elapsed[i];
+
+  g_print ("random %lf typing %lf delete %lf lookup %lf scan %lf total %lf (%"G_GUINT64_FORMAT")\n",
+           elapsed[0], elapsed[1], elapsed[2], elapsed[3], elapsed[4], total, checksum);
+
+  g_rand_free (rand);
+  g_timer_destroy (t);
+  piece_table_free (table);
+
+  return 0;
+}
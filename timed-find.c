@@ -0,0 +1,117 @@
+#include <string.h>
+
+#include "piece-table.h"
+
+#define N_EDITS 100000
+
+/*
+ * Compares finding every occurrence of a word by copying the text out of
+ * the table and scanning the copy, against piece_table_find() which scans
+ * the pieces where they are. The size of the text in megabytes may be
+ * provided as the first argument.
+ */
+
+static guint
+count_copied (PieceTable  *table,
+              const gchar *needle)
+{
+  g_autofree gchar *text = piece_table_get_text (table, 0, piece_table_get_length (table));
+  gsize needle_len = strlen (needle);
+  gsize length = piece_table_get_length (table);
+  guint n = 0;
+
+  for (gsize i = 0; i + needle_len <= length; i++)
+    {
+      if (text[i] == needle[0] && memcmp (text + i, needle, needle_len) == 0)
+        n++;
+    }
+
+  return n;
+}
+
+static guint
+count_found (PieceTable  *table,
+             const gchar *needle)
+{
+  guint64 match;
+  guint n = 0;
+
+  for (guint64 from = 0; piece_table_find (table, needle, -1, from, &match); from = match + 1)
+    n++;
+
+  return n;
+}
+
+static guint
+count_found_backward (PieceTable  *table,
+                      const gchar *needle)
+{
+  guint64 position = piece_table_get_length (table);
+  guint64 match;
+  guint n = 0;
+
+  while (piece_table_find_backward (table, needle, -1, position, &match))
+    {
+      position = match + strlen (needle) - 1;
+      n++;
+    }
+
+  return n;
+}
+
+gint
+main (gint argc,
+      gchar *argv[])
+{
+  static const gchar *needles[] = { "quartz", "the lazy dog", "lazy dog\nThe quick", "not in the text" };
+  PieceTable *table = piece_table_new ();
+  guint64 size_mb = 64;
+  GTimer *t;
+
+  if (argc > 1)
+    size_mb = g_ascii_strtoull (argv[1], NULL, 10);
+
+  g_print ("Generating %"G_GUINT64_FORMAT" MB with %u edits before starting timer.\n",
+           size_mb, N_EDITS);
+
+  while (piece_table_get_length (table) < size_mb * 1024 * 1024)
+    piece_table_insert_text (table, piece_table_get_length (table),
+                             "The quick brown fox jumps over the lazy dog\n", -1);
+
+  for (guint i = 0; i < N_EDITS; i++)
+    piece_table_insert_text (table,
+                             g_random_int_range (0, piece_table_get_length (table) + 1),
+                             "quartz ", -1);
+
+  t = g_timer_new ();
+
+  for (guint i = 0; i < G_N_ELEMENTS (needles); i++)
+    {
+      g_autofree gchar *escaped = g_strescape (needles[i], NULL);
+      guint copied, found, backward;
+      gdouble copied_time, found_time, backward_time;
+
+      g_timer_start (t);
+      copied = count_copied (table, needles[i]);
+      copied_time = g_timer_elapsed (t, NULL);
+
+      g_timer_start (t);
+      found = count_found (table, needles[i]);
+      found_time = g_timer_elapsed (t, NULL);
+
+      g_timer_start (t);
+      backward = count_found_backward (table, needles[i]);
+      backward_time = g_timer_elapsed (t, NULL);
+
+      g_print ("%-30s %8u matches: copied %lf, found %lf, backward %lf seconds\n",
+               escaped, found, copied_time, found_time, backward_time);
+
+      g_assert_cmpint (found, ==, copied);
+      g_assert_cmpint (backward, ==, copied);
+    }
+
+  g_timer_destroy (t);
+  piece_table_free (table);
+
+  return 0;
+}
@@ -0,0 +1,136 @@
+#include <linux/perf_event.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "piece-table.h"
+
+#define N_PIECES  1000000
+#define N_LOOKUPS 2000000
+
+/*
+ * Compares the memory used by a large table, and the cost (and where the
+ * kernel allows it, the cache misses) of descending it, between builds
+ * with and without PIECE_TABLE_COMPACT or PIECE_TABLE_SOA. Build
+ * timed-layout, timed-layout-compact and timed-layout-soa and compare
+ * their output.
+ */
+
+static gint
+open_cache_misses (void)
+{
+  struct perf_event_attr attr;
+
+  memset (&attr, 0, sizeof attr);
+  attr.type = PERF_TYPE_HARDWARE;
+  attr.size = sizeof attr;
+  attr.config = PERF_COUNT_HW_CACHE_MISSES;
+  attr.disabled = 1;
+  attr.exclude_kernel = 1;
+  attr.exclude_hv = 1;
+
+  return syscall (SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+static guint64
+resident_bytes (void)
+{
+  g_autofree gchar *contents = NULL;
+  guint64 pages = 0;
+
+  if (g_file_get_contents ("/proc/self/statm", &contents, NULL, NULL))
+    sscanf (contents, "%*u %"G_GUINT64_FORMAT, &pages);
+
+  return pages * sysconf (_SC_PAGESIZE);
+}
+
+gint
+main (gint argc,
+      gchar *argv[])
+{
+  PieceTable *table;
+  PieceTableCounts counts;
+  guint64 before;
+  guint64 misses = 0;
+  guint64 sum = 0;
+  GTimer *t;
+  gint fd;
+
+  g_print ("%s layout%s: %u byte entries\n",
+#ifdef PIECE_TABLE_COMPACT
+           "Compact",
+#else
+           "Wide",
+#endif
+#ifdef PIECE_TABLE_SOA
+           " with structure-of-arrays leaves",
+#else
+           "",
+#endif
+           (guint)sizeof (PieceTableEntry));
+
+  before = resident_bytes ();
+  t = g_timer_new ();
+  table = piece_table_new ();
+
+  for (guint i = 0; i < N_PIECES; i++)
+    piece_table_insert (table,
+                        g_random_int_range (0, piece_table_get_length (table) + 1),
+                        PIECE_CHANGE,
+                        (guint64)i * 32,
+                        g_random_int_range (1, 32));
+
+  g_print ("%u random inserts: %lf seconds, %"G_GUINT64_FORMAT" KiB resident\n",
+           N_PIECES, g_timer_elapsed (t, NULL), (resident_bytes () - before) / 1024);
+
+  fd = open_cache_misses ();
+  if (fd >= 0)
+    ioctl (fd, PERF_EVENT_IOC_ENABLE, 0);
+
+  g_timer_start (t);
+
+  for (guint i = 0; i < N_LOOKUPS; i++)
+    {
+      piece_table_get_counts (table, g_random_int_range (0, piece_table_get_length (table)), &counts);
+      sum += counts.code_points;
+    }
+
+  if (fd >= 0)
+    {
+      ioctl (fd, PERF_EVENT_IOC_DISABLE, 0);
+      if (read (fd, &misses, sizeof misses) != sizeof misses)
+        misses = 0;
+      close (fd);
+    }
+
+  g_print ("%u random descents: %lf seconds", N_LOOKUPS, g_timer_elapsed (t, NULL));
+  if (fd >= 0)
+    g_print (", %.2lf cache misses each\n", (gdouble)misses / N_LOOKUPS);
+  else
+    g_print (" (cache misses unavailable)\n");
+
+  /* Locating an entry only compares lengths, without summing counts */
+  g_timer_start (t);
+
+  for (guint i = 0; i < N_LOOKUPS; i++)
+    {
+      PieceTableIter iter;
+      guint64 position;
+
+      piece_table_iter_init_at_offset (&iter, table, g_random_int_range (0, piece_table_get_length (table)));
+      sum += piece_table_iter_get_entry (&iter, &position)->length;
+    }
+
+  g_print ("%u random entry lookups: %lf seconds\n", N_LOOKUPS, g_timer_elapsed (t, NULL));
+
+  /* Keep the lookups from being optimized away */
+  if (sum == 0)
+    g_print ("\n");
+
+  piece_table_free (table);
+  g_timer_destroy (t);
+
+  return 0;
+}
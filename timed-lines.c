@@ -0,0 +1,94 @@
+#include <glib/gstdio.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "piece-table.h"
+
+#define N_EDITS   10000
+#define N_LOOKUPS 1000000
+
+/*
+ * Opens a file and applies scattered edits, then measures random
+ * conversions between lines and offsets. The size of the file in
+ * megabytes may be provided as the first argument.
+ */
+
+gint
+main (gint argc,
+      gchar *argv[])
+{
+  g_autoptr(GError) error = NULL;
+  g_autofree gchar *filename = NULL;
+  g_autofree gchar *block = NULL;
+  PieceTable *table;
+  GTimer *t;
+  guint64 size_mb = 256;
+  guint64 n_lines;
+  guint64 sum = 0;
+  FILE *fp;
+  gint fd;
+
+  if (argc > 1)
+    size_mb = g_ascii_strtoull (argv[1], NULL, 10);
+
+  g_print ("Generating a %"G_GUINT64_FORMAT" MB file before starting timer.\n", size_mb);
+
+  fd = g_file_open_tmp ("timed-lines-XXXXXX", &filename, &error);
+  g_assert_no_error (error);
+  g_close (fd, NULL);
+
+  block = g_malloc (1024 * 1024);
+  for (guint i = 0; i < 1024 * 1024; i++)
+    block[i] = (i % 80) == 79 ? '\n' : 'a' + (i % 26);
+
+  fp = fopen (filename, "w");
+  for (guint64 i = 0; i < size_mb; i++)
+    fwrite (block, 1, 1024 * 1024, fp);
+  fclose (fp);
+
+  g_print ("Starting timer\n");
+  t = g_timer_new ();
+
+  table = piece_table_new_for_file (filename, &error);
+  g_assert_no_error (error);
+
+  g_print ("piece_table_new_for_file: %lf seconds\n", g_timer_elapsed (t, NULL));
+
+  for (guint i = 0; i < N_EDITS; i++)
+    {
+      guint64 position = g_random_int_range (0, piece_table_get_length (table));
+
+      if (i % 2)
+        piece_table_insert_text (table, position, "a line\n", -1);
+      else
+        piece_table_delete (table, position, 3);
+    }
+
+  n_lines = piece_table_get_n_lines (table);
+
+  g_timer_start (t);
+
+  for (guint i = 0; i < N_LOOKUPS; i++)
+    sum += piece_table_line_to_offset (table, g_random_int_range (0, n_lines));
+
+  g_print ("piece_table_line_to_offset: %lf usec per lookup\n",
+           g_timer_elapsed (t, NULL) * G_USEC_PER_SEC / N_LOOKUPS);
+
+  g_timer_start (t);
+
+  for (guint i = 0; i < N_LOOKUPS; i++)
+    sum += piece_table_offset_to_line (table, g_random_int_range (0, piece_table_get_length (table)));
+
+  g_print ("piece_table_offset_to_line: %lf usec per lookup\n",
+           g_timer_elapsed (t, NULL) * G_USEC_PER_SEC / N_LOOKUPS);
+
+  /* Keep the lookups from being optimized away */
+  if (sum == 0)
+    g_print ("\n");
+
+  g_timer_destroy (t);
+  piece_table_free (table);
+  g_unlink (filename);
+
+  return 0;
+}
@@ -0,0 +1,131 @@
+#include "linked-array.h"
+
+#define N_ITEMS  26
+#define N_ROUNDS 2000000
+
+/*
+ * Times the LINKED_ARRAY operations the tree relies on, using elements the
+ * size of a piece and the default fanout. Build with
+ * -DLINKED_ARRAY_PERMUTATION (timed-linked-array-permutation) to compare
+ * the two ways of keeping the logical order.
+ */
+
+typedef struct
+{
+  guint64 data[5];
+} Element;
+
+typedef LINKED_ARRAY_FIELD(Element, N_ITEMS) ElementArray;
+
+gint
+main (gint argc,
+      gchar *argv[])
+{
+  ElementArray array;
+  ElementArray left;
+  ElementArray split;
+  /* Positions are drawn up front so that the generator is not timed */
+  guint8 *positions = g_new (guint8, N_ROUNDS * N_ITEMS);
+  guint64 checksum = 0;
+  gdouble elapsed[5];
+  GRand *rand;
+  GTimer *t;
+
+  rand = g_rand_new_with_seed (0x5eed);
+
+  for (guint i = 0; i < N_ROUNDS * N_ITEMS; i++)
+    positions[i] = g_rand_int_range (rand, 0, (i % N_ITEMS) + 1);
+
+  t = g_timer_new ();
+
+  for (guint r = 0; r < N_ROUNDS; r++)
+    {
+      const guint8 *p = &positions[r * N_ITEMS];
+
+      LINKED_ARRAY_INIT (&array);
+
+      for (guint i = 0; i < N_ITEMS; i++)
+        {
+          Element element = { { i } };
+          LINKED_ARRAY_INSERT_VAL (&array, p[i], element);
+        }
+
+      checksum += LINKED_ARRAY_PEEK_HEAD (&array).data[0];
+    }
+
+  elapsed[0] = g_timer_elapsed (t, NULL);
+  g_timer_start (t);
+
+  for (guint r = 0; r < N_ROUNDS; r++)
+    {
+      const guint8 *p = &positions[r * N_ITEMS];
+
+      for (guint i = 0; i < N_ITEMS; i++)
+        checksum += LINKED_ARRAY_NTH (&array, p[i] % N_ITEMS)->data[0];
+    }
+
+  elapsed[1] = g_timer_elapsed (t, NULL);
+  g_timer_start (t);
+
+  for (guint r = 0; r < N_ROUNDS; r++)
+    {
+      LINKED_ARRAY_FOREACH (&array, Element, element, {
+        checksum += element->data[0];
+      });
+    }
+
+  elapsed[2] = g_timer_elapsed (t, NULL);
+  g_timer_start (t);
+
+  for (guint r = 0; r < N_ROUNDS; r++)
+    {
+      const guint8 *p = &positions[r * N_ITEMS];
+
+      /* Refill with the elements removed, so that each round starts full */
+      for (guint i = 0; i < N_ITEMS; i++)
+        {
+          guint position = p[N_ITEMS - 1 - i] % (N_ITEMS - i);
+          Element element = *LINKED_ARRAY_NTH (&array, position);
+
+          LINKED_ARRAY_REMOVE_INDEX (&array, position);
+          checksum += element.data[0];
+        }
+
+      for (guint i = 0; i < N_ITEMS; i++)
+        {
+          Element element = { { i } };
+          LINKED_ARRAY_INSERT_VAL (&array, p[i], element);
+        }
+    }
+
+  elapsed[3] = g_timer_elapsed (t, NULL);
+  g_timer_start (t);
+
+  /* Each round splits a copy of the full, shuffled array */
+  for (guint r = 0; r < N_ROUNDS; r++)
+    {
+      left = array;
+      LINKED_ARRAY_SPLIT (&left, &split);
+      checksum += LINKED_ARRAY_PEEK_HEAD (&split).data[0];
+    }
+
+  elapsed[4] = g_timer_elapsed (t, NULL);
+
+#ifdef LINKED_ARRAY_PERMUTATION
+  g_print ("Permutation backend, %u items\n", N_ITEMS);
+#else
+  g_print ("Linked backend, %u items\n", N_ITEMS);
+#endif
+  g_print ("%u rounds of random inserts took %lf seconds\n", N_ROUNDS, elapsed[0]);
+  g_print ("%u random nth lookups took %lf seconds\n", N_ROUNDS * N_ITEMS, elapsed[1]);
+  g_print ("%u full iterations took %lf seconds\n", N_ROUNDS, elapsed[2]);
+  g_print ("%u rounds of random removes and inserts took %lf seconds\n", N_ROUNDS, elapsed[3]);
+  g_print ("%u splits took %lf seconds\n", N_ROUNDS, elapsed[4]);
+  g_print ("(%"G_GUINT64_FORMAT")\n", checksum);
+
+  g_rand_free (rand);
+  g_timer_destroy (t);
+  g_free (positions);
+
+  return 0;
+}
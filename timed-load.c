@@ -0,0 +1,53 @@
+#include "piece-table.h"
+
+#define N_ENTRIES 5000000
+
+/*
+ * Compares loading a table one entry at a time with piece_table_insert()
+ * against building it in a single pass with piece_table_new_from_entries().
+ */
+
+gint
+main (gint argc,
+      gchar *argv[])
+{
+  PieceTableEntry *entries = g_new (PieceTableEntry, N_ENTRIES);
+  PieceTable *table;
+  guint64 position = 0;
+  GTimer *t;
+
+  g_print ("Generating %u entries before starting timer.\n", N_ENTRIES);
+
+  for (guint i = 0; i < N_ENTRIES; i++)
+    {
+      /* Leave gaps so that entries are not chained together */
+      entries[i].kind = i & 1;
+      entries[i].offset = (guint64)i * 64;
+      entries[i].length = g_random_int_range (1, 32);
+    }
+
+  g_print ("Starting timer\n");
+  t = g_timer_new ();
+
+  table = piece_table_new ();
+  for (guint i = 0; i < N_ENTRIES; i++)
+    {
+      piece_table_insert (table, position, entries[i].kind, entries[i].offset, entries[i].length);
+      position += entries[i].length;
+    }
+
+  g_print ("piece_table_insert: %lf seconds\n", g_timer_elapsed (t, NULL));
+  piece_table_free (table);
+
+  g_timer_start (t);
+
+  table = piece_table_new_from_entries (entries, N_ENTRIES, 0.0);
+
+  g_print ("piece_table_new_from_entries: %lf seconds\n", g_timer_elapsed (t, NULL));
+  piece_table_free (table);
+
+  g_timer_destroy (t);
+  g_free (entries);
+
+  return 0;
+}
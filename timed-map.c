@@ -0,0 +1,163 @@
+#include <glib/gstdio.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "piece-table.h"
+
+#define N_EDITS 10000
+
+/*
+ * Compares counting the words of a file on a single thread against
+ * piece_table_map_reduce(). The size of the file in megabytes may be
+ * provided as the first argument.
+ */
+
+typedef struct
+{
+  guint64  n_words;
+  gboolean starts_in_word;
+  gboolean ends_in_word;
+} WordCount;
+
+static void
+count_words (WordCount   *count,
+             const gchar *data,
+             gsize        length,
+             gboolean    *in_word)
+{
+  for (gsize i = 0; i < length; i++)
+    {
+      gboolean is_word = data[i] != ' ' && data[i] != '\n';
+
+      if (is_word && !*in_word)
+        count->n_words++;
+      *in_word = is_word;
+    }
+}
+
+static gpointer
+map_words (PieceTable *table,
+           guint64     position,
+           guint64     length,
+           gpointer    user_data)
+{
+  WordCount *count = g_new0 (WordCount, 1);
+  struct iovec iov[64];
+  guint64 end = position + length;
+  gboolean in_word = FALSE;
+  gboolean first = TRUE;
+  gsize n;
+
+  while ((n = piece_table_get_iovecs (table, &position, end, iov, G_N_ELEMENTS (iov))))
+    {
+      if (first)
+        {
+          const gchar *c = iov[0].iov_base;
+
+          count->starts_in_word = *c != ' ' && *c != '\n';
+          first = FALSE;
+        }
+
+      for (gsize i = 0; i < n; i++)
+        count_words (count, iov[i].iov_base, iov[i].iov_len, &in_word);
+    }
+
+  count->ends_in_word = in_word;
+
+  return count;
+}
+
+static gpointer
+reduce_words (gpointer left,
+              gpointer right,
+              gpointer user_data)
+{
+  WordCount *l = left;
+  WordCount *r = right;
+
+  /* A word spanning both ranges was counted twice */
+  l->n_words += r->n_words - (l->ends_in_word && r->starts_in_word);
+  l->ends_in_word = r->ends_in_word;
+  g_free (r);
+
+  return l;
+}
+
+gint
+main (gint argc,
+      gchar *argv[])
+{
+  g_autoptr(GError) error = NULL;
+  g_autofree gchar *filename = NULL;
+  g_autofree gchar *block = NULL;
+  PieceTable *table;
+  WordCount *count;
+  WordCount single = { 0 };
+  gboolean in_word = FALSE;
+  struct iovec iov[64];
+  guint64 position = 0;
+  guint64 size_mb = 1024;
+  GTimer *t;
+  FILE *fp;
+  gsize n;
+  gint fd;
+
+  if (argc > 1)
+    size_mb = g_ascii_strtoull (argv[1], NULL, 10);
+
+  g_print ("Generating a %"G_GUINT64_FORMAT" MB file before starting timer.\n", size_mb);
+
+  fd = g_file_open_tmp ("timed-map-XXXXXX", &filename, &error);
+  g_assert_no_error (error);
+  g_close (fd, NULL);
+
+  block = g_malloc (1024 * 1024);
+  for (guint i = 0; i < 1024 * 1024; i++)
+    block[i] = (i % 80) == 79 ? '\n' : (i % 7) == 6 ? ' ' : 'a' + (i % 26);
+
+  fp = fopen (filename, "w");
+  for (guint64 i = 0; i < size_mb; i++)
+    fwrite (block, 1, 1024 * 1024, fp);
+  fclose (fp);
+
+  table = piece_table_new_for_file (filename, &error);
+  g_assert_no_error (error);
+
+  for (guint i = 0; i < N_EDITS; i++)
+    {
+      guint64 at = g_random_int_range (0, piece_table_get_length (table));
+
+      piece_table_insert_text (table, at, "an edit ", -1);
+    }
+
+  g_print ("%u processors\n", g_get_num_processors ());
+  g_print ("Starting timer\n");
+  t = g_timer_new ();
+
+  while ((n = piece_table_get_iovecs (table, &position, piece_table_get_length (table), iov, G_N_ELEMENTS (iov))))
+    {
+      for (gsize i = 0; i < n; i++)
+        count_words (&single, iov[i].iov_base, iov[i].iov_len, &in_word);
+    }
+
+  g_print ("Single thread: %"G_GUINT64_FORMAT" words in %lf seconds\n",
+           single.n_words, g_timer_elapsed (t, NULL));
+
+  g_timer_start (t);
+
+  count = piece_table_map_reduce (table, 0, piece_table_get_length (table),
+                                  map_words, reduce_words, NULL);
+
+  g_print ("piece_table_map_reduce: %"G_GUINT64_FORMAT" words in %lf seconds\n",
+           count->n_words, g_timer_elapsed (t, NULL));
+
+  g_assert_cmpint (count->n_words, ==, single.n_words);
+
+  g_free (count);
+  g_timer_destroy (t);
+  piece_table_free (table);
+
+  g_unlink (filename);
+
+  return 0;
+}
@@ -0,0 +1,53 @@
+#include "piece-table.h"
+
+#define N_INITIAL 1000000
+#define N_INSERTS 10000000
+
+/*
+ * Measures the cost of propagating a length change from a leaf up to the
+ * root. Each insert extends the piece under the cursor by a single byte,
+ * so the leaf is found using the cached finger and no entries or nodes
+ * are added. What remains is updating each ancestor along the way up.
+ */
+
+gint
+main (gint argc,
+      gchar *argv[])
+{
+  PieceTable *table = piece_table_new ();
+  GTimer *t;
+  guint64 cursor;
+  guint64 offset;
+
+  g_print ("Generating a tree with %u pieces before starting timer.\n", N_INITIAL);
+
+  for (guint i = 0; i < N_INITIAL; i++)
+    piece_table_insert (table,
+                        g_random_int_range (0, piece_table_get_length (table) + 1),
+                        PIECE_INITIAL,
+                        (guint64)i * 64,
+                        g_random_int_range (1, 32));
+
+  cursor = piece_table_get_length (table) / 2;
+  offset = G_MAXUINT32;
+
+  /* Place a piece under the cursor that we can keep extending */
+  piece_table_insert (table, cursor, PIECE_CHANGE, offset, 1);
+  cursor++;
+  offset++;
+
+  g_print ("Starting timer\n");
+  t = g_timer_new ();
+
+  for (guint i = 0; i < N_INSERTS; i++)
+    piece_table_insert (table, cursor++, PIECE_CHANGE, offset++, 1);
+
+  g_print ("Done. %lf seconds (%lf nsec per insert)\n",
+           g_timer_elapsed (t, NULL),
+           g_timer_elapsed (t, NULL) * 1000000000.0 / N_INSERTS);
+  g_timer_destroy (t);
+
+  piece_table_free (table);
+
+  return 0;
+}
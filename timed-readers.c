@@ -0,0 +1,157 @@
+#include "piece-table.h"
+
+#define N_INITIAL    100000
+#define READ_LENGTH  256
+#define DURATION_MS  500
+
+/*
+ * Measures how many reads per second a number of reader threads manage
+ * while a writer types continuously, either sharing the table behind a
+ * mutex or reading versions published with piece_table_publish().
+ */
+
+typedef struct
+{
+  PieceTable       *table;
+  PieceTableReader *reader;
+  GMutex           *mutex;
+  gint             *done;
+  guint64           n_reads;
+} Worker;
+
+static void
+read_range (PieceTable *table,
+            guint       seed)
+{
+  guint64 length = piece_table_get_length (table);
+  guint64 position = (guint64)seed * 7919 % (length - READ_LENGTH);
+  g_autofree gchar *text = piece_table_get_text (table, position, READ_LENGTH);
+
+  (void)piece_table_offset_to_line (table, position);
+}
+
+static gpointer
+read_locked (gpointer data)
+{
+  Worker *worker = data;
+
+  while (!g_atomic_int_get (worker->done))
+    {
+      g_mutex_lock (worker->mutex);
+      read_range (worker->table, worker->n_reads);
+      g_mutex_unlock (worker->mutex);
+      worker->n_reads++;
+    }
+
+  return NULL;
+}
+
+static gpointer
+read_published (gpointer data)
+{
+  Worker *worker = data;
+
+  while (!g_atomic_int_get (worker->done))
+    {
+      read_range (piece_table_reader_pin (worker->reader), worker->n_reads);
+      piece_table_reader_unpin (worker->reader);
+      worker->n_reads++;
+    }
+
+  return NULL;
+}
+
+static void
+run (PieceTable *table,
+     guint       n_readers,
+     gboolean    publish)
+{
+  Worker *workers = g_new0 (Worker, n_readers);
+  GThread **threads = g_new0 (GThread *, n_readers);
+  GMutex mutex;
+  gint done = FALSE;
+  guint64 cursor = piece_table_get_length (table) / 2;
+  guint64 n_edits = 0;
+  guint64 n_reads = 0;
+  gint64 end;
+
+  g_mutex_init (&mutex);
+
+  for (guint i = 0; i < n_readers; i++)
+    {
+      workers[i].table = table;
+      workers[i].mutex = &mutex;
+      workers[i].done = &done;
+
+      if (publish)
+        {
+          workers[i].reader = piece_table_reader_new (table);
+          threads[i] = g_thread_new ("reader", read_published, &workers[i]);
+        }
+      else
+        threads[i] = g_thread_new ("reader", read_locked, &workers[i]);
+    }
+
+  end = g_get_monotonic_time () + DURATION_MS * 1000;
+
+  while (g_get_monotonic_time () < end)
+    {
+      if (!publish)
+        g_mutex_lock (&mutex);
+
+      piece_table_insert_text (table, cursor++, "x", 1);
+
+      if (publish)
+        piece_table_publish (table);
+      else
+        g_mutex_unlock (&mutex);
+
+      n_edits++;
+    }
+
+  g_atomic_int_set (&done, TRUE);
+
+  for (guint i = 0; i < n_readers; i++)
+    {
+      g_thread_join (threads[i]);
+      piece_table_reader_free (workers[i].reader);
+      n_reads += workers[i].n_reads;
+    }
+
+  g_print ("%-9s %2u readers: %10.0lf reads/sec, %9.0lf edits/sec\n",
+           publish ? "Published" : "Mutex", n_readers,
+           n_reads * 1000.0 / DURATION_MS,
+           n_edits * 1000.0 / DURATION_MS);
+
+  g_mutex_clear (&mutex);
+  g_free (threads);
+  g_free (workers);
+}
+
+gint
+main (gint argc,
+      gchar *argv[])
+{
+  PieceTable *table = piece_table_new ();
+  guint max_readers = MAX (4, g_get_num_processors ());
+
+  g_print ("Generating %u random edits before starting timer.\n", N_INITIAL);
+
+  for (guint i = 0; i < N_INITIAL; i++)
+    piece_table_insert_text (table,
+                             g_random_int_range (0, piece_table_get_length (table) + 1),
+                             "abcdefghijklmnopqrstuvwxyz\n",
+                             g_random_int_range (1, 28));
+
+  g_print ("%u processors\n", g_get_num_processors ());
+
+  for (guint n = 1; n <= max_readers; n *= 2)
+    {
+      run (table, n, FALSE);
+      run (table, n, TRUE);
+    }
+
+  piece_table_free (table);
+
+  return 0;
+}
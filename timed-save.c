@@ -0,0 +1,85 @@
+#include <glib/gstdio.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "piece-table.h"
+
+#define N_EDITS 16
+
+/*
+ * Compares piece_table_save() against a naive save which builds the
+ * entire contents in memory before writing them out. The size of the
+ * original file in megabytes may be provided as the first argument.
+ */
+
+gint
+main (gint argc,
+      gchar *argv[])
+{
+  g_autoptr(GError) error = NULL;
+  g_autofree gchar *filename = NULL;
+  g_autofree gchar *saved = NULL;
+  g_autofree gchar *block = NULL;
+  PieceTable *table;
+  GTimer *t;
+  guint64 size_mb = 1024;
+  gchar *contents;
+  FILE *fp;
+  gint fd;
+
+  if (argc > 1)
+    size_mb = g_ascii_strtoull (argv[1], NULL, 10);
+
+  g_print ("Generating a %"G_GUINT64_FORMAT" MB file before starting timer.\n", size_mb);
+
+  fd = g_file_open_tmp ("timed-save-XXXXXX", &filename, &error);
+  g_assert_no_error (error);
+  g_close (fd, NULL);
+
+  block = g_malloc (1024 * 1024);
+  for (guint i = 0; i < 1024 * 1024; i++)
+    block[i] = (i % 80) == 79 ? '\n' : 'a' + (i % 26);
+
+  fp = fopen (filename, "w");
+  for (guint64 i = 0; i < size_mb; i++)
+    fwrite (block, 1, 1024 * 1024, fp);
+  fclose (fp);
+
+  table = piece_table_new_for_file (filename, &error);
+  g_assert_no_error (error);
+
+  for (guint i = 0; i < N_EDITS; i++)
+    {
+      guint64 position = g_random_int_range (0, piece_table_get_length (table));
+
+      piece_table_insert_text (table, position, "an edit", -1);
+    }
+
+  saved = g_strdup_printf ("%s.saved", filename);
+
+  g_print ("Starting timer\n");
+  t = g_timer_new ();
+
+  contents = piece_table_get_text (table, 0, piece_table_get_length (table));
+  g_file_set_contents (saved, contents, piece_table_get_length (table), &error);
+  g_assert_no_error (error);
+  g_free (contents);
+
+  g_print ("Naive save: %lf seconds\n", g_timer_elapsed (t, NULL));
+  g_unlink (saved);
+
+  g_timer_start (t);
+
+  piece_table_save (table, saved, &error);
+  g_assert_no_error (error);
+
+  g_print ("piece_table_save: %lf seconds\n", g_timer_elapsed (t, NULL));
+
+  g_timer_destroy (t);
+  piece_table_free (table);
+
+  g_unlink (saved);
+  g_unlink (filename);
+
+  return 0;
+}
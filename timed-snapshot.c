@@ -0,0 +1,118 @@
+#include "piece-table.h"
+
+#define N_INITIAL    100000
+#define N_KEYSTROKES 1000000
+#define N_PENDING    4
+
+/*
+ * Simulates handing snapshots to background readers (such as a syntax
+ * highlighter or an autosave) while typing. A snapshot is taken every
+ * so many keystrokes and released a few snapshots later, so that typing
+ * keeps running into nodes which are still shared and must be copied.
+ */
+
+static void
+run (PieceTable *table,
+     guint       interval)
+{
+  PieceTable *pending[N_PENDING] = { NULL };
+  guint64 cursor = piece_table_get_length (table) / 2;
+  guint64 offset = 0;
+  guint n_snapshots = 0;
+  GTimer *t;
+
+  t = g_timer_new ();
+
+  for (guint i = 0; i < N_KEYSTROKES; i++)
+    {
+      if (interval > 0 && i % interval == 0)
+        {
+          guint slot = n_snapshots++ % N_PENDING;
+
+          piece_table_free (pending[slot]);
+          pending[slot] = piece_table_snapshot (table);
+        }
+
+      /* Jump elsewhere once in a while so the copied path changes */
+      if (i % 1000 == 0)
+        cursor = g_random_int_range (0, piece_table_get_length (table) + 1);
+
+      piece_table_insert (table, cursor++, PIECE_CHANGE, offset++, 1);
+    }
+
+  if (interval > 0)
+    g_print ("Snapshot every %4u keystrokes: %lf seconds (%lf usec per keystroke)\n",
+             interval, g_timer_elapsed (t, NULL),
+             g_timer_elapsed (t, NULL) * G_USEC_PER_SEC / N_KEYSTROKES);
+  else
+    g_print ("No snapshots:                    %lf seconds (%lf usec per keystroke)\n",
+             g_timer_elapsed (t, NULL),
+             g_timer_elapsed (t, NULL) * G_USEC_PER_SEC / N_KEYSTROKES);
+
+  for (guint i = 0; i < N_PENDING; i++)
+    piece_table_free (pending[i]);
+
+  g_timer_destroy (t);
+}
+
+gint
+main (gint argc,
+      gchar *argv[])
+{
+  static const guint intervals[] = { 0, 1000, 100, 10, 1 };
+  PieceTableEntry entries[64];
+  PieceTable *table = piece_table_new ();
+  PieceTable *snapshot;
+  guint64 position = 0;
+  guint n_entries = 0;
+  GTimer *t;
+  gsize n;
+
+  g_print ("Generating %u random edits before starting timer.\n", N_INITIAL);
+
+  for (guint i = 0; i < N_INITIAL; i++)
+    piece_table_insert (table,
+                        g_random_int_range (0, piece_table_get_length (table) + 1),
+                        PIECE_INITIAL,
+                        g_random_int_range (0, 1000000),
+                        g_random_int_range (1, 32));
+
+  for (guint i = 0; i < G_N_ELEMENTS (intervals); i++)
+    run (table, intervals[i]);
+
+  t = g_timer_new ();
+
+  for (guint i = 0; i < 100000; i++)
+    piece_table_free (piece_table_snapshot (table));
+
+  g_print ("Snapshot: %lf usec to take and release\n",
+           g_timer_elapsed (t, NULL) * G_USEC_PER_SEC / 100000);
+
+  /* Reading a snapshot searches for each leaf rather than following links */
+  snapshot = piece_table_snapshot (table);
+  g_timer_reset (t);
+
+  while ((n = piece_table_get_entries (snapshot, &position, piece_table_get_length (snapshot),
+                                       entries, G_N_ELEMENTS (entries))))
+    n_entries += n;
+
+  g_print ("Read %u entries from a snapshot in %lf seconds\n",
+           n_entries, g_timer_elapsed (t, NULL));
+
+  position = 0;
+  n_entries = 0;
+  g_timer_reset (t);
+
+  while ((n = piece_table_get_entries (table, &position, piece_table_get_length (table),
+                                       entries, G_N_ELEMENTS (entries))))
+    n_entries += n;
+
+  g_print ("Read %u entries from the table in %lf seconds\n",
+           n_entries, g_timer_elapsed (t, NULL));
+
+  piece_table_free (snapshot);
+  piece_table_free (table);
+  g_timer_destroy (t);
+
+  return 0;
+}
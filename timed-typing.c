@@ -0,0 +1,89 @@
+#include "piece-table.h"
+
+#define N_INITIAL    100000
+#define N_KEYSTROKES 1000000
+
+/*
+ * Simulates a user typing into a document that has already been edited
+ * in many places. Most keystrokes insert a single byte at the cursor,
+ * some are backspaces, and once in a while the cursor jumps elsewhere.
+ */
+
+typedef enum
+{
+  ACTION_TYPE,
+  ACTION_BACKSPACE,
+  ACTION_JUMP,
+} Action;
+
+gint
+main (gint argc,
+      gchar *argv[])
+{
+  PieceTable *table = piece_table_new ();
+  GTimer *t;
+  Action *actions = g_new (Action, N_KEYSTROKES);
+  guint64 *jumps = g_new (guint64, N_KEYSTROKES);
+  guint64 cursor = 0;
+  guint64 offset = 0;
+
+  g_print ("Generating %u random edits before starting timer.\n", N_INITIAL);
+
+  for (guint i = 0; i < N_INITIAL; i++)
+    piece_table_insert (table,
+                        g_random_int_range (0, piece_table_get_length (table) + 1),
+                        PIECE_INITIAL,
+                        g_random_int_range (0, 1000000),
+                        g_random_int_range (1, 32));
+
+  for (guint i = 0; i < N_KEYSTROKES; i++)
+    {
+      guint r = g_random_int_range (0, 1000);
+
+      if (r < 2)
+        actions[i] = ACTION_JUMP;
+      else if (r < 100)
+        actions[i] = ACTION_BACKSPACE;
+      else
+        actions[i] = ACTION_TYPE;
+
+      jumps[i] = g_random_int_range (0, N_INITIAL);
+    }
+
+  cursor = piece_table_get_length (table) / 2;
+
+  g_print ("Starting timer\n");
+  t = g_timer_new ();
+
+  for (guint i = 0; i < N_KEYSTROKES; i++)
+    {
+      switch (actions[i])
+        {
+        case ACTION_JUMP:
+          cursor = jumps[i] % (piece_table_get_length (table) + 1);
+          break;
+
+        case ACTION_BACKSPACE:
+          if (cursor > 0)
+            piece_table_delete (table, --cursor, 1);
+          break;
+
+        case ACTION_TYPE:
+        default:
+          piece_table_insert (table, cursor++, PIECE_CHANGE, offset++, 1);
+          break;
+        }
+    }
+
+  g_print ("Done. %lf seconds (%lf usec per keystroke)\n",
+           g_timer_elapsed (t, NULL),
+           g_timer_elapsed (t, NULL) * G_USEC_PER_SEC / N_KEYSTROKES);
+  g_timer_destroy (t);
+
+  piece_table_free (table);
+
+  g_free (actions);
+  g_free (jumps);
+
+  return 0;
+}
@@ -0,0 +1,134 @@
+#include "piece-table.h"
+
+#define N_INITIAL    100000
+#define N_KEYSTROKES 1000000
+
+/*
+ * Simulates a long editing session with undo enabled, reporting how much
+ * memory the journal uses per keystroke, followed by undoing and then
+ * redoing the whole session.
+ */
+
+typedef enum
+{
+  ACTION_TYPE,
+  ACTION_BACKSPACE,
+  ACTION_CUT,
+  ACTION_PASTE,
+  ACTION_JUMP,
+} Action;
+
+gint
+main (gint argc,
+      gchar *argv[])
+{
+  PieceTable *table = piece_table_new ();
+  GTimer *t;
+  Action *actions = g_new (Action, N_KEYSTROKES);
+  guint64 *jumps = g_new (guint64, N_KEYSTROKES);
+  guint64 cursor = 0;
+  guint64 offset = 0;
+  guint n_undo = 0;
+  guint n_redo = 0;
+  gsize size;
+
+  g_print ("Generating %u random edits before starting timer.\n", N_INITIAL);
+
+  for (guint i = 0; i < N_INITIAL; i++)
+    piece_table_insert (table,
+                        g_random_int_range (0, piece_table_get_length (table) + 1),
+                        PIECE_INITIAL,
+                        g_random_int_range (0, 1000000),
+                        g_random_int_range (1, 32));
+
+  for (guint i = 0; i < N_KEYSTROKES; i++)
+    {
+      guint r = g_random_int_range (0, 1000);
+
+      if (r < 2)
+        actions[i] = ACTION_JUMP;
+      else if (r < 3)
+        actions[i] = ACTION_CUT;
+      else if (r < 4)
+        actions[i] = ACTION_PASTE;
+      else if (r < 100)
+        actions[i] = ACTION_BACKSPACE;
+      else
+        actions[i] = ACTION_TYPE;
+
+      jumps[i] = g_random_int_range (0, N_INITIAL);
+    }
+
+  cursor = piece_table_get_length (table) / 2;
+
+  piece_table_set_undo_enabled (table, TRUE);
+
+  g_print ("Starting timer\n");
+  t = g_timer_new ();
+
+  for (guint i = 0; i < N_KEYSTROKES; i++)
+    {
+      guint64 length = piece_table_get_length (table);
+
+      switch (actions[i])
+        {
+        case ACTION_JUMP:
+          cursor = jumps[i] % (length + 1);
+          break;
+
+        case ACTION_CUT:
+          piece_table_delete (table, cursor, MIN (length - cursor, 1000));
+          break;
+
+        case ACTION_PASTE:
+          piece_table_copy (table, jumps[i] % (length - 1000), cursor, 1000);
+          cursor += 1000;
+          break;
+
+        case ACTION_BACKSPACE:
+          if (cursor > 0)
+            piece_table_delete (table, --cursor, 1);
+          break;
+
+        case ACTION_TYPE:
+        default:
+          piece_table_insert (table, cursor++, PIECE_CHANGE, offset++, 1);
+          break;
+        }
+    }
+
+  size = piece_table_get_journal_size (table);
+
+  g_print ("Edits: %lf seconds (%lf usec per keystroke)\n",
+           g_timer_elapsed (t, NULL),
+           g_timer_elapsed (t, NULL) * G_USEC_PER_SEC / N_KEYSTROKES);
+  g_print ("Journal: %" G_GSIZE_FORMAT " bytes (%lf bytes per keystroke)\n",
+           size, (gdouble)size / N_KEYSTROKES);
+
+  g_timer_reset (t);
+
+  while (piece_table_undo (table))
+    n_undo++;
+
+  g_print ("Undo: %u steps in %lf seconds (%lf usec per step)\n",
+           n_undo, g_timer_elapsed (t, NULL),
+           g_timer_elapsed (t, NULL) * G_USEC_PER_SEC / n_undo);
+
+  g_timer_reset (t);
+
+  while (piece_table_redo (table))
+    n_redo++;
+
+  g_print ("Redo: %u steps in %lf seconds (%lf usec per step)\n",
+           n_redo, g_timer_elapsed (t, NULL),
+           g_timer_elapsed (t, NULL) * G_USEC_PER_SEC / n_redo);
+
+  g_timer_destroy (t);
+
+  piece_table_free (table);
+
+  g_free (actions);
+  g_free (jumps);
+
+  return 0;
+}
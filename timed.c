@@ -11,6 +11,9 @@ main (gint argc,
   guint64 *positions = g_new (guint64, N_INSERTS);
   guint64 *lengths = g_new (guint64, N_INSERTS);
 
+  /* The same inserts for every build, so that their times compare */
+  g_random_set_seed (0x5eed);
+
   positions[0] = 0;
   lengths[0] = g_random_int_range (1, 32);
 
@@ -0,0 +1,59 @@
+#!/bin/sh
+#
+# Builds timed-fanout at a range of leaf and branch fanouts and reports
+# the pair which ran the workloads fastest on this machine. The leaf
+# fanout is tuned first with the branch fanout at its default, then the
+# branch fanout with the best leaf fanout. Each build is run RUNS times
+# and the fastest run kept.
+#
+# CC, CFLAGS, LDFLAGS, OPTS and EXTRA (for example -DPIECE_TABLE_COMPACT)
+# are taken from the environment, which `make tune` fills in.
+
+set -e
+
+CC=${CC:-cc}
+OPTS=${OPTS:--march=native -O3}
+RUNS=${RUNS:-3}
+FANOUTS=${FANOUTS:-"8 12 16 20 26 32 40 48 64 96 128 192 254"}
+SOURCES="timed-fanout.c piece-table.c piece-arena.c piece-buffer.c piece-epoch.c piece-journal.c piece-search.c"
+
+tmp=$(mktemp -d)
+trap 'rm -rf "$tmp"' EXIT
+
+# Prints the fastest total of RUNS runs at the given fanouts
+measure () {
+  $CC -o "$tmp/timed-fanout" $CFLAGS $LDFLAGS -DG_DISABLE_ASSERT $OPTS $EXTRA \
+    -DPIECE_TREE_LEAF_FANOUT=$1 -DPIECE_TREE_BRANCH_FANOUT=$2 $SOURCES 2>/dev/null
+  best=
+  i=0
+  while [ $i -lt $RUNS ]; do
+    line=$("$tmp/timed-fanout")
+    total=$(echo "$line" | sed 's/.*total \([0-9.]*\).*/\1/')
+    if [ -z "$best" ] || awk "BEGIN { exit !($total < $best) }"; then
+      best=$total
+      best_line=$line
+    fi
+    i=$((i + 1))
+  done
+  echo "leaf $1 branch $2: $best_line" >&2
+  echo "$best"
+}
+
+# Picks the fanout with the lowest time from "fanout time" lines
+fastest () {
+  sort -g -k2 | head -n 1 | cut -d ' ' -f 1
+}
+
+default_branch=$(echo "$EXTRA" | grep -q PIECE_TABLE_COMPACT && echo 40 || echo 26)
+
+for leaf in $FANOUTS; do
+  echo "$leaf $(measure $leaf $default_branch)"
+done > "$tmp/leaf"
+best_leaf=$(fastest < "$tmp/leaf")
+
+for branch in $FANOUTS; do
+  echo "$branch $(measure $best_leaf $branch)"
+done > "$tmp/branch"
+best_branch=$(fastest < "$tmp/branch")
+
+echo "Best fanouts: -DPIECE_TREE_LEAF_FANOUT=$best_leaf -DPIECE_TREE_BRANCH_FANOUT=$best_branch"